@@ -9,18 +9,40 @@
 #define CLIPPY_COMMON_H
 
 #import <Foundation/Foundation.h>
+#include <CommonCrypto/CommonDigest.h>
+#include <compression.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
 
 // ============================================================================
 // Configuration Defaults (can be overridden by config file)
 // ============================================================================
 
 #define CLIPPY_DEFAULT_POLL_INTERVAL_MS   500
+#define CLIPPY_DEFAULT_POLL_MIN_INTERVAL_MS  100   // burst, right after a change
+#define CLIPPY_DEFAULT_POLL_MAX_INTERVAL_MS  3000  // idle backoff ceiling
 #define CLIPPY_DEFAULT_MAX_HISTORY_ITEMS  50
 #define CLIPPY_DEFAULT_MAX_PINS           50
 #define CLIPPY_DEFAULT_MAX_ENTRY_LENGTH   10000
 #define CLIPPY_DEFAULT_MAX_AGE_DAYS       30
 #define CLIPPY_DEFAULT_CLEANUP_INTERVAL   3600  // seconds
+#define CLIPPY_DEFAULT_CAPTURE_TYPES      (CLIPPY_CAPTURE_TEXT | CLIPPY_CAPTURE_IMAGE)
+#define CLIPPY_DEFAULT_MAX_TEXT_KB        4096
+#define CLIPPY_DEFAULT_MAX_IMAGE_KB       102400
+#define CLIPPY_DEFAULT_MAX_RTF_KB         1024
+#define CLIPPY_DEFAULT_MAX_HTML_KB        1024
+#define CLIPPY_DEFAULT_MAX_FILES_KB       64
+#define CLIPPY_DEFAULT_MAX_MEMORY_MB      64    // History held in memory by clipd and the picker
+
+// Pasteboard representations clipd captures (capture_types)
+#define CLIPPY_CAPTURE_TEXT   (1u << 0)
+#define CLIPPY_CAPTURE_IMAGE  (1u << 1)
+#define CLIPPY_CAPTURE_RTF    (1u << 2)
+#define CLIPPY_CAPTURE_HTML   (1u << 3)
+#define CLIPPY_CAPTURE_FILES  (1u << 4)
 
 // ============================================================================
 // File Names
@@ -32,6 +54,9 @@
 #define CLIPPY_DATA_DIR       ".clippy_data"
 #define CLIPPY_IMAGES_DIR     "images"
 #define CLIPPY_BACKUP_SUFFIX  ".backup"
+#define CLIPPY_HISTORY_LOG    "history.log"
+#define CLIPPY_PINS_JOURNAL   "pins.journal"
+#define CLIPPY_LOCK_SUFFIX    ".lock"
 
 // ============================================================================
 // Runtime Configuration
@@ -39,223 +64,2517 @@
 
 typedef struct {
     int pollIntervalMs;
+    int pollMinIntervalMs;
+    int pollMaxIntervalMs;
     int maxHistoryItems;
     int maxPins;
     int maxEntryLength;
     int maxAgeDays;
     int cleanupIntervalSec;
+    unsigned captureTypes;  // CLIPPY_CAPTURE_* flags
+    int maxTextKB;          // Per-type capture budgets
+    int maxImageKB;
+    int maxRtfKB;
+    int maxHtmlKB;
+    int maxFilesKB;
+    int maxMemoryMB;        // Cap on the history kept in memory
 } ClippyConfig;
 
 // Global config instance
 static ClippyConfig clippy_config = {
     .pollIntervalMs = CLIPPY_DEFAULT_POLL_INTERVAL_MS,
+    .pollMinIntervalMs = CLIPPY_DEFAULT_POLL_MIN_INTERVAL_MS,
+    .pollMaxIntervalMs = CLIPPY_DEFAULT_POLL_MAX_INTERVAL_MS,
     .maxHistoryItems = CLIPPY_DEFAULT_MAX_HISTORY_ITEMS,
     .maxPins = CLIPPY_DEFAULT_MAX_PINS,
     .maxEntryLength = CLIPPY_DEFAULT_MAX_ENTRY_LENGTH,
     .maxAgeDays = CLIPPY_DEFAULT_MAX_AGE_DAYS,
-    .cleanupIntervalSec = CLIPPY_DEFAULT_CLEANUP_INTERVAL
+    .cleanupIntervalSec = CLIPPY_DEFAULT_CLEANUP_INTERVAL,
+    .captureTypes = CLIPPY_DEFAULT_CAPTURE_TYPES,
+    .maxTextKB = CLIPPY_DEFAULT_MAX_TEXT_KB,
+    .maxImageKB = CLIPPY_DEFAULT_MAX_IMAGE_KB,
+    .maxRtfKB = CLIPPY_DEFAULT_MAX_RTF_KB,
+    .maxHtmlKB = CLIPPY_DEFAULT_MAX_HTML_KB,
+    .maxFilesKB = CLIPPY_DEFAULT_MAX_FILES_KB,
+    .maxMemoryMB = CLIPPY_DEFAULT_MAX_MEMORY_MB
 };
 
+// ============================================================================
+// IO Counters
+// ============================================================================
+
+// Per-process totals of what the helpers below wrote to disk (reported by
+// clipd's stats command). Atomic because clipd stores images off the main queue
+static _Atomic uint64_t clippy_stat_bytes_written = 0;
+static _Atomic uint64_t clippy_stat_files_stored = 0;
+
+static inline void clippy_stat_count_write(NSUInteger bytes) {
+    atomic_fetch_add_explicit(&clippy_stat_bytes_written, bytes, memory_order_relaxed);
+}
+
 // ============================================================================
 // File Path Helpers
 // ============================================================================
 
-static inline NSString *clippy_get_home_path(NSString *filename) {
-    return [NSHomeDirectory() stringByAppendingPathComponent:filename];
+static inline NSString *clippy_get_home_path(NSString *filename) {
+    return [NSHomeDirectory() stringByAppendingPathComponent:filename];
+}
+
+static inline NSString *clippy_history_path(void) {
+    return clippy_get_home_path(@CLIPPY_HISTORY_FILE);
+}
+
+static inline NSString *clippy_pins_path(void) {
+    return clippy_get_home_path(@CLIPPY_PINS_FILE);
+}
+
+static inline NSString *clippy_config_path(void) {
+    return clippy_get_home_path(@CLIPPY_CONFIG_FILE);
+}
+
+// Tests point this at a scratch directory; nil means ~/.clippy_data
+static NSString *clippy_data_dir_override = nil;
+
+static inline NSString *clippy_data_dir(void) {
+    return clippy_data_dir_override ?: clippy_get_home_path(@CLIPPY_DATA_DIR);
+}
+
+static inline NSString *clippy_images_dir(void) {
+    return [clippy_data_dir() stringByAppendingPathComponent:@CLIPPY_IMAGES_DIR];
+}
+
+static inline NSString *clippy_history_log_path(void) {
+    return [clippy_data_dir() stringByAppendingPathComponent:@CLIPPY_HISTORY_LOG];
+}
+
+static inline NSString *clippy_pins_journal_path(void) {
+    return [clippy_data_dir() stringByAppendingPathComponent:@CLIPPY_PINS_JOURNAL];
+}
+
+/**
+ * Ensure the data directory exists
+ */
+static inline BOOL clippy_ensure_data_dir(void) {
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSString *path = clippy_data_dir();
+
+    if ([fm fileExistsAtPath:path]) {
+        return YES;
+    }
+
+    NSError *error = nil;
+    BOOL success = [fm createDirectoryAtPath:path
+                 withIntermediateDirectories:YES
+                                  attributes:@{NSFilePosixPermissions: @0700}
+                                       error:&error];
+    if (!success) {
+        NSLog(@"clippy: Failed to create data dir: %@", error);
+    }
+    return success;
+}
+
+// ============================================================================
+// File Locking
+// ============================================================================
+
+/**
+ * Exclusive flock() on "<path>.lock", shared by every clippy process
+ * Returns the lock fd (pass to clippy_log_unlock), or -1 on failure
+ */
+static inline int clippy_log_lock(NSString *path) {
+    NSString *lockPath = [path stringByAppendingString:@CLIPPY_LOCK_SUFFIX];
+    int fd = open([lockPath fileSystemRepresentation], O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        NSLog(@"clippy: Failed to open lock %@: %s", lockPath, strerror(errno));
+        return -1;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline void clippy_log_unlock(int fd) {
+    if (fd >= 0) {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+}
+
+// ============================================================================
+// File Change Stamps
+// ============================================================================
+
+/**
+ * Identity and version of a file, cheap to take with one stat()
+ * Appends change size/mtime; atomic rewrites and truncation change the inode
+ * or size, so an unchanged stamp means the file can be trusted as read
+ */
+typedef struct {
+    BOOL exists;
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+} ClippyFileStamp;
+
+static inline ClippyFileStamp clippy_file_stamp(NSString *path) {
+    ClippyFileStamp stamp;
+    memset(&stamp, 0, sizeof(stamp));
+
+    struct stat st;
+    if (stat([path fileSystemRepresentation], &st) == 0) {
+        stamp.exists = YES;
+        stamp.device = st.st_dev;
+        stamp.inode = st.st_ino;
+        stamp.size = st.st_size;
+        stamp.mtime = st.st_mtimespec;
+    }
+    return stamp;
+}
+
+static inline BOOL clippy_file_stamp_equal(ClippyFileStamp a, ClippyFileStamp b) {
+    if (a.exists != b.exists) {
+        return NO;
+    }
+    if (!a.exists) {
+        return YES;
+    }
+    return a.device == b.device && a.inode == b.inode && a.size == b.size &&
+           a.mtime.tv_sec == b.mtime.tv_sec && a.mtime.tv_nsec == b.mtime.tv_nsec;
+}
+
+// ============================================================================
+// Image Store
+// ============================================================================
+
+/**
+ * Ensure the images directory exists
+ */
+static inline BOOL clippy_ensure_images_dir(void) {
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSString *path = clippy_images_dir();
+
+    if ([fm fileExistsAtPath:path]) {
+        return YES;
+    }
+
+    NSError *error = nil;
+    BOOL success = [fm createDirectoryAtPath:path
+                 withIntermediateDirectories:YES
+                                  attributes:@{NSFilePosixPermissions: @0700}
+                                       error:&error];
+    if (!success) {
+        NSLog(@"clippy: Failed to create images dir: %@", error);
+    }
+    return success;
+}
+
+/**
+ * Hex-encoded SHA-256 of data (content hash for images)
+ */
+static inline NSString *clippy_sha256_hex(NSData *data) {
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256([data bytes], (CC_LONG)[data length], digest);
+
+    char hex[CC_SHA256_DIGEST_LENGTH * 2 + 1];
+    for (int i = 0; i < CC_SHA256_DIGEST_LENGTH; i++) {
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    return [NSString stringWithUTF8String:hex];
+}
+
+/**
+ * Images are content-addressed: stored as images/<sha256>.png and shared by
+ * every entry (history or pin) holding the same bytes. images/refs.json maps
+ * filename -> reference count; a file is unlinked only when its last
+ * reference is released. Counts change under refs.json.lock, so a store and
+ * a release of the same image can never interleave.
+ */
+
+#define CLIPPY_IMAGE_REFS_FILE  "refs.json"
+#define CLIPPY_THUMBNAIL_SUFFIX ".thumb.png"
+
+static inline NSString *clippy_image_refs_path(void) {
+    return [clippy_images_dir() stringByAppendingPathComponent:@CLIPPY_IMAGE_REFS_FILE];
+}
+
+static inline NSString *clippy_image_path_for_hash(NSString *hash) {
+    return [clippy_images_dir() stringByAppendingPathComponent:
+            [hash stringByAppendingPathExtension:@"png"]];
+}
+
+/**
+ * Downscaled preview stored next to an image: <sha256>.thumb.png
+ */
+static inline NSString *clippy_thumbnail_path(NSString *imagePath) {
+    return [[imagePath stringByDeletingPathExtension] stringByAppendingString:@CLIPPY_THUMBNAIL_SUFFIX];
+}
+
+static inline NSMutableDictionary *clippy_image_refs_read(void) {
+    NSData *data = [NSData dataWithContentsOfFile:clippy_image_refs_path()];
+    id parsed = data ? [NSJSONSerialization JSONObjectWithData:data options:0 error:nil] : nil;
+    if ([parsed isKindOfClass:[NSDictionary class]]) {
+        return [parsed mutableCopy];
+    }
+    return [NSMutableDictionary dictionary];
+}
+
+static inline BOOL clippy_image_refs_write(NSDictionary *refs) {
+    NSError *error = nil;
+    NSData *data = [NSJSONSerialization dataWithJSONObject:refs options:0 error:&error];
+    if (!data || ![data writeToFile:clippy_image_refs_path() options:NSDataWritingAtomic error:&error]) {
+        NSLog(@"clippy: Failed to write image refs: %@", error);
+        return NO;
+    }
+    chmod([clippy_image_refs_path() fileSystemRepresentation], S_IRUSR | S_IWUSR);
+    return YES;
+}
+
+/**
+ * Delete an image file
+ */
+static inline BOOL clippy_delete_image(NSString *path) {
+    if (!path || [path length] == 0) {
+        return NO;
+    }
+
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSError *error = nil;
+    return [fm removeItemAtPath:path error:&error];
+}
+
+/**
+ * Store a content-addressed file and take one reference to it
+ * The data block only runs if the file isn't stored yet, so repeats cost no
+ * encoding or writing. Returns path, or nil on failure
+ */
+static inline NSString *clippy_store_file(NSString *path, NSData *(^contents)(void)) {
+    if (!clippy_ensure_images_dir()) {
+        return nil;
+    }
+
+    NSString *filename = [path lastPathComponent];
+    int lock = clippy_log_lock(clippy_image_refs_path());
+    NSMutableDictionary *refs = clippy_image_refs_read();
+
+    if (![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+        NSError *error = nil;
+        NSData *data = contents();
+        BOOL success = data && [data writeToFile:path options:NSDataWritingAtomic error:&error];
+        if (!success) {
+            clippy_log_unlock(lock);
+            NSLog(@"clippy: Failed to save %@: %@", filename, error);
+            return nil;
+        }
+        clippy_stat_count_write([data length]);
+        atomic_fetch_add_explicit(&clippy_stat_files_stored, 1, memory_order_relaxed);
+
+        // Set restrictive permissions
+        chmod([path fileSystemRepresentation], S_IRUSR | S_IWUSR);
+        [refs removeObjectForKey:filename];  // Stale count for a vanished file
+    }
+
+    refs[filename] = @([refs[filename] integerValue] + 1);
+    clippy_image_refs_write(refs);
+    clippy_log_unlock(lock);
+
+    return path;
+}
+
+/**
+ * Store image data under its content hash and take one reference to it
+ * Writes nothing if the same image is already stored.
+ * Returns the full path to the stored file, or nil on failure
+ */
+static inline NSString *clippy_store_image(NSData *imageData, NSString *hash) {
+    if (!imageData || [imageData length] == 0) {
+        return nil;
+    }
+    if (!hash) {
+        hash = clippy_sha256_hex(imageData);
+    }
+    return clippy_store_file(clippy_image_path_for_hash(hash), ^NSData *{
+        return imageData;
+    });
+}
+
+static inline NSString *clippy_save_image(NSData *imageData) {
+    return clippy_store_image(imageData, nil);
+}
+
+/**
+ * Take another reference to each already stored image (e.g. when pinning)
+ * A path listed twice takes two references. refs.json is written once.
+ */
+static inline void clippy_images_retain(NSArray *paths) {
+    if ([paths count] == 0 ||
+        ![[NSFileManager defaultManager] fileExistsAtPath:clippy_images_dir()]) {
+        return;
+    }
+
+    int lock = clippy_log_lock(clippy_image_refs_path());
+    NSMutableDictionary *refs = clippy_image_refs_read();
+    BOOL changed = NO;
+    for (NSString *path in paths) {
+        if ([path length] == 0) {
+            continue;
+        }
+        NSString *filename = [path lastPathComponent];
+        // Untracked files (pre-refcount images) start out with their one owner
+        NSInteger count = refs[filename] ? [refs[filename] integerValue] : 1;
+        refs[filename] = @(count + 1);
+        changed = YES;
+    }
+    if (changed) {
+        clippy_image_refs_write(refs);
+    }
+    clippy_log_unlock(lock);
+}
+
+/**
+ * Drop one reference per path; a file is deleted when its last one goes
+ * away. refs.json is written once.
+ */
+static inline void clippy_images_release(NSArray *paths) {
+    if ([paths count] == 0 ||
+        ![[NSFileManager defaultManager] fileExistsAtPath:clippy_images_dir()]) {
+        return;
+    }
+
+    int lock = clippy_log_lock(clippy_image_refs_path());
+    NSMutableDictionary *refs = clippy_image_refs_read();
+    BOOL changed = NO;
+    for (NSString *path in paths) {
+        if ([path length] == 0) {
+            continue;
+        }
+        NSString *filename = [path lastPathComponent];
+        NSInteger count = [refs[filename] integerValue] - 1;
+
+        if (count > 0) {
+            refs[filename] = @(count);
+        } else {
+            [refs removeObjectForKey:filename];
+            clippy_delete_image(path);
+            clippy_delete_image(clippy_thumbnail_path(path));
+        }
+        changed = YES;
+    }
+    if (changed) {
+        clippy_image_refs_write(refs);
+    }
+    clippy_log_unlock(lock);
+}
+
+static inline void clippy_image_retain(NSString *path) {
+    if (path) {
+        clippy_images_retain(@[path]);
+    }
+}
+
+static inline void clippy_image_release(NSString *path) {
+    if (path) {
+        clippy_images_release(@[path]);
+    }
+}
+
+/**
+ * The stored file an entry holds a reference to: its image, or the blob
+ * with its full text. nil for plain (and pending) entries.
+ */
+static inline NSString *clippy_entry_stored_path(NSDictionary *entry) {
+    if ([entry[@"type"] isEqualToString:@"image"]) {
+        return entry[@"path"];
+    }
+    return entry[@"blob"];
+}
+
+/**
+ * Every stored file an entry references: the one above plus the blobs of
+ * its extra representations (see Representations)
+ */
+static inline NSArray *clippy_entry_stored_paths(NSDictionary *entry) {
+    NSMutableArray *paths = [NSMutableArray arrayWithCapacity:1];
+    NSString *path = clippy_entry_stored_path(entry);
+    if (path) {
+        [paths addObject:path];
+    }
+
+    NSDictionary *reps = entry[@"reps"];
+    if ([reps isKindOfClass:[NSDictionary class]]) {
+        for (id blob in [reps allValues]) {
+            if ([blob isKindOfClass:[NSString class]]) {
+                [paths addObject:blob];
+            }
+        }
+    }
+    return paths;
+}
+
+static inline void clippy_entry_retain(NSDictionary *entry) {
+    clippy_images_retain(clippy_entry_stored_paths(entry));
+}
+
+static inline void clippy_entry_release(NSDictionary *entry) {
+    clippy_images_release(clippy_entry_stored_paths(entry));
+}
+
+/**
+ * Release every entry's stored files with one refs.json write
+ */
+static inline void clippy_entries_release(NSArray *entries) {
+    NSMutableArray *paths = [NSMutableArray array];
+    for (NSDictionary *entry in entries) {
+        [paths addObjectsFromArray:clippy_entry_stored_paths(entry)];
+    }
+    clippy_images_release(paths);
+}
+
+// ============================================================================
+// Text Blobs
+// ============================================================================
+
+/**
+ * Text longer than max_entry_length is kept out of line: the UTF-8 is
+ * LZFSE-compressed into images/<sha256>.lzfse, a content-addressed file
+ * sharing the image refcounts, and the history record carries only a
+ * preview ("text", the first max_entry_length characters), the blob path
+ * ("blob") and the full length in characters ("length"). Readers that need
+ * the whole text go through clippy_entry_full_text.
+ *
+ * A blob is "CLZ1", the uncompressed size as a little-endian uint64, then
+ * the compressed bytes.
+ */
+
+#define CLIPPY_BLOB_EXTENSION "lzfse"
+#define CLIPPY_BLOB_MAGIC     "CLZ1"
+#define CLIPPY_BLOB_HEADER    12
+
+static inline NSString *clippy_blob_path_for_hash(NSString *hash) {
+    return [clippy_images_dir() stringByAppendingPathComponent:
+            [hash stringByAppendingPathExtension:@CLIPPY_BLOB_EXTENSION]];
+}
+
+static inline NSData *clippy_blob_compress(NSData *raw) {
+    size_t capacity = [raw length] + [raw length] / 16 + 4096;  // Room for incompressible input
+    NSMutableData *blob = [NSMutableData dataWithLength:CLIPPY_BLOB_HEADER + capacity];
+    uint8_t *bytes = [blob mutableBytes];
+
+    size_t compressed = compression_encode_buffer(bytes + CLIPPY_BLOB_HEADER, capacity,
+                                                  [raw bytes], [raw length], NULL,
+                                                  COMPRESSION_LZFSE);
+    if (compressed == 0) {
+        return nil;
+    }
+
+    uint64_t size = CFSwapInt64HostToLittle((uint64_t)[raw length]);
+    memcpy(bytes, CLIPPY_BLOB_MAGIC, 4);
+    memcpy(bytes + 4, &size, sizeof(size));
+    [blob setLength:CLIPPY_BLOB_HEADER + compressed];
+    return blob;
+}
+
+static inline NSData *clippy_blob_decompress(NSData *blob) {
+    const uint8_t *bytes = [blob bytes];
+    if ([blob length] < CLIPPY_BLOB_HEADER || memcmp(bytes, CLIPPY_BLOB_MAGIC, 4) != 0) {
+        return nil;
+    }
+
+    uint64_t size;
+    memcpy(&size, bytes + 4, sizeof(size));
+    size = CFSwapInt64LittleToHost(size);
+    if (size == 0 || size > NSUIntegerMax / 2) {
+        return size == 0 ? [NSData data] : nil;
+    }
+
+    NSMutableData *raw = [NSMutableData dataWithLength:(NSUInteger)size];
+    if (!raw) {
+        return nil;
+    }
+    size_t decoded = compression_decode_buffer([raw mutableBytes], (size_t)size,
+                                               bytes + CLIPPY_BLOB_HEADER,
+                                               [blob length] - CLIPPY_BLOB_HEADER, NULL,
+                                               COMPRESSION_LZFSE);
+    return decoded == size ? raw : nil;
+}
+
+/**
+ * Store text out of line and take one reference to it (nothing is
+ * compressed or written when the same text is already stored)
+ * utf8 and hash come from clippy_text_blob_key. Returns the blob path or nil
+ */
+static inline NSString *clippy_store_text_blob(NSData *utf8, NSString *hash) {
+    return clippy_store_file(clippy_blob_path_for_hash(hash), ^NSData *{
+        return clippy_blob_compress(utf8);
+    });
+}
+
+/**
+ * UTF-8 bytes and content hash of a long text; the blob path for that hash
+ * identifies the text without storing it
+ */
+static inline NSString *clippy_text_blob_key(NSString *text, NSData **utf8) {
+    *utf8 = [text dataUsingEncoding:NSUTF8StringEncoding];
+    return clippy_sha256_hex(*utf8);
+}
+
+static inline BOOL clippy_text_needs_blob(NSString *text) {
+    return (NSInteger)[text length] > (NSInteger)MAX(clippy_config.maxEntryLength, 0);
+}
+
+/**
+ * First max_entry_length characters, without splitting a composed character
+ */
+static inline NSString *clippy_text_blob_preview(NSString *text) {
+    NSUInteger limit = (NSUInteger)MAX(clippy_config.maxEntryLength, 0);
+    if ([text length] <= limit) {
+        return text;
+    }
+    if (limit == 0) {
+        return @"";
+    }
+    NSRange last = [text rangeOfComposedCharacterSequenceAtIndex:limit - 1];
+    return [text substringToIndex:MIN(NSMaxRange(last), [text length])];
+}
+
+/**
+ * The entry's complete text, read from its blob when it has one
+ * Falls back to the preview if the blob can't be read
+ */
+static inline NSString *clippy_entry_full_text(NSDictionary *entry) {
+    NSString *blob = entry[@"blob"];
+    if (!blob || [entry[@"type"] isEqualToString:@"image"]) {
+        return entry[@"text"];
+    }
+
+    NSData *raw = clippy_blob_decompress([NSData dataWithContentsOfFile:blob] ?: [NSData data]);
+    NSString *text = raw ? [[NSString alloc] initWithData:raw encoding:NSUTF8StringEncoding] : nil;
+    if (!text) {
+        NSLog(@"clippy: Failed to read text blob %@", [blob lastPathComponent]);
+        return entry[@"text"];
+    }
+    return text;
+}
+
+// ============================================================================
+// Representations
+// ============================================================================
+
+/**
+ * Besides its text, an entry can keep other representations the source app
+ * put on the pasteboard, when capture_types lists them. Rich text and HTML
+ * are stored as blobs like long text, under "reps" ({"rtf": path, ...});
+ * copied files stay inline as a list of paths under "files". Every type has
+ * a max_*_kb budget: images and representations over it are not captured,
+ * text over it is cut.
+ */
+
+static inline NSUInteger clippy_budget_bytes(int kb) {
+    return (NSUInteger)MAX(kb, 0) * 1024;
+}
+
+/**
+ * Pasteboard type (UTI) of each "reps" key
+ */
+static inline NSDictionary *clippy_rep_types(void) {
+    return @{@"rtf": @"public.rtf", @"html": @"public.html"};
+}
+
+/**
+ * Store one representation as a blob and take a reference to it
+ * Returns the blob path, or nil if the data is empty or over budget
+ */
+static inline NSString *clippy_store_rep(NSData *data, int budgetKB) {
+    if ([data length] == 0 || [data length] > clippy_budget_bytes(budgetKB)) {
+        return nil;
+    }
+    return clippy_store_text_blob(data, clippy_sha256_hex(data));
+}
+
+/**
+ * The bytes of one of the entry's representations, or nil
+ */
+static inline NSData *clippy_entry_rep_data(NSDictionary *entry, NSString *rep) {
+    NSDictionary *reps = entry[@"reps"];
+    NSString *blob = [reps isKindOfClass:[NSDictionary class]] ? reps[rep] : nil;
+    if (![blob isKindOfClass:[NSString class]]) {
+        return nil;
+    }
+    return clippy_blob_decompress([NSData dataWithContentsOfFile:blob] ?: [NSData data]);
+}
+
+/**
+ * The longest prefix of text whose UTF-8 fits max_text_kb, ending on a
+ * character boundary; text itself when it already fits
+ */
+static inline NSString *clippy_text_fit_budget(NSString *text) {
+    NSUInteger budget = clippy_budget_bytes(clippy_config.maxTextKB);
+    if ([text maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding] <= budget ||
+        [text lengthOfBytesUsingEncoding:NSUTF8StringEncoding] <= budget) {
+        return text;
+    }
+
+    // A NULL buffer would make the encoder ignore maxLength and run to the end
+    NSMutableData *scratch = [NSMutableData dataWithLength:budget];
+    NSRange remaining = NSMakeRange(0, 0);
+    [text getBytes:[scratch mutableBytes] maxLength:budget usedLength:NULL
+          encoding:NSUTF8StringEncoding options:0
+             range:NSMakeRange(0, [text length]) remainingRange:&remaining];
+    NSUInteger cut = MIN(remaining.location, [text length]);
+    if (cut < [text length]) {
+        cut = [text rangeOfComposedCharacterSequenceAtIndex:cut].location;
+    }
+    return [text substringToIndex:cut];
+}
+
+/**
+ * Recount references from the given entries and delete unreferenced files
+ * Heals counts that drifted (e.g. a crash between a history write and a
+ * refcount update). Returns number of orphaned files removed.
+ */
+static inline NSUInteger clippy_image_rebuild_refs(NSArray *entries) {
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSString *dir = clippy_images_dir();
+    if (![fm fileExistsAtPath:dir]) {
+        return 0;
+    }
+
+    NSMutableDictionary *refs = [NSMutableDictionary dictionary];
+    for (NSDictionary *entry in entries) {
+        for (NSString *path in clippy_entry_stored_paths(entry)) {
+            NSString *filename = [path lastPathComponent];
+            refs[filename] = @([refs[filename] integerValue] + 1);
+        }
+    }
+
+    int lock = clippy_log_lock(clippy_image_refs_path());
+    NSUInteger removed = 0;
+    for (NSString *filename in [fm contentsOfDirectoryAtPath:dir error:nil]) {
+        // Thumbnails live as long as the image they belong to
+        NSString *owner = filename;
+        if ([filename hasSuffix:@CLIPPY_THUMBNAIL_SUFFIX]) {
+            owner = [[filename substringToIndex:[filename length] - strlen(CLIPPY_THUMBNAIL_SUFFIX)]
+                     stringByAppendingPathExtension:@"png"];
+        }
+        NSString *extension = [filename pathExtension];
+        if ((![extension isEqualToString:@"png"] && ![extension isEqualToString:@CLIPPY_BLOB_EXTENSION]) ||
+            refs[owner]) {
+            continue;
+        }
+        if (clippy_delete_image([dir stringByAppendingPathComponent:filename])) {
+            removed++;
+        }
+    }
+    clippy_image_refs_write(refs);
+    clippy_log_unlock(lock);
+
+    return removed;
+}
+
+// ============================================================================
+// JSON File Operations (with error recovery)
+// ============================================================================
+
+static inline NSMutableArray *clippy_parse_json_array(NSData *data, NSError **error) {
+    if ([data length] == 0) {
+        return nil;
+    }
+    id parsed = [NSJSONSerialization JSONObjectWithData:data options:0 error:error];
+    return [parsed isKindOfClass:[NSArray class]] ? [NSMutableArray arrayWithArray:parsed] : nil;
+}
+
+/**
+ * Read JSON array from file with validation
+ * Falls back to a ".backup" copy left by versions that kept one.
+ * Returns empty mutable array on error
+ */
+static inline NSMutableArray *clippy_read_json_array(NSString *path) {
+    NSError *error = nil;
+    NSData *data = [NSData dataWithContentsOfFile:path options:0 error:&error];
+    if (!data) {
+        return [NSMutableArray array];
+    }
+
+    NSMutableArray *array = clippy_parse_json_array(data, &error);
+    if (array) {
+        return array;
+    }
+
+    // Main file corrupted, try backup
+    NSString *backupPath = [path stringByAppendingString:@CLIPPY_BACKUP_SUFFIX];
+    NSData *backup = [NSData dataWithContentsOfFile:backupPath options:0 error:nil];
+    if (backup) {
+        NSLog(@"clippy: Main file corrupted, trying backup: %@", backupPath);
+        array = clippy_parse_json_array(backup, nil);
+        if (array) {
+            NSLog(@"clippy: Recovered from backup successfully");
+            return array;
+        }
+    }
+
+    if (error) {
+        NSLog(@"clippy: Failed to read %@: %@", path, error);
+    }
+    return [NSMutableArray array];
+}
+
+/**
+ * Write JSON array to file as compact JSON
+ * The write is atomic (temporary file, then rename), so readers see the old
+ * or the new contents and never a partial file
+ */
+static inline BOOL clippy_write_json_array(NSArray *array, NSString *path) {
+    NSError *error = nil;
+    NSData *data = [NSJSONSerialization dataWithJSONObject:array options:0 error:&error];
+    if (!data) {
+        NSLog(@"clippy: Failed to serialize JSON: %@", error);
+        return NO;
+    }
+
+    // Write atomically
+    BOOL success = [data writeToFile:path options:NSDataWritingAtomic error:&error];
+    if (!success) {
+        NSLog(@"clippy: Failed to write %@: %@", path, error);
+        return NO;
+    }
+    clippy_stat_count_write([data length]);
+
+    // Set restrictive permissions (owner read/write only)
+    chmod([path fileSystemRepresentation], S_IRUSR | S_IWUSR);
+
+    return YES;
+}
+
+// ============================================================================
+// Append-Only Record Log
+// ============================================================================
+
+/**
+ * History is stored as a log of compact JSON records, one per line, oldest
+ * first. Capturing an entry costs a single small append; the file is only
+ * rewritten when it is compacted back down to the live entries. An exclusive
+ * flock() on "<log>.lock" serializes writers across clipd, clippy and the picker.
+ */
+
+#define CLIPPY_LOG_TAIL_CHUNK 4096
+
+/**
+ * Encode a record as one line of compact JSON (newline terminated)
+ */
+static inline NSData *clippy_log_encode_record(NSDictionary *record) {
+    NSError *error = nil;
+    NSData *json = [NSJSONSerialization dataWithJSONObject:record options:0 error:&error];
+    if (!json) {
+        NSLog(@"clippy: Failed to encode record: %@", error);
+        return nil;
+    }
+
+    NSMutableData *line = [NSMutableData dataWithCapacity:[json length] + 1];
+    [line appendData:json];
+    [line appendBytes:"\n" length:1];
+    return line;
+}
+
+static inline NSDictionary *clippy_log_decode_record(const char *bytes, NSUInteger length) {
+    if (length == 0) {
+        return nil;
+    }
+    NSData *line = [NSData dataWithBytesNoCopy:(void *)bytes length:length freeWhenDone:NO];
+    id record = [NSJSONSerialization JSONObjectWithData:line options:0 error:nil];
+    return [record isKindOfClass:[NSDictionary class]] ? record : nil;
+}
+
+/**
+ * Length of fd's content up to and including its last newline (0 if none)
+ */
+static inline off_t clippy_last_line_end(int fd, off_t size) {
+    char chunk[CLIPPY_LOG_TAIL_CHUNK];
+    off_t end = size;
+    while (end > 0) {
+        size_t length = (size_t)MIN((off_t)sizeof(chunk), end);
+        if (pread(fd, chunk, length, end - (off_t)length) != (ssize_t)length) {
+            return -1;
+        }
+        for (size_t i = length; i > 0; i--) {
+            if (chunk[i - 1] == '\n') {
+                return end - (off_t)length + (off_t)i;
+            }
+        }
+        end -= (off_t)length;
+    }
+    return 0;
+}
+
+/**
+ * Append one encoded line; the caller holds the file's lock
+ * A torn final line (crash mid-append) is cut off first; appending behind
+ * it would fuse the new line onto the fragment and lose both.
+ */
+static inline BOOL clippy_append_line(NSString *path, NSData *line) {
+    int fd = open([path fileSystemRepresentation], O_RDWR | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+    BOOL success = NO;
+    int savedErrno = 0;
+    if (fd >= 0) {
+        struct stat st;
+        char last = '\n';
+        if (fstat(fd, &st) == 0 && st.st_size > 0 && pread(fd, &last, 1, st.st_size - 1) == 1 && last != '\n') {
+            off_t end = clippy_last_line_end(fd, st.st_size);
+            if (end >= 0 && ftruncate(fd, end) == 0) {
+                NSLog(@"clippy: Dropped a torn %lld-byte line from the end of %@",
+                      (long long)(st.st_size - end), [path lastPathComponent]);
+            }
+        }
+        success = (write(fd, [line bytes], [line length]) == (ssize_t)[line length]);
+        savedErrno = errno;
+        close(fd);
+    } else {
+        savedErrno = errno;
+    }
+
+    if (success) {
+        clippy_stat_count_write([line length]);
+    } else {
+        NSLog(@"clippy: Failed to append to %@: %s", path, strerror(savedErrno));
+    }
+    return success;
+}
+
+/**
+ * Append one record to the log; the caller holds the log lock
+ */
+static inline BOOL clippy_log_append_locked(NSString *path, NSDictionary *record) {
+    NSData *line = clippy_log_encode_record(record);
+    return line && clippy_append_line(path, line);
+}
+
+/**
+ * Append one record to the log
+ */
+static inline BOOL clippy_log_append(NSString *path, NSDictionary *record) {
+    int lock = clippy_log_lock(path);
+    BOOL success = clippy_log_append_locked(path, record);
+    clippy_log_unlock(lock);
+    return success;
+}
+
+/**
+ * Append several records with a single write under one lock (group commit)
+ * Records that fail to encode are skipped
+ */
+static inline BOOL clippy_log_append_batch(NSString *path, NSArray *records) {
+    NSMutableData *lines = [NSMutableData data];
+    for (NSDictionary *record in records) {
+        NSData *line = clippy_log_encode_record(record);
+        if (line) {
+            [lines appendData:line];
+        }
+    }
+    if ([lines length] == 0) {
+        return [records count] == 0;
+    }
+
+    int lock = clippy_log_lock(path);
+    BOOL success = clippy_append_line(path, lines);
+    clippy_log_unlock(lock);
+    return success;
+}
+
+/**
+ * Decode the records in length bytes of log data, appending them to records
+ * (base is where the bytes start in the log, for the skip message)
+ */
+static inline void clippy_log_parse_records(const char *bytes, NSUInteger length, NSString *path,
+                                            uint64_t base, NSMutableArray *records) {
+    NSUInteger start = 0;
+
+    while (start < length) {
+        const char *newline = memchr(bytes + start, '\n', length - start);
+        NSUInteger end = newline ? (NSUInteger)(newline - bytes) : length;
+
+        NSDictionary *record = clippy_log_decode_record(bytes + start, end - start);
+        if (record) {
+            [records addObject:record];
+        } else if (end > start) {
+            NSLog(@"clippy: Skipping unreadable record in %@ at offset %llu",
+                  path, (unsigned long long)(base + start));
+        }
+        start = end + 1;
+    }
+}
+
+/**
+ * Read every record in the log, oldest first
+ * A torn final line (crash mid-append) fails to parse and is skipped (and
+ * cut off by the next append)
+ */
+static inline NSMutableArray *clippy_log_read_records(NSString *path) {
+    NSMutableArray *records = [NSMutableArray array];
+    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:nil];
+    if (data) {
+        clippy_log_parse_records([data bytes], [data length], path, 0, records);
+    }
+    return records;
+}
+
+/**
+ * Read the most recent entry record without parsing the rest of the log
+ */
+static inline NSDictionary *clippy_log_read_last(NSString *path) {
+    int fd = open([path fileSystemRepresentation], O_RDONLY);
+    if (fd < 0) {
+        return nil;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return nil;
+    }
+
+    NSMutableData *tail = [NSMutableData data];
+    off_t pos = st.st_size;
+    NSDictionary *last = nil;
+
+    while (!last && pos > 0) {
+        size_t chunk = (size_t)MIN((off_t)CLIPPY_LOG_TAIL_CHUNK, pos);
+        pos -= chunk;
+
+        NSMutableData *block = [NSMutableData dataWithLength:chunk];
+        if (pread(fd, [block mutableBytes], chunk, pos) != (ssize_t)chunk) {
+            break;
+        }
+        [block appendData:tail];
+        tail = block;
+
+        // Walk complete lines backwards; a line touching the start of the
+        // buffer may continue in an earlier chunk unless we reached offset 0
+        const char *bytes = [tail bytes];
+        NSUInteger end = [tail length];
+        while (end > 0) {
+            NSUInteger start = end;
+            while (start > 0 && bytes[start - 1] != '\n') {
+                start--;
+            }
+            if (start == 0 && pos > 0) {
+                break;
+            }
+
+            // Op records amend earlier entries; keep looking for an entry
+            NSDictionary *record = clippy_log_decode_record(bytes + start, end - start);
+            if (record && !record[@"op"]) {
+                last = record;
+                break;
+            }
+            if (start == 0) {
+                break;
+            }
+            end = start - 1;
+        }
+    }
+
+    close(fd);
+    return last;
+}
+
+// ============================================================================
+// Checksummed Journal
+// ============================================================================
+
+/**
+ * Small collections kept as a JSON array (pins) pair that checkpoint file
+ * with a journal of changes since it was written. Each mutation appends one
+ * line, "<crc32 hex> <compact JSON>\n"; readers load the checkpoint and
+ * replay the journal, stopping at the first torn or mismatched line, since a
+ * crash can only damage the tail. Every CLIPPY_JOURNAL_CHECKPOINT_RECORDS
+ * records the current state is written as a new checkpoint (atomically) and
+ * the journal is replaced by an empty one. Records must be safe to replay
+ * twice, as a crash between those two steps replays the old journal onto
+ * the new checkpoint.
+ */
+
+#define CLIPPY_JOURNAL_CHECKPOINT_RECORDS 64
+#define CLIPPY_JOURNAL_CHECKSUM_CHARS 8
+
+static inline uint32_t clippy_crc32(const void *bytes, size_t length) {
+    static uint32_t table[256];
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    });
+
+    const uint8_t *p = bytes;
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static inline NSData *clippy_journal_encode_record(NSDictionary *record) {
+    NSData *json = clippy_log_encode_record(record);
+    if (!json) {
+        return nil;
+    }
+
+    NSUInteger jsonLength = [json length] - 1;  // Checksum covers the JSON, not the newline
+    char checksum[CLIPPY_JOURNAL_CHECKSUM_CHARS + 2];
+    snprintf(checksum, sizeof(checksum), "%08x ", clippy_crc32([json bytes], jsonLength));
+
+    NSMutableData *line = [NSMutableData dataWithCapacity:[json length] + sizeof(checksum)];
+    [line appendBytes:checksum length:CLIPPY_JOURNAL_CHECKSUM_CHARS + 1];
+    [line appendData:json];
+    return line;
+}
+
+/**
+ * Records in a journal, oldest first, up to the first bad line
+ * *validLength (optional) is set to the bytes those records span
+ */
+static inline NSMutableArray *clippy_journal_read_valid(NSString *path, NSUInteger *validLength) {
+    NSMutableArray *records = [NSMutableArray array];
+    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:nil];
+    const char *bytes = [data bytes];
+    NSUInteger length = [data length];
+    NSUInteger offset = 0;
+    NSUInteger valid = 0;
+
+    while (offset < length) {
+        const char *start = bytes + offset;
+        const char *newline = memchr(start, '\n', length - offset);
+        if (!newline) {
+            break;  // Torn final append
+        }
+        NSUInteger lineLength = (NSUInteger)(newline - start);
+        offset += lineLength + 1;
+        if (lineLength <= CLIPPY_JOURNAL_CHECKSUM_CHARS + 1 || start[CLIPPY_JOURNAL_CHECKSUM_CHARS] != ' ') {
+            break;
+        }
+
+        char hex[CLIPPY_JOURNAL_CHECKSUM_CHARS + 1];
+        memcpy(hex, start, CLIPPY_JOURNAL_CHECKSUM_CHARS);
+        hex[CLIPPY_JOURNAL_CHECKSUM_CHARS] = '\0';
+        char *hexEnd = NULL;
+        uint32_t expected = (uint32_t)strtoul(hex, &hexEnd, 16);
+
+        const char *json = start + CLIPPY_JOURNAL_CHECKSUM_CHARS + 1;
+        NSUInteger jsonLength = lineLength - CLIPPY_JOURNAL_CHECKSUM_CHARS - 1;
+        if (*hexEnd != '\0' || clippy_crc32(json, jsonLength) != expected) {
+            NSLog(@"clippy: Journal %@ damaged after %lu records, ignoring the rest",
+                  [path lastPathComponent], (unsigned long)[records count]);
+            break;
+        }
+
+        NSDictionary *record = clippy_log_decode_record(json, jsonLength);
+        if (!record) {
+            break;
+        }
+        [records addObject:record];
+        valid = offset;
+    }
+    if (validLength) {
+        *validLength = valid;
+    }
+    return records;
+}
+
+static inline NSMutableArray *clippy_journal_read(NSString *path) {
+    return clippy_journal_read_valid(path, NULL);
+}
+
+/**
+ * Cut a journal back to its first validLength bytes (see
+ * clippy_journal_read_valid). A torn or damaged tail would otherwise stay
+ * in front of every later append, and replay stops before reaching them.
+ * The caller holds the journal's lock.
+ */
+static inline BOOL clippy_journal_truncate_locked(NSString *path, NSUInteger validLength) {
+    struct stat st;
+    if (stat([path fileSystemRepresentation], &st) != 0 || (uint64_t)st.st_size <= validLength) {
+        return YES;
+    }
+    NSLog(@"clippy: Dropping %llu damaged bytes from the end of journal %@",
+          (unsigned long long)st.st_size - validLength, [path lastPathComponent]);
+    return truncate([path fileSystemRepresentation], (off_t)validLength) == 0;
+}
+
+/**
+ * Append one record; the caller holds the journal's lock
+ */
+static inline BOOL clippy_journal_append_locked(NSString *path, NSDictionary *record) {
+    NSData *line = clippy_journal_encode_record(record);
+    return line && clippy_append_line(path, line);
+}
+
+/**
+ * Write state as the new checkpoint, then start an empty journal (renamed
+ * into place, so watchers of the old journal see it replaced)
+ */
+static inline BOOL clippy_journal_checkpoint_locked(NSString *journalPath, NSString *checkpointPath,
+                                                    NSArray *state) {
+    if (!clippy_write_json_array(state, checkpointPath)) {
+        return NO;
+    }
+    if (![[NSData data] writeToFile:journalPath options:NSDataWritingAtomic error:nil]) {
+        return NO;
+    }
+    chmod([journalPath fileSystemRepresentation], S_IRUSR | S_IWUSR);
+    return YES;
+}
+
+// ============================================================================
+// Entry IDs
+// ============================================================================
+
+/**
+ * Every history entry and pin carries a stable "id", assigned when it is
+ * created and kept through updates and moves, so edits name the record
+ * itself rather than a position or its content. An id is the creation time
+ * in milliseconds shifted left by CLIPPY_ID_SEQUENCE_BITS, plus a random
+ * non-zero sequence that is bumped if needed to keep ids increasing within
+ * a process. Ids stay below 2^53 so any JSON reader keeps them exact.
+ *
+ * Records written before ids existed get one derived from their timestamp
+ * (sequence zero, so it can't collide with a new id); every reader derives
+ * the same value, and a move pins it down before the timestamp changes.
+ */
+
+#define CLIPPY_ID_SEQUENCE_BITS 10
+
+static inline uint64_t clippy_id_for_timestamp(double timestamp) {
+    return (uint64_t)llround(MAX(timestamp, 0) * 1000.0) << CLIPPY_ID_SEQUENCE_BITS;
+}
+
+static inline NSNumber *clippy_new_entry_id(void) {
+    static _Atomic uint64_t lastId = 0;
+    uint64_t base = clippy_id_for_timestamp([[NSDate date] timeIntervalSince1970]);
+    uint64_t candidate = base | (1 + arc4random_uniform((1u << CLIPPY_ID_SEQUENCE_BITS) - 1));
+
+    uint64_t last = atomic_load(&lastId);
+    uint64_t next;
+    do {
+        next = candidate > last ? candidate : last + 1;
+    } while (!atomic_compare_exchange_weak(&lastId, &last, next));
+    return @(next);
+}
+
+/**
+ * The entry's id (derived from its timestamp for older records), or 0
+ */
+static inline uint64_t clippy_entry_id(NSDictionary *entry) {
+    NSNumber *entryId = entry[@"id"];
+    if ([entryId isKindOfClass:[NSNumber class]]) {
+        return [entryId unsignedLongLongValue];
+    }
+    NSNumber *timestamp = entry[@"timestamp"];
+    return [timestamp isKindOfClass:[NSNumber class]] ? clippy_id_for_timestamp([timestamp doubleValue]) : 0;
+}
+
+/**
+ * Index of the entry with the given id, or NSNotFound (a scan, for arrays
+ * without an id map: pins, or history read back from the files)
+ */
+static inline NSUInteger clippy_index_of_entry_id(NSArray *entries, uint64_t entryId) {
+    for (NSUInteger i = 0; i < [entries count]; i++) {
+        if (clippy_entry_id(entries[i]) == entryId) {
+            return i;
+        }
+    }
+    return NSNotFound;
+}
+
+// ============================================================================
+// Frecency
+// ============================================================================
+
+/**
+ * Pasting an entry from the picker or `clippy get` counts as a use. Uses
+ * decay with a half-life, and an entry keeps just one number for them, its
+ * "frecency": log2 of the sum of 2^(t / half-life) over its use times t.
+ * Recording a use is a log-add, and the decayed count at time now is
+ * 2^(frecency - now / half-life), so the value never overflows and nothing
+ * has to be rescaled as time passes.
+ */
+
+#define CLIPPY_FRECENCY_HALF_LIFE_SEC (3 * 24 * 60 * 60)
+#define CLIPPY_FRECENCY_WEIGHT 16      // Score points per doubling of recent uses
+#define CLIPPY_FRECENCY_MAX_BOOST 64   // About what a better match position earns
+
+/**
+ * The entry's frecency after one more use at now (seconds since 1970)
+ */
+static inline double clippy_frecency_after_use(NSDictionary *entry, NSTimeInterval now) {
+    double use = now / CLIPPY_FRECENCY_HALF_LIFE_SEC;
+    NSNumber *frecency = entry[@"frecency"];
+    if (![frecency isKindOfClass:[NSNumber class]]) {
+        return use;
+    }
+    double high = MAX([frecency doubleValue], use);
+    double low = MIN([frecency doubleValue], use);
+    return high + log2(1.0 + exp2(low - high));
+}
+
+/**
+ * Uses of the entry, each weighted by how long ago it was (0 if never used)
+ */
+static inline double clippy_frecency_uses(NSDictionary *entry, NSTimeInterval now) {
+    NSNumber *frecency = entry[@"frecency"];
+    if (![frecency isKindOfClass:[NSNumber class]]) {
+        return 0;
+    }
+    return exp2(MIN([frecency doubleValue] - now / CLIPPY_FRECENCY_HALF_LIFE_SEC, 32.0));
+}
+
+/**
+ * Points added to the entry's fuzzy score when it matches: WEIGHT per
+ * doubling of its decayed uses, capped so that a much closer match still
+ * wins over a popular one
+ */
+static inline NSInteger clippy_frecency_boost(NSDictionary *entry, NSTimeInterval now) {
+    double uses = clippy_frecency_uses(entry, now);
+    if (uses <= 0) {
+        return 0;
+    }
+    return (NSInteger)MIN(CLIPPY_FRECENCY_WEIGHT * log2(1.0 + uses), (double)CLIPPY_FRECENCY_MAX_BOOST);
+}
+
+// ============================================================================
+// Expiry Boundaries
+// ============================================================================
+
+/**
+ * History is newest first and pins are appended, so both are ordered by
+ * timestamp and the expired entries form one run at the old end, found by
+ * binary search instead of checking every entry. New entries are stamped
+ * with clippy_next_timestamp so a clock stepping back can't break the order,
+ * and imports put entries without a timestamp at the new end. The run found
+ * is still checked, since callers touch each of its entries anyway; if the
+ * order is broken regardless (older data), only the expired entries at the
+ * very end are taken, never a live one.
+ */
+
+static inline BOOL clippy_entry_expired(NSDictionary *entry, NSTimeInterval cutoff) {
+    NSNumber *timestamp = entry[@"timestamp"];
+    return [timestamp isKindOfClass:[NSNumber class]] && [timestamp doubleValue] < cutoff;
+}
+
+/**
+ * Timestamp for a new entry at the new end of a time-ordered array: now, or
+ * the newest entry's timestamp if the clock has since stepped back
+ */
+static inline NSNumber *clippy_next_timestamp(NSArray *entries, BOOL newestFirst) {
+    NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+    NSNumber *newest = (newestFirst ? [entries firstObject] : [entries lastObject])[@"timestamp"];
+    if ([newest isKindOfClass:[NSNumber class]] && [newest doubleValue] > now) {
+        return newest;
+    }
+    return @(now);
+}
+
+/**
+ * Entries with a timestamp before this have expired (maxAgeDays ago)
+ */
+static inline NSTimeInterval clippy_expiry_cutoff(void) {
+    return [[NSDate date] timeIntervalSince1970] - clippy_config.maxAgeDays * 24 * 60 * 60;
+}
+
+/**
+ * Where the expired run starts in a time-ordered array
+ * Newest-first arrays return the index of the first expired entry, so
+ * [idx, count) has expired; oldest-first arrays return the number of
+ * expired entries, so [0, idx) has. Entries without a timestamp never expire.
+ */
+static inline NSUInteger clippy_expiry_boundary(NSArray *entries, NSTimeInterval cutoff, BOOL newestFirst) {
+    NSUInteger count = [entries count];
+    NSUInteger low = 0;
+    NSUInteger high = count;
+    while (low < high) {
+        NSUInteger mid = low + (high - low) / 2;
+        if (clippy_entry_expired(entries[mid], cutoff) == newestFirst) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    NSRange run = newestFirst ? NSMakeRange(low, count - low) : NSMakeRange(0, low);
+    for (NSUInteger i = run.location; i < NSMaxRange(run); i++) {
+        if (!clippy_entry_expired(entries[i], cutoff)) {
+            NSLog(@"clippy: Entries out of time order; expiring only the oldest run");
+            NSUInteger edge = newestFirst ? count : 0;
+            if (newestFirst) {
+                while (edge > 0 && clippy_entry_expired(entries[edge - 1], cutoff)) {
+                    edge--;
+                }
+            } else {
+                while (edge < count && clippy_entry_expired(entries[edge], cutoff)) {
+                    edge++;
+                }
+            }
+            return edge;
+        }
+    }
+    return low;
+}
+
+// ============================================================================
+// Log Index
+// ============================================================================
+
+/**
+ * Rewriting a log also writes "<log>.idx": where each entry's line starts,
+ * newest first, with its id and timestamp. The index describes a prefix of
+ * the log and records the log's device, inode and length at the time plus a
+ * checksum of its last bytes, so a log that has since been replaced,
+ * truncated or regrown is noticed and the index ignored. Readers replay only
+ * the records appended after that prefix on top of the index and decode
+ * just the entries they return (see clippy_log_read_range).
+ */
+
+#define CLIPPY_LOG_INDEX_SUFFIX ".idx"
+#define CLIPPY_LOG_INDEX_MAGIC "CLX1"
+#define CLIPPY_LOG_INDEX_CHECK_BYTES 64
+#define CLIPPY_LOG_INDEX_MAX_TAIL 1024    // Appends before clipd compacts regardless of max_history_items
+
+typedef struct {
+    char magic[4];
+    uint32_t count;       // Slots that follow, newest first
+    uint64_t device;      // The log's st_dev and st_ino
+    uint64_t inode;
+    uint64_t covered;     // Length of the log prefix described
+    uint32_t check;       // CRC32 of the covered prefix's last CLIPPY_LOG_INDEX_CHECK_BYTES
+    uint32_t reserved;
+} ClippyLogIndexHeader;
+
+typedef struct {
+    uint64_t offset;      // Start of the entry's line
+    uint64_t entryId;     // clippy_entry_id
+    double timestamp;     // 0 for entries without one
+    uint32_t length;      // Line length, newline excluded
+    uint32_t reserved;
+} ClippyLogIndexSlot;
+
+static inline NSString *clippy_log_index_path(NSString *logPath) {
+    return [logPath stringByAppendingString:@CLIPPY_LOG_INDEX_SUFFIX];
+}
+
+/**
+ * Checksum of the bytes just before covered; NO if they can't be read
+ */
+static inline BOOL clippy_log_index_check(int fd, uint64_t covered, uint32_t *check) {
+    uint8_t bytes[CLIPPY_LOG_INDEX_CHECK_BYTES];
+    size_t span = (size_t)MIN(covered, (uint64_t)CLIPPY_LOG_INDEX_CHECK_BYTES);
+    if (pread(fd, bytes, span, (off_t)(covered - span)) != (ssize_t)span) {
+        return NO;
+    }
+    *check = clippy_crc32(bytes, span);
+    return YES;
+}
+
+/**
+ * Write the index for the first covered bytes of the log (slots oldest first,
+ * as they were laid out); a stale index is removed if this fails
+ */
+static inline void clippy_log_index_write(NSString *logPath, NSData *slots, uint64_t covered) {
+    NSString *indexPath = clippy_log_index_path(logPath);
+    ClippyLogIndexHeader header = {
+        .magic = CLIPPY_LOG_INDEX_MAGIC,
+        .count = (uint32_t)([slots length] / sizeof(ClippyLogIndexSlot)),
+        .covered = covered
+    };
+
+    int fd = open([logPath fileSystemRepresentation], O_RDONLY);
+    struct stat st;
+    BOOL valid = fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size >= covered &&
+                 clippy_log_index_check(fd, covered, &header.check);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!valid) {
+        unlink([indexPath fileSystemRepresentation]);
+        return;
+    }
+    header.device = (uint64_t)st.st_dev;
+    header.inode = (uint64_t)st.st_ino;
+
+    NSMutableData *data = [NSMutableData dataWithCapacity:sizeof(header) + [slots length]];
+    [data appendBytes:&header length:sizeof(header)];
+    const ClippyLogIndexSlot *oldest = [slots bytes];
+    for (NSUInteger i = header.count; i-- > 0; ) {
+        [data appendBytes:&oldest[i] length:sizeof(ClippyLogIndexSlot)];
+    }
+
+    NSError *error = nil;
+    if (![data writeToFile:indexPath options:NSDataWritingAtomic error:&error]) {
+        NSLog(@"clippy: Failed to write %@: %@", indexPath, error);
+        unlink([indexPath fileSystemRepresentation]);
+        return;
+    }
+    clippy_stat_count_write([data length]);
+    chmod([indexPath fileSystemRepresentation], S_IRUSR | S_IWUSR);
+}
+
+/**
+ * Map the log's index if it still describes a prefix of the log open on fd
+ * Sets *header and *logSize; nil when the index is missing or stale
+ */
+static inline NSData *clippy_log_index_open(NSString *logPath, int fd, const ClippyLogIndexHeader **header,
+                                            uint64_t *logSize) {
+    NSData *map = [NSData dataWithContentsOfFile:clippy_log_index_path(logPath)
+                                         options:NSDataReadingMappedIfSafe error:nil];
+    if ([map length] < sizeof(ClippyLogIndexHeader)) {
+        return nil;
+    }
+
+    const ClippyLogIndexHeader *h = [map bytes];
+    struct stat st;
+    uint32_t check = 0;
+    if (memcmp(h->magic, CLIPPY_LOG_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        [map length] != sizeof(*h) + (NSUInteger)h->count * sizeof(ClippyLogIndexSlot) ||
+        fstat(fd, &st) != 0 || (uint64_t)st.st_dev != h->device || (uint64_t)st.st_ino != h->inode ||
+        (uint64_t)st.st_size < h->covered ||
+        !clippy_log_index_check(fd, h->covered, &check) || check != h->check) {
+        return nil;
+    }
+
+    *header = h;
+    *logSize = (uint64_t)st.st_size;
+    return map;
+}
+
+/**
+ * Whether the log's index describes all of it (nothing appended since)
+ */
+static inline BOOL clippy_log_index_current(NSString *logPath) {
+    int fd = open([logPath fileSystemRepresentation], O_RDONLY);
+    if (fd < 0) {
+        return NO;
+    }
+    const ClippyLogIndexHeader *header = NULL;
+    uint64_t size = 0;
+    NSData *map = clippy_log_index_open(logPath, fd, &header, &size);
+    BOOL current = map && header->covered == size;
+    close(fd);
+    return current;
+}
+
+/**
+ * Decode the entry a slot points at
+ */
+static inline NSDictionary *clippy_log_index_entry(int fd, const ClippyLogIndexSlot *slot) {
+    NSMutableData *line = [NSMutableData dataWithLength:slot->length];
+    if (pread(fd, [line mutableBytes], slot->length, (off_t)slot->offset) != (ssize_t)slot->length) {
+        return nil;
+    }
+    return clippy_log_decode_record([line bytes], [line length]);
+}
+
+/**
+ * Rewrite the log so it holds exactly the given entries (newest first in
+ * memory), then its index. Caller must hold the log lock
+ */
+static inline BOOL clippy_log_write_entries(NSString *path, NSArray *entries) {
+    NSMutableData *data = [NSMutableData data];
+    NSMutableData *slots = [NSMutableData dataWithCapacity:[entries count] * sizeof(ClippyLogIndexSlot)];
+    for (NSDictionary *entry in [entries reverseObjectEnumerator]) {
+        NSData *line = clippy_log_encode_record(entry);
+        if (line) {
+            ClippyLogIndexSlot slot = {
+                .offset = [data length],
+                .entryId = clippy_entry_id(entry),
+                .timestamp = [entry[@"timestamp"] doubleValue],
+                .length = (uint32_t)([line length] - 1)
+            };
+            [slots appendBytes:&slot length:sizeof(slot)];
+            [data appendData:line];
+        }
+    }
+
+    NSError *error = nil;
+    BOOL success = [data writeToFile:path options:NSDataWritingAtomic error:&error];
+    if (!success) {
+        NSLog(@"clippy: Failed to write %@: %@", path, error);
+        return NO;
+    }
+    clippy_stat_count_write([data length]);
+
+    chmod([path fileSystemRepresentation], S_IRUSR | S_IWUSR);
+    clippy_log_index_write(path, slots, [data length]);
+    return YES;
+}
+
+// ============================================================================
+// History Store
+// ============================================================================
+
+/**
+ * Rough bytes a decoded record holds in memory: its containers, strings
+ * (UTF-16) and numbers. An estimate, but the same one in every process
+ */
+static inline NSUInteger clippy_entry_footprint(id object) {
+    if ([object isKindOfClass:[NSString class]]) {
+        return 32 + [object length] * sizeof(unichar);
+    }
+    if ([object isKindOfClass:[NSDictionary class]]) {
+        NSUInteger bytes = 48;
+        for (id key in object) {
+            bytes += 2 * sizeof(id) + clippy_entry_footprint(object[key]);
+        }
+        return bytes;
+    }
+    if ([object isKindOfClass:[NSArray class]]) {
+        NSUInteger bytes = 32;
+        for (id item in object) {
+            bytes += sizeof(id) + clippy_entry_footprint(item);
+        }
+        return bytes;
+    }
+    return 16;
+}
+
+static inline NSUInteger clippy_memory_budget_bytes(void) {
+    return (NSUInteger)MAX(clippy_config.maxMemoryMB, 0) * 1024 * 1024;
+}
+
+/**
+ * How many of the newest entries fit both max_history_items and
+ * max_memory_mb (the newest entry is always kept)
+ */
+static inline NSUInteger clippy_history_keep_count(NSArray *history) {
+    NSUInteger limit = MIN([history count], (NSUInteger)MAX(clippy_config.maxHistoryItems, 0));
+    NSUInteger budget = clippy_memory_budget_bytes();
+    NSUInteger bytes = 0;
+    for (NSUInteger i = 0; i < limit; i++) {
+        bytes += clippy_entry_footprint(history[i]);
+        if (bytes > budget && i > 0) {
+            return i;
+        }
+    }
+    return limit;
+}
+
+/**
+ * Drop entries beyond maxHistoryItems or the memory budget, releasing
+ * their images
+ * Returns number of entries removed
+ */
+static inline NSUInteger clippy_trim_history(NSMutableArray *history) {
+    NSUInteger keep = clippy_history_keep_count(history);
+    if ([history count] <= keep) {
+        return 0;
+    }
+    NSRange dropped = NSMakeRange(keep, [history count] - keep);
+    clippy_entries_release([history subarrayWithRange:dropped]);
+    [history removeObjectsInRange:dropped];
+    return dropped.length;
+}
+
+/**
+ * Import the legacy JSON history file the first time the log is used
+ */
+static inline void clippy_history_migrate(void) {
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSString *logPath = clippy_history_log_path();
+
+    if ([fm fileExistsAtPath:logPath] || ![fm fileExistsAtPath:clippy_history_path()]) {
+        return;
+    }
+    if (!clippy_ensure_data_dir()) {
+        return;
+    }
+
+    int lock = clippy_log_lock(logPath);
+    if (![fm fileExistsAtPath:logPath]) {
+        NSArray *legacy = clippy_read_json_array(clippy_history_path());
+        if (clippy_log_write_entries(logPath, legacy)) {
+            NSLog(@"clippy: Imported %lu entries from %@",
+                  (unsigned long)[legacy count], clippy_history_path());
+        }
+    }
+    clippy_log_unlock(lock);
+}
+
+/**
+ * Records that amend an entry in place
+ */
+static inline BOOL clippy_history_amends(NSString *op) {
+    return [op isEqualToString:@"update"] || [op isEqualToString:@"use"];
+}
+
+/**
+ * The entry as amended by an "update" or "use" record
+ */
+static inline NSDictionary *clippy_history_updated_entry(NSDictionary *current, NSDictionary *record) {
+    NSMutableDictionary *entry = [current mutableCopy];
+    if ([record[@"op"] isEqualToString:@"use"]) {
+        if ([record[@"at"] isKindOfClass:[NSNumber class]]) {
+            entry[@"frecency"] = @(clippy_frecency_after_use(current, [record[@"at"] doubleValue]));
+        }
+        return entry;
+    }
+    NSDictionary *set = record[@"set"];
+    NSArray *unset = record[@"unset"];
+    if ([set isKindOfClass:[NSDictionary class]]) {
+        [entry addEntriesFromDictionary:set];
+    }
+    if ([unset isKindOfClass:[NSArray class]]) {
+        [entry removeObjectsForKeys:unset];
+    }
+    return entry;
+}
+
+/**
+ * The entry as brought to the front by a "move" record
+ * Its id is fixed first: a derived one would change with the timestamp
+ */
+static inline NSDictionary *clippy_history_moved_entry(NSDictionary *current, NSNumber *to) {
+    NSMutableDictionary *entry = [current mutableCopy];
+    entry[@"id"] = @(clippy_entry_id(current));
+    entry[@"timestamp"] = to;
+    return entry;
+}
+
+/**
+ * Whether op is a well-formed "remove", or a "move" with a new timestamp
+ */
+static inline BOOL clippy_history_valid_removal(NSString *op, NSNumber *to) {
+    if ([op isEqualToString:@"move"]) {
+        return [to isKindOfClass:[NSNumber class]];
+    }
+    return [op isEqualToString:@"remove"];
+}
+
+/**
+ * Replay log records into history (newest first)
+ * Plain records are entries. Records with an "op" amend an earlier entry,
+ * identified by its id ("id"), or by its timestamp ("ts") in logs written
+ * before entries had ids:
+ *   update  merge "set" into the entry and drop the keys listed in "unset"
+ *   remove  delete the entry
+ *   move    make the entry the newest one, with timestamp "to"
+ *   use     count a use at time "at" toward the entry's frecency
+ * except "expire", which drops every entry with a timestamp before "before".
+ */
+static inline NSMutableArray *clippy_history_entries_from_records(NSArray *records) {
+    NSMutableArray *entries = [NSMutableArray arrayWithCapacity:[records count]];
+    NSMutableDictionary *slots = [NSMutableDictionary dictionary];      // id -> index in entries
+    NSMutableDictionary *timeSlots = [NSMutableDictionary dictionary];  // timestamp -> index
+    NSTimeInterval expireBefore = 0;
+
+    for (NSDictionary *record in records) {
+        NSString *op = record[@"op"];
+        if ([op isEqualToString:@"expire"]) {
+            expireBefore = MAX(expireBefore, [record[@"before"] doubleValue]);
+            continue;
+        }
+        if (!op) {
+            NSNumber *slot = @([entries count]);
+            uint64_t entryId = clippy_entry_id(record);
+            if (entryId) {
+                slots[@(entryId)] = slot;
+            }
+            if (record[@"timestamp"]) {
+                timeSlots[record[@"timestamp"]] = slot;
+            }
+            [entries addObject:record];
+            continue;
+        }
+
+        NSNumber *slot = nil;
+        if (record[@"id"]) {
+            slot = slots[record[@"id"]];
+        } else if (record[@"ts"]) {
+            slot = timeSlots[record[@"ts"]];
+        }
+        if (!slot) {
+            continue;
+        }
+        NSUInteger idx = [slot unsignedIntegerValue];
+        NSDictionary *current = entries[idx];
+
+        if (clippy_history_amends(op)) {
+            entries[idx] = clippy_history_updated_entry(current, record);
+            continue;
+        }
+
+        NSNumber *to = record[@"to"];
+        BOOL move = [op isEqualToString:@"move"];
+        if (!clippy_history_valid_removal(op, to)) {
+            continue;
+        }
+
+        NSNumber *entryId = @(clippy_entry_id(current));
+        entries[idx] = [NSNull null];
+        [slots removeObjectForKey:entryId];
+        if (current[@"timestamp"]) {
+            [timeSlots removeObjectForKey:current[@"timestamp"]];
+        }
+
+        if (move) {
+            slots[entryId] = @([entries count]);
+            timeSlots[to] = @([entries count]);
+            [entries addObject:clippy_history_moved_entry(current, to)];
+        }
+    }
+
+    NSMutableArray *history = [NSMutableArray arrayWithCapacity:[entries count]];
+    for (id entry in [entries reverseObjectEnumerator]) {
+        if (entry != [NSNull null]) {
+            [history addObject:entry];
+        }
+    }
+
+    // Later records only add newer entries, so expiry is still a tail
+    NSUInteger expired = clippy_expiry_boundary(history, expireBefore, YES);
+    [history removeObjectsInRange:NSMakeRange(expired, [history count] - expired)];
+    return history;
+}
+
+/**
+ * Load history (newest first), limited to maxHistoryItems and the memory
+ * budget
+ */
+static inline NSMutableArray *clippy_history_load(void) {
+    clippy_history_migrate();
+
+    NSArray *records = clippy_log_read_records(clippy_history_log_path());
+    NSMutableArray *history = clippy_history_entries_from_records(records);
+
+    NSUInteger keep = clippy_history_keep_count(history);
+    [history removeObjectsInRange:NSMakeRange(keep, [history count] - keep)];
+    return history;
+}
+
+/**
+ * Whether an op record names the entry: by id, or by timestamp in logs
+ * written before entries had ids (as clippy_history_entries_from_records)
+ */
+static inline BOOL clippy_history_record_targets(NSDictionary *record, uint64_t entryId, NSNumber *timestamp) {
+    if (record[@"id"]) {
+        return entryId != 0 && [record[@"id"] unsignedLongLongValue] == entryId;
+    }
+    return timestamp && [record[@"ts"] isEqual:timestamp];
+}
+
+/**
+ * Index slots by entry id, or by timestamp for logs written before entries
+ * had ids, so each op in the tail finds its slot without a scan. Slots
+ * sharing a key are chained in index order (newest first).
+ */
+typedef struct {
+    uint64_t *keys;       // Open addressing; 0 marks an empty bucket
+    NSUInteger *firsts;   // Bucket -> first slot with its key
+    NSUInteger *next;     // Slot -> next slot with the same key, or NSNotFound
+    NSUInteger size;      // Power of two, at least twice the slot count
+} ClippyLogSlotMap;
+
+static inline uint64_t clippy_log_timestamp_key(double timestamp) {
+    uint64_t key = 0;  // 0 for no timestamp, like the slots
+    memcpy(&key, &timestamp, sizeof(key));
+    return key;
+}
+
+static inline NSUInteger clippy_log_slot_bucket(const ClippyLogSlotMap *map, uint64_t key) {
+    NSUInteger i = (NSUInteger)((key * 0x9E3779B97F4A7C15ull) >> 32) & (map->size - 1);
+    while (map->keys[i] != 0 && map->keys[i] != key) {
+        i = (i + 1) & (map->size - 1);
+    }
+    return i;
+}
+
+static inline void clippy_log_slot_map_free(ClippyLogSlotMap *map) {
+    free(map->keys);
+    free(map->firsts);
+    free(map->next);
+    *map = (ClippyLogSlotMap){0};
+}
+
+static inline BOOL clippy_log_slot_map_build(ClippyLogSlotMap *map, const ClippyLogIndexSlot *slots,
+                                             NSUInteger count, BOOL byTimestamp) {
+    NSUInteger size = 16;
+    while (size < count * 2) {
+        size <<= 1;
+    }
+    *map = (ClippyLogSlotMap){calloc(size, sizeof(uint64_t)), malloc(size * sizeof(NSUInteger)),
+                              malloc(MAX(count, (NSUInteger)1) * sizeof(NSUInteger)), size};
+    if (!map->keys || !map->firsts || !map->next) {
+        clippy_log_slot_map_free(map);
+        return NO;
+    }
+
+    for (NSUInteger i = count; i-- > 0; ) {
+        map->next[i] = NSNotFound;
+        uint64_t key = byTimestamp ? clippy_log_timestamp_key(slots[i].timestamp) : slots[i].entryId;
+        if (key == 0) {
+            continue;
+        }
+        NSUInteger bucket = clippy_log_slot_bucket(map, key);
+        if (map->keys[bucket] == key) {
+            map->next[i] = map->firsts[bucket];
+        }
+        map->keys[bucket] = key;
+        map->firsts[bucket] = i;
+    }
+    return YES;
+}
+
+/**
+ * The first slot with key that isn't hidden, or NSNotFound
+ */
+static inline NSUInteger clippy_log_slot_map_find(const ClippyLogSlotMap *map, uint64_t key, NSIndexSet *hidden) {
+    if (key == 0 || !map->keys) {
+        return NSNotFound;
+    }
+    NSUInteger bucket = clippy_log_slot_bucket(map, key);
+    NSUInteger slot = map->keys[bucket] == key ? map->firsts[bucket] : NSNotFound;
+    while (slot != NSNotFound && [hidden containsIndex:slot]) {
+        slot = map->next[slot];
+    }
+    return slot;
+}
+
+/**
+ * Entries [start, start + limit) of the log's history (newest first; limit 0
+ * for the rest) and, in *total, how many entries there are
+ * With a current index only the records appended since it was written are
+ * replayed, and only the returned entries are decoded; otherwise the whole
+ * log is replayed.
+ */
+static inline NSArray *clippy_log_read_range(NSString *path, NSUInteger start, NSUInteger limit, NSUInteger *total) {
+    int fd = open([path fileSystemRepresentation], O_RDONLY);
+    const ClippyLogIndexHeader *header = NULL;
+    uint64_t size = 0;
+    NSData *map = fd >= 0 ? clippy_log_index_open(path, fd, &header, &size) : nil;
+    NSMutableData *tailData = nil;
+    if (map) {
+        tailData = [NSMutableData dataWithLength:(NSUInteger)(size - header->covered)];
+        if (pread(fd, [tailData mutableBytes], [tailData length], (off_t)header->covered) !=
+            (ssize_t)[tailData length]) {
+            map = nil;
+        }
+    }
+
+    const ClippyLogIndexSlot *slots = map ? (const ClippyLogIndexSlot *)(header + 1) : NULL;
+    NSUInteger count = map ? header->count : 0;
+    NSMutableArray *tail = [NSMutableArray array];
+    ClippyLogSlotMap byId = {0};
+    ClippyLogSlotMap byTime = {0};
+    if (map) {
+        clippy_log_parse_records([tailData bytes], [tailData length], path, header->covered, tail);
+
+        // Built once for the whole tail, and only for the keys it uses
+        BOOL needIds = NO;
+        BOOL needTimes = NO;
+        for (NSDictionary *record in tail) {
+            needIds = needIds || (record[@"op"] && record[@"id"]);
+            needTimes = needTimes || (record[@"op"] && !record[@"id"] && record[@"ts"]);
+        }
+        if ((needIds && !clippy_log_slot_map_build(&byId, slots, count, NO)) ||
+            (needTimes && !clippy_log_slot_map_build(&byTime, slots, count, YES))) {
+            clippy_log_slot_map_free(&byId);
+            map = nil;
+        }
+    }
+    if (!map) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        NSArray *history = clippy_history_entries_from_records(clippy_log_read_records(path));
+        *total = [history count];
+        NSUInteger first = MIN(start, *total);
+        NSUInteger length = limit > 0 ? MIN(limit, *total - first) : *total - first;
+        return [history subarrayWithRange:NSMakeRange(first, length)];
+    }
+
+    // Overlay the tail on the indexed entries the way a full replay would
+    NSMutableArray *front = [NSMutableArray array];                  // Added or moved since, oldest first
+    NSMutableIndexSet *hidden = [NSMutableIndexSet indexSet];         // Slots removed or moved since
+    NSMutableDictionary *patched = [NSMutableDictionary dictionary];  // Slot -> entry as updated since
+    NSTimeInterval expireBefore = 0;
+
+    for (NSDictionary *record in tail) {
+        NSString *op = record[@"op"];
+        if ([op isEqualToString:@"expire"]) {
+            expireBefore = MAX(expireBefore, [record[@"before"] doubleValue]);
+            continue;
+        }
+        if (!op) {
+            [front addObject:record];
+            continue;
+        }
+
+        // The newest entry it names: one added since, else an indexed one
+        NSUInteger frontIdx = NSNotFound;
+        NSUInteger slot = NSNotFound;
+        for (NSUInteger i = [front count]; i-- > 0; ) {
+            if (clippy_history_record_targets(record, clippy_entry_id(front[i]), front[i][@"timestamp"])) {
+                frontIdx = i;
+                break;
+            }
+        }
+        NSDictionary *current = frontIdx != NSNotFound ? front[frontIdx] : nil;
+        if (!current) {
+            slot = record[@"id"]
+                 ? clippy_log_slot_map_find(&byId, [record[@"id"] unsignedLongLongValue], hidden)
+                 : clippy_log_slot_map_find(&byTime, clippy_log_timestamp_key([record[@"ts"] doubleValue]), hidden);
+        }
+        if (slot != NSNotFound) {
+            current = patched[@(slot)] ?: clippy_log_index_entry(fd, &slots[slot]);
+        }
+        if (!current) {
+            continue;
+        }
+
+        if (clippy_history_amends(op)) {
+            NSDictionary *entry = clippy_history_updated_entry(current, record);
+            if (frontIdx != NSNotFound) {
+                front[frontIdx] = entry;
+            } else {
+                patched[@(slot)] = entry;
+            }
+            continue;
+        }
+
+        NSNumber *to = record[@"to"];
+        if (!clippy_history_valid_removal(op, to)) {
+            continue;
+        }
+        if (frontIdx != NSNotFound) {
+            [front removeObjectAtIndex:frontIdx];
+        } else {
+            [hidden addIndex:slot];
+            [patched removeObjectForKey:@(slot)];
+        }
+        if ([op isEqualToString:@"move"]) {
+            [front addObject:clippy_history_moved_entry(current, to)];
+        }
+    }
+
+    // Newest first: what was added since, then the indexed entries left.
+    // Both runs are time ordered, so expiry cuts the indexed slots by binary
+    // search, and only reaches the recent ones once every slot has expired.
+    // As in clippy_expiry_boundary, the cut run is checked, and if the order
+    // is broken only the expired slots at the very end are cut.
+    NSMutableArray *recent = [[[front reverseObjectEnumerator] allObjects] mutableCopy];
+    NSUInteger live = 0;
+    NSUInteger high = count;
+    while (live < high) {
+        NSUInteger mid = live + (high - live) / 2;
+        if (slots[mid].timestamp != 0 && slots[mid].timestamp < expireBefore) {
+            high = mid;
+        } else {
+            live = mid + 1;
+        }
+    }
+    for (NSUInteger i = live; i < count; i++) {
+        if (![hidden containsIndex:i] && (slots[i].timestamp == 0 || slots[i].timestamp >= expireBefore)) {
+            live = count;
+            while (live > 0 && ([hidden containsIndex:live - 1] ||
+                                (slots[live - 1].timestamp != 0 && slots[live - 1].timestamp < expireBefore))) {
+                live--;
+            }
+            break;
+        }
+    }
+    NSUInteger kept = live == [hidden countOfIndexesInRange:NSMakeRange(0, live)]
+                    ? clippy_expiry_boundary(recent, expireBefore, YES) : [recent count];
+    [recent removeObjectsInRange:NSMakeRange(kept, [recent count] - kept)];
+    *total = [recent count] + live - [hidden countOfIndexesInRange:NSMakeRange(0, live)];
+
+    NSUInteger want = limit > 0 ? limit : NSUIntegerMax;
+    NSMutableArray *entries = [NSMutableArray array];
+    NSUInteger position = 0;
+    for (NSDictionary *entry in recent) {
+        if (position++ >= start && [entries count] < want) {
+            [entries addObject:entry];
+        }
+    }
+    for (NSUInteger i = 0; i < live && [entries count] < want; i++) {
+        if ([hidden containsIndex:i] || position++ < start) {
+            continue;
+        }
+        NSDictionary *entry = patched[@(i)] ?: clippy_log_index_entry(fd, &slots[i]);
+        if (entry) {
+            [entries addObject:entry];
+        }
+    }
+
+    clippy_log_slot_map_free(&byId);
+    clippy_log_slot_map_free(&byTime);
+    close(fd);
+    return entries;
 }
 
-static inline NSString *clippy_history_path(void) {
-    return clippy_get_home_path(@CLIPPY_HISTORY_FILE);
+/**
+ * Entries [start, start + limit) of history (newest first; limit 0 for the
+ * rest) and, in *total, how many there are, limited to maxHistoryItems
+ * Reads only what it returns when the log's index is current; the memory
+ * budget isn't applied here but when the log is compacted
+ */
+static inline NSArray *clippy_history_read_range(NSUInteger start, NSUInteger limit, NSUInteger *total) {
+    clippy_history_migrate();
+
+    NSUInteger cap = (NSUInteger)MAX(clippy_config.maxHistoryItems, 0);
+    NSUInteger available = start < cap ? cap - start : 0;
+    limit = limit > 0 ? MIN(limit, available) : available;
+    NSArray *entries = clippy_log_read_range(clippy_history_log_path(), available > 0 ? start : NSUIntegerMax,
+                                             MAX(limit, 1), total);
+    *total = MIN(*total, cap);
+    return available > 0 ? entries : @[];
 }
 
-static inline NSString *clippy_pins_path(void) {
-    return clippy_get_home_path(@CLIPPY_PINS_FILE);
+/**
+ * Most recent history entry, read from the tail of the log
+ */
+static inline NSDictionary *clippy_history_last_entry(void) {
+    clippy_history_migrate();
+    return clippy_log_read_last(clippy_history_log_path());
 }
 
-static inline NSString *clippy_config_path(void) {
-    return clippy_get_home_path(@CLIPPY_CONFIG_FILE);
+/**
+ * Record a new entry (one append; no rewrite of existing history)
+ */
+static inline BOOL clippy_history_append(NSDictionary *entry) {
+    if (!clippy_ensure_data_dir()) {
+        return NO;
+    }
+    clippy_history_migrate();
+    return clippy_log_append(clippy_history_log_path(), entry);
 }
 
-static inline NSString *clippy_data_dir(void) {
-    return clippy_get_home_path(@CLIPPY_DATA_DIR);
+/**
+ * Append several records at once (clipd's group commit)
+ */
+static inline BOOL clippy_history_append_batch(NSArray *records) {
+    if (!clippy_ensure_data_dir()) {
+        return NO;
+    }
+    clippy_history_migrate();
+    return clippy_log_append_batch(clippy_history_log_path(), records);
 }
 
-static inline NSString *clippy_images_dir(void) {
-    return [clippy_data_dir() stringByAppendingPathComponent:@CLIPPY_IMAGES_DIR];
+/**
+ * Record amending the entry with the given id
+ */
+static inline NSDictionary *clippy_history_update_record(uint64_t entryId, NSDictionary *set, NSArray *unset) {
+    return @{
+        @"op": @"update",
+        @"id": @(entryId),
+        @"set": set ?: @{},
+        @"unset": unset ?: @[]
+    };
 }
 
 /**
- * Ensure the images directory exists
+ * Record settling a pending image capture whose file is now stored, or nil
+ * when its placeholder is gone (deleted, cleared, trimmed or expired while
+ * the job ran). Then no entry will ever own the reference the store took,
+ * and the caller must release it.
  */
-static inline BOOL clippy_ensure_images_dir(void) {
-    NSFileManager *fm = [NSFileManager defaultManager];
-    NSString *path = clippy_images_dir();
+static inline NSDictionary *clippy_image_capture_record(NSDictionary *placeholder, NSDictionary *set) {
+    if (!placeholder) {
+        return nil;
+    }
+    return clippy_history_update_record(clippy_entry_id(placeholder), set, @[@"pending"]);
+}
 
-    if ([fm fileExistsAtPath:path]) {
-        return YES;
+/**
+ * Record removing the entry with the given id
+ */
+static inline NSDictionary *clippy_history_remove_record(uint64_t entryId) {
+    return @{@"op": @"remove", @"id": @(entryId)};
+}
+
+/**
+ * Record bringing the entry with the given id to the front as newTimestamp
+ * (used when the same content is captured again)
+ */
+static inline NSDictionary *clippy_history_move_record(uint64_t entryId, NSNumber *newTimestamp) {
+    return @{@"op": @"move", @"id": @(entryId), @"to": newTimestamp};
+}
+
+/**
+ * Record counting one use of the entry with the given id at time at
+ * It carries the time rather than a new score, so replay folds every use
+ * into the entry's frecency however many writers recorded them.
+ */
+static inline NSDictionary *clippy_history_use_record(uint64_t entryId, NSTimeInterval at) {
+    return @{@"op": @"use", @"id": @(entryId), @"at": @(at)};
+}
+
+/**
+ * Count a use straight into the log (when clipd isn't running)
+ */
+static inline BOOL clippy_history_record_use(uint64_t entryId) {
+    return clippy_history_append(clippy_history_use_record(entryId, [[NSDate date] timeIntervalSince1970]));
+}
+
+/**
+ * Read-modify-write history under the log lock
+ * The block returns YES if it changed the array. The log is rewritten when
+ * something changed, when it holds records beyond the live entries or when
+ * its index doesn't cover all of it, so a nil block simply compacts.
+ */
+static inline BOOL clippy_history_update(BOOL (^mutate)(NSMutableArray *history)) {
+    if (!clippy_ensure_data_dir()) {
+        return NO;
     }
+    clippy_history_migrate();
 
-    NSError *error = nil;
-    BOOL success = [fm createDirectoryAtPath:path
-                 withIntermediateDirectories:YES
-                                  attributes:@{NSFilePosixPermissions: @0700}
-                                       error:&error];
-    if (!success) {
-        NSLog(@"clippy: Failed to create images dir: %@", error);
+    NSString *path = clippy_history_log_path();
+    int lock = clippy_log_lock(path);
+
+    NSArray *records = clippy_log_read_records(path);
+    NSMutableArray *history = clippy_history_entries_from_records(records);
+
+    BOOL changed = mutate ? mutate(history) : NO;
+    NSUInteger trimmed = clippy_trim_history(history);
+
+    BOOL success = YES;
+    if (changed || trimmed > 0 || [records count] != [history count] || !clippy_log_index_current(path)) {
+        success = clippy_log_write_entries(path, history);
     }
+
+    clippy_log_unlock(lock);
     return success;
 }
 
-/**
- * Generate a unique filename for an image
- */
-static inline NSString *clippy_generate_image_filename(void) {
-    NSString *uuid = [[NSUUID UUID] UUIDString];
-    return [NSString stringWithFormat:@"%@.png", uuid];
+static inline BOOL clippy_history_compact(void) {
+    return clippy_history_update(nil);
 }
 
 /**
- * Save image data to the images directory
- * Returns the full path to the saved file, or nil on failure
+ * Remove all history entries (log, legacy JSON file and its backup)
+ * Images still referenced by pins are kept.
+ * Returns YES if there was anything to clear
  */
-static inline NSString *clippy_save_image(NSData *imageData) {
-    if (!imageData || [imageData length] == 0) {
-        return nil;
+static inline BOOL clippy_history_clear(void) {
+    NSFileManager *fm = [NSFileManager defaultManager];
+    NSString *logPath = clippy_history_log_path();
+    NSString *legacyPath = clippy_history_path();
+    BOOL cleared = NO;
+
+    if ([fm fileExistsAtPath:logPath]) {
+        int lock = clippy_log_lock(logPath);
+        NSArray *history = clippy_history_entries_from_records(clippy_log_read_records(logPath));
+        clippy_entries_release(history);
+        // Leave an empty log behind so the legacy file is never re-imported
+        cleared = truncate([logPath fileSystemRepresentation], 0) == 0 && [history count] > 0;
+        unlink([clippy_log_index_path(logPath) fileSystemRepresentation]);
+        clippy_log_unlock(lock);
     }
 
-    if (!clippy_ensure_images_dir()) {
-        return nil;
+    if ([fm fileExistsAtPath:legacyPath]) {
+        cleared = [fm removeItemAtPath:legacyPath error:nil] || cleared;
     }
+    [fm removeItemAtPath:[legacyPath stringByAppendingString:@CLIPPY_BACKUP_SUFFIX] error:nil];
+
+    return cleared;
+}
 
-    NSString *filename = clippy_generate_image_filename();
-    NSString *path = [clippy_images_dir() stringByAppendingPathComponent:filename];
+/**
+ * Export history as a JSON array (the legacy ~/.clipboard_history format)
+ */
+static inline BOOL clippy_history_export_json(NSString *path) {
+    return clippy_write_json_array(clippy_history_load(), path);
+}
 
-    NSError *error = nil;
-    BOOL success = [imageData writeToFile:path options:NSDataWritingAtomic error:&error];
-    if (!success) {
-        NSLog(@"clippy: Failed to save image: %@", error);
-        return nil;
+/**
+ * Add the entries history doesn't hold yet and re-sort it newest first
+ * Entries without a timestamp never expire, so they go at the new end
+ * rather than among the ones that will (see clippy_expiry_boundary).
+ * Returns the number added
+ */
+static inline NSInteger clippy_history_merge(NSMutableArray *history, NSArray *imported) {
+    NSInteger added = 0;
+    for (NSDictionary *entry in imported) {
+        if (![entry isKindOfClass:[NSDictionary class]] || [history containsObject:entry]) {
+            continue;
+        }
+        [history addObject:entry];
+        added++;
     }
+    [history sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(id a, id b) {
+        NSNumber *tsA = [a[@"timestamp"] isKindOfClass:[NSNumber class]] ? a[@"timestamp"] : @(INFINITY);
+        NSNumber *tsB = [b[@"timestamp"] isKindOfClass:[NSNumber class]] ? b[@"timestamp"] : @(INFINITY);
+        return [tsB compare:tsA];
+    }];
+    return added;
+}
 
-    // Set restrictive permissions
-    chmod([path fileSystemRepresentation], S_IRUSR | S_IWUSR);
+/**
+ * Merge entries from a JSON array file into history, newest first by timestamp
+ * Returns number of entries imported, or -1 on failure
+ */
+static inline NSInteger clippy_history_import_json(NSString *path) {
+    NSArray *imported = clippy_read_json_array(path);
+    if ([imported count] == 0) {
+        return 0;
+    }
 
-    return path;
+    __block NSInteger added = 0;
+    BOOL success = clippy_history_update(^BOOL(NSMutableArray *history) {
+        added = clippy_history_merge(history, imported);
+        return added > 0;
+    });
+
+    return success ? added : -1;
 }
 
 /**
- * Delete an image file
+ * Delete the history entry with the given id: one remove record, appended
+ * under the log lock once the entry is known to be live (reading is what
+ * finds its stored file, whose reference is dropped)
+ * Returns the removed entry, or nil
  */
-static inline BOOL clippy_delete_image(NSString *path) {
-    if (!path || [path length] == 0) {
-        return NO;
+static inline NSDictionary *clippy_history_remove_id(uint64_t entryId) {
+    NSString *path = clippy_history_log_path();
+    if (!clippy_ensure_data_dir() || entryId == 0) {
+        return nil;
     }
+    clippy_history_migrate();
 
-    NSFileManager *fm = [NSFileManager defaultManager];
-    NSError *error = nil;
-    return [fm removeItemAtPath:path error:&error];
+    int lock = clippy_log_lock(path);
+    NSArray *history = clippy_history_entries_from_records(clippy_log_read_records(path));
+    NSUInteger idx = clippy_index_of_entry_id(history, entryId);
+
+    NSDictionary *removed = nil;
+    if (idx != NSNotFound &&
+        clippy_log_append_locked(path, clippy_history_remove_record(entryId))) {
+        removed = history[idx];
+        clippy_entry_release(removed);
+    }
+    clippy_log_unlock(lock);
+    return removed;
 }
 
 // ============================================================================
-// JSON File Operations (with error recovery)
+// Pin Store
 // ============================================================================
 
 /**
- * Read JSON array from file with validation and backup recovery
- * Returns empty mutable array on error
+ * Pins are a small JSON array (~/.clipboard_pins, oldest first) checkpointed
+ * from ~/.clippy_data/pins.journal, which records each change since:
+ *   {"op":"add","pin":{...}}     append the pin (unless its id is present)
+ *   {"op":"remove","id":I}       drop the pin with that id
+ *   {"op":"expire","before":T}   drop pins with a timestamp before T
+ * Read-modify-write cycles serialize on ~/.clippy_data/pins.lock so
+ * concurrent pin/unpin calls don't lose updates. The journal's file stamp
+ * changes with every mutation, so it is what watchers compare.
  */
-static inline NSMutableArray *clippy_read_json_array(NSString *path) {
-    NSFileManager *fm = [NSFileManager defaultManager];
-    NSError *error = nil;
+static inline int clippy_pins_lock(void) {
+    if (!clippy_ensure_data_dir()) {
+        return -1;
+    }
+    return clippy_log_lock([clippy_data_dir() stringByAppendingPathComponent:@"pins"]);
+}
 
-    // Try reading main file
-    if ([fm fileExistsAtPath:path]) {
-        NSString *content = [NSString stringWithContentsOfFile:path
-                                                      encoding:NSUTF8StringEncoding
-                                                         error:&error];
-        if (!error && content && [content length] > 0) {
-            NSData *data = [content dataUsingEncoding:NSUTF8StringEncoding];
-            id parsed = [NSJSONSerialization JSONObjectWithData:data
-                                                        options:0
-                                                          error:&error];
-            if (!error && [parsed isKindOfClass:[NSArray class]]) {
-                return [NSMutableArray arrayWithArray:parsed];
-            }
+static inline void clippy_pins_apply(NSMutableArray *pins, NSDictionary *record) {
+    NSString *op = record[@"op"];
+    if ([op isEqualToString:@"add"]) {
+        NSDictionary *pin = record[@"pin"];
+        if ([pin isKindOfClass:[NSDictionary class]] &&
+            clippy_index_of_entry_id(pins, clippy_entry_id(pin)) == NSNotFound) {
+            [pins addObject:pin];
         }
-
-        // Main file corrupted, try backup
-        NSString *backupPath = [path stringByAppendingString:@CLIPPY_BACKUP_SUFFIX];
-        if ([fm fileExistsAtPath:backupPath]) {
-            NSLog(@"clippy: Main file corrupted, trying backup: %@", backupPath);
-            content = [NSString stringWithContentsOfFile:backupPath
-                                                encoding:NSUTF8StringEncoding
-                                                   error:&error];
-            if (!error && content && [content length] > 0) {
-                NSData *data = [content dataUsingEncoding:NSUTF8StringEncoding];
-                id parsed = [NSJSONSerialization JSONObjectWithData:data
-                                                            options:0
-                                                              error:&error];
-                if (!error && [parsed isKindOfClass:[NSArray class]]) {
-                    NSLog(@"clippy: Recovered from backup successfully");
-                    return [NSMutableArray arrayWithArray:parsed];
-                }
-            }
+    } else if ([op isEqualToString:@"remove"]) {
+        NSUInteger idx = clippy_index_of_entry_id(pins, [record[@"id"] unsignedLongLongValue]);
+        if (idx != NSNotFound) {
+            [pins removeObjectAtIndex:idx];
         }
+    } else if ([op isEqualToString:@"expire"]) {
+        NSUInteger expired = clippy_expiry_boundary(pins, [record[@"before"] doubleValue], NO);
+        [pins removeObjectsInRange:NSMakeRange(0, expired)];
+    }
+}
 
-        // Both corrupted
-        if (error) {
-            NSLog(@"clippy: Failed to read %@: %@", path, error);
-        }
+static inline NSMutableArray *clippy_pins_replay(NSUInteger *journalRecords, NSUInteger *journalLength) {
+    NSMutableArray *pins = clippy_read_json_array(clippy_pins_path());
+    NSArray *records = clippy_journal_read_valid(clippy_pins_journal_path(), journalLength);
+    for (NSDictionary *record in records) {
+        clippy_pins_apply(pins, record);
+    }
+    if (journalRecords) {
+        *journalRecords = [records count];
     }
+    return pins;
+}
 
-    return [NSMutableArray array];
+/**
+ * Current pins: the checkpoint with the journal replayed onto it
+ * *journalRecords (optional) is set to the number of records replayed
+ */
+static inline NSMutableArray *clippy_pins_read(NSUInteger *journalRecords) {
+    return clippy_pins_replay(journalRecords, NULL);
 }
 
 /**
- * Write JSON array to file with backup
- * Creates backup of existing file before writing
+ * clippy_pins_read for a writer holding the pins lock: a torn or damaged
+ * journal tail is cut off first, so the writer's record lands where replay
+ * reaches it. If it can't be cut, *journalRecords is NSNotFound and the
+ * commit writes a checkpoint instead of appending.
  */
-static inline BOOL clippy_write_json_array(NSArray *array, NSString *path) {
-    NSFileManager *fm = [NSFileManager defaultManager];
-    NSError *error = nil;
+static inline NSMutableArray *clippy_pins_read_locked(NSUInteger *journalRecords) {
+    NSUInteger journalLength = 0;
+    NSMutableArray *pins = clippy_pins_replay(journalRecords, &journalLength);
+    if (!clippy_journal_truncate_locked(clippy_pins_journal_path(), journalLength)) {
+        *journalRecords = NSNotFound;
+    }
+    return pins;
+}
 
-    // Create backup of existing file
-    if ([fm fileExistsAtPath:path]) {
-        NSString *backupPath = [path stringByAppendingString:@CLIPPY_BACKUP_SUFFIX];
-        [fm removeItemAtPath:backupPath error:nil];  // Remove old backup
-        [fm copyItemAtPath:path toPath:backupPath error:&error];
-        if (error) {
-            NSLog(@"clippy: Warning - failed to create backup: %@", error);
-            error = nil;  // Continue anyway
+static inline NSMutableArray *clippy_pins_load(void) {
+    return clippy_pins_read(NULL);
+}
+
+/**
+ * Journal one change (already applied to pins) under the pins lock,
+ * checkpointing once enough records have built up
+ */
+static inline BOOL clippy_pins_commit_locked(NSArray *pins, NSDictionary *record, NSUInteger journalRecords) {
+    if (journalRecords == NSNotFound) {
+        // A journal that couldn't be repaired: the checkpoint carries the change
+        return clippy_journal_checkpoint_locked(clippy_pins_journal_path(), clippy_pins_path(), pins);
+    }
+    if (!clippy_journal_append_locked(clippy_pins_journal_path(), record)) {
+        return NO;
+    }
+    if (journalRecords + 1 >= CLIPPY_JOURNAL_CHECKPOINT_RECORDS &&
+        !clippy_journal_checkpoint_locked(clippy_pins_journal_path(), clippy_pins_path(), pins)) {
+        NSLog(@"clippy: Pins checkpoint failed; keeping the journal");
+    }
+    return YES;
+}
+
+/**
+ * Pin a copy of a history entry (with optional label)
+ * Image pins take a reference on the stored image.
+ * Returns the new pin count, or -1 with *error set
+ */
+static inline NSInteger clippy_pins_add(NSDictionary *entry, NSString *label, NSString **error) {
+    if ([entry[@"pending"] boolValue]) {
+        if (error) *error = @"Image is still being processed.";
+        return -1;
+    }
+
+    int lock = clippy_pins_lock();
+    NSUInteger journalRecords = 0;
+    NSMutableArray *pins = clippy_pins_read_locked(&journalRecords);
+    NSString *type = entry[@"type"] ?: @"text";
+    NSInteger result = -1;
+
+    BOOL duplicate = NO;
+    for (NSDictionary *pin in pins) {
+        if ([pin[@"text"] isEqualToString:entry[@"text"]] &&
+            [(pin[@"type"] ?: @"text") isEqualToString:type] &&
+            (pin[@"blob"] == entry[@"blob"] || [pin[@"blob"] isEqualToString:entry[@"blob"]])) {
+            duplicate = YES;
+            break;
         }
     }
 
-    // Serialize to JSON
-    NSData *data = [NSJSONSerialization dataWithJSONObject:array
-                                                   options:NSJSONWritingPrettyPrinted
-                                                     error:&error];
-    if (error) {
-        NSLog(@"clippy: Failed to serialize JSON: %@", error);
-        return NO;
+    if ((int)[pins count] >= clippy_config.maxPins) {
+        if (error) *error = [NSString stringWithFormat:@"Pin limit reached (%d). Unpin some items first.",
+                             clippy_config.maxPins];
+    } else if (duplicate) {
+        if (error) *error = @"This item is already pinned.";
+    } else {
+        NSMutableDictionary *pin = [NSMutableDictionary dictionary];
+        pin[@"id"] = clippy_new_entry_id();
+        pin[@"text"] = entry[@"text"] ?: @"";
+        pin[@"timestamp"] = clippy_next_timestamp(pins, NO);
+        if ([label length] > 0) {
+            pin[@"label"] = label;
+        }
+        if ([type isEqualToString:@"image"] && entry[@"path"]) {
+            pin[@"type"] = type;
+            pin[@"path"] = entry[@"path"];
+        } else {
+            if (entry[@"blob"]) {
+                pin[@"blob"] = entry[@"blob"];
+                pin[@"length"] = entry[@"length"] ?: @0;
+            }
+            if (entry[@"reps"]) {
+                pin[@"reps"] = entry[@"reps"];
+            }
+            if (entry[@"files"]) {
+                pin[@"files"] = entry[@"files"];
+            }
+        }
+
+        [pins addObject:pin];
+        if (clippy_pins_commit_locked(pins, @{@"op": @"add", @"pin": pin}, journalRecords)) {
+            clippy_entry_retain(pin);
+            result = (NSInteger)[pins count];
+        } else if (error) {
+            *error = @"Failed to save pin.";
+        }
     }
 
-    // Write atomically
-    BOOL success = [data writeToFile:path options:NSDataWritingAtomic error:&error];
-    if (!success) {
-        NSLog(@"clippy: Failed to write %@: %@", path, error);
-        return NO;
+    clippy_log_unlock(lock);
+    return result;
+}
+
+/**
+ * Remove the pin at a zero-based index, or the pin with the given id when
+ * index is NSNotFound. Returns the removed pin, or nil.
+ */
+static inline NSDictionary *clippy_pins_remove(NSUInteger index, uint64_t pinId) {
+    int lock = clippy_pins_lock();
+    NSUInteger journalRecords = 0;
+    NSMutableArray *pins = clippy_pins_read_locked(&journalRecords);
+
+    if (index == NSNotFound) {
+        index = clippy_index_of_entry_id(pins, pinId);
     }
 
-    // Set restrictive permissions (owner read/write only)
-    chmod([path fileSystemRepresentation], S_IRUSR | S_IWUSR);
+    NSDictionary *removed = nil;
+    if (index < [pins count]) {
+        NSDictionary *pin = pins[index];
+        NSDictionary *record = @{@"op": @"remove", @"id": @(clippy_entry_id(pin))};
+        [pins removeObjectAtIndex:index];
+        if (clippy_pins_commit_locked(pins, record, journalRecords)) {
+            clippy_entry_release(pin);
+            removed = pin;
+        }
+    }
 
-    return YES;
+    clippy_log_unlock(lock);
+    return removed;
 }
 
 // ============================================================================
 // Configuration File Parsing
 // ============================================================================
 
+/**
+ * capture_types value: comma-separated text, image, rtf, html, files
+ * Unknown names are ignored; returns 0 if none were recognized
+ */
+static inline unsigned clippy_parse_capture_types(NSString *value) {
+    NSDictionary *flags = @{
+        @"text": @(CLIPPY_CAPTURE_TEXT),
+        @"image": @(CLIPPY_CAPTURE_IMAGE),
+        @"rtf": @(CLIPPY_CAPTURE_RTF),
+        @"html": @(CLIPPY_CAPTURE_HTML),
+        @"files": @(CLIPPY_CAPTURE_FILES)
+    };
+    unsigned types = 0;
+    for (NSString *name in [value componentsSeparatedByString:@","]) {
+        NSString *trimmed = [[name stringByTrimmingCharactersInSet:
+                              [NSCharacterSet whitespaceCharacterSet]] lowercaseString];
+        types |= [flags[trimmed] unsignedIntValue];
+    }
+    return types;
+}
+
 /**
  * Load configuration from ~/.clippy.conf
  * Format: key=value (one per line, # for comments)
@@ -295,6 +2614,10 @@ static inline void clippy_load_config(void) {
 
         if ([key isEqualToString:@"poll_interval_ms"] && intValue > 0) {
             clippy_config.pollIntervalMs = intValue;
+        } else if ([key isEqualToString:@"poll_min_interval_ms"] && intValue > 0) {
+            clippy_config.pollMinIntervalMs = intValue;
+        } else if ([key isEqualToString:@"poll_max_interval_ms"] && intValue > 0) {
+            clippy_config.pollMaxIntervalMs = intValue;
         } else if ([key isEqualToString:@"max_history_items"] && intValue > 0) {
             clippy_config.maxHistoryItems = intValue;
         } else if ([key isEqualToString:@"max_pins"] && intValue > 0) {
@@ -305,6 +2628,20 @@ static inline void clippy_load_config(void) {
             clippy_config.maxAgeDays = intValue;
         } else if ([key isEqualToString:@"cleanup_interval_sec"] && intValue > 0) {
             clippy_config.cleanupIntervalSec = intValue;
+        } else if ([key isEqualToString:@"capture_types"] && clippy_parse_capture_types(value) != 0) {
+            clippy_config.captureTypes = clippy_parse_capture_types(value);
+        } else if ([key isEqualToString:@"max_text_kb"] && intValue > 0) {
+            clippy_config.maxTextKB = intValue;
+        } else if ([key isEqualToString:@"max_image_kb"] && intValue > 0) {
+            clippy_config.maxImageKB = intValue;
+        } else if ([key isEqualToString:@"max_rtf_kb"] && intValue > 0) {
+            clippy_config.maxRtfKB = intValue;
+        } else if ([key isEqualToString:@"max_html_kb"] && intValue > 0) {
+            clippy_config.maxHtmlKB = intValue;
+        } else if ([key isEqualToString:@"max_files_kb"] && intValue > 0) {
+            clippy_config.maxFilesKB = intValue;
+        } else if ([key isEqualToString:@"max_memory_mb"] && intValue > 0) {
+            clippy_config.maxMemoryMB = intValue;
         }
     }
 }
@@ -315,33 +2652,93 @@ static inline void clippy_load_config(void) {
 
 #define CLIPPY_PREVIEW_LENGTH 60
 
-static inline NSString *clippy_format_timestamp(NSNumber *timestamp) {
-    NSDate *date = [NSDate dateWithTimeIntervalSince1970:[timestamp doubleValue]];
-    NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
+#define CLIPPY_PREVIEW_CHUNK  64
 
-    if ([[NSCalendar currentCalendar] isDateInToday:date]) {
-        [formatter setDateFormat:@"HH:mm:ss"];
-        return [NSString stringWithFormat:@"Today %@", [formatter stringFromDate:date]];
-    }
+/**
+ * Local day boundaries (Unix time) around now
+ */
+typedef struct {
+    NSTimeInterval yesterday;
+    NSTimeInterval today;
+    NSTimeInterval tomorrow;
+} ClippyDayBuckets;
+
+/**
+ * Current day boundaries, recomputed only once the day has rolled over, so
+ * timestamps can be bucketed without calendar queries
+ */
+static inline ClippyDayBuckets clippy_day_buckets(void) {
+    static ClippyDayBuckets buckets = {0, 0, 0};
 
-    if ([[NSCalendar currentCalendar] isDateInYesterday:date]) {
-        [formatter setDateFormat:@"HH:mm"];
-        return [NSString stringWithFormat:@"Yesterday %@", [formatter stringFromDate:date]];
+    NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+    if (now < buckets.today || now >= buckets.tomorrow) {
+        NSCalendar *calendar = [NSCalendar currentCalendar];
+        NSDate *today = [calendar startOfDayForDate:[NSDate date]];
+        buckets.today = [today timeIntervalSince1970];
+        buckets.tomorrow = [[calendar dateByAddingUnit:NSCalendarUnitDay value:1 toDate:today options:0]
+                            timeIntervalSince1970];
+        buckets.yesterday = [[calendar dateByAddingUnit:NSCalendarUnitDay value:-1 toDate:today options:0]
+                             timeIntervalSince1970];
     }
+    return buckets;
+}
 
-    [formatter setDateFormat:@"MMM d HH:mm"];
-    return [formatter stringFromDate:date];
+static inline NSDateFormatter *clippy_date_formatter(NSString *format) {
+    NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
+    [formatter setDateFormat:format];
+    return formatter;
 }
 
-static inline NSString *clippy_preview_text(NSString *text) {
-    text = [text stringByReplacingOccurrencesOfString:@"\n" withString:@"↵"];
-    text = [text stringByReplacingOccurrencesOfString:@"\r" withString:@""];
+/**
+ * "Today 14:03:12", "Yesterday 09:15" or "Mar 4 18:40"
+ * Formatters are created once and shared
+ */
+static inline NSString *clippy_format_timestamp(NSNumber *timestamp) {
+    static NSDateFormatter *todayFormatter = nil;
+    static NSDateFormatter *yesterdayFormatter = nil;
+    static NSDateFormatter *olderFormatter = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        todayFormatter = clippy_date_formatter(@"'Today' HH:mm:ss");
+        yesterdayFormatter = clippy_date_formatter(@"'Yesterday' HH:mm");
+        olderFormatter = clippy_date_formatter(@"MMM d HH:mm");
+    });
+
+    NSTimeInterval seconds = [timestamp doubleValue];
+    ClippyDayBuckets days = clippy_day_buckets();
+    NSDateFormatter *formatter = olderFormatter;
+    if (seconds >= days.today && seconds < days.tomorrow) {
+        formatter = todayFormatter;
+    } else if (seconds >= days.yesterday && seconds < days.today) {
+        formatter = yesterdayFormatter;
+    }
+    return [formatter stringFromDate:[NSDate dateWithTimeIntervalSince1970:seconds]];
+}
 
-    if ([text length] <= CLIPPY_PREVIEW_LENGTH) {
-        return text;
+/**
+ * One-line preview: newlines shown as ↵, carriage returns dropped, cut at
+ * CLIPPY_PREVIEW_LENGTH chars. Only reads as much of text as the preview needs
+ */
+static inline NSString *clippy_preview_text(NSString *text) {
+    NSUInteger length = [text length];
+    unichar preview[CLIPPY_PREVIEW_LENGTH + 1];
+    unichar chunk[CLIPPY_PREVIEW_CHUNK];
+    NSUInteger kept = 0;
+
+    for (NSUInteger offset = 0; offset < length && kept <= CLIPPY_PREVIEW_LENGTH; offset += CLIPPY_PREVIEW_CHUNK) {
+        NSUInteger count = MIN((NSUInteger)CLIPPY_PREVIEW_CHUNK, length - offset);
+        [text getCharacters:chunk range:NSMakeRange(offset, count)];
+        for (NSUInteger i = 0; i < count && kept <= CLIPPY_PREVIEW_LENGTH; i++) {
+            if (chunk[i] != '\r') {
+                preview[kept++] = (chunk[i] == '\n') ? 0x21B5 : chunk[i];  // ↵
+            }
+        }
     }
 
-    return [[text substringToIndex:CLIPPY_PREVIEW_LENGTH] stringByAppendingString:@"..."];
+    if (kept <= CLIPPY_PREVIEW_LENGTH) {
+        return [NSString stringWithCharacters:preview length:kept];
+    }
+    return [[NSString stringWithCharacters:preview length:CLIPPY_PREVIEW_LENGTH] stringByAppendingString:@"..."];
 }
 
 // ============================================================================
@@ -349,38 +2746,75 @@ static inline NSString *clippy_preview_text(NSString *text) {
 // ============================================================================
 
 /**
- * Remove entries older than maxAgeDays from a JSON array file
+ * Expire history entries older than cutoff with one "expire" record
+ * The log is read once (under its lock) to release the expired entries'
+ * stored files; nothing is rewritten, and nothing is appended when nothing
+ * has expired. The records themselves go at the next compaction.
+ * Returns number of entries expired
+ */
+static inline NSUInteger clippy_history_expire(NSTimeInterval cutoff) {
+    NSString *path = clippy_history_log_path();
+    if (!clippy_ensure_data_dir()) {
+        return 0;
+    }
+    clippy_history_migrate();
+
+    int lock = clippy_log_lock(path);
+    NSArray *history = clippy_history_entries_from_records(clippy_log_read_records(path));
+    NSUInteger boundary = clippy_expiry_boundary(history, cutoff, YES);
+    NSUInteger expired = 0;
+
+    if (boundary < [history count] &&
+        clippy_log_append_locked(path, @{@"op": @"expire", @"before": @(cutoff)})) {
+        expired = [history count] - boundary;
+        clippy_entries_release([history subarrayWithRange:NSMakeRange(boundary, expired)]);
+    }
+    clippy_log_unlock(lock);
+    return expired;
+}
+
+/**
+ * Drop entries older than cutoff from a time-ordered JSON array file,
+ * releasing their stored files; the file is only written if some expired
  * Returns number of entries removed
  */
-static inline NSUInteger clippy_cleanup_old_entries(NSString *path) {
+static inline NSUInteger clippy_json_array_expire(NSString *path, NSTimeInterval cutoff, BOOL newestFirst) {
     NSMutableArray *entries = clippy_read_json_array(path);
-    if ([entries count] == 0) {
+    NSUInteger boundary = clippy_expiry_boundary(entries, cutoff, newestFirst);
+    NSRange expired = newestFirst ? NSMakeRange(boundary, [entries count] - boundary)
+                                  : NSMakeRange(0, boundary);
+    if (expired.length == 0) {
         return 0;
     }
 
-    NSTimeInterval maxAge = clippy_config.maxAgeDays * 24 * 60 * 60;
-    NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
-    NSMutableArray *filtered = [NSMutableArray array];
+    NSArray *removed = [entries subarrayWithRange:expired];
+    [entries removeObjectsInRange:expired];
+    if (!clippy_write_json_array(entries, path)) {
+        return 0;
+    }
+    clippy_entries_release(removed);
+    return expired.length;
+}
+
+/**
+ * Expire pins older than cutoff (pins are oldest first; one journal record)
+ */
+static inline NSUInteger clippy_pins_expire(NSTimeInterval cutoff) {
+    int lock = clippy_pins_lock();
+    NSUInteger journalRecords = 0;
+    NSMutableArray *pins = clippy_pins_read_locked(&journalRecords);
+    NSUInteger boundary = clippy_expiry_boundary(pins, cutoff, NO);
     NSUInteger removed = 0;
 
-    for (NSDictionary *entry in entries) {
-        NSNumber *timestamp = entry[@"timestamp"];
-        if (timestamp) {
-            NSTimeInterval age = now - [timestamp doubleValue];
-            if (age <= maxAge) {
-                [filtered addObject:entry];
-            } else {
-                removed++;
-            }
-        } else {
-            [filtered addObject:entry];
+    if (boundary > 0) {
+        NSArray *expired = [pins subarrayWithRange:NSMakeRange(0, boundary)];
+        [pins removeObjectsInRange:NSMakeRange(0, boundary)];
+        if (clippy_pins_commit_locked(pins, @{@"op": @"expire", @"before": @(cutoff)}, journalRecords)) {
+            clippy_entries_release(expired);
+            removed = boundary;
         }
     }
-
-    if (removed > 0) {
-        clippy_write_json_array(filtered, path);
-    }
-
+    clippy_log_unlock(lock);
     return removed;
 }
 
@@ -0,0 +1,179 @@
+/**
+ * clippy_ipc.h - Client side of the clipd socket protocol
+ *
+ * clipd keeps the canonical history and pins in memory and serves them on a
+ * Unix socket at ~/.clippy_data/clipd.sock. Messages are compact JSON, one
+ * per line, in both directions:
+ *
+ *   {"cmd":"list","offset":N,"limit":N}  -> {"ok":true,"entries":[...],"total":N}
+ *                                           (offset and limit optional)
+ *   {"cmd":"pins"}                       -> {"ok":true,"pins":[...]}
+ *   {"cmd":"get","index":N}              -> {"ok":true,"entry":{...}}
+ *   {"cmd":"get","id":I}
+ *   {"cmd":"search","query":Q}           -> {"ok":true,"results":[{"index":N,"entry":{...}}]}
+ *   {"cmd":"pin","index":N,"label":L}    -> {"ok":true,"count":N,"entry":{...}}
+ *   {"cmd":"pin","id":I,"label":L}
+ *   {"cmd":"unpin","index":N}            -> {"ok":true,"pin":{...}}
+ *   {"cmd":"unpin","id":I}
+ *   {"cmd":"delete","id":I}              -> {"ok":true}
+ *   {"cmd":"use","id":I}                 -> {"ok":true,"frecency":F} (a paste, for ranking)
+ *   {"cmd":"clear"}                      -> {"ok":true,"cleared":BOOL}
+ *   {"cmd":"stats"}                      -> {"ok":true,"counters":{...},"latency":{...}}
+ *   {"cmd":"report","metric":"picker_open","us":N}
+ *   {"cmd":"report","metric":"picker_search","us":N}
+ *                                        -> {"ok":true} (a sample for the stats histograms)
+ *   {"cmd":"report","metric":"picker_memory","bytes":N,"footprint":N}
+ *                                        -> {"ok":true} (the picker's model size, for stats)
+ *   {"cmd":"subscribe"}                  -> {"ok":true}, then {"event":"history"|"pins"}
+ *                                           whenever that collection changes
+ *
+ * Indexes are 1-based, as shown by `clippy list` / `clippy pins`, and are
+ * resolved against clipd's current state. Ids are the entries' and pins'
+ * "id" fields (see clippy_entry_id) and keep naming the same record while
+ * others are added or removed. Failures answer {"ok":false,"error":"..."}.
+ * When clipd isn't running the socket is missing or refuses connections;
+ * callers then fall back to the files.
+ */
+
+#ifndef CLIPPY_IPC_H
+#define CLIPPY_IPC_H
+
+#import <Foundation/Foundation.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "clippy_common.h"
+
+#define CLIPPY_SOCKET_FILE "clipd.sock"
+#define CLIPPY_IPC_TIMEOUT_SEC 2
+#define CLIPPY_IPC_READ_CHUNK 65536
+
+static inline NSString *clippy_socket_path(void) {
+    return [clippy_data_dir() stringByAppendingPathComponent:@CLIPPY_SOCKET_FILE];
+}
+
+/**
+ * Fill a sockaddr_un for the clipd socket; NO if the path doesn't fit
+ */
+static inline BOOL clippy_socket_address(struct sockaddr_un *addr) {
+    const char *path = [clippy_socket_path() fileSystemRepresentation];
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return NO;
+    }
+    strlcpy(addr->sun_path, path, sizeof(addr->sun_path));
+    return YES;
+}
+
+/**
+ * Connect to clipd. Returns a blocking socket with send/receive timeouts,
+ * or -1 if the daemon isn't reachable
+ */
+static inline int clippy_ipc_connect(void) {
+    struct sockaddr_un addr;
+    if (!clippy_socket_address(&addr)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int on = 1;
+    struct timeval timeout = {CLIPPY_IPC_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline BOOL clippy_ipc_write_all(int fd, NSData *data) {
+    const char *bytes = [data bytes];
+    NSUInteger remaining = [data length];
+    while (remaining > 0) {
+        ssize_t written = write(fd, bytes, remaining);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return NO;
+        }
+        bytes += written;
+        remaining -= (NSUInteger)written;
+    }
+    return YES;
+}
+
+static inline BOOL clippy_ipc_send(int fd, NSDictionary *message) {
+    NSData *line = clippy_log_encode_record(message);
+    return line && clippy_ipc_write_all(fd, line);
+}
+
+/**
+ * Pop one complete message off the front of buffer, if there is one
+ * *complete is set when a full line was consumed (even if it didn't parse)
+ */
+static inline NSDictionary *clippy_ipc_take_message(NSMutableData *buffer, BOOL *complete) {
+    const char *bytes = [buffer bytes];
+    const char *newline = [buffer length] > 0 ? memchr(bytes, '\n', [buffer length]) : NULL;
+    *complete = (newline != NULL);
+    if (!newline) {
+        return nil;
+    }
+
+    NSUInteger lineLength = (NSUInteger)(newline - bytes);
+    NSDictionary *message = clippy_log_decode_record(bytes, lineLength);
+    [buffer replaceBytesInRange:NSMakeRange(0, lineLength + 1) withBytes:NULL length:0];
+    return message;
+}
+
+/**
+ * Block until one message arrives on fd (bytes after it stay in buffer)
+ * Returns nil on EOF, timeout or a malformed line
+ */
+static inline NSDictionary *clippy_ipc_read_message(int fd, NSMutableData *buffer) {
+    char chunk[CLIPPY_IPC_READ_CHUNK];
+    for (;;) {
+        BOOL complete = NO;
+        NSDictionary *message = clippy_ipc_take_message(buffer, &complete);
+        if (complete) {
+            return message;
+        }
+
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return nil;
+        }
+        [buffer appendBytes:chunk length:(NSUInteger)n];
+    }
+}
+
+/**
+ * One request/response round trip
+ * Returns nil if clipd isn't running (callers fall back to the files)
+ */
+static inline NSDictionary *clippy_ipc_request(NSDictionary *request) {
+    int fd = clippy_ipc_connect();
+    if (fd < 0) {
+        return nil;
+    }
+
+    NSDictionary *response = nil;
+    if (clippy_ipc_send(fd, request)) {
+        response = clippy_ipc_read_message(fd, [NSMutableData data]);
+    }
+    close(fd);
+    return response;
+}
+
+#endif // CLIPPY_IPC_H
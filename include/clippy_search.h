@@ -0,0 +1,816 @@
+/**
+ * clippy_search.h - Precomputed search index and fuzzy matcher
+ *
+ * Entries are case-folded and scanned for word boundaries once, when the
+ * history is loaded; each keystroke then runs the matcher over plain C
+ * arrays. Scores are identical to the original NSString-based fuzzyMatch.
+ * This is the one matcher: the picker, `clippy search --fuzzy`, the tests
+ * and the benchmarks all call it.
+ *
+ * Pure-ASCII text (most of a clipboard history) is detected once per entry
+ * and stored as one byte per char; its matcher jumps from query char to
+ * query char with memchr. Everything else takes the UTF-16 path. Either
+ * path can report the matched positions for highlighting.
+ *
+ * Before scoring, a 64-bit character-presence mask and a vectorized
+ * character scan (NEON on Apple Silicon, scalar elsewhere) reject entries
+ * that cannot contain every query character. Per-character posting lists
+ * let a fresh query start from just the entries holding its rarest char.
+ *
+ * An index carves every entry's folded text from one arena, a short chain
+ * of large blocks freed together, instead of two allocations per entry.
+ * Each entry can also carry a precomputed boost (its frecency) that ranked
+ * matching adds to the score.
+ */
+
+#ifndef CLIPPY_SEARCH_H
+#define CLIPPY_SEARCH_H
+
+#import <Foundation/Foundation.h>
+#include <stdlib.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Mask bits for 'a'-'z' and '0'-'9' are exact; the rest are shared buckets
+#define CLIPPY_SEARCH_EXACT_BITS 36
+
+// ============================================================================
+// Types
+// ============================================================================
+
+typedef struct {
+    BOOL matches;
+    NSInteger score;
+} FuzzyMatchResult;
+
+/**
+ * One searchable string, lowercased: ASCII bytes when every char is ASCII,
+ * UTF-16 otherwise (exactly one of ascii/chars is set for non-empty text),
+ * plus a bitmap whose bit i is set when char i - 1 is whitespace, newline
+ * or punctuation
+ */
+typedef struct {
+    uint8_t *ascii;
+    unichar *chars;
+    uint8_t *boundary;
+    NSUInteger length;
+    uint64_t mask;       // clippy_search_char_bit of every char
+} ClippySearchText;
+
+/**
+ * boost starts at 0; callers that rank by use set it once per index (see
+ * clippy_frecency_boost), so each keystroke only adds it to a match
+ */
+typedef struct {
+    ClippySearchText text;
+    ClippySearchText label;
+    NSInteger boost;
+} ClippySearchEntry;
+
+typedef struct ClippySearchArenaBlock {
+    struct ClippySearchArenaBlock *next;
+    size_t size;
+    size_t used;
+    uint8_t bytes[];
+} ClippySearchArenaBlock;
+
+/**
+ * Bump allocator for an index's texts (see clippy_search_arena_alloc)
+ */
+typedef struct {
+    ClippySearchArenaBlock *blocks;  // Current block first
+    size_t reserved;                 // Bytes in all blocks
+} ClippySearchArena;
+
+/**
+ * Index parallel to a history array: entries[i] describes array[i]
+ */
+typedef struct {
+    ClippySearchArena arena;   // Owns every entry's text and label
+    ClippySearchEntry *entries;
+    NSUInteger count;
+    NSUInteger bitCounts[64];  // Number of texts/labels with each mask bit
+    NSUInteger *postings[64];  // Ascending slots whose text or label has the bit
+    NSUInteger postingCounts[64];
+} ClippySearchIndex;
+
+/**
+ * Case-folded query, built once per keystroke
+ */
+typedef struct {
+    unichar *chars;
+    NSUInteger length;
+    uint64_t mask;
+    BOOL hasScanChar;    // scanChar is in a shared bucket: confirm it by scanning
+    unichar scanChar;    // Rarest query char (see clippy_search_query_prepare)
+    unsigned postingBit; // Query bit with the shortest posting list
+} ClippySearchQuery;
+
+// ============================================================================
+// Arena
+// ============================================================================
+
+#define CLIPPY_SEARCH_ARENA_BLOCK (256 * 1024)
+
+/**
+ * Zeroed, 8-byte aligned memory from the arena, or from calloc when arena
+ * is NULL (a standalone text, released with clippy_search_text_free)
+ */
+static inline void *clippy_search_arena_alloc(ClippySearchArena *arena, size_t size) {
+    if (!arena) {
+        return calloc(1, size);
+    }
+
+    size = (size + 7) & ~(size_t)7;
+    ClippySearchArenaBlock *block = arena->blocks;
+    if (!block || block->size - block->used < size) {
+        size_t blockSize = MAX(size, (size_t)CLIPPY_SEARCH_ARENA_BLOCK);
+        block = calloc(1, sizeof(ClippySearchArenaBlock) + blockSize);
+        if (!block) {
+            return NULL;
+        }
+        block->size = blockSize;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->reserved += blockSize;
+    }
+
+    void *bytes = block->bytes + block->used;
+    block->used += size;
+    return bytes;
+}
+
+/**
+ * Give back the arena's most recent allocation (re-zeroed for the next),
+ * or free a standalone one
+ */
+static inline void clippy_search_arena_unwind(ClippySearchArena *arena, void *bytes, size_t size) {
+    if (!arena) {
+        free(bytes);
+        return;
+    }
+    size = (size + 7) & ~(size_t)7;
+    ClippySearchArenaBlock *block = arena->blocks;
+    if (block && block->used >= size && (uint8_t *)bytes == block->bytes + block->used - size) {
+        memset(bytes, 0, size);
+        block->used -= size;
+    }
+}
+
+static inline void clippy_search_arena_free(ClippySearchArena *arena) {
+    ClippySearchArenaBlock *block = arena->blocks;
+    while (block) {
+        ClippySearchArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+// ============================================================================
+// Building
+// ============================================================================
+
+static inline NSCharacterSet *clippy_search_boundary_set(void) {
+    static NSCharacterSet *set = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        NSMutableCharacterSet *chars = [[NSCharacterSet whitespaceAndNewlineCharacterSet] mutableCopy];
+        [chars formUnionWithCharacterSet:[NSCharacterSet punctuationCharacterSet]];
+        set = [chars copy];
+    });
+    return set;
+}
+
+/**
+ * clippy_search_boundary_set membership for each ASCII char
+ */
+static inline const BOOL *clippy_search_ascii_boundaries(void) {
+    static BOOL table[128];
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        NSCharacterSet *set = clippy_search_boundary_set();
+        for (unichar c = 0; c < 128; c++) {
+            table[c] = [set characterIsMember:c];
+        }
+    });
+    return table;
+}
+
+static inline BOOL clippy_search_is_boundary(const ClippySearchText *text, NSUInteger idx) {
+    return (text->boundary[idx >> 3] >> (idx & 7)) & 1;
+}
+
+/**
+ * Presence bit for a (lowercased) char: one per letter and digit, other
+ * ASCII folded into 27 buckets, everything non-ASCII in the last bit
+ */
+static inline unsigned clippy_search_char_bit(unichar c) {
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a';
+    }
+    if (c >= '0' && c <= '9') {
+        return 26 + (c - '0');
+    }
+    if (c < 128) {
+        return CLIPPY_SEARCH_EXACT_BITS + (c % 27);
+    }
+    return 63;
+}
+
+/**
+ * Index of the first c in chars[from..length), or NSNotFound
+ */
+static inline NSUInteger clippy_search_find(const unichar *chars, NSUInteger length,
+                                            NSUInteger from, unichar c) {
+    NSUInteger i = from;
+#if defined(__ARM_NEON)
+    uint16x8_t needle = vdupq_n_u16(c);
+    for (; i + 8 <= length; i += 8) {
+        uint16x8_t eq = vceqq_u16(vld1q_u16(chars + i), needle);
+        // Narrow each 16-bit lane to 8 bits: 0xFF per matching lane
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(eq, 4)), 0);
+        if (bits) {
+            return i + (NSUInteger)(__builtin_ctzll(bits) >> 3);
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        if (chars[i] == c) {
+            return i;
+        }
+    }
+    return NSNotFound;
+}
+
+/**
+ * clippy_search_find for ASCII text (a non-ASCII c is never present)
+ */
+static inline NSUInteger clippy_search_find_ascii(const uint8_t *bytes, NSUInteger length,
+                                                  NSUInteger from, unichar c) {
+    if (c >= 128 || from >= length) {
+        return NSNotFound;
+    }
+    const uint8_t *hit = memchr(bytes + from, c, length - from);
+    return hit ? (NSUInteger)(hit - bytes) : NSNotFound;
+}
+
+/**
+ * ASCII fast path of clippy_search_text_init: copies the bytes straight out
+ * of the string and folds A-Z in place, with no lowercased copy
+ * Returns NO (text untouched) if the string isn't pure ASCII
+ */
+static inline BOOL clippy_search_text_init_ascii(ClippySearchText *text, NSString *string,
+                                                 NSUInteger length, ClippySearchArena *arena) {
+    size_t bitmapBytes = (length + 7) / 8;
+    uint8_t *buffer = clippy_search_arena_alloc(arena, length + bitmapBytes);
+    if (!buffer) {
+        return NO;
+    }
+
+    NSUInteger used = 0;
+    NSRange remaining = {0, 0};
+    BOOL converted = [string getBytes:buffer maxLength:length usedLength:&used
+                             encoding:NSASCIIStringEncoding options:0
+                                range:NSMakeRange(0, length) remainingRange:&remaining];
+    if (!converted || used != length || remaining.length > 0) {
+        clippy_search_arena_unwind(arena, buffer, length + bitmapBytes);
+        return NO;
+    }
+
+    const BOOL *boundaries = clippy_search_ascii_boundaries();
+    uint64_t mask = 0;
+    for (NSUInteger i = 0; i < length; i++) {
+        if (buffer[i] >= 'A' && buffer[i] <= 'Z') {
+            buffer[i] += 'a' - 'A';
+        }
+        mask |= 1ull << clippy_search_char_bit(buffer[i]);
+        if (i > 0 && boundaries[buffer[i - 1]]) {
+            buffer[length + (i >> 3)] |= (uint8_t)(1u << (i & 7));
+        }
+    }
+
+    text->ascii = buffer;
+    text->boundary = buffer + length;
+    text->length = length;
+    text->mask = mask;
+    return YES;
+}
+
+/**
+ * Fill a search text from a string (nil is treated as empty), allocating
+ * from arena; chars and boundary share one allocation
+ */
+static inline void clippy_search_text_init_in(ClippySearchText *text, NSString *string,
+                                              ClippySearchArena *arena) {
+    memset(text, 0, sizeof(*text));
+
+    NSUInteger stringLength = [string length];
+    if (stringLength == 0 || clippy_search_text_init_ascii(text, string, stringLength, arena)) {
+        return;
+    }
+
+    NSString *lower = [string lowercaseString];
+    NSUInteger length = [lower length];
+    if (length == 0) {
+        return;
+    }
+
+    size_t charBytes = length * sizeof(unichar);
+    size_t bitmapBytes = (length + 7) / 8;
+    uint8_t *buffer = clippy_search_arena_alloc(arena, charBytes + bitmapBytes);
+    if (!buffer) {
+        return;
+    }
+
+    text->chars = (unichar *)buffer;
+    text->boundary = buffer + charBytes;
+    text->length = length;
+    [lower getCharacters:text->chars range:NSMakeRange(0, length)];
+
+    NSCharacterSet *boundarySet = clippy_search_boundary_set();
+    uint64_t mask = 1ull << clippy_search_char_bit(text->chars[0]);
+    for (NSUInteger i = 1; i < length; i++) {
+        mask |= 1ull << clippy_search_char_bit(text->chars[i]);
+        if ([boundarySet characterIsMember:text->chars[i - 1]]) {
+            text->boundary[i >> 3] |= (uint8_t)(1u << (i & 7));
+        }
+    }
+    text->mask = mask;
+}
+
+/**
+ * A standalone search text; release with clippy_search_text_free
+ */
+static inline void clippy_search_text_init(ClippySearchText *text, NSString *string) {
+    clippy_search_text_init_in(text, string, NULL);
+}
+
+static inline void clippy_search_text_free(ClippySearchText *text) {
+    free(text->ascii ? (void *)text->ascii : (void *)text->chars);
+    memset(text, 0, sizeof(*text));
+}
+
+static inline void clippy_search_query_init(ClippySearchQuery *query, NSString *pattern) {
+    memset(query, 0, sizeof(*query));
+
+    NSString *lower = [pattern lowercaseString];
+    NSUInteger length = [lower length];
+    if (length == 0) {
+        return;
+    }
+
+    query->chars = malloc(length * sizeof(unichar));
+    if (!query->chars) {
+        return;
+    }
+    query->length = length;
+    [lower getCharacters:query->chars range:NSMakeRange(0, length)];
+
+    for (NSUInteger i = 0; i < length; i++) {
+        query->mask |= 1ull << clippy_search_char_bit(query->chars[i]);
+    }
+}
+
+/**
+ * Pick the query char whose mask bit is rarest in the index. If that bit is
+ * a shared bucket the mask alone can't prove the char is present, so the
+ * matcher scans for it before scoring.
+ */
+static inline void clippy_search_query_prepare(ClippySearchQuery *query,
+                                               const ClippySearchIndex *index) {
+    query->hasScanChar = NO;
+    if (!index || query->length == 0) {
+        return;
+    }
+
+    NSUInteger rarestCount = NSUIntegerMax;
+    unsigned rarestBit = 0;
+    for (NSUInteger i = 0; i < query->length; i++) {
+        unsigned bit = clippy_search_char_bit(query->chars[i]);
+        if (index->bitCounts[bit] < rarestCount) {
+            rarestCount = index->bitCounts[bit];
+            rarestBit = bit;
+            query->scanChar = query->chars[i];
+        }
+    }
+    query->hasScanChar = (rarestBit >= CLIPPY_SEARCH_EXACT_BITS);
+
+    query->postingBit = rarestBit;
+    for (uint64_t bits = query->mask; bits; bits &= bits - 1) {
+        unsigned bit = (unsigned)__builtin_ctzll(bits);
+        if (index->postingCounts[bit] < index->postingCounts[query->postingBit]) {
+            query->postingBit = bit;
+        }
+    }
+}
+
+static inline void clippy_search_query_free(ClippySearchQuery *query) {
+    free(query->chars);
+    memset(query, 0, sizeof(*query));
+}
+
+static inline void clippy_search_index_free(ClippySearchIndex *index) {
+    if (!index) {
+        return;
+    }
+    clippy_search_arena_free(&index->arena);
+    for (unsigned bit = 0; bit < 64; bit++) {
+        free(index->postings[bit]);
+    }
+    free(index->entries);
+    free(index);
+}
+
+/**
+ * Bytes the index holds: its arena, entry table and posting lists
+ */
+static inline size_t clippy_search_index_bytes(const ClippySearchIndex *index) {
+    if (!index) {
+        return 0;
+    }
+    size_t bytes = sizeof(*index) + index->arena.reserved + index->count * sizeof(ClippySearchEntry);
+    for (unsigned bit = 0; bit < 64; bit++) {
+        bytes += index->postingCounts[bit] * sizeof(NSUInteger);
+    }
+    return bytes;
+}
+
+/**
+ * Build an index over history entries ("text" and "label" fields)
+ * Returns NULL on allocation failure; release with clippy_search_index_free
+ */
+static inline ClippySearchIndex *clippy_search_index_create(NSArray *entries) {
+    ClippySearchIndex *index = calloc(1, sizeof(ClippySearchIndex));
+    if (!index) {
+        return NULL;
+    }
+
+    NSUInteger count = [entries count];
+    if (count > 0) {
+        index->entries = calloc(count, sizeof(ClippySearchEntry));
+        if (!index->entries) {
+            free(index);
+            return NULL;
+        }
+    }
+    index->count = count;
+
+    for (NSUInteger i = 0; i < count; i++) {
+        @autoreleasepool {
+            NSDictionary *entry = entries[i];
+            clippy_search_text_init_in(&index->entries[i].text, entry[@"text"], &index->arena);
+            clippy_search_text_init_in(&index->entries[i].label, entry[@"label"], &index->arena);
+        }
+
+        uint64_t masks[2] = {index->entries[i].text.mask, index->entries[i].label.mask};
+        for (int m = 0; m < 2; m++) {
+            for (uint64_t bits = masks[m]; bits; bits &= bits - 1) {
+                index->bitCounts[__builtin_ctzll(bits)]++;
+            }
+        }
+        for (uint64_t bits = masks[0] | masks[1]; bits; bits &= bits - 1) {
+            index->postingCounts[__builtin_ctzll(bits)]++;
+        }
+    }
+
+    for (unsigned bit = 0; bit < 64; bit++) {
+        if (index->postingCounts[bit] == 0) {
+            continue;
+        }
+        index->postings[bit] = malloc(index->postingCounts[bit] * sizeof(NSUInteger));
+        if (!index->postings[bit]) {
+            clippy_search_index_free(index);
+            return NULL;
+        }
+        index->postingCounts[bit] = 0;
+    }
+    for (NSUInteger i = 0; i < count; i++) {
+        uint64_t mask = index->entries[i].text.mask | index->entries[i].label.mask;
+        for (uint64_t bits = mask; bits; bits &= bits - 1) {
+            unsigned bit = (unsigned)__builtin_ctzll(bits);
+            index->postings[bit][index->postingCounts[bit]++] = i;
+        }
+    }
+    return index;
+}
+
+// ============================================================================
+// Matching
+// ============================================================================
+
+/**
+ * Cheap rejection: NO means the text cannot contain every query char
+ */
+static inline BOOL clippy_search_may_match(const ClippySearchQuery *query,
+                                           const ClippySearchText *text) {
+    if ((text->mask & query->mask) != query->mask) {
+        return NO;
+    }
+    if (!query->hasScanChar) {
+        return YES;
+    }
+    NSUInteger found = text->ascii
+        ? clippy_search_find_ascii(text->ascii, text->length, 0, query->scanChar)
+        : clippy_search_find(text->chars, text->length, 0, query->scanChar);
+    return found != NSNotFound;
+}
+
+/**
+ * Points for the query char matched at textIdx
+ *
+ * Per matched char: +1, a growing bonus for runs, +10 at the start, +5 after
+ * a word boundary, and up to +50 for early positions
+ */
+static inline NSInteger clippy_search_score_at(const ClippySearchText *text, NSUInteger textIdx,
+                                               NSInteger *lastMatchIdx, NSInteger *consecutiveBonus) {
+    NSInteger score = 1;
+
+    if ((NSInteger)textIdx == *lastMatchIdx + 1) {
+        *consecutiveBonus += 2;
+        score += *consecutiveBonus;
+    } else {
+        *consecutiveBonus = 0;
+    }
+
+    if (textIdx == 0) {
+        score += 10;
+    } else if (clippy_search_is_boundary(text, textIdx)) {
+        score += 5;
+    }
+
+    if (textIdx < 50) {
+        score += 50 - (NSInteger)textIdx;
+    }
+
+    *lastMatchIdx = (NSInteger)textIdx;
+    return score;
+}
+
+/**
+ * ASCII path: each query char is the next memchr hit after the previous one
+ */
+static inline FuzzyMatchResult clippy_search_match_ascii(const ClippySearchQuery *query,
+                                                         const ClippySearchText *text,
+                                                         NSUInteger *positions) {
+    FuzzyMatchResult result = {NO, 0};
+    NSInteger score = 0;
+    NSInteger consecutiveBonus = 0;
+    NSInteger lastMatchIdx = -2;
+    NSUInteger textIdx = 0;
+
+    for (NSUInteger patternIdx = 0; patternIdx < query->length; patternIdx++) {
+        textIdx = clippy_search_find_ascii(text->ascii, text->length, textIdx, query->chars[patternIdx]);
+        if (textIdx == NSNotFound) {
+            return result;
+        }
+        score += clippy_search_score_at(text, textIdx, &lastMatchIdx, &consecutiveBonus);
+        if (positions) {
+            positions[patternIdx] = textIdx;
+        }
+        textIdx++;
+    }
+
+    result.matches = YES;
+    result.score = score;
+    return result;
+}
+
+/**
+ * UTF-16 path
+ */
+static inline FuzzyMatchResult clippy_search_match_wide(const ClippySearchQuery *query,
+                                                        const ClippySearchText *text,
+                                                        NSUInteger *positions) {
+    FuzzyMatchResult result = {NO, 0};
+
+    const unichar *pattern = query->chars;
+    const unichar *chars = text->chars;
+    NSUInteger patternLength = query->length;
+    NSUInteger textLength = text->length;
+
+    // Nothing scores before the first pattern char, so jump straight to it
+    NSUInteger start = clippy_search_find(chars, textLength, 0, pattern[0]);
+    if (start == NSNotFound) {
+        return result;
+    }
+
+    NSUInteger patternIdx = 0;
+    NSInteger score = 0;
+    NSInteger consecutiveBonus = 0;
+    NSInteger lastMatchIdx = -2;
+
+    for (NSUInteger textIdx = start; textIdx < textLength && patternIdx < patternLength; textIdx++) {
+        if (chars[textIdx] != pattern[patternIdx]) {
+            continue;
+        }
+        score += clippy_search_score_at(text, textIdx, &lastMatchIdx, &consecutiveBonus);
+        if (positions) {
+            positions[patternIdx] = textIdx;
+        }
+        patternIdx++;
+    }
+
+    result.matches = (patternIdx == patternLength);
+    result.score = result.matches ? score : 0;
+    return result;
+}
+
+/**
+ * Score a query against one search text, recording where each query char
+ * matched when positions is non-NULL (room for query->length indexes into
+ * the lowercased text; only meaningful when the result matches)
+ */
+static inline FuzzyMatchResult clippy_search_match_text_positions(const ClippySearchQuery *query,
+                                                                  const ClippySearchText *text,
+                                                                  NSUInteger *positions) {
+    FuzzyMatchResult result = {NO, 0};
+
+    if (query->length == 0) {
+        result.matches = YES;
+        return result;
+    }
+    if (text->length == 0 || !clippy_search_may_match(query, text)) {
+        return result;
+    }
+
+    return text->ascii ? clippy_search_match_ascii(query, text, positions)
+                       : clippy_search_match_wide(query, text, positions);
+}
+
+static inline FuzzyMatchResult clippy_search_match_text(const ClippySearchQuery *query,
+                                                        const ClippySearchText *text) {
+    return clippy_search_match_text_positions(query, text, NULL);
+}
+
+/**
+ * Best match of a query against an entry's text and label
+ */
+static inline FuzzyMatchResult clippy_search_match_entry(const ClippySearchQuery *query,
+                                                         const ClippySearchEntry *entry) {
+    FuzzyMatchResult textMatch = clippy_search_match_text(query, &entry->text);
+    FuzzyMatchResult labelMatch = clippy_search_match_text(query, &entry->label);
+
+    FuzzyMatchResult result;
+    result.matches = textMatch.matches || labelMatch.matches;
+    result.score = MAX(textMatch.score, labelMatch.score);
+    return result;
+}
+
+/**
+ * clippy_search_match_entry plus the entry's boost when it matches, for
+ * ordering results (the match itself is unchanged)
+ */
+static inline FuzzyMatchResult clippy_search_match_ranked(const ClippySearchQuery *query,
+                                                          const ClippySearchEntry *entry) {
+    FuzzyMatchResult result = clippy_search_match_entry(query, entry);
+    if (result.matches) {
+        result.score += entry->boost;
+    }
+    return result;
+}
+
+/**
+ * One-off match of two strings; builds and frees temporary buffers
+ */
+static inline FuzzyMatchResult clippy_fuzzy_match(NSString *pattern, NSString *text) {
+    ClippySearchQuery query;
+    ClippySearchText searchText;
+    clippy_search_query_init(&query, pattern);
+    clippy_search_text_init(&searchText, text);
+
+    FuzzyMatchResult result = clippy_search_match_text(&query, &searchText);
+
+    clippy_search_text_free(&searchText);
+    clippy_search_query_free(&query);
+    return result;
+}
+
+/**
+ * clippy_fuzzy_match that also adds each matched position to positions
+ * Positions index [text lowercaseString], which lines up with text itself
+ * unless case folding changed its length (rare outside ASCII)
+ */
+static inline FuzzyMatchResult clippy_fuzzy_match_positions(NSString *pattern, NSString *text,
+                                                            NSMutableIndexSet *positions) {
+    ClippySearchQuery query;
+    ClippySearchText searchText;
+    clippy_search_query_init(&query, pattern);
+    clippy_search_text_init(&searchText, text);
+
+    NSUInteger *matched = query.length > 0 ? malloc(query.length * sizeof(NSUInteger)) : NULL;
+    FuzzyMatchResult result = {NO, 0};
+    if (matched || query.length == 0) {
+        result = clippy_search_match_text_positions(&query, &searchText, matched);
+    }
+    if (result.matches) {
+        for (NSUInteger i = 0; i < query.length; i++) {
+            [positions addIndex:matched[i]];
+        }
+    }
+
+    free(matched);
+    clippy_search_text_free(&searchText);
+    clippy_search_query_free(&query);
+    return result;
+}
+
+// ============================================================================
+// Top-K Selection
+// ============================================================================
+
+typedef struct {
+    NSInteger score;
+    NSUInteger slot;
+} ClippySearchHit;
+
+/**
+ * Bounded heap keeping the best `capacity` hits; the root is the worst kept
+ */
+typedef struct {
+    ClippySearchHit *hits;
+    NSUInteger count;
+    NSUInteger capacity;
+} ClippySearchTopK;
+
+/**
+ * Higher score wins; equal scores keep history order (lower slot first)
+ */
+static inline BOOL clippy_search_hit_better(ClippySearchHit a, ClippySearchHit b) {
+    return a.score > b.score || (a.score == b.score && a.slot < b.slot);
+}
+
+static inline BOOL clippy_search_topk_init(ClippySearchTopK *heap, NSUInteger capacity) {
+    heap->hits = capacity > 0 ? malloc(capacity * sizeof(ClippySearchHit)) : NULL;
+    heap->count = 0;
+    heap->capacity = heap->hits ? capacity : 0;
+    return heap->hits != NULL;
+}
+
+static inline void clippy_search_topk_free(ClippySearchTopK *heap) {
+    free(heap->hits);
+    memset(heap, 0, sizeof(*heap));
+}
+
+static inline void clippy_search_topk_sift_down(ClippySearchTopK *heap, NSUInteger i) {
+    ClippySearchHit *hits = heap->hits;
+    for (;;) {
+        NSUInteger worst = i;
+        NSUInteger left = 2 * i + 1;
+        NSUInteger right = left + 1;
+        if (left < heap->count && clippy_search_hit_better(hits[worst], hits[left])) {
+            worst = left;
+        }
+        if (right < heap->count && clippy_search_hit_better(hits[worst], hits[right])) {
+            worst = right;
+        }
+        if (worst == i) {
+            return;
+        }
+        ClippySearchHit tmp = hits[i];
+        hits[i] = hits[worst];
+        hits[worst] = tmp;
+        i = worst;
+    }
+}
+
+static inline void clippy_search_topk_push(ClippySearchTopK *heap, ClippySearchHit hit) {
+    ClippySearchHit *hits = heap->hits;
+
+    if (heap->count < heap->capacity) {
+        NSUInteger i = heap->count++;
+        hits[i] = hit;
+        while (i > 0) {
+            NSUInteger parent = (i - 1) / 2;
+            if (!clippy_search_hit_better(hits[parent], hits[i])) {
+                break;
+            }
+            ClippySearchHit tmp = hits[i];
+            hits[i] = hits[parent];
+            hits[parent] = tmp;
+            i = parent;
+        }
+    } else if (heap->capacity > 0 && clippy_search_hit_better(hit, hits[0])) {
+        hits[0] = hit;
+        clippy_search_topk_sift_down(heap, 0);
+    }
+}
+
+static inline int clippy_search_hit_compare(const void *a, const void *b) {
+    ClippySearchHit x = *(const ClippySearchHit *)a;
+    ClippySearchHit y = *(const ClippySearchHit *)b;
+    if (clippy_search_hit_better(x, y)) {
+        return -1;
+    }
+    return clippy_search_hit_better(y, x) ? 1 : 0;
+}
+
+/**
+ * Order the kept hits best first (destroys the heap property)
+ */
+static inline void clippy_search_topk_sort(ClippySearchTopK *heap) {
+    qsort(heap->hits, heap->count, sizeof(ClippySearchHit), clippy_search_hit_compare);
+}
+
+#endif // CLIPPY_SEARCH_H
@@ -0,0 +1,147 @@
+/**
+ * clippy_trace.h - Signpost intervals and latency histograms
+ *
+ * CLIPPY_TRACE_BEGIN/END bracket a hot path with an os_signpost interval
+ * (subsystem com.local.clippy, category Performance), so Instruments'
+ * os_signpost and Points of Interest tracks show where time goes. The pair
+ * also measures the interval, which clipd feeds into the histograms that
+ * `clippy stats` prints. Signposts cost next to nothing unless a tool is
+ * recording. clippy_trace_footprint_bytes reports the process's memory as
+ * Activity Monitor and jetsam count it.
+ */
+
+#ifndef CLIPPY_TRACE_H
+#define CLIPPY_TRACE_H
+
+#import <Foundation/Foundation.h>
+#include <os/log.h>
+#include <os/signpost.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+
+#define CLIPPY_TRACE_SUBSYSTEM "com.local.clippy"
+
+// Bucket i holds durations in [2^i, 2^(i+1)) microseconds (bucket 0 also
+// holds 0); the last bucket is open ended (about 8 s and up)
+#define CLIPPY_HISTOGRAM_BUCKETS 24
+
+// ============================================================================
+// Signposts
+// ============================================================================
+
+static inline os_log_t clippy_trace_log(void) {
+    static os_log_t log = NULL;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        log = os_log_create(CLIPPY_TRACE_SUBSYSTEM, "Performance");
+    });
+    return log;
+}
+
+/**
+ * Microseconds in a span of mach_absolute_time ticks (the unit of event
+ * timestamps such as CGEventGetTimestamp's; not nanoseconds on Apple Silicon)
+ */
+static inline uint64_t clippy_trace_ticks_to_us(uint64_t ticks) {
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        mach_timebase_info(&timebase);
+    });
+    return ticks * timebase.numer / timebase.denom / 1000;
+}
+
+static inline uint64_t clippy_trace_now_us(void) {
+    return clippy_trace_ticks_to_us(mach_absolute_time());
+}
+
+/**
+ * Open an interval named by a bare identifier, e.g. CLIPPY_TRACE_BEGIN(Cleanup);
+ * declares Cleanup_signpost and Cleanup_start in the current scope
+ */
+#define CLIPPY_TRACE_BEGIN(name) \
+    os_signpost_id_t name##_signpost = os_signpost_id_generate(clippy_trace_log()); \
+    uint64_t name##_start __attribute__((unused)) = clippy_trace_now_us(); \
+    os_signpost_interval_begin(clippy_trace_log(), name##_signpost, #name)
+
+#define CLIPPY_TRACE_END(name) \
+    os_signpost_interval_end(clippy_trace_log(), name##_signpost, #name)
+
+// Microseconds since the matching CLIPPY_TRACE_BEGIN
+#define CLIPPY_TRACE_ELAPSED_US(name) (clippy_trace_now_us() - name##_start)
+
+/**
+ * The process's physical footprint in bytes, or 0 if it can't be read
+ */
+static inline uint64_t clippy_trace_footprint_bytes(void) {
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+        return 0;
+    }
+    return info.phys_footprint;
+}
+
+// ============================================================================
+// Latency Histograms
+// ============================================================================
+
+typedef struct {
+    uint64_t count;
+    uint64_t totalUs;
+    uint64_t maxUs;
+    uint64_t buckets[CLIPPY_HISTOGRAM_BUCKETS];
+} ClippyHistogram;
+
+static inline void clippy_histogram_record(ClippyHistogram *histogram, uint64_t us) {
+    unsigned bucket = us > 1 ? 63 - (unsigned)__builtin_clzll(us) : 0;
+    histogram->buckets[MIN(bucket, CLIPPY_HISTOGRAM_BUCKETS - 1)]++;
+    histogram->count++;
+    histogram->totalUs += us;
+    histogram->maxUs = MAX(histogram->maxUs, us);
+}
+
+/**
+ * Upper bound of the bucket holding the given fraction of samples
+ * (capped at the largest sample seen)
+ */
+static inline uint64_t clippy_histogram_percentile(const ClippyHistogram *histogram, double fraction) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)ceil(fraction * (double)histogram->count);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < CLIPPY_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= MAX(target, 1ull)) {
+            return MIN((2ull << i) - 1, histogram->maxUs);
+        }
+    }
+    return histogram->maxUs;
+}
+
+/**
+ * JSON-friendly summary: count, total/max/p50/p99 in microseconds and the
+ * raw bucket counts (trailing empty buckets dropped)
+ */
+static inline NSDictionary *clippy_histogram_dictionary(const ClippyHistogram *histogram) {
+    NSUInteger used = CLIPPY_HISTOGRAM_BUCKETS;
+    while (used > 0 && histogram->buckets[used - 1] == 0) {
+        used--;
+    }
+    NSMutableArray *buckets = [NSMutableArray arrayWithCapacity:used];
+    for (NSUInteger i = 0; i < used; i++) {
+        [buckets addObject:@(histogram->buckets[i])];
+    }
+
+    return @{
+        @"count": @(histogram->count),
+        @"total_us": @(histogram->totalUs),
+        @"max_us": @(histogram->maxUs),
+        @"p50_us": @(clippy_histogram_percentile(histogram, 0.50)),
+        @"p99_us": @(clippy_histogram_percentile(histogram, 0.99)),
+        @"buckets": buckets
+    };
+}
+
+#endif // CLIPPY_TRACE_H
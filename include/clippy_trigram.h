@@ -0,0 +1,503 @@
+/**
+ * clippy_trigram.h - Incremental trigram index for substring search
+ *
+ * Mirrors a newest-first list of strings (clipd's history). Every run of
+ * three case-folded UTF-16 units maps to a posting list of the documents
+ * containing it, so a substring query only visits entries holding all of
+ * its trigrams instead of lowercasing and scanning the whole history.
+ *
+ * Documents get ascending ids as they are prepended, so id order is list
+ * order reversed; a Fenwick tree over the live ids converts between list
+ * positions and ids in O(log n). Removing an entry only clears its live
+ * bit, and replacing its text only adds postings: results are candidates,
+ * which callers confirm against the real text. Once dead ids outnumber
+ * live ones the postings are rewritten with dense ids.
+ */
+
+#ifndef CLIPPY_TRIGRAM_H
+#define CLIPPY_TRIGRAM_H
+
+#import <Foundation/Foundation.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define CLIPPY_TRIGRAM_LENGTH 3
+#define CLIPPY_TRIGRAM_COMPACT_MIN 1024  // Dead ids tolerated before compacting
+
+// ============================================================================
+// Types
+// ============================================================================
+
+typedef struct {
+    uint64_t key;        // Three UTF-16 units, first in the high bits
+    uint32_t *docs;      // Ascending doc ids; NULL marks an empty table slot
+    uint32_t count;
+    uint32_t capacity;
+} ClippyTrigramPosting;
+
+typedef struct {
+    ClippyTrigramPosting *table;  // Open addressing, power-of-two size
+    NSUInteger tableSize;
+    NSUInteger used;
+    uint8_t *live;                // live[d]: doc d is still in the list
+    uint32_t *tree;               // Fenwick tree over live, 1-based
+    uint32_t docCount;            // Ids handed out so far
+    uint32_t docCapacity;
+    uint32_t liveCount;
+} ClippyTrigramIndex;
+
+// ============================================================================
+// Helpers
+// ============================================================================
+
+static inline uint64_t clippy_trigram_key(const unichar *chars) {
+    return ((uint64_t)chars[0] << 32) | ((uint64_t)chars[1] << 16) | (uint64_t)chars[2];
+}
+
+static inline NSUInteger clippy_trigram_hash(uint64_t key, NSUInteger tableSize) {
+    return (NSUInteger)((key * 0x9E3779B97F4A7C15ull) >> 32) & (tableSize - 1);
+}
+
+/**
+ * Lowercased UTF-16 copy of a string, the same folding the callers apply
+ * before comparing; caller frees. NULL (length 0) for nil or empty strings.
+ */
+static inline unichar *clippy_trigram_fold(NSString *string, NSUInteger *length) {
+    NSString *lower = [string lowercaseString];
+    *length = [lower length];
+    if (*length == 0) {
+        return NULL;
+    }
+
+    unichar *chars = malloc(*length * sizeof(unichar));
+    if (!chars) {
+        *length = 0;
+        return NULL;
+    }
+    [lower getCharacters:chars range:NSMakeRange(0, *length)];
+    return chars;
+}
+
+/**
+ * First index in docs[from..count) holding a value >= doc
+ */
+static inline uint32_t clippy_trigram_lower_bound(const ClippyTrigramPosting *posting,
+                                                  uint32_t from, uint32_t doc) {
+    uint32_t lo = from;
+    uint32_t hi = posting->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (posting->docs[mid] < doc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// ============================================================================
+// Live Set
+// ============================================================================
+
+static inline void clippy_trigram_tree_add(ClippyTrigramIndex *index, uint32_t doc, int32_t delta) {
+    for (uint32_t i = doc + 1; i <= index->docCapacity; i += i & (~i + 1)) {
+        index->tree[i] += (uint32_t)delta;
+    }
+}
+
+/**
+ * Number of live ids <= doc
+ */
+static inline uint32_t clippy_trigram_tree_prefix(const ClippyTrigramIndex *index, uint32_t doc) {
+    uint32_t sum = 0;
+    for (uint32_t i = doc + 1; i > 0; i -= i & (~i + 1)) {
+        sum += index->tree[i];
+    }
+    return sum;
+}
+
+/**
+ * The rank-th live id in ascending order (rank is 1-based)
+ */
+static inline uint32_t clippy_trigram_tree_select(const ClippyTrigramIndex *index, uint32_t rank) {
+    uint32_t pos = 0;
+    uint32_t step = 1;
+    while ((step << 1) <= index->docCapacity) {
+        step <<= 1;
+    }
+    for (; step > 0; step >>= 1) {
+        if (pos + step <= index->docCapacity && index->tree[pos + step] < rank) {
+            pos += step;
+            rank -= index->tree[pos];
+        }
+    }
+    return pos;  // Tree slot pos + 1, i.e. doc id pos
+}
+
+/**
+ * Rebuild the Fenwick tree from live[] in O(n)
+ */
+static inline void clippy_trigram_tree_rebuild(ClippyTrigramIndex *index) {
+    memset(index->tree, 0, (index->docCapacity + 1) * sizeof(uint32_t));
+    for (uint32_t i = 1; i <= index->docCapacity; i++) {
+        index->tree[i] += (i - 1 < index->docCount) ? index->live[i - 1] : 0;
+        uint32_t parent = i + (i & (~i + 1));
+        if (parent <= index->docCapacity) {
+            index->tree[parent] += index->tree[i];
+        }
+    }
+}
+
+static inline BOOL clippy_trigram_reserve_docs(ClippyTrigramIndex *index, uint32_t needed) {
+    if (needed <= index->docCapacity) {
+        return YES;
+    }
+
+    uint32_t capacity = MAX(index->docCapacity * 2, 64u);
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    uint8_t *live = realloc(index->live, capacity);
+    if (!live) {
+        return NO;
+    }
+    index->live = live;
+    uint32_t *tree = realloc(index->tree, (capacity + 1) * sizeof(uint32_t));
+    if (!tree) {
+        return NO;
+    }
+    index->tree = tree;
+    index->docCapacity = capacity;
+    clippy_trigram_tree_rebuild(index);
+    return YES;
+}
+
+/**
+ * Doc id of the entry at a list position (0 = newest)
+ */
+static inline uint32_t clippy_trigram_doc_at(const ClippyTrigramIndex *index, NSUInteger position) {
+    return clippy_trigram_tree_select(index, index->liveCount - (uint32_t)position);
+}
+
+static inline NSUInteger clippy_trigram_position_of(const ClippyTrigramIndex *index, uint32_t doc) {
+    return index->liveCount - clippy_trigram_tree_prefix(index, doc);
+}
+
+// ============================================================================
+// Postings
+// ============================================================================
+
+static inline ClippyTrigramPosting *clippy_trigram_find(const ClippyTrigramIndex *index, uint64_t key) {
+    if (index->tableSize == 0) {
+        return NULL;
+    }
+    for (NSUInteger i = clippy_trigram_hash(key, index->tableSize);; i = (i + 1) & (index->tableSize - 1)) {
+        ClippyTrigramPosting *slot = &index->table[i];
+        if (!slot->docs) {
+            return NULL;
+        }
+        if (slot->key == key) {
+            return slot;
+        }
+    }
+}
+
+static inline BOOL clippy_trigram_resize_table(ClippyTrigramIndex *index, NSUInteger tableSize) {
+    ClippyTrigramPosting *table = calloc(tableSize, sizeof(ClippyTrigramPosting));
+    if (!table) {
+        return NO;
+    }
+    for (NSUInteger i = 0; i < index->tableSize; i++) {
+        ClippyTrigramPosting posting = index->table[i];
+        if (!posting.docs) {
+            continue;
+        }
+        NSUInteger j = clippy_trigram_hash(posting.key, tableSize);
+        while (table[j].docs) {
+            j = (j + 1) & (tableSize - 1);
+        }
+        table[j] = posting;
+    }
+    free(index->table);
+    index->table = table;
+    index->tableSize = tableSize;
+    return YES;
+}
+
+static inline ClippyTrigramPosting *clippy_trigram_find_or_add(ClippyTrigramIndex *index, uint64_t key) {
+    ClippyTrigramPosting *posting = clippy_trigram_find(index, key);
+    if (posting) {
+        return posting;
+    }
+
+    // Keep the table at most half full
+    if ((index->used + 1) * 2 > index->tableSize &&
+        !clippy_trigram_resize_table(index, MAX(index->tableSize * 2, (NSUInteger)1024))) {
+        return NULL;
+    }
+
+    uint32_t *docs = malloc(4 * sizeof(uint32_t));
+    if (!docs) {
+        return NULL;
+    }
+    NSUInteger i = clippy_trigram_hash(key, index->tableSize);
+    while (index->table[i].docs) {
+        i = (i + 1) & (index->tableSize - 1);
+    }
+    index->table[i] = (ClippyTrigramPosting){key, docs, 0, 4};
+    index->used++;
+    return &index->table[i];
+}
+
+/**
+ * Add doc to a posting list, keeping it sorted; new docs are the largest id
+ * so this is nearly always an append
+ */
+static inline BOOL clippy_trigram_posting_insert(ClippyTrigramPosting *posting, uint32_t doc) {
+    uint32_t at = posting->count;
+    if (at > 0 && posting->docs[at - 1] >= doc) {
+        at = clippy_trigram_lower_bound(posting, 0, doc);
+        if (at < posting->count && posting->docs[at] == doc) {
+            return YES;
+        }
+    }
+
+    if (posting->count == posting->capacity) {
+        uint32_t *docs = realloc(posting->docs, posting->capacity * 2 * sizeof(uint32_t));
+        if (!docs) {
+            return NO;
+        }
+        posting->docs = docs;
+        posting->capacity *= 2;
+    }
+    memmove(posting->docs + at + 1, posting->docs + at, (posting->count - at) * sizeof(uint32_t));
+    posting->docs[at] = doc;
+    posting->count++;
+    return YES;
+}
+
+static inline BOOL clippy_trigram_index_text(ClippyTrigramIndex *index, uint32_t doc, NSString *text) {
+    NSUInteger length = 0;
+    unichar *chars = clippy_trigram_fold(text, &length);
+    BOOL ok = YES;
+    for (NSUInteger i = 0; ok && i + CLIPPY_TRIGRAM_LENGTH <= length; i++) {
+        ClippyTrigramPosting *posting = clippy_trigram_find_or_add(index, clippy_trigram_key(chars + i));
+        ok = posting && clippy_trigram_posting_insert(posting, doc);
+    }
+    free(chars);
+    return ok;
+}
+
+// ============================================================================
+// Lifetime
+// ============================================================================
+
+static inline void clippy_trigram_index_init(ClippyTrigramIndex *index) {
+    memset(index, 0, sizeof(*index));
+}
+
+static inline void clippy_trigram_index_free(ClippyTrigramIndex *index) {
+    for (NSUInteger i = 0; i < index->tableSize; i++) {
+        free(index->table[i].docs);
+    }
+    free(index->table);
+    free(index->live);
+    free(index->tree);
+    memset(index, 0, sizeof(*index));
+}
+
+/**
+ * Renumber live docs densely (keeping their order) and drop dead postings
+ */
+static inline void clippy_trigram_index_compact(ClippyTrigramIndex *index) {
+    for (NSUInteger i = 0; i < index->tableSize; i++) {
+        ClippyTrigramPosting *posting = &index->table[i];
+        if (!posting->docs) {
+            continue;
+        }
+        uint32_t kept = 0;
+        for (uint32_t n = 0; n < posting->count; n++) {
+            uint32_t doc = posting->docs[n];
+            if (index->live[doc]) {
+                posting->docs[kept++] = clippy_trigram_tree_prefix(index, doc) - 1;
+            }
+        }
+        posting->count = kept;
+    }
+
+    // Empty lists are dropped by rehashing what's left (open addressing
+    // can't delete in place); if that allocation fails they just stay
+    NSUInteger used = 0;
+    for (NSUInteger i = 0; i < index->tableSize; i++) {
+        used += (index->table[i].docs && index->table[i].count > 0);
+    }
+    NSUInteger tableSize = 1024;
+    while (used * 2 > tableSize) {
+        tableSize *= 2;
+    }
+    ClippyTrigramPosting *table = calloc(tableSize, sizeof(ClippyTrigramPosting));
+    if (table) {
+        for (NSUInteger i = 0; i < index->tableSize; i++) {
+            ClippyTrigramPosting posting = index->table[i];
+            if (posting.docs && posting.count == 0) {
+                free(posting.docs);
+            } else if (posting.docs) {
+                NSUInteger j = clippy_trigram_hash(posting.key, tableSize);
+                while (table[j].docs) {
+                    j = (j + 1) & (tableSize - 1);
+                }
+                table[j] = posting;
+            }
+        }
+        free(index->table);
+        index->table = table;
+        index->tableSize = tableSize;
+        index->used = used;
+    }
+
+    index->docCount = index->liveCount;
+    memset(index->live, 1, index->liveCount);
+    clippy_trigram_tree_rebuild(index);
+}
+
+// ============================================================================
+// List Operations
+// ============================================================================
+
+/**
+ * Add text as the new newest entry (position 0)
+ * On NO the index can't be trusted; callers drop it and scan instead
+ */
+static inline BOOL clippy_trigram_index_prepend(ClippyTrigramIndex *index, NSString *text) {
+    if (index->docCount == UINT32_MAX || !clippy_trigram_reserve_docs(index, index->docCount + 1)) {
+        return NO;
+    }
+    uint32_t doc = index->docCount++;
+    index->live[doc] = 1;
+    index->liveCount++;
+    clippy_trigram_tree_add(index, doc, 1);
+    return clippy_trigram_index_text(index, doc, text);
+}
+
+static inline void clippy_trigram_index_remove_at(ClippyTrigramIndex *index, NSUInteger position) {
+    if (position >= index->liveCount) {
+        return;
+    }
+    uint32_t doc = clippy_trigram_doc_at(index, position);
+    index->live[doc] = 0;
+    index->liveCount--;
+    clippy_trigram_tree_add(index, doc, -1);
+
+    uint32_t dead = index->docCount - index->liveCount;
+    if (dead >= CLIPPY_TRIGRAM_COMPACT_MIN && dead > index->liveCount) {
+        clippy_trigram_index_compact(index);
+    }
+}
+
+/**
+ * The entry at position now has a different text; its old trigrams stay
+ * as harmless false positives until the next compaction or rebuild
+ */
+static inline BOOL clippy_trigram_index_update_at(ClippyTrigramIndex *index, NSUInteger position,
+                                                  NSString *text) {
+    if (position >= index->liveCount) {
+        return YES;
+    }
+    return clippy_trigram_index_text(index, clippy_trigram_doc_at(index, position), text);
+}
+
+/**
+ * Rebuild from newest-first entries' "text" fields
+ */
+static inline BOOL clippy_trigram_index_load(ClippyTrigramIndex *index, NSArray *entries) {
+    clippy_trigram_index_free(index);
+    for (NSDictionary *entry in [entries reverseObjectEnumerator]) {
+        @autoreleasepool {
+            if (!clippy_trigram_index_prepend(index, entry[@"text"])) {
+                return NO;
+            }
+        }
+    }
+    return YES;
+}
+
+// ============================================================================
+// Queries
+// ============================================================================
+
+static inline int clippy_trigram_posting_compare(const void *a, const void *b) {
+    uint32_t x = (*(ClippyTrigramPosting *const *)a)->count;
+    uint32_t y = (*(ClippyTrigramPosting *const *)b)->count;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Positions (ascending, i.e. newest first) of entries that may contain
+ * query, lowercased. Returns NO when the query is shorter than a trigram
+ * and the index can't narrow anything; the caller scans every entry.
+ */
+static inline BOOL clippy_trigram_index_candidates(const ClippyTrigramIndex *index, NSString *query,
+                                                   NSMutableData *positions) {
+    [positions setLength:0];
+
+    NSUInteger length = 0;
+    unichar *chars = clippy_trigram_fold(query, &length);
+    if (length < CLIPPY_TRIGRAM_LENGTH) {
+        free(chars);
+        return NO;
+    }
+
+    NSUInteger gramCount = length - CLIPPY_TRIGRAM_LENGTH + 1;
+    ClippyTrigramPosting **lists = malloc(gramCount * sizeof(ClippyTrigramPosting *));
+    uint32_t *cursors = calloc(gramCount, sizeof(uint32_t));
+    if (!lists || !cursors) {
+        free(lists);
+        free(cursors);
+        free(chars);
+        return NO;
+    }
+
+    BOOL empty = NO;
+    for (NSUInteger g = 0; g < gramCount && !empty; g++) {
+        lists[g] = clippy_trigram_find(index, clippy_trigram_key(chars + g));
+        empty = (lists[g] == NULL);
+    }
+    free(chars);
+
+    if (!empty) {
+        // Walk the shortest list, probing the others with forward-only cursors
+        qsort(lists, gramCount, sizeof(ClippyTrigramPosting *), clippy_trigram_posting_compare);
+        const ClippyTrigramPosting *base = lists[0];
+        for (uint32_t n = 0; n < base->count; n++) {
+            uint32_t doc = base->docs[n];
+            if (!index->live[doc]) {
+                continue;
+            }
+            BOOL inAll = YES;
+            for (NSUInteger g = 1; g < gramCount && inAll; g++) {
+                cursors[g] = clippy_trigram_lower_bound(lists[g], cursors[g], doc);
+                inAll = (cursors[g] < lists[g]->count && lists[g]->docs[cursors[g]] == doc);
+            }
+            if (inAll) {
+                NSUInteger position = clippy_trigram_position_of(index, doc);
+                [positions appendBytes:&position length:sizeof(position)];
+            }
+        }
+
+        // Ascending ids are oldest first; flip to list order
+        NSUInteger *found = [positions mutableBytes];
+        NSUInteger foundCount = [positions length] / sizeof(NSUInteger);
+        for (NSUInteger i = 0; i < foundCount / 2; i++) {
+            NSUInteger tmp = found[i];
+            found[i] = found[foundCount - 1 - i];
+            found[foundCount - 1 - i] = tmp;
+        }
+    }
+
+    free(lists);
+    free(cursors);
+    return YES;
+}
+
+#endif // CLIPPY_TRIGRAM_H
@@ -1,123 +1,1442 @@
 /**
  * clipd - Clipboard History Daemon
  *
- * Monitors the macOS clipboard and saves history to ~/.clipboard_history
+ * Monitors the macOS clipboard and appends history to ~/.clippy_data/history.log
  * Uses only Apple's native frameworks - zero external dependencies.
  *
- * Build: clang -framework AppKit -framework Foundation -Iinclude -o clipd clipd.m
+ * Build: clang -framework AppKit -framework Foundation -framework ImageIO -lcompression -Iinclude -o clipd clipd.m
  */
 
 #import <AppKit/AppKit.h>
 #import <Foundation/Foundation.h>
+#import <ImageIO/ImageIO.h>
 #include <signal.h>
 #include "clippy_common.h"
+#include "clippy_ipc.h"
+#include "clippy_trigram.h"
+#include "clippy_trace.h"
 
 static volatile sig_atomic_t running = 1;
 
+BOOL flushHistoryRecords(void);
+
+// Runs on the main queue via a dispatch signal source, not in signal context
 void signalHandler(int sig) {
     (void)sig;
+    flushHistoryRecords();
     running = 0;
+    CFRunLoopStop(CFRunLoopGetMain());
+}
+
+static dispatch_source_t sigintSource = nil;
+static dispatch_source_t sigtermSource = nil;
+
+static dispatch_source_t installSignalSource(int sig) {
+    signal(sig, SIG_IGN);
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, (uintptr_t)sig,
+                                                      0, dispatch_get_main_queue());
+    dispatch_source_set_event_handler(source, ^{
+        signalHandler(sig);
+    });
+    dispatch_resume(source);
+    return source;
+}
+
+// ============================================================================
+// Canonical State
+// ============================================================================
+
+/**
+ * clipd owns history and pins in memory and serves them over the socket;
+ * every change is also written to the files, which stay the durable copy
+ * (and the fallback when clipd isn't running). Each collection remembers
+ * the file stamp of clipd's own last write; a different stamp means another
+ * process wrote the file directly and the collection is reloaded.
+ * All of this runs on the main queue.
+ *
+ * A trigram index mirrors history for the search command. It is updated
+ * alongside every in-memory change and rebuilt on reload; if it ever fails
+ * to allocate, search falls back to scanning until the next reload.
+ *
+ * A content index maps each text, and each stored image or text blob path
+ * (paths are content hashes), to the live entry holding it, so a repeated
+ * capture finds its earlier copy without comparing against every entry.
+ * An id index maps each entry's id to the live entry, so requests naming an
+ * entry by id resolve it without matching text or trusting a position.
+ */
+
+static NSMutableArray *history = nil;    // Newest first, as clippy_history_load
+static NSMutableArray *pins = nil;
+static ClippyFileStamp historyStamp;
+static ClippyFileStamp pinsStamp;
+static ClippyTrigramIndex historyIndex;
+static BOOL historyIndexValid = NO;
+static NSMutableDictionary *historyByText = nil;
+static NSMutableDictionary *historyByFile = nil;
+static NSMutableDictionary *historyById = nil;
+static NSUInteger historyBytes = 0;      // clippy_entry_footprint of history
+static uint64_t memoryTrimmed = 0;       // Entries dropped for max_memory_mb
+
+void notifySubscribers(NSString *event);
+void scheduleExpiry(void);
+
+static NSMutableDictionary *contentIndexFor(NSDictionary *entry, NSString **key) {
+    if ([entry[@"type"] isEqualToString:@"image"] || entry[@"blob"]) {
+        *key = clippy_entry_stored_path(entry);  // nil while an image is pending
+        return historyByFile;
+    }
+    *key = entry[@"text"];
+    return historyByText;
+}
+
+void indexContent(NSDictionary *entry) {
+    NSString *key = nil;
+    NSMutableDictionary *index = contentIndexFor(entry, &key);
+    if (key) {
+        index[key] = entry;
+    }
+    historyById[@(clippy_entry_id(entry))] = entry;
+    historyBytes += clippy_entry_footprint(entry);
+}
+
+void unindexContent(NSDictionary *entry) {
+    NSString *key = nil;
+    NSMutableDictionary *index = contentIndexFor(entry, &key);
+    if (key && index[key] == entry) {
+        [index removeObjectForKey:key];
+    }
+    NSNumber *entryId = @(clippy_entry_id(entry));
+    if (historyById[entryId] == entry) {
+        [historyById removeObjectForKey:entryId];
+    }
+    historyBytes -= MIN(historyBytes, clippy_entry_footprint(entry));
+}
+
+void loadHistoryState(void) {
+    historyStamp = clippy_file_stamp(clippy_history_log_path());
+    history = clippy_history_load();
+    historyIndexValid = clippy_trigram_index_load(&historyIndex, history);
+
+    // Oldest first, so duplicates written before dedup map to the newest copy
+    historyByText = [NSMutableDictionary dictionary];
+    historyByFile = [NSMutableDictionary dictionary];
+    historyById = [NSMutableDictionary dictionaryWithCapacity:[history count]];
+    historyBytes = 0;
+    for (NSDictionary *entry in [history reverseObjectEnumerator]) {
+        indexContent(entry);
+    }
+    scheduleExpiry();
+}
+
+void loadPinsState(void) {
+    pinsStamp = clippy_file_stamp(clippy_pins_journal_path());
+    pins = clippy_pins_load();
+    scheduleExpiry();
+}
+
+/**
+ * Pick up writes made by other processes
+ */
+void syncState(void) {
+    if (!clippy_file_stamp_equal(historyStamp, clippy_file_stamp(clippy_history_log_path()))) {
+        flushHistoryRecords();  // Queued records land after the other writer's
+        loadHistoryState();
+        notifySubscribers(@"history");
+    }
+    if (!clippy_file_stamp_equal(pinsStamp, clippy_file_stamp(clippy_pins_journal_path()))) {
+        loadPinsState();
+        notifySubscribers(@"pins");
+    }
+}
+
+/**
+ * After clipd wrote the log itself: restamp, and tell subscribers if the
+ * visible history changed (compaction alone doesn't)
+ */
+void historyWritten(BOOL changed) {
+    historyStamp = clippy_file_stamp(clippy_history_log_path());
+    if (changed) {
+        notifySubscribers(@"history");
+    }
+}
+
+void pinsWritten(void) {
+    loadPinsState();
+    notifySubscribers(@"pins");
+}
+
+/**
+ * Mirror an append in memory (trimmed like clippy_history_load; images of
+ * trimmed entries are released when the log is compacted)
+ */
+void insertIntoHistory(NSDictionary *entry) {
+    [history insertObject:entry atIndex:0];
+    historyIndexValid = historyIndexValid && clippy_trigram_index_prepend(&historyIndex, entry[@"text"]);
+    indexContent(entry);
+    if ([history count] == 1) {
+        scheduleExpiry();  // Only the first entry can become the oldest
+    }
+
+    NSUInteger limit = (NSUInteger)MAX(clippy_config.maxHistoryItems, 0);
+    NSUInteger budget = clippy_memory_budget_bytes();
+    while ([history count] > limit || ([history count] > 1 && historyBytes > budget)) {
+        if ([history count] <= limit) {
+            memoryTrimmed++;
+        }
+        unindexContent([history lastObject]);
+        [history removeLastObject];
+        clippy_trigram_index_remove_at(&historyIndex, [history count]);
+    }
+}
+
+void replaceHistoryEntry(NSUInteger idx, NSDictionary *entry) {
+    unindexContent(history[idx]);
+    history[idx] = entry;
+    indexContent(entry);
+    historyIndexValid = historyIndexValid &&
+                        clippy_trigram_index_update_at(&historyIndex, idx, entry[@"text"]);
+}
+
+void removeHistoryEntry(NSUInteger idx) {
+    unindexContent(history[idx]);
+    [history removeObjectAtIndex:idx];
+    clippy_trigram_index_remove_at(&historyIndex, idx);
+}
+
+void clearHistoryState(void) {
+    [history removeAllObjects];
+    historyBytes = 0;
+    [historyByText removeAllObjects];
+    [historyByFile removeAllObjects];
+    [historyById removeAllObjects];
+    clippy_trigram_index_free(&historyIndex);
+    historyIndexValid = YES;
+}
+
+/**
+ * Position of the live entry with the given id, or NSNotFound
+ * (the lookup is a hash probe; the position a pointer scan)
+ */
+NSUInteger historyIndexOfId(uint64_t entryId) {
+    NSDictionary *entry = historyById[@(entryId)];
+    return entry ? [history indexOfObjectIdenticalTo:entry] : NSNotFound;
+}
+
+// ============================================================================
+// Statistics
+// ============================================================================
+
+/**
+ * Counters and latency histograms for `clippy stats`, since clipd started
+ * Main queue only; the image job measures its transcode and hands the
+ * figure back with its completion. Bytes written and files stored come
+ * from the shared clippy_stat_* counters.
+ */
+typedef struct {
+    NSTimeInterval startedAt;
+    uint64_t textCaptures;
+    uint64_t imageCaptures;
+    uint64_t imagesSkipped;   // Image queue full
+    uint64_t overBudget;      // Representations dropped or text cut by max_*_kb
+    uint64_t dedupHits;       // Repeats moved to the front instead of stored
+    uint64_t uses;            // Pastes counted toward frecency
+    uint64_t requests;
+    uint64_t historyCommits;  // Batched log writes
+    uint64_t historyRecords;  // Records those writes carried
+    ClippyHistogram pasteboardRead;
+    ClippyHistogram imageTranscode;
+    ClippyHistogram historyWrite;
+    ClippyHistogram compaction;
+    ClippyHistogram cleanup;
+    ClippyHistogram search;
+    ClippyHistogram pickerOpen;  // Reported by clippy-picker
+    ClippyHistogram pickerSearch;
+    uint64_t pickerModelBytes;   // Last reported by clippy-picker
+    uint64_t pickerFootprint;
+} ClipdStats;
+
+static ClipdStats stats;
+
+NSDictionary *statsResponse(void) {
+    return @{
+        @"ok": @YES,
+        @"uptime": @([NSDate timeIntervalSinceReferenceDate] - stats.startedAt),
+        @"counters": @{
+            @"history_entries": @([history count]),
+            @"pins": @([pins count]),
+            @"text_captures": @(stats.textCaptures),
+            @"image_captures": @(stats.imageCaptures),
+            @"images_skipped": @(stats.imagesSkipped),
+            @"over_budget": @(stats.overBudget),
+            @"dedup_hits": @(stats.dedupHits),
+            @"uses": @(stats.uses),
+            @"files_stored": @(atomic_load(&clippy_stat_files_stored)),
+            @"bytes_written": @(atomic_load(&clippy_stat_bytes_written)),
+            @"requests": @(stats.requests),
+            @"history_commits": @(stats.historyCommits),
+            @"history_records": @(stats.historyRecords),
+            @"history_bytes": @(historyBytes),
+            @"memory_budget": @(clippy_memory_budget_bytes()),
+            @"memory_trimmed": @(memoryTrimmed),
+            @"footprint": @(clippy_trace_footprint_bytes()),
+            @"picker_model_bytes": @(stats.pickerModelBytes),
+            @"picker_footprint": @(stats.pickerFootprint)
+        },
+        @"latency": @{
+            @"pasteboard_read": clippy_histogram_dictionary(&stats.pasteboardRead),
+            @"image_transcode": clippy_histogram_dictionary(&stats.imageTranscode),
+            @"history_write": clippy_histogram_dictionary(&stats.historyWrite),
+            @"compaction": clippy_histogram_dictionary(&stats.compaction),
+            @"cleanup": clippy_histogram_dictionary(&stats.cleanup),
+            @"search": clippy_histogram_dictionary(&stats.search),
+            @"picker_open": clippy_histogram_dictionary(&stats.pickerOpen),
+            @"picker_search": clippy_histogram_dictionary(&stats.pickerSearch)
+        }
+    };
+}
+
+// ============================================================================
+// Group Commit
+// ============================================================================
+
+/**
+ * History records are queued and written as one batch: a single write()
+ * under one lock. A batch is written CLIPD_COMMIT_WINDOW_MS after its last
+ * record, as soon as CLIPD_COMMIT_MAX_RECORDS are waiting, and never later
+ * than CLIPD_COMMIT_DEADLINE_MS after its first, so a pbcopy loop costs a
+ * bounded number of writes per second. In-memory state changes at once, so
+ * requests see queued entries. Anything that reads or rewrites the log
+ * flushes first, as do SIGINT/SIGTERM.
+ *
+ * Stored files that queued records let go of are released only once those
+ * records are written, so a crash never leaves the log naming a deleted
+ * file. A batch that keeps failing to write is dropped after
+ * CLIPD_COMMIT_MAX_ATTEMPTS tries and history is reloaded from disk.
+ */
+
+#define CLIPD_COMMIT_WINDOW_MS    250   // Longer than the burst poll interval
+#define CLIPD_COMMIT_DEADLINE_MS  1000  // Longest a captured entry waits for disk
+#define CLIPD_COMMIT_MAX_RECORDS  32
+#define CLIPD_COMMIT_MAX_ATTEMPTS 10
+
+static NSMutableArray *pendingRecords = nil;
+static NSMutableArray *pendingReleases = nil;  // Stored file paths
+static NSUInteger failedFlushes = 0;
+static NSTimer *commitTimer = nil;
+static NSTimeInterval batchDeadline = 0;  // Reference-date time
+
+void armCommitTimer(NSTimeInterval fireAt) {
+    NSDate *fireDate = [NSDate dateWithTimeIntervalSinceReferenceDate:fireAt];
+    if (commitTimer.valid) {
+        commitTimer.fireDate = fireDate;
+        return;
+    }
+    commitTimer = [[NSTimer alloc] initWithFireDate:fireDate interval:0 repeats:NO block:^(NSTimer *timer) {
+        (void)timer;
+        @autoreleasepool {
+            flushHistoryRecords();
+        }
+    }];
+    [[NSRunLoop currentRunLoop] addTimer:commitTimer forMode:NSDefaultRunLoopMode];
+}
+
+/**
+ * Write every queued record now; on failure they stay queued for a retry
+ */
+BOOL flushHistoryRecords(void) {
+    NSUInteger count = [pendingRecords count];
+    if (count == 0) {
+        // Everything queued before these releases is already written
+        clippy_images_release(pendingReleases);
+        [pendingReleases removeAllObjects];
+        return YES;
+    }
+
+    CLIPPY_TRACE_BEGIN(HistoryWrite);
+    BOOL written = clippy_history_append_batch(pendingRecords);
+    CLIPPY_TRACE_END(HistoryWrite);
+    clippy_histogram_record(&stats.historyWrite, CLIPPY_TRACE_ELAPSED_US(HistoryWrite));
+
+    if (!written && ++failedFlushes < CLIPD_COMMIT_MAX_ATTEMPTS) {
+        NSLog(@"clipd: Failed to write %lu history records, will retry", (unsigned long)count);
+        batchDeadline = [NSDate timeIntervalSinceReferenceDate] + CLIPD_COMMIT_DEADLINE_MS / 1000.0;
+        armCommitTimer(batchDeadline);
+        return NO;
+    }
+
+    [commitTimer invalidate];
+    commitTimer = nil;
+    failedFlushes = 0;
+    if (!written) {
+        // The files stay referenced by the entries still in the log
+        NSLog(@"clipd: Dropping %lu history records after %d failed writes; reloading history",
+              (unsigned long)count, CLIPD_COMMIT_MAX_ATTEMPTS);
+        [pendingRecords removeAllObjects];
+        [pendingReleases removeAllObjects];
+        loadHistoryState();
+        notifySubscribers(@"history");
+        return NO;
+    }
+
+    stats.historyCommits++;
+    stats.historyRecords += count;
+    [pendingRecords removeAllObjects];
+    clippy_images_release(pendingReleases);
+    [pendingReleases removeAllObjects];
+    historyWritten(NO);
+    return YES;
+}
+
+/**
+ * Release stored files once the records queued so far are written
+ */
+void releaseAfterFlush(NSArray *paths) {
+    if (!pendingReleases) {
+        pendingReleases = [NSMutableArray array];
+    }
+    [pendingReleases addObjectsFromArray:paths];
+}
+
+void queueHistoryRecord(NSDictionary *record) {
+    if (!pendingRecords) {
+        pendingRecords = [NSMutableArray arrayWithCapacity:CLIPD_COMMIT_MAX_RECORDS];
+    }
+
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    if ([pendingRecords count] == 0) {
+        batchDeadline = now + CLIPD_COMMIT_DEADLINE_MS / 1000.0;
+    }
+    [pendingRecords addObject:record];
+
+    if ([pendingRecords count] >= CLIPD_COMMIT_MAX_RECORDS) {
+        flushHistoryRecords();
+    } else {
+        armCommitTimer(MIN(now + CLIPD_COMMIT_WINDOW_MS / 1000.0, batchDeadline));
+    }
 }
 
 // ============================================================================
 // History Management
 // ============================================================================
 
-void addTextToHistory(NSString *text) {
+// Appends since the log was last compacted; once the log holds about twice
+// maxHistoryItems records it is rewritten down to the live entries. Large
+// histories compact sooner, so readers going through the log's index (see
+// clippy_log_read_range) never replay more than a bounded tail.
+static int appendsSinceCompaction = 0;
+
+void recordAppend(void) {
+    historyWritten(YES);
+    if (++appendsSinceCompaction >= MIN(clippy_config.maxHistoryItems, CLIPPY_LOG_INDEX_MAX_TAIL)) {
+        CLIPPY_TRACE_BEGIN(Compaction);
+        flushHistoryRecords();
+        clippy_history_compact();
+        historyWritten(NO);
+        appendsSinceCompaction = 0;
+        CLIPPY_TRACE_END(Compaction);
+        clippy_histogram_record(&stats.compaction, CLIPPY_TRACE_ELAPSED_US(Compaction));
+    }
+}
+
+/**
+ * Make an existing entry the newest one, with a fresh timestamp, instead of
+ * storing its content twice (one record)
+ */
+void moveHistoryEntryToFront(NSUInteger idx) {
+    if (idx == 0 || idx == NSNotFound) {
+        return;
+    }
+
+    NSDictionary *entry = history[idx];
+    uint64_t entryId = clippy_entry_id(entry);
+    NSNumber *now = clippy_next_timestamp(history, YES);
+    queueHistoryRecord(clippy_history_move_record(entryId, now));
+
+    // Same id as replay gives it, even when it was derived from the old timestamp
+    NSMutableDictionary *moved = [entry mutableCopy];
+    moved[@"id"] = @(entryId);
+    moved[@"timestamp"] = now;
+    removeHistoryEntry(idx);
+    insertIntoHistory(moved);
+    recordAppend();
+}
+
+/**
+ * Add the representations capture_types asks for, besides the text, to a
+ * new entry (each only if it fits its budget)
+ */
+void captureRepresentations(NSMutableDictionary *entry, NSPasteboard *pasteboard, NSArray *types) {
+    unsigned wanted = clippy_config.captureTypes;
+    NSMutableDictionary *reps = [NSMutableDictionary dictionary];
+    NSDictionary *budgets = @{@"rtf": @(clippy_config.maxRtfKB), @"html": @(clippy_config.maxHtmlKB)};
+    NSDictionary *flags = @{@"rtf": @(CLIPPY_CAPTURE_RTF), @"html": @(CLIPPY_CAPTURE_HTML)};
+
+    [clippy_rep_types() enumerateKeysAndObjectsUsingBlock:^(NSString *rep, NSString *type, BOOL *stop) {
+        (void)stop;
+        if (!(wanted & [flags[rep] unsignedIntValue]) || ![types containsObject:type]) {
+            return;
+        }
+        NSString *blob = clippy_store_rep([pasteboard dataForType:type], [budgets[rep] intValue]);
+        if (blob) {
+            reps[rep] = blob;
+        } else {
+            stats.overBudget++;
+        }
+    }];
+    if ([reps count] > 0) {
+        entry[@"reps"] = reps;
+    }
+
+    if ((wanted & CLIPPY_CAPTURE_FILES) && [types containsObject:NSPasteboardTypeFileURL]) {
+        NSArray *urls = [pasteboard readObjectsForClasses:@[[NSURL class]]
+                                                  options:@{NSPasteboardURLReadingFileURLsOnlyKey: @YES}];
+        NSMutableArray *files = [NSMutableArray arrayWithCapacity:[urls count]];
+        NSUInteger bytes = 0;
+        for (NSURL *url in urls) {
+            [files addObject:[url path]];
+            bytes += [[url path] lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+        }
+        if (bytes > clippy_budget_bytes(clippy_config.maxFilesKB)) {
+            stats.overBudget++;
+        } else if ([files count] > 0) {
+            entry[@"files"] = files;
+        }
+    }
+}
+
+/**
+ * Capture text, plus whatever other representations of it are wanted from
+ * pasteboard (nil to store the text alone)
+ */
+void addTextToHistory(NSString *text, NSPasteboard *pasteboard, NSArray *types) {
     if (!text || [text length] == 0) {
         return;
     }
 
-    // Truncate very long entries
-    if ((int)[text length] > clippy_config.maxEntryLength) {
-        text = [[text substringToIndex:clippy_config.maxEntryLength]
-                stringByAppendingString:@"... [truncated]"];
+    NSString *fitted = clippy_text_fit_budget(text);
+    if (fitted != text) {
+        stats.overBudget++;
+        text = [fitted stringByAppendingString:@"... [truncated]"];
     }
 
-    NSMutableArray *history = clippy_read_json_array(clippy_history_path());
+    // Long text goes out of line, identified by its content hash
+    NSData *utf8 = nil;
+    NSString *hash = nil;
+    NSString *blobPath = nil;
+    if (clippy_text_needs_blob(text)) {
+        hash = clippy_text_blob_key(text, &utf8);
+        blobPath = clippy_blob_path_for_hash(hash);
+    }
 
-    // Skip if same as most recent entry
-    if ([history count] > 0) {
-        NSDictionary *lastEntry = [history firstObject];
-        if ([lastEntry[@"type"] isEqualToString:@"text"]) {
-            NSString *lastText = lastEntry[@"text"];
-            if ([lastText isEqualToString:text]) {
-                return;
-            }
-        }
+    // Copying something already in history brings that entry back to the
+    // front (nothing to do if it is the most recent one)
+    syncState();
+    NSDictionary *earlier = blobPath ? historyByFile[blobPath] : historyByText[text];
+    if (earlier[@"timestamp"]) {
+        stats.dedupHits++;
+        moveHistoryEntryToFront([history indexOfObjectIdenticalTo:earlier]);
+        return;
     }
 
     // Create new entry with timestamp
-    NSDictionary *entry = @{
+    NSMutableDictionary *entry = [@{
+        @"id": clippy_new_entry_id(),
         @"text": text,
-        @"timestamp": @([[NSDate date] timeIntervalSince1970]),
+        @"timestamp": clippy_next_timestamp(history, YES),
         @"type": @"text"
-    };
+    } mutableCopy];
 
-    // Insert at beginning (most recent first)
-    [history insertObject:entry atIndex:0];
+    if (pasteboard) {
+        captureRepresentations(entry, pasteboard, types);
+    }
 
-    // Trim to max size (delete old image files if needed)
-    while ((int)[history count] > clippy_config.maxHistoryItems) {
-        NSDictionary *oldEntry = [history lastObject];
-        if ([oldEntry[@"type"] isEqualToString:@"image"]) {
-            clippy_delete_image(oldEntry[@"path"]);
+    if (blobPath) {
+        NSString *preview = clippy_text_blob_preview(text);
+        NSString *stored = clippy_store_text_blob(utf8, hash);
+        if (stored) {
+            entry[@"text"] = preview;
+            entry[@"blob"] = stored;
+            entry[@"length"] = @([text length]);
+        } else {
+            // No blob, no full text: keep what fits, as before blobs existed
+            entry[@"text"] = [preview stringByAppendingString:@"... [truncated]"];
         }
-        [history removeLastObject];
     }
 
-    clippy_write_json_array(history, clippy_history_path());
+    queueHistoryRecord(entry);
+    stats.textCaptures++;
+    insertIntoHistory(entry);
+    recordAppend();
 }
 
-void addImageToHistory(NSData *imageData) {
-    if (!imageData || [imageData length] == 0) {
-        return;
+// ============================================================================
+// Image Ingestion
+// ============================================================================
+
+/**
+ * Decoding a TIFF screenshot and re-encoding it as PNG can take hundreds of
+ * milliseconds, so images are ingested on a background queue. The poll thread
+ * only commits a pending placeholder entry; the job reads the pasteboard,
+ * transcodes, hashes and stores the image plus its thumbnail (no write at all
+ * when the same bytes are already stored), then completes the placeholder, or
+ * removes it if the pasteboard moved on. At most CLIPD_IMAGE_JOBS jobs are
+ * queued or running at once; images beyond that are skipped, which bounds
+ * memory during a screenshot burst.
+ */
+
+#define CLIPD_IMAGE_JOBS 2
+#define CLIPD_THUMBNAIL_MAX_PIXELS 160  // 2x the picker's 80pt thumbnail box
+
+static dispatch_queue_t imageQueue = nil;
+static dispatch_semaphore_t imageSlots = nil;
+
+void setupImageQueue(void) {
+    dispatch_queue_attr_t attr = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL,
+                                                                         QOS_CLASS_UTILITY, 0);
+    imageQueue = dispatch_queue_create("com.local.clipd.images", attr);
+    imageSlots = dispatch_semaphore_create(CLIPD_IMAGE_JOBS);
+}
+
+/**
+ * Read the pasteboard image as PNG: as offered when the app put PNG there,
+ * otherwise transcoded from TIFF. Both what is read and what would be stored
+ * must fit max_image_kb (*overBudget is set when they don't).
+ * Returns nil if the pasteboard changed since changeCount was observed
+ */
+NSData *readPasteboardImage(NSPasteboard *pasteboard, NSInteger changeCount, BOOL hasPNG, BOOL *overBudget) {
+    NSUInteger budget = clippy_budget_bytes(clippy_config.maxImageKB);
+    NSData *data = [pasteboard dataForType:hasPNG ? NSPasteboardTypePNG : NSPasteboardTypeTIFF];
+    if (!data || [pasteboard changeCount] != changeCount) {
+        return nil;
+    }
+    if ([data length] > budget) {
+        *overBudget = YES;
+        return nil;
+    }
+    if (hasPNG) {
+        return data;
     }
 
-    // Save image to disk
-    NSString *imagePath = clippy_save_image(imageData);
-    if (!imagePath) {
-        return;
+    // Convert TIFF (macOS screenshots) to PNG for consistent storage
+    NSBitmapImageRep *imageRep = [NSBitmapImageRep imageRepWithData:data];
+    NSData *pngData = imageRep ? [imageRep representationUsingType:NSBitmapImageFileTypePNG properties:@{}] : nil;
+    if ([pngData length] > budget) {
+        *overBudget = YES;
+        return nil;
+    }
+    return pngData;
+}
+
+/**
+ * Write a small preview next to the image for the picker's rows
+ * ImageIO decodes straight to the reduced size, so this stays cheap even for
+ * 5K screenshots. Skipped when the image (and thus its thumbnail) was already stored.
+ */
+BOOL writeThumbnail(NSData *pngData, NSString *imagePath) {
+    NSString *thumbPath = clippy_thumbnail_path(imagePath);
+    if ([[NSFileManager defaultManager] fileExistsAtPath:thumbPath]) {
+        return YES;
     }
 
-    NSMutableArray *history = clippy_read_json_array(clippy_history_path());
+    CGImageSourceRef source = CGImageSourceCreateWithData((__bridge CFDataRef)pngData, NULL);
+    if (!source) {
+        return NO;
+    }
+
+    NSDictionary *options = @{
+        (__bridge NSString *)kCGImageSourceCreateThumbnailFromImageAlways: @YES,
+        (__bridge NSString *)kCGImageSourceCreateThumbnailWithTransform: @YES,
+        (__bridge NSString *)kCGImageSourceThumbnailMaxPixelSize: @(CLIPD_THUMBNAIL_MAX_PIXELS)
+    };
+    CGImageRef thumbnail = CGImageSourceCreateThumbnailAtIndex(source, 0, (__bridge CFDictionaryRef)options);
+    CFRelease(source);
+    if (!thumbnail) {
+        return NO;
+    }
+
+    BOOL success = NO;
+    NSURL *url = [NSURL fileURLWithPath:thumbPath];
+    CGImageDestinationRef destination = CGImageDestinationCreateWithURL((__bridge CFURLRef)url,
+                                                                        CFSTR("public.png"), 1, NULL);
+    if (destination) {
+        CGImageDestinationAddImage(destination, thumbnail, NULL);
+        success = CGImageDestinationFinalize(destination);
+        CFRelease(destination);
+    }
+    CGImageRelease(thumbnail);
+
+    if (success) {
+        chmod([thumbPath fileSystemRepresentation], S_IRUSR | S_IWUSR);
+    }
+    return success;
+}
+
+/**
+ * Main thread: settle the placeholder once the job is done
+ */
+void completeImageCapture(uint64_t entryId, NSString *path, NSString *hash, NSUInteger length,
+                          uint64_t transcodeUs, BOOL overBudget) {
+    clippy_histogram_record(&stats.imageTranscode, transcodeUs);
+    if (overBudget) {
+        stats.overBudget++;
+    }
+    syncState();
+    NSUInteger idx = historyIndexOfId(entryId);
 
-    // Create image entry
-    NSDictionary *entry = @{
+    if (path) {
+        NSDictionary *set = @{
+            @"path": path,
+            @"hash": hash,
+            @"text": [NSString stringWithFormat:@"[Image: %lu bytes]", (unsigned long)length]
+        };
+        NSDictionary *earlier = historyByFile[path];
+        NSDictionary *record = clippy_image_capture_record(idx != NSNotFound ? history[idx] : nil, set);
+        if (!record) {
+            // Nothing to settle; drop the store's reference once the
+            // placeholder's removal is written
+            releaseAfterFlush(@[path]);
+            flushHistoryRecords();
+            return;
+        }
+        queueHistoryRecord(record);
+        NSMutableDictionary *entry = [history[idx] mutableCopy];
+        [entry addEntriesFromDictionary:set];
+        [entry removeObjectForKey:@"pending"];
+        replaceHistoryEntry(idx, entry);
+        stats.imageCaptures++;
+
+        // The same image captured again: keep only this, the newest copy
+        // (the store above took a reference, so releasing the old one
+        // leaves the file in place)
+        NSUInteger earlierIdx = [history indexOfObjectIdenticalTo:earlier];
+        if (earlier && earlierIdx != NSNotFound) {
+            queueHistoryRecord(clippy_history_remove_record(clippy_entry_id(earlier)));
+            stats.dedupHits++;
+            releaseAfterFlush(@[path]);
+            removeHistoryEntry(earlierIdx);
+        }
+    } else {
+        queueHistoryRecord(clippy_history_remove_record(entryId));
+        if (idx != NSNotFound) {
+            removeHistoryEntry(idx);
+        }
+    }
+    recordAppend();
+}
+
+void enqueueImageCapture(NSPasteboard *pasteboard, NSInteger changeCount, BOOL hasPNG) {
+    if (dispatch_semaphore_wait(imageSlots, DISPATCH_TIME_NOW) != 0) {
+        NSLog(@"clipd: Image queue full, skipping image");
+        stats.imagesSkipped++;
+        return;
+    }
+
+    NSNumber *entryId = clippy_new_entry_id();
+    NSDictionary *placeholder = @{
+        @"id": entryId,
         @"type": @"image",
-        @"path": imagePath,
-        @"text": [NSString stringWithFormat:@"[Image: %lu bytes]", (unsigned long)[imageData length]],
-        @"timestamp": @([[NSDate date] timeIntervalSince1970])
+        @"text": @"[Image: processing]",
+        @"pending": @YES,
+        @"timestamp": clippy_next_timestamp(history, YES)
     };
 
-    // Insert at beginning
-    [history insertObject:entry atIndex:0];
+    syncState();
+    queueHistoryRecord(placeholder);
+    insertIntoHistory(placeholder);
+    recordAppend();
+
+    dispatch_async(imageQueue, ^{
+        NSString *path = nil;
+        NSString *hash = nil;
+        NSUInteger length = 0;
+        uint64_t transcodeUs = 0;
+        BOOL overBudget = NO;
+
+        @autoreleasepool {
+            CLIPPY_TRACE_BEGIN(ImageTranscode);
+            NSData *pngData = readPasteboardImage(pasteboard, changeCount, hasPNG, &overBudget);
+            CLIPPY_TRACE_END(ImageTranscode);
+            transcodeUs = CLIPPY_TRACE_ELAPSED_US(ImageTranscode);
 
-    // Trim to max size
-    while ((int)[history count] > clippy_config.maxHistoryItems) {
-        NSDictionary *oldEntry = [history lastObject];
-        if ([oldEntry[@"type"] isEqualToString:@"image"]) {
-            clippy_delete_image(oldEntry[@"path"]);
+            if ([pngData length] > 0) {
+                hash = clippy_sha256_hex(pngData);
+                path = clippy_store_image(pngData, hash);
+                length = [pngData length];
+                CLIPPY_TRACE_BEGIN(Thumbnail);
+                if (path && !writeThumbnail(pngData, path)) {
+                    NSLog(@"clipd: Failed to create thumbnail for %@", [path lastPathComponent]);
+                }
+                CLIPPY_TRACE_END(Thumbnail);
+            }
         }
-        [history removeLastObject];
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            completeImageCapture([entryId unsignedLongLongValue], path, hash, length, transcodeUs, overBudget);
+            dispatch_semaphore_signal(imageSlots);
+        });
+    });
+}
+
+/**
+ * Placeholders left by a previous run will never complete
+ */
+void dropOrphanedPlaceholders(void) {
+    clippy_history_update(^BOOL(NSMutableArray *history) {
+        NSIndexSet *orphaned = [history indexesOfObjectsPassingTest:^BOOL(NSDictionary *entry, NSUInteger idx, BOOL *stop) {
+            (void)idx;
+            (void)stop;
+            return [entry[@"pending"] boolValue];
+        }];
+        [history removeObjectsAtIndexes:orphaned];
+        return [orphaned count] > 0;
+    });
+}
+
+/**
+ * Recount image references from history and pins, removing orphaned files
+ */
+void rebuildImageRefs(void) {
+    NSMutableArray *entries = clippy_history_entries_from_records(
+        clippy_log_read_records(clippy_history_log_path()));
+    [entries addObjectsFromArray:clippy_pins_load()];
+
+    NSUInteger removed = clippy_image_rebuild_refs(entries);
+    if (removed > 0) {
+        NSLog(@"clipd: Removed %lu unreferenced images", (unsigned long)removed);
     }
+}
 
-    clippy_write_json_array(history, clippy_history_path());
+// ============================================================================
+// Clipboard Capture
+// ============================================================================
+
+/**
+ * The type list is fetched once per change, and only representations it
+ * offers (and capture_types wants) are read: text first (most common), else
+ * an image, preferring PNG, which is stored without transcoding
+ */
+void captureClipboard(NSPasteboard *pasteboard, NSInteger changeCount) {
+    unsigned wanted = clippy_config.captureTypes;
+
+    CLIPPY_TRACE_BEGIN(PasteboardRead);
+    NSArray<NSPasteboardType> *types = [pasteboard types];
+    NSString *text = nil;
+    if ((wanted & CLIPPY_CAPTURE_TEXT) && [types containsObject:NSPasteboardTypeString]) {
+        text = [pasteboard stringForType:NSPasteboardTypeString];
+    }
+    CLIPPY_TRACE_END(PasteboardRead);
+    clippy_histogram_record(&stats.pasteboardRead, CLIPPY_TRACE_ELAPSED_US(PasteboardRead));
+
+    if (text) {
+        text = [text stringByTrimmingCharactersInSet:
+                [NSCharacterSet whitespaceAndNewlineCharacterSet]];
+
+        if ([text length] > 0) {
+            addTextToHistory(text, pasteboard, types);
+        }
+    }
+    // Check for image if no text (ingested off the poll thread)
+    else if ((wanted & CLIPPY_CAPTURE_IMAGE) &&
+             ([types containsObject:NSPasteboardTypePNG] || [types containsObject:NSPasteboardTypeTIFF])) {
+        enqueueImageCapture(pasteboard, changeCount, [types containsObject:NSPasteboardTypePNG]);
+    }
+}
+
+// ============================================================================
+// Poll Scheduler
+// ============================================================================
+
+/**
+ * The general pasteboard has no change notification, so clipd polls
+ * changeCount - but adaptively rather than at a fixed rate:
+ *   burst   poll_min_interval_ms for a few seconds after a change
+ *   active  poll_interval_ms once the burst window passes
+ *   idle    backs off geometrically up to poll_max_interval_ms
+ * App activation and wake from sleep snap back to the active interval.
+ * Timers carry tolerance so the kernel can coalesce wakeups.
+ */
+
+#define CLIPD_BURST_WINDOW_SEC  3.0
+#define CLIPD_IDLE_BACKOFF      1.5
+#define CLIPD_POLL_TOLERANCE    0.1   // fraction of the interval
+
+typedef struct {
+    NSTimeInterval interval;      // Current delay between polls
+    NSTimeInterval burstUntil;    // Poll at the minimum interval until then
+    NSTimeInterval startedAt;
+    unsigned long long wakeups;   // Polls since start
+    unsigned long long changes;   // Polls that saw a new changeCount
+} ClipdScheduler;
+
+static ClipdScheduler scheduler;
+static NSTimer *pollTimer = nil;
+static NSPasteboard *pasteboard = nil;
+static NSInteger lastChangeCount = 0;
+
+void pollPasteboard(void);
+
+void schedulePoll(NSTimeInterval delay) {
+    [pollTimer invalidate];
+    pollTimer = [NSTimer timerWithTimeInterval:delay repeats:NO block:^(NSTimer *timer) {
+        (void)timer;
+        pollPasteboard();
+    }];
+    pollTimer.tolerance = delay * CLIPD_POLL_TOLERANCE;
+    [[NSRunLoop currentRunLoop] addTimer:pollTimer forMode:NSDefaultRunLoopMode];
+}
+
+void pollPasteboard(void) {
+    @autoreleasepool {
+        NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+        NSTimeInterval minInterval = clippy_config.pollMinIntervalMs / 1000.0;
+        NSTimeInterval baseInterval = clippy_config.pollIntervalMs / 1000.0;
+        NSTimeInterval maxInterval = clippy_config.pollMaxIntervalMs / 1000.0;
+
+        scheduler.wakeups++;
+        NSInteger currentChangeCount = [pasteboard changeCount];
+
+        if (currentChangeCount != lastChangeCount) {
+            lastChangeCount = currentChangeCount;
+            scheduler.changes++;
+            captureClipboard(pasteboard, currentChangeCount);
+            scheduler.burstUntil = now + CLIPD_BURST_WINDOW_SEC;
+            scheduler.interval = minInterval;
+        } else if (now < scheduler.burstUntil) {
+            scheduler.interval = minInterval;
+        } else {
+            scheduler.interval = MIN(MAX(scheduler.interval * CLIPD_IDLE_BACKOFF, baseInterval),
+                                     maxInterval);
+        }
+
+        schedulePoll(scheduler.interval);
+    }
+}
+
+/**
+ * Drop back to the active interval if currently backed off
+ */
+void pollSoon(void) {
+    NSTimeInterval baseInterval = clippy_config.pollIntervalMs / 1000.0;
+    if (scheduler.interval > baseInterval) {
+        scheduler.interval = baseInterval;
+        schedulePoll(baseInterval);
+    }
+}
+
+void logSchedulerStats(void) {
+    NSTimeInterval uptime = [NSDate timeIntervalSinceReferenceDate] - scheduler.startedAt;
+    NSLog(@"clipd: Scheduler - interval=%.0fms, wakeups=%llu (%.1f/min), changes=%llu",
+          scheduler.interval * 1000.0, scheduler.wakeups,
+          uptime > 0 ? scheduler.wakeups / (uptime / 60.0) : 0.0,
+          scheduler.changes);
 }
 
 // ============================================================================
 // Cleanup
 // ============================================================================
 
+/**
+ * Expiry runs when the oldest entry (the last in history, the first pin)
+ * reaches max_age_days, not on a fixed interval: the timer is set for that
+ * moment and may fire up to cleanup_interval_sec late, so entries expiring
+ * close together go in one wakeup. The expired entries are a run at the old
+ * end of each collection, found by binary search, so a run with nothing to
+ * expire touches no files.
+ */
+
+static NSTimer *expiryTimer = nil;
+
 void runCleanup(void) {
-    NSUInteger historyRemoved = clippy_cleanup_old_entries(clippy_history_path());
-    NSUInteger pinsRemoved = clippy_cleanup_old_entries(clippy_pins_path());
+    CLIPPY_TRACE_BEGIN(Cleanup);
+    syncState();
+    NSTimeInterval cutoff = clippy_expiry_cutoff();
+    NSUInteger historyRemoved = 0;
+    NSUInteger pinsRemoved = 0;
+
+    NSUInteger boundary = clippy_expiry_boundary(history, cutoff, YES);
+    if (boundary < [history count]) {
+        flushHistoryRecords();
+        historyRemoved = clippy_history_expire(cutoff);
+        if (historyRemoved > 0) {
+            while ([history count] > boundary) {
+                removeHistoryEntry([history count] - 1);
+            }
+            recordAppend();
+        }
+    }
+
+    if (clippy_expiry_boundary(pins, cutoff, NO) > 0) {
+        pinsRemoved = clippy_pins_expire(cutoff);
+        pinsWritten();
+    }
+    CLIPPY_TRACE_END(Cleanup);
+    clippy_histogram_record(&stats.cleanup, CLIPPY_TRACE_ELAPSED_US(Cleanup));
 
     if (historyRemoved > 0 || pinsRemoved > 0) {
         NSLog(@"clipd: Cleanup - removed %lu history, %lu pins (older than %d days)",
               (unsigned long)historyRemoved, (unsigned long)pinsRemoved,
               clippy_config.maxAgeDays);
     }
+    scheduleExpiry();
+}
+
+void scheduleExpiry(void) {
+    NSNumber *oldestEntry = [history lastObject][@"timestamp"];
+    NSNumber *oldestPin = [pins firstObject][@"timestamp"];
+    if (!oldestEntry && !oldestPin) {
+        [expiryTimer invalidate];
+        expiryTimer = nil;
+        return;
+    }
+
+    // Something already due that a run couldn't remove: retry later, not in a loop
+    NSTimeInterval oldest = MIN(oldestEntry ? [oldestEntry doubleValue] : INFINITY,
+                                oldestPin ? [oldestPin doubleValue] : INFINITY);
+    NSTimeInterval due = oldest + clippy_config.maxAgeDays * 24 * 60 * 60;
+    NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+    if (due <= now) {
+        due = now + clippy_config.cleanupIntervalSec;
+    }
+
+    NSDate *fireDate = [NSDate dateWithTimeIntervalSince1970:due];
+    if (expiryTimer.valid && [expiryTimer.fireDate isEqualToDate:fireDate]) {
+        return;
+    }
+    [expiryTimer invalidate];
+    expiryTimer = [[NSTimer alloc] initWithFireDate:fireDate interval:0 repeats:NO block:^(NSTimer *timer) {
+        (void)timer;
+        @autoreleasepool {
+            runCleanup();
+            logSchedulerStats();
+        }
+    }];
+    expiryTimer.tolerance = clippy_config.cleanupIntervalSec;
+    [[NSRunLoop currentRunLoop] addTimer:expiryTimer forMode:NSDefaultRunLoopMode];
+}
+
+// ============================================================================
+// IPC Server
+// ============================================================================
+
+/**
+ * Line-delimited JSON over ~/.clippy_data/clipd.sock (protocol in
+ * clippy_ipc.h). Sockets are non-blocking and driven by dispatch sources on
+ * the main queue, so requests are serialized with capture and cleanup
+ * without any locking. Only the owning user may connect.
+ */
+
+#define CLIPD_MAX_PENDING_INPUT (1024 * 1024)  // Longest request line accepted
+
+@interface ClipdClient : NSObject
+@property (assign) int fd;
+@property (strong) dispatch_source_t readSource;
+@property (strong) dispatch_source_t writeSource;
+@property (assign) BOOL writing;           // writeSource resumed
+@property (assign) BOOL subscribed;
+@property (strong) NSMutableData *input;
+@property (strong) NSMutableData *output;
+@end
+
+@implementation ClipdClient
+@end
+
+static int listenFd = -1;
+static dispatch_source_t listenSource = nil;
+static NSMutableSet *clients = nil;
+
+void closeClient(ClipdClient *client) {
+    if (![clients containsObject:client]) {
+        return;
+    }
+    [clients removeObject:client];
+
+    if (!client.writing) {
+        dispatch_resume(client.writeSource);  // Suspended sources can't finish cancelling
+    }
+    dispatch_source_cancel(client.writeSource);
+    dispatch_source_cancel(client.readSource);  // The last cancel handler to run closes the fd
+}
+
+void flushClient(ClipdClient *client) {
+    if (!client) {
+        return;
+    }
+    NSMutableData *output = client.output;
+    while ([output length] > 0) {
+        ssize_t n = write(client.fd, [output bytes], [output length]);
+        if (n > 0) {
+            [output replaceBytesInRange:NSMakeRange(0, (NSUInteger)n) withBytes:NULL length:0];
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            closeClient(client);
+            return;
+        }
+    }
+
+    BOOL pending = [output length] > 0;
+    if (pending && !client.writing) {
+        client.writing = YES;
+        dispatch_resume(client.writeSource);
+    } else if (!pending && client.writing) {
+        client.writing = NO;
+        dispatch_suspend(client.writeSource);
+    }
+}
+
+void sendToClient(ClipdClient *client, NSDictionary *message) {
+    NSData *line = clippy_log_encode_record(message);
+    if (line) {
+        [client.output appendData:line];
+        flushClient(client);
+    }
+}
+
+void notifySubscribers(NSString *event) {
+    for (ClipdClient *client in [clients allObjects]) {
+        if (client.subscribed) {
+            sendToClient(client, @{@"event": event});
+        }
+    }
+}
+
+static NSDictionary *errorResponse(NSString *format, ...) NS_FORMAT_FUNCTION(1, 2);
+static NSDictionary *errorResponse(NSString *format, ...) {
+    va_list args;
+    va_start(args, format);
+    NSString *message = [[NSString alloc] initWithFormat:format arguments:args];
+    va_end(args);
+    return @{@"ok": @NO, @"error": message};
+}
+
+/**
+ * Resolve a 1-based "index" into a collection, reporting the valid range
+ */
+static NSDictionary *itemAtIndex(NSArray *items, NSDictionary *request, NSString *what,
+                                 NSDictionary **error) {
+    NSInteger index = [request[@"index"] integerValue];
+    if ([items count] == 0) {
+        *error = errorResponse(@"No %@.", what);
+        return nil;
+    }
+    if (index < 1 || index > (NSInteger)[items count]) {
+        *error = errorResponse(@"Invalid index %ld. Valid range: 1-%lu",
+                               (long)index, (unsigned long)[items count]);
+        return nil;
+    }
+    return items[index - 1];
+}
+
+/**
+ * The history entry a request names: by "id" when given, else by "index"
+ */
+static NSDictionary *historyItemForRequest(NSDictionary *request, NSDictionary **error) {
+    if (!request[@"id"]) {
+        return itemAtIndex(history, request, @"clipboard history", error);
+    }
+    NSDictionary *entry = historyById[@([request[@"id"] unsignedLongLongValue])];
+    if (!entry) {
+        *error = errorResponse(@"Entry no longer in history.");
+    }
+    return entry;
+}
+
+NSDictionary *handleRequest(ClipdClient *client, NSDictionary *request) {
+    syncState();
+
+    NSString *cmd = request[@"cmd"];
+    NSDictionary *error = nil;
+    stats.requests++;
+
+    if ([cmd isEqualToString:@"list"]) {
+        NSUInteger offset = MIN((NSUInteger)MAX([request[@"offset"] integerValue], 0), [history count]);
+        NSUInteger limit = [history count] - offset;
+        if ([request[@"limit"] integerValue] > 0) {
+            limit = MIN(limit, (NSUInteger)[request[@"limit"] integerValue]);
+        }
+        return @{@"ok": @YES,
+                 @"entries": [history subarrayWithRange:NSMakeRange(offset, limit)],
+                 @"total": @([history count])};
+    }
+
+    if ([cmd isEqualToString:@"pins"]) {
+        return @{@"ok": @YES, @"pins": pins};
+    }
+
+    if ([cmd isEqualToString:@"get"]) {
+        NSDictionary *entry = historyItemForRequest(request, &error);
+        return entry ? @{@"ok": @YES, @"entry": entry} : error;
+    }
+
+    if ([cmd isEqualToString:@"search"]) {
+        CLIPPY_TRACE_BEGIN(Search);
+        NSString *query = [request[@"query"] lowercaseString] ?: @"";
+        NSMutableData *candidates = [NSMutableData data];
+        BOOL indexed = historyIndexValid &&
+                       clippy_trigram_index_candidates(&historyIndex, query, candidates);
+        const NSUInteger *positions = [candidates bytes];
+        NSUInteger count = indexed ? [candidates length] / sizeof(NSUInteger) : [history count];
+
+        // Trigrams only narrow the search; each candidate is still checked
+        NSMutableArray *results = [NSMutableArray array];
+        for (NSUInteger n = 0; n < count; n++) {
+            NSUInteger i = indexed ? positions[n] : n;
+            NSDictionary *entry = history[i];
+            if ([[entry[@"text"] lowercaseString] containsString:query]) {
+                [results addObject:@{@"index": @(i + 1), @"entry": entry}];
+            }
+        }
+        CLIPPY_TRACE_END(Search);
+        clippy_histogram_record(&stats.search, CLIPPY_TRACE_ELAPSED_US(Search));
+        return @{@"ok": @YES, @"results": results};
+    }
+
+    if ([cmd isEqualToString:@"pin"]) {
+        NSDictionary *entry = historyItemForRequest(request, &error);
+        if (!entry) {
+            return error;
+        }
+
+        NSString *reason = nil;
+        NSInteger count = clippy_pins_add(entry, request[@"label"], &reason);
+        pinsWritten();
+        if (count < 0) {
+            return errorResponse(@"%@", reason);
+        }
+        return @{@"ok": @YES, @"count": @(count), @"entry": entry};
+    }
+
+    if ([cmd isEqualToString:@"unpin"]) {
+        NSDictionary *removed = nil;
+        if (request[@"id"]) {
+            uint64_t pinId = [request[@"id"] unsignedLongLongValue];
+            if (clippy_index_of_entry_id(pins, pinId) == NSNotFound) {
+                return errorResponse(@"Pin no longer exists.");
+            }
+            removed = clippy_pins_remove(NSNotFound, pinId);
+        } else if (itemAtIndex(pins, request, @"pinned items", &error)) {
+            removed = clippy_pins_remove((NSUInteger)[request[@"index"] integerValue] - 1, 0);
+        } else {
+            return error;
+        }
+        pinsWritten();
+        return removed ? @{@"ok": @YES, @"pin": removed} : errorResponse(@"Failed to update pins.");
+    }
+
+    if ([cmd isEqualToString:@"delete"]) {
+        uint64_t entryId = [request[@"id"] unsignedLongLongValue];
+        NSUInteger idx = historyIndexOfId(entryId);
+        if (idx == NSNotFound) {
+            return errorResponse(@"Entry no longer in history.");
+        }
+
+        NSDictionary *entry = history[idx];
+        queueHistoryRecord(clippy_history_remove_record(entryId));
+        releaseAfterFlush(clippy_entry_stored_paths(entry));
+        removeHistoryEntry(idx);
+        recordAppend();
+        return @{@"ok": @YES};
+    }
+
+    if ([cmd isEqualToString:@"use"]) {
+        NSDictionary *entry = historyItemForRequest(request, &error);
+        if (!entry) {
+            return error;
+        }
+
+        NSDictionary *record = clippy_history_use_record(clippy_entry_id(entry), [[NSDate date] timeIntervalSince1970]);
+        NSDictionary *used = clippy_history_updated_entry(entry, record);
+        queueHistoryRecord(record);
+        replaceHistoryEntry(historyIndexOfId(clippy_entry_id(entry)), used);
+        stats.uses++;
+        recordAppend();
+        return @{@"ok": @YES, @"frecency": used[@"frecency"]};
+    }
+
+    if ([cmd isEqualToString:@"clear"]) {
+        flushHistoryRecords();  // So clearing releases what they reference
+        BOOL cleared = clippy_history_clear();
+        [pendingReleases removeAllObjects];  // Left over from a failed flush; the clear released them
+        clearHistoryState();
+        historyWritten(YES);
+        return @{@"ok": @YES, @"cleared": @(cleared)};
+    }
+
+    if ([cmd isEqualToString:@"stats"]) {
+        return statsResponse();
+    }
+
+    if ([cmd isEqualToString:@"report"]) {
+        if ([request[@"metric"] isEqual:@"picker_open"] && [request[@"us"] isKindOfClass:[NSNumber class]]) {
+            clippy_histogram_record(&stats.pickerOpen, [request[@"us"] unsignedLongLongValue]);
+            return @{@"ok": @YES};
+        }
+        if ([request[@"metric"] isEqual:@"picker_search"] && [request[@"us"] isKindOfClass:[NSNumber class]]) {
+            clippy_histogram_record(&stats.pickerSearch, [request[@"us"] unsignedLongLongValue]);
+            return @{@"ok": @YES};
+        }
+        if ([request[@"metric"] isEqual:@"picker_memory"] && [request[@"bytes"] isKindOfClass:[NSNumber class]]) {
+            stats.pickerModelBytes = [request[@"bytes"] unsignedLongLongValue];
+            stats.pickerFootprint = [request[@"footprint"] unsignedLongLongValue];
+            return @{@"ok": @YES};
+        }
+        return errorResponse(@"Unknown metric.");
+    }
+
+    if ([cmd isEqualToString:@"subscribe"]) {
+        client.subscribed = YES;
+        return @{@"ok": @YES};
+    }
+
+    return errorResponse(@"Unknown command: %@", cmd ?: @"(none)");
+}
+
+void readFromClient(ClipdClient *client) {
+    if (!client) {
+        return;
+    }
+    char chunk[CLIPPY_IPC_READ_CHUNK];
+    ssize_t n = read(client.fd, chunk, sizeof(chunk));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        closeClient(client);
+        return;
+    }
+    [client.input appendBytes:chunk length:(NSUInteger)n];
+
+    for (;;) {
+        BOOL complete = NO;
+        NSDictionary *request = clippy_ipc_take_message(client.input, &complete);
+        if (!complete) {
+            break;
+        }
+        @autoreleasepool {
+            sendToClient(client, request ? handleRequest(client, request)
+                                         : errorResponse(@"Malformed request."));
+        }
+        if (![clients containsObject:client]) {
+            return;
+        }
+    }
+
+    if ([client.input length] > CLIPD_MAX_PENDING_INPUT) {
+        NSLog(@"clipd: Dropping client with oversized request");
+        closeClient(client);
+    }
+}
+
+void acceptClients(void) {
+    for (;;) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            return;  // EAGAIN: no more pending connections
+        }
+
+        uid_t uid;
+        gid_t gid;
+        if (getpeereid(fd, &uid, &gid) != 0 || uid != getuid()) {
+            close(fd);
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        ClipdClient *client = [[ClipdClient alloc] init];
+        client.fd = fd;
+        client.input = [NSMutableData data];
+        client.output = [NSMutableData data];
+        client.readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t)fd, 0,
+                                                   dispatch_get_main_queue());
+        client.writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, (uintptr_t)fd, 0,
+                                                    dispatch_get_main_queue());
+
+        __weak ClipdClient *weakClient = client;
+        dispatch_source_set_event_handler(client.readSource, ^{
+            readFromClient(weakClient);
+        });
+        dispatch_source_set_event_handler(client.writeSource, ^{
+            flushClient(weakClient);
+        });
+
+        // Both sources watch the fd, so it stays open until both have
+        // finished cancelling (the handlers run on the main queue)
+        __block int watchingSources = 2;
+        dispatch_block_t sourceCancelled = ^{
+            if (--watchingSources == 0) {
+                close(fd);
+            }
+        };
+        dispatch_source_set_cancel_handler(client.readSource, sourceCancelled);
+        dispatch_source_set_cancel_handler(client.writeSource, sourceCancelled);
+
+        [clients addObject:client];
+        dispatch_resume(client.readSource);  // writeSource stays suspended until output backs up
+    }
+}
+
+/**
+ * Bind the socket; NO if another clipd already answers on it
+ */
+BOOL startIPCServer(void) {
+    struct sockaddr_un addr;
+    if (!clippy_ensure_data_dir() || !clippy_socket_address(&addr)) {
+        NSLog(@"clipd: IPC disabled (socket path unavailable)");
+        return YES;
+    }
+
+    int existing = clippy_ipc_connect();
+    if (existing >= 0) {
+        close(existing);
+        NSLog(@"clipd: Another clipd is already running");
+        return NO;
+    }
+    unlink(addr.sun_path);  // Stale socket from a previous run
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listenFd, 16) != 0) {
+        NSLog(@"clipd: IPC disabled (%s)", strerror(errno));
+        if (listenFd >= 0) {
+            close(listenFd);
+            listenFd = -1;
+        }
+        return YES;
+    }
+    chmod(addr.sun_path, S_IRUSR | S_IWUSR);
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+
+    clients = [NSMutableSet set];
+    listenSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t)listenFd, 0,
+                                          dispatch_get_main_queue());
+    dispatch_source_set_event_handler(listenSource, ^{
+        acceptClients();
+    });
+    int fd = listenFd;
+    dispatch_source_set_cancel_handler(listenSource, ^{
+        close(fd);
+    });
+    dispatch_resume(listenSource);
+
+    NSLog(@"clipd: Serving history on %@", clippy_socket_path());
+    return YES;
+}
+
+void stopIPCServer(void) {
+    if (listenFd < 0) {
+        return;
+    }
+    for (ClipdClient *client in [clients allObjects]) {
+        closeClient(client);
+    }
+    dispatch_source_cancel(listenSource);  // Its cancel handler closes listenFd
+    listenFd = -1;
+    unlink([clippy_socket_path() fileSystemRepresentation]);
 }
 
 // ============================================================================
@@ -135,15 +1454,20 @@ int main(int argc, const char *argv[]) {
                 printf("  -h, --help     Show this help message\n");
                 printf("  --foreground   Run in foreground (default)\n\n");
                 printf("Files:\n");
-                printf("  ~/.clipboard_history   History storage\n");
-                printf("  ~/.clipboard_pins      Pinned items\n");
-                printf("  ~/.clippy.conf         Configuration (optional)\n\n");
+                printf("  ~/.clippy_data/history.log  History storage (append-only log)\n");
+                printf("  ~/.clippy_data/clipd.sock   Socket serving history to clippy and the picker\n");
+                printf("  ~/.clipboard_history        Legacy history (imported on first run)\n");
+                printf("  ~/.clipboard_pins           Pinned items\n");
+                printf("  ~/.clippy.conf              Configuration (optional)\n\n");
                 printf("Config file format (key=value):\n");
                 printf("  poll_interval_ms = %d\n", CLIPPY_DEFAULT_POLL_INTERVAL_MS);
+                printf("  poll_min_interval_ms = %d\n", CLIPPY_DEFAULT_POLL_MIN_INTERVAL_MS);
+                printf("  poll_max_interval_ms = %d\n", CLIPPY_DEFAULT_POLL_MAX_INTERVAL_MS);
                 printf("  max_history_items = %d\n", CLIPPY_DEFAULT_MAX_HISTORY_ITEMS);
                 printf("  max_pins = %d\n", CLIPPY_DEFAULT_MAX_PINS);
                 printf("  max_entry_length = %d\n", CLIPPY_DEFAULT_MAX_ENTRY_LENGTH);
                 printf("  max_age_days = %d\n", CLIPPY_DEFAULT_MAX_AGE_DAYS);
+                printf("  max_memory_mb = %d\n", CLIPPY_DEFAULT_MAX_MEMORY_MB);
                 return 0;
             }
         }
@@ -151,76 +1475,68 @@ int main(int argc, const char *argv[]) {
         // Load configuration
         clippy_load_config();
 
+        // Keep the scheduler bounds ordered: min <= base <= max
+        clippy_config.pollMinIntervalMs = MIN(clippy_config.pollMinIntervalMs, clippy_config.pollIntervalMs);
+        clippy_config.pollMaxIntervalMs = MAX(clippy_config.pollMaxIntervalMs, clippy_config.pollIntervalMs);
+
         // Setup signal handlers
-        signal(SIGINT, signalHandler);
-        signal(SIGTERM, signalHandler);
+        sigintSource = installSignalSource(SIGINT);
+        sigtermSource = installSignalSource(SIGTERM);
 
         NSLog(@"clipd: Starting clipboard monitoring daemon");
-        NSLog(@"clipd: Config - poll=%dms, max_history=%d, max_age=%d days",
+        stats.startedAt = [NSDate timeIntervalSinceReferenceDate];
+        NSLog(@"clipd: Config - poll=%d/%d/%dms (burst/active/idle), max_history=%d, max_age=%d days",
+              clippy_config.pollMinIntervalMs,
               clippy_config.pollIntervalMs,
+              clippy_config.pollMaxIntervalMs,
               clippy_config.maxHistoryItems,
               clippy_config.maxAgeDays);
 
-        // Run cleanup on startup
+        // Start from a compacted log, then expire what aged out while stopped
+        dropOrphanedPlaceholders();
+        rebuildImageRefs();
+        loadHistoryState();
+        loadPinsState();
         runCleanup();
+        setupImageQueue();
 
-        NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
-        NSInteger lastChangeCount = [pasteboard changeCount];
-        NSTimeInterval lastCleanup = [[NSDate date] timeIntervalSince1970];
+        if (!startIPCServer()) {
+            return 1;
+        }
 
-        // Main polling loop
-        while (running) {
-            @autoreleasepool {
-                NSInteger currentChangeCount = [pasteboard changeCount];
-
-                if (currentChangeCount != lastChangeCount) {
-                    lastChangeCount = currentChangeCount;
-
-                    // Check for text first (most common)
-                    NSString *text = [pasteboard stringForType:NSPasteboardTypeString];
-                    if (text) {
-                        text = [text stringByTrimmingCharactersInSet:
-                                [NSCharacterSet whitespaceAndNewlineCharacterSet]];
-
-                        if ([text length] > 0) {
-                            addTextToHistory(text);
-                        }
-                    }
-                    // Check for image if no text
-                    else {
-                        NSData *pngData = [pasteboard dataForType:NSPasteboardTypePNG];
-                        if (pngData) {
-                            addImageToHistory(pngData);
-                        } else {
-                            // Try TIFF format (macOS screenshots)
-                            NSData *tiffData = [pasteboard dataForType:NSPasteboardTypeTIFF];
-                            if (tiffData) {
-                                // Convert TIFF to PNG for consistent storage
-                                NSBitmapImageRep *imageRep = [NSBitmapImageRep imageRepWithData:tiffData];
-                                if (imageRep) {
-                                    NSData *pngConverted = [imageRep representationUsingType:NSBitmapImageFileTypePNG
-                                                                                  properties:@{}];
-                                    if (pngConverted) {
-                                        addImageToHistory(pngConverted);
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
+        pasteboard = [NSPasteboard generalPasteboard];
+        lastChangeCount = [pasteboard changeCount];
 
-                // Periodic cleanup
-                NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
-                if (now - lastCleanup >= clippy_config.cleanupIntervalSec) {
-                    runCleanup();
-                    lastCleanup = now;
-                }
+        // Switching apps or waking from sleep usually precedes a copy
+        NSNotificationCenter *workspaceCenter = [[NSWorkspace sharedWorkspace] notificationCenter];
+        for (NSNotificationName name in @[NSWorkspaceDidActivateApplicationNotification,
+                                          NSWorkspaceDidWakeNotification]) {
+            [workspaceCenter addObserverForName:name
+                                         object:nil
+                                          queue:nil
+                                     usingBlock:^(NSNotification *note) {
+                (void)note;
+                pollSoon();
+            }];
+        }
 
-                // Sleep for poll interval
-                [NSThread sleepForTimeInterval:(clippy_config.pollIntervalMs / 1000.0)];
+        scheduler.interval = clippy_config.pollIntervalMs / 1000.0;
+        scheduler.startedAt = [NSDate timeIntervalSinceReferenceDate];
+        schedulePoll(scheduler.interval);
+
+        // Sleep in the run loop until a timer, workspace event or signal arrives
+        while (running) {
+            @autoreleasepool {
+                [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+                                         beforeDate:[NSDate distantFuture]];
             }
         }
 
+        flushHistoryRecords();
+        [pollTimer invalidate];
+        [expiryTimer invalidate];
+        stopIPCServer();
+        logSchedulerStats();
         NSLog(@"clipd: Shutting down gracefully");
     }
     return 0;
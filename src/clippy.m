@@ -3,39 +3,65 @@
  *
  * Access clipboard history saved by clipd daemon.
  *
- * Build: clang -framework AppKit -framework Foundation -Iinclude -o clippy clippy.m
+ * Build: clang -framework AppKit -framework Foundation -lcompression -Iinclude -o clippy clippy.m
  */
 
 #import <AppKit/AppKit.h>
 #import <Foundation/Foundation.h>
 #include "clippy_common.h"
+#include "clippy_ipc.h"
+#include "clippy_search.h"
 
 // ============================================================================
 // Clipboard Operations
 // ============================================================================
 
-void copyTextToClipboard(NSString *text) {
+/**
+ * Put text on the pasteboard along with the other representations the
+ * entry kept (rich text, HTML, copied files), if any
+ */
+void copyTextToClipboard(NSString *text, NSDictionary *entry) {
+    NSPasteboardItem *item = [[NSPasteboardItem alloc] init];
+    NSMutableArray *items = [NSMutableArray arrayWithObject:item];
+
+    NSArray *files = [entry[@"files"] isKindOfClass:[NSArray class]] ? entry[@"files"] : @[];
+    for (NSUInteger i = 0; i < [files count]; i++) {
+        NSPasteboardItem *fileItem = i == 0 ? item : [[NSPasteboardItem alloc] init];
+        [fileItem setString:[[NSURL fileURLWithPath:files[i]] absoluteString] forType:NSPasteboardTypeFileURL];
+        if (i > 0) {
+            [items addObject:fileItem];
+        }
+    }
+    [clippy_rep_types() enumerateKeysAndObjectsUsingBlock:^(NSString *rep, NSString *type, BOOL *stop) {
+        (void)stop;
+        NSData *data = clippy_entry_rep_data(entry, rep);
+        if (data) {
+            [item setData:data forType:type];
+        }
+    }];
+    [item setString:text forType:NSPasteboardTypeString];
+
     NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
     [pasteboard clearContents];
-    [pasteboard setString:text forType:NSPasteboardTypeString];
+    [pasteboard writeObjects:items];
 }
 
+/**
+ * Hand the stored PNG to the pasteboard as is: mapped, never decoded
+ * (clippy exits right away, so it can't promise the data like the picker)
+ */
 void copyImageToClipboard(NSString *imagePath) {
-    NSData *imageData = [NSData dataWithContentsOfFile:imagePath];
+    NSData *imageData = [NSData dataWithContentsOfFile:imagePath options:NSDataReadingMappedIfSafe error:nil];
     if (!imageData) {
         fprintf(stderr, "Error: Could not read image file: %s\n", [imagePath UTF8String]);
         return;
     }
 
-    NSImage *image = [[NSImage alloc] initWithData:imageData];
-    if (!image) {
-        fprintf(stderr, "Error: Could not create image from data\n");
-        return;
-    }
-
     NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
     [pasteboard clearContents];
-    [pasteboard writeObjects:@[image]];
+    if (![pasteboard setData:imageData forType:NSPasteboardTypePNG]) {
+        fprintf(stderr, "Error: Could not copy image to clipboard\n");
+    }
 }
 
 // ============================================================================
@@ -48,15 +74,21 @@ void printUsage(void) {
     printf("  clippy list [N]        Show last N history items (default: 10)\n");
     printf("  clippy get <N>         Copy history item N to clipboard\n");
     printf("  clippy search <Q>      Search history for text\n");
+    printf("  clippy search -f <Q>   Fuzzy search, best matches first (--fuzzy)\n");
     printf("  clippy clear           Clear all clipboard history\n");
-    printf("  clippy raw <N>         Print history item N (for scripting)\n\n");
+    printf("  clippy raw <N>         Print history item N (for scripting)\n");
+    printf("  clippy export [FILE]   Export history as JSON (default: ~/.clipboard_history)\n");
+    printf("  clippy import <FILE>   Merge history from a JSON export\n\n");
     printf("Pin Commands:\n");
     printf("  clippy pin <N> [label] Pin history item N (optional label)\n");
     printf("  clippy pins            List all pinned items\n");
     printf("  clippy paste <N>       Copy pinned item N to clipboard\n");
     printf("  clippy unpin <N>       Remove pinned item N\n\n");
     printf("Configuration:\n");
-    printf("  clippy config          Show current configuration\n\n");
+    printf("  clippy config          Show current configuration\n");
+    printf("  clippy stats [--json]  Show clipd counters and latencies\n\n");
+    printf("Scripting:\n");
+    printf("  clippy --batch         Run commands from stdin, one per line, with framed output\n\n");
     printf("Examples:\n");
     printf("  clippy list            Show last 10 clipboard items\n");
     printf("  clippy get 1           Copy most recent item\n");
@@ -65,12 +97,83 @@ void printUsage(void) {
     printf("  clippy paste 1         Copy first pinned item\n");
 }
 
+// ============================================================================
+// Data Access
+// ============================================================================
+
+/**
+ * Reads and writes go through clipd's socket when it is running (no parsing
+ * of the files, no racing its captures) and fall back to the files otherwise
+ */
+
+// Set by --batch: history read from the files is kept between commands
+static BOOL batchMode = NO;
+static NSArray *cachedHistory = nil;
+static ClippyFileStamp cachedHistoryStamp;
+
+/**
+ * All of history from the files; in batch mode reloaded only when the
+ * log's stamp changes (a capture, or an edit by this or another process)
+ */
+NSArray *historyFromFiles(void) {
+    if (!batchMode) {
+        return clippy_history_load();
+    }
+    ClippyFileStamp stamp = clippy_file_stamp(clippy_history_log_path());
+    if (!cachedHistory || !clippy_file_stamp_equal(stamp, cachedHistoryStamp)) {
+        cachedHistory = clippy_history_load();
+        cachedHistoryStamp = stamp;
+    }
+    return cachedHistory;
+}
+
+/**
+ * Entries [start, start + limit) of history (limit 0 for the rest) and the
+ * total; the files are only read as far as needed (see clippy_log_read_range)
+ */
+NSArray *loadHistory(NSUInteger start, NSInteger limit, NSUInteger *total) {
+    NSDictionary *response = clippy_ipc_request(@{@"cmd": @"list", @"offset": @(start), @"limit": @(limit)});
+    if ([response[@"ok"] boolValue]) {
+        *total = [response[@"total"] unsignedIntegerValue];
+        return response[@"entries"];
+    }
+    if (!batchMode) {
+        return clippy_history_read_range(start, (NSUInteger)MAX(limit, 0), total);
+    }
+
+    NSArray *history = historyFromFiles();
+    *total = [history count];
+    NSUInteger first = MIN(start, *total);
+    NSUInteger length = limit > 0 ? MIN((NSUInteger)limit, *total - first) : *total - first;
+    return [history subarrayWithRange:NSMakeRange(first, length)];
+}
+
+/**
+ * Count a paste of entry toward its frecency; an entry clipd no longer has
+ * is simply not counted
+ */
+void recordUse(NSDictionary *entry) {
+    uint64_t entryId = clippy_entry_id(entry);
+    if (!clippy_ipc_request(@{@"cmd": @"use", @"id": @(entryId)})) {
+        clippy_history_record_use(entryId);
+    }
+}
+
+NSArray *loadPins(void) {
+    NSDictionary *response = clippy_ipc_request(@{@"cmd": @"pins"});
+    if ([response[@"ok"] boolValue]) {
+        return response[@"pins"];
+    }
+    return clippy_pins_load();
+}
+
 // ============================================================================
 // History Commands
 // ============================================================================
 
 int cmdList(int count) {
-    NSArray *history = clippy_read_json_array(clippy_history_path());
+    NSUInteger total = 0;
+    NSArray *history = loadHistory(0, count, &total);
 
     if ([history count] == 0) {
         printf("No clipboard history.\n");
@@ -80,7 +183,7 @@ int cmdList(int count) {
 
     NSInteger showCount = MIN(count, (int)[history count]);
     printf("Clipboard History (showing %ld of %lu):\n\n",
-           (long)showCount, (unsigned long)[history count]);
+           (long)showCount, (unsigned long)total);
 
     for (NSInteger i = 0; i < showCount; i++) {
         NSDictionary *entry = history[i];
@@ -105,24 +208,29 @@ int cmdList(int count) {
 }
 
 int cmdGet(int index) {
-    NSArray *history = clippy_read_json_array(clippy_history_path());
+    NSUInteger total = 0;
+    NSArray *history = loadHistory((NSUInteger)MAX(index, 1) - 1, 1, &total);
 
-    if ([history count] == 0) {
+    if (total == 0) {
         fprintf(stderr, "Error: No clipboard history.\n");
         return 1;
     }
 
-    if (index < 1 || index > (int)[history count]) {
+    if (index < 1 || [history count] == 0) {
         fprintf(stderr, "Error: Invalid index %d. Valid range: 1-%lu\n",
-                index, (unsigned long)[history count]);
+                index, (unsigned long)total);
         return 1;
     }
 
-    NSDictionary *entry = history[index - 1];
+    NSDictionary *entry = history[0];
     NSString *type = entry[@"type"] ?: @"text";
 
     if ([type isEqualToString:@"image"]) {
         NSString *path = entry[@"path"];
+        if ([entry[@"pending"] boolValue]) {
+            fprintf(stderr, "Error: Image is still being processed.\n");
+            return 1;
+        }
         if (![[NSFileManager defaultManager] fileExistsAtPath:path]) {
             fprintf(stderr, "Error: Image file not found: %s\n", [path UTF8String]);
             return 1;
@@ -130,57 +238,38 @@ int cmdGet(int index) {
         copyImageToClipboard(path);
         printf("Copied image to clipboard: %s\n", [entry[@"text"] UTF8String]);
     } else {
-        NSString *text = entry[@"text"];
-        copyTextToClipboard(text);
+        NSString *text = clippy_entry_full_text(entry);
+        copyTextToClipboard(text, entry);
         printf("Copied to clipboard: %s\n", [clippy_preview_text(text) UTF8String]);
     }
 
+    recordUse(entry);
     return 0;
 }
 
 int cmdRaw(int index) {
-    NSArray *history = clippy_read_json_array(clippy_history_path());
+    NSUInteger total = 0;
+    NSArray *history = loadHistory((NSUInteger)MAX(index, 1) - 1, 1, &total);
 
-    if (index < 1 || index > (int)[history count]) {
+    if (index < 1 || [history count] == 0) {
         return 1;
     }
 
-    NSDictionary *entry = history[index - 1];
-    NSString *text = entry[@"text"];
+    NSDictionary *entry = history[0];
+    NSString *text = clippy_entry_full_text(entry);
 
     printf("%s", [text UTF8String]);
     return 0;
 }
 
 int cmdClear(void) {
-    NSFileManager *fm = [NSFileManager defaultManager];
-    NSError *error = nil;
-    BOOL clearedSomething = NO;
-
-    // Remove history file
-    NSString *historyPath = clippy_history_path();
-    if ([fm fileExistsAtPath:historyPath]) {
-        if ([fm removeItemAtPath:historyPath error:&error]) {
-            clearedSomething = YES;
-        } else {
-            fprintf(stderr, "Error: Failed to clear history: %s\n",
-                    [[error localizedDescription] UTF8String]);
-        }
-    }
-
-    // Remove backup file
-    NSString *backupPath = [historyPath stringByAppendingString:@".backup"];
-    if ([fm fileExistsAtPath:backupPath]) {
-        [fm removeItemAtPath:backupPath error:nil];
-    }
-
-    // Remove images directory
-    NSString *imagesPath = clippy_images_dir();
-    if ([fm fileExistsAtPath:imagesPath]) {
-        if ([fm removeItemAtPath:imagesPath error:&error]) {
-            clearedSomething = YES;
-            printf("Cleared stored images.\n");
-        }
+    // Images are released with their entries; pinned images survive
+    BOOL clearedSomething;
+    NSDictionary *response = clippy_ipc_request(@{@"cmd": @"clear"});
+    if ([response[@"ok"] boolValue]) {
+        clearedSomething = [response[@"cleared"] boolValue];
+    } else {
+        clearedSomething = clippy_history_clear();
     }
 
     if (clearedSomething) {
@@ -192,14 +281,41 @@ int cmdClear(void) {
     }
 }
 
-int cmdSearch(NSString *query) {
-    NSArray *history = clippy_read_json_array(clippy_history_path());
+int cmdExport(NSString *path) {
+    if (!clippy_history_export_json(path)) {
+        fprintf(stderr, "Error: Failed to export history to %s\n", [path UTF8String]);
+        return 1;
+    }
+    printf("Exported history to %s\n", [path UTF8String]);
+    return 0;
+}
 
-    if ([history count] == 0) {
-        printf("No clipboard history to search.\n");
-        return 0;
+int cmdImport(NSString *path) {
+    if (![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+        fprintf(stderr, "Error: File not found: %s\n", [path UTF8String]);
+        return 1;
+    }
+
+    // Written straight to the log; a running clipd notices and reloads
+    NSInteger imported = clippy_history_import_json(path);
+    if (imported < 0) {
+        fprintf(stderr, "Error: Failed to import history from %s\n", [path UTF8String]);
+        return 1;
     }
+    printf("Imported %ld entries from %s\n", (long)imported, [path UTF8String]);
+    return 0;
+}
 
+/**
+ * Case-insensitive substring matches as [{index, entry}]
+ */
+NSArray *searchHistory(NSString *query) {
+    NSDictionary *response = clippy_ipc_request(@{@"cmd": @"search", @"query": query});
+    if ([response[@"ok"] boolValue]) {
+        return response[@"results"];
+    }
+
+    NSArray *history = historyFromFiles();
     query = [query lowercaseString];
     NSMutableArray *results = [NSMutableArray array];
 
@@ -211,6 +327,98 @@ int cmdSearch(NSString *query) {
             [results addObject:@{@"index": @(i + 1), @"entry": entry}];
         }
     }
+    return results;
+}
+
+static NSArray *indexedHistory = nil;
+static ClippySearchIndex *cachedSearchIndex = NULL;
+
+/**
+ * Search index over history, kept and reused while history is unchanged
+ * (which only happens across commands in batch mode)
+ */
+ClippySearchIndex *searchIndexFor(NSArray *history) {
+    if (cachedSearchIndex && [history isEqualToArray:indexedHistory]) {
+        return cachedSearchIndex;
+    }
+    clippy_search_index_free(cachedSearchIndex);
+    cachedSearchIndex = clippy_search_index_create(history);
+    indexedHistory = cachedSearchIndex ? history : nil;
+
+    NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+    for (NSUInteger i = 0; cachedSearchIndex && i < cachedSearchIndex->count; i++) {
+        cachedSearchIndex->entries[i].boost = clippy_frecency_boost(history[i], now);
+    }
+    return cachedSearchIndex;
+}
+
+/**
+ * Fuzzy matches as [{index, entry}], best first, scored by the picker's
+ * matcher with the same frecency boost
+ */
+NSArray *fuzzySearchHistory(NSString *query) {
+    NSUInteger total = 0;
+    NSArray *history = loadHistory(0, 0, &total);
+    ClippySearchIndex *index = searchIndexFor(history);
+    ClippySearchHit *hits = index ? malloc(MAX(index->count, (NSUInteger)1) * sizeof(ClippySearchHit)) : NULL;
+    if (!hits) {
+        return @[];
+    }
+
+    ClippySearchQuery searchQuery;
+    clippy_search_query_init(&searchQuery, query);
+    clippy_search_query_prepare(&searchQuery, index);
+
+    NSUInteger hitCount = 0;
+    for (NSUInteger slot = 0; slot < index->count; slot++) {
+        FuzzyMatchResult match = clippy_search_match_ranked(&searchQuery, &index->entries[slot]);
+        if (match.matches) {
+            hits[hitCount++] = (ClippySearchHit){match.score, slot};
+        }
+    }
+    qsort(hits, hitCount, sizeof(ClippySearchHit), clippy_search_hit_compare);
+
+    NSMutableArray *results = [NSMutableArray arrayWithCapacity:hitCount];
+    for (NSUInteger i = 0; i < hitCount; i++) {
+        [results addObject:@{@"index": @(hits[i].slot + 1), @"entry": history[hits[i].slot]}];
+    }
+
+    clippy_search_query_free(&searchQuery);
+    free(hits);
+    return results;
+}
+
+/**
+ * Bold the matched chars of a preview when printing to a terminal
+ * Matches that fall past the preview (or shift under case folding) are left plain
+ */
+NSString *highlightMatches(NSString *preview, NSString *query) {
+    NSMutableIndexSet *positions = [NSMutableIndexSet indexSet];
+    if (!isatty(STDOUT_FILENO) ||
+        [[preview lowercaseString] length] != [preview length] ||
+        !clippy_fuzzy_match_positions(query, preview, positions).matches) {
+        return preview;
+    }
+
+    NSMutableString *highlighted = [NSMutableString string];
+    __block NSUInteger cursor = 0;
+    [positions enumerateIndexesUsingBlock:^(NSUInteger idx, BOOL *stop) {
+        (void)stop;
+        if (idx < cursor) {
+            return;  // Inside a character already bolded
+        }
+        NSRange character = [preview rangeOfComposedCharacterSequenceAtIndex:idx];
+        [highlighted appendString:[preview substringWithRange:NSMakeRange(cursor, character.location - cursor)]];
+        [highlighted appendFormat:@"\033[1m%@\033[0m", [preview substringWithRange:character]];
+        cursor = NSMaxRange(character);
+    }];
+    [highlighted appendString:[preview substringFromIndex:cursor]];
+    return highlighted;
+}
+
+int cmdSearch(NSString *query, BOOL fuzzy) {
+    NSArray *results = fuzzy ? fuzzySearchHistory(query) : searchHistory(query);
+    query = [query lowercaseString];
 
     if ([results count] == 0) {
         printf("No results found for '%s'.\n", [query UTF8String]);
@@ -228,6 +436,9 @@ int cmdSearch(NSString *query) {
 
         NSString *timeStr = clippy_format_timestamp(timestamp);
         NSString *preview = clippy_preview_text(text);
+        if (fuzzy) {
+            preview = highlightMatches(preview, query);
+        }
 
         printf("  %2ld. [%s] %s\n", (long)index, [timeStr UTF8String], [preview UTF8String]);
     }
@@ -241,67 +452,56 @@ int cmdSearch(NSString *query) {
 // ============================================================================
 
 int cmdPin(int historyIndex, NSString *label) {
-    NSArray *history = clippy_read_json_array(clippy_history_path());
-
-    if ([history count] == 0) {
-        fprintf(stderr, "Error: No clipboard history.\n");
-        return 1;
-    }
-
-    if (historyIndex < 1 || historyIndex > (int)[history count]) {
-        fprintf(stderr, "Error: Invalid history index %d. Valid range: 1-%lu\n",
-                historyIndex, (unsigned long)[history count]);
-        return 1;
+    NSMutableDictionary *request = [@{@"cmd": @"pin", @"index": @(historyIndex)} mutableCopy];
+    if (label) {
+        request[@"label"] = label;
     }
 
-    NSDictionary *historyEntry = history[historyIndex - 1];
-    NSString *text = historyEntry[@"text"];
+    NSDictionary *historyEntry = nil;
+    NSInteger count = -1;
+    NSString *error = nil;
 
-    NSMutableArray *pins = clippy_read_json_array(clippy_pins_path());
+    NSDictionary *response = clippy_ipc_request(request);
+    if (response) {
+        historyEntry = response[@"entry"];
+        count = [response[@"ok"] boolValue] ? [response[@"count"] integerValue] : -1;
+        error = response[@"error"];
+    } else {
+        NSUInteger total = 0;
+        NSArray *history = loadHistory((NSUInteger)MAX(historyIndex, 1) - 1, 1, &total);
 
-    // Check pin limit
-    if ((int)[pins count] >= clippy_config.maxPins) {
-        fprintf(stderr, "Error: Pin limit reached (%d). Unpin some items first.\n",
-                clippy_config.maxPins);
-        return 1;
-    }
+        if (total == 0) {
+            fprintf(stderr, "Error: No clipboard history.\n");
+            return 1;
+        }
 
-    // Check for duplicate
-    for (NSDictionary *pin in pins) {
-        if ([pin[@"text"] isEqualToString:text]) {
-            fprintf(stderr, "Error: This item is already pinned.\n");
+        if (historyIndex < 1 || [history count] == 0) {
+            fprintf(stderr, "Error: Invalid history index %d. Valid range: 1-%lu\n",
+                    historyIndex, (unsigned long)total);
             return 1;
         }
-    }
 
-    // Create pin entry
-    NSMutableDictionary *pinEntry = [NSMutableDictionary dictionary];
-    pinEntry[@"text"] = text;
-    pinEntry[@"timestamp"] = @([[NSDate date] timeIntervalSince1970]);
-    if (label && [label length] > 0) {
-        pinEntry[@"label"] = label;
+        historyEntry = history[0];
+        count = clippy_pins_add(historyEntry, label, &error);
     }
 
-    [pins addObject:pinEntry];
-
-    if (clippy_write_json_array(pins, clippy_pins_path())) {
-        NSString *preview = clippy_preview_text(text);
-        if (label && [label length] > 0) {
-            printf("Pinned as #%lu [%s]: %s\n",
-                   (unsigned long)[pins count], [label UTF8String], [preview UTF8String]);
-        } else {
-            printf("Pinned as #%lu: %s\n",
-                   (unsigned long)[pins count], [preview UTF8String]);
-        }
-        return 0;
+    if (count < 0) {
+        fprintf(stderr, "Error: %s\n", [error ?: @"Failed to save pin." UTF8String]);
+        return 1;
     }
 
-    fprintf(stderr, "Error: Failed to save pin.\n");
-    return 1;
+    NSString *preview = clippy_preview_text(historyEntry[@"text"]);
+    if (label && [label length] > 0) {
+        printf("Pinned as #%ld [%s]: %s\n",
+               (long)count, [label UTF8String], [preview UTF8String]);
+    } else {
+        printf("Pinned as #%ld: %s\n", (long)count, [preview UTF8String]);
+    }
+    return 0;
 }
 
 int cmdPins(void) {
-    NSArray *pins = clippy_read_json_array(clippy_pins_path());
+    NSArray *pins = loadPins();
 
     if ([pins count] == 0) {
         printf("No pinned items.\n");
@@ -335,7 +535,7 @@ int cmdPins(void) {
 }
 
 int cmdPaste(int index) {
-    NSArray *pins = clippy_read_json_array(clippy_pins_path());
+    NSArray *pins = loadPins();
 
     if ([pins count] == 0) {
         fprintf(stderr, "Error: No pinned items.\n");
@@ -352,7 +552,11 @@ int cmdPaste(int index) {
     NSString *text = pin[@"text"];
     NSString *label = pin[@"label"];
 
-    copyTextToClipboard(text);
+    if ([pin[@"type"] isEqualToString:@"image"]) {
+        copyImageToClipboard(pin[@"path"]);
+    } else {
+        copyTextToClipboard(clippy_entry_full_text(pin), pin);
+    }
 
     if (label && [label length] > 0) {
         printf("Copied pin #%d [%s]: %s\n",
@@ -364,37 +568,45 @@ int cmdPaste(int index) {
 }
 
 int cmdUnpin(int index) {
-    NSMutableArray *pins = clippy_read_json_array(clippy_pins_path());
+    NSDictionary *pin = nil;
 
-    if ([pins count] == 0) {
-        fprintf(stderr, "Error: No pinned items.\n");
-        return 1;
-    }
-
-    if (index < 1 || index > (int)[pins count]) {
-        fprintf(stderr, "Error: Invalid pin index %d. Valid range: 1-%lu\n",
-                index, (unsigned long)[pins count]);
-        return 1;
-    }
+    NSDictionary *response = clippy_ipc_request(@{@"cmd": @"unpin", @"index": @(index)});
+    if (response) {
+        if (![response[@"ok"] boolValue]) {
+            fprintf(stderr, "Error: %s\n", [response[@"error"] UTF8String]);
+            return 1;
+        }
+        pin = response[@"pin"];
+    } else {
+        NSArray *pins = clippy_pins_load();
 
-    NSDictionary *pin = pins[index - 1];
-    NSString *text = pin[@"text"];
-    NSString *label = pin[@"label"];
+        if ([pins count] == 0) {
+            fprintf(stderr, "Error: No pinned items.\n");
+            return 1;
+        }
 
-    [pins removeObjectAtIndex:index - 1];
+        if (index < 1 || index > (int)[pins count]) {
+            fprintf(stderr, "Error: Invalid pin index %d. Valid range: 1-%lu\n",
+                    index, (unsigned long)[pins count]);
+            return 1;
+        }
 
-    if (clippy_write_json_array(pins, clippy_pins_path())) {
-        if (label && [label length] > 0) {
-            printf("Unpinned #%d [%s]: %s\n",
-                   index, [label UTF8String], [clippy_preview_text(text) UTF8String]);
-        } else {
-            printf("Unpinned #%d: %s\n", index, [clippy_preview_text(text) UTF8String]);
+        pin = clippy_pins_remove((NSUInteger)(index - 1), 0);
+        if (!pin) {
+            fprintf(stderr, "Error: Failed to update pins.\n");
+            return 1;
         }
-        return 0;
     }
 
-    fprintf(stderr, "Error: Failed to update pins.\n");
-    return 1;
+    NSString *text = pin[@"text"];
+    NSString *label = pin[@"label"];
+    if (label && [label length] > 0) {
+        printf("Unpinned #%d [%s]: %s\n",
+               index, [label UTF8String], [clippy_preview_text(text) UTF8String]);
+    } else {
+        printf("Unpinned #%d: %s\n", index, [clippy_preview_text(text) UTF8String]);
+    }
+    return 0;
 }
 
 // ============================================================================
@@ -403,12 +615,15 @@ int cmdUnpin(int index) {
 
 int cmdConfig(void) {
     printf("Clippy Configuration:\n\n");
-    printf("  poll_interval_ms   = %d\n", clippy_config.pollIntervalMs);
-    printf("  max_history_items  = %d\n", clippy_config.maxHistoryItems);
-    printf("  max_pins           = %d\n", clippy_config.maxPins);
-    printf("  max_entry_length   = %d\n", clippy_config.maxEntryLength);
-    printf("  max_age_days       = %d\n", clippy_config.maxAgeDays);
-    printf("  cleanup_interval   = %d sec\n", clippy_config.cleanupIntervalSec);
+    printf("  poll_interval_ms     = %d\n", clippy_config.pollIntervalMs);
+    printf("  poll_min_interval_ms = %d\n", clippy_config.pollMinIntervalMs);
+    printf("  poll_max_interval_ms = %d\n", clippy_config.pollMaxIntervalMs);
+    printf("  max_history_items    = %d\n", clippy_config.maxHistoryItems);
+    printf("  max_pins             = %d\n", clippy_config.maxPins);
+    printf("  max_entry_length     = %d\n", clippy_config.maxEntryLength);
+    printf("  max_age_days         = %d\n", clippy_config.maxAgeDays);
+    printf("  cleanup_interval     = %d sec\n", clippy_config.cleanupIntervalSec);
+    printf("  max_memory_mb        = %d\n", clippy_config.maxMemoryMB);
     printf("\nConfig file: %s\n", [clippy_config_path() UTF8String]);
 
     NSFileManager *fm = [NSFileManager defaultManager];
@@ -420,15 +635,225 @@ int cmdConfig(void) {
     return 0;
 }
 
+// ============================================================================
+// Stats Command
+// ============================================================================
+
+static NSString *formatBytes(NSNumber *bytes) {
+    return [NSByteCountFormatter stringFromByteCount:[bytes longLongValue]
+                                          countStyle:NSByteCountFormatterCountStyleMemory];
+}
+
+static void printLatency(NSString *label, NSDictionary *latency) {
+    printf("  %-16s %8llu %10llu %10llu %10llu\n", [label UTF8String],
+           [latency[@"count"] unsignedLongLongValue],
+           [latency[@"p50_us"] unsignedLongLongValue],
+           [latency[@"p99_us"] unsignedLongLongValue],
+           [latency[@"max_us"] unsignedLongLongValue]);
+}
+
+int cmdStats(BOOL json) {
+    NSDictionary *response = clippy_ipc_request(@{@"cmd": @"stats"});
+    if (![response[@"ok"] boolValue]) {
+        fprintf(stderr, "Error: %s\n", response ? [response[@"error"] UTF8String]
+                                                 : "clipd is not running.");
+        return 1;
+    }
+
+    if (json) {
+        NSData *data = [NSJSONSerialization dataWithJSONObject:response
+                                                       options:NSJSONWritingPrettyPrinted | NSJSONWritingSortedKeys
+                                                         error:nil];
+        printf("%.*s\n", (int)[data length], (const char *)[data bytes]);
+        return 0;
+    }
+
+    NSDictionary *counters = response[@"counters"];
+    NSDictionary *latency = response[@"latency"];
+    double uptime = [response[@"uptime"] doubleValue];
+
+    printf("clipd Stats (up %.0fh %02.0fm):\n\n", floor(uptime / 3600), fmod(floor(uptime / 60), 60));
+    printf("  History entries  %llu\n", [counters[@"history_entries"] unsignedLongLongValue]);
+    printf("  Pins             %llu\n", [counters[@"pins"] unsignedLongLongValue]);
+    printf("  Text captures    %llu\n", [counters[@"text_captures"] unsignedLongLongValue]);
+    printf("  Image captures   %llu (%llu skipped)\n",
+           [counters[@"image_captures"] unsignedLongLongValue],
+           [counters[@"images_skipped"] unsignedLongLongValue]);
+    printf("  Over budget      %llu\n", [counters[@"over_budget"] unsignedLongLongValue]);
+    printf("  Dedup hits       %llu\n", [counters[@"dedup_hits"] unsignedLongLongValue]);
+    printf("  Uses             %llu\n", [counters[@"uses"] unsignedLongLongValue]);
+    printf("  Files stored     %llu\n", [counters[@"files_stored"] unsignedLongLongValue]);
+    printf("  Bytes written    %s\n", [[NSByteCountFormatter stringFromByteCount:[counters[@"bytes_written"] longLongValue]
+                                                                   countStyle:NSByteCountFormatterCountStyleFile] UTF8String]);
+    printf("  History commits  %llu (%llu records)\n",
+           [counters[@"history_commits"] unsignedLongLongValue],
+           [counters[@"history_records"] unsignedLongLongValue]);
+    printf("  History memory   %s of %s (%llu trimmed to fit)\n",
+           [formatBytes(counters[@"history_bytes"]) UTF8String],
+           [formatBytes(counters[@"memory_budget"]) UTF8String],
+           [counters[@"memory_trimmed"] unsignedLongLongValue]);
+    printf("  Footprint        %s", [formatBytes(counters[@"footprint"]) UTF8String]);
+    if ([counters[@"picker_footprint"] unsignedLongLongValue] > 0) {
+        printf(" (picker %s, model %s)", [formatBytes(counters[@"picker_footprint"]) UTF8String],
+               [formatBytes(counters[@"picker_model_bytes"]) UTF8String]);
+    }
+    printf("\n");
+    printf("  Requests         %llu\n\n", [counters[@"requests"] unsignedLongLongValue]);
+
+    printf("  %-16s %8s %10s %10s %10s\n", "Latency (us)", "count", "p50", "p99", "max");
+    printLatency(@"pasteboard read", latency[@"pasteboard_read"]);
+    printLatency(@"image transcode", latency[@"image_transcode"]);
+    printLatency(@"history write", latency[@"history_write"]);
+    printLatency(@"compaction", latency[@"compaction"]);
+    printLatency(@"cleanup", latency[@"cleanup"]);
+    printLatency(@"substring search", latency[@"search"]);
+    printLatency(@"fuzzy search", latency[@"picker_search"]);
+    printLatency(@"picker open", latency[@"picker_open"]);
+    printf("\nPercentiles are bucket upper bounds (powers of two).\n");
+    return 0;
+}
+
+// ============================================================================
+// Batch Mode
+// ============================================================================
+
+/**
+ * `clippy --batch` reads one command per line on stdin, e.g. `raw 3` or
+ * `search -f "git push"`, and answers each on stdout with a header line
+ * "<exit status> <length>", then exactly length bytes of the command's
+ * output and a newline. Config is loaded once, clipd's socket is used as
+ * usual, and history read from the files is kept until the log changes, so
+ * a coprocess can run many queries without paying for a process each.
+ * Errors still go to stderr; blank lines are ignored.
+ */
+
+int runCommand(int argc, const char *argv[]);
+
+/**
+ * Split a batch line into words at whitespace, honoring '...' and "..."
+ * quoting and backslash escapes; nil if a quote is left open
+ */
+NSArray *splitCommandLine(NSString *line) {
+    NSMutableArray *words = [NSMutableArray array];
+    NSMutableString *word = nil;
+    unichar quote = 0;
+    NSUInteger length = [line length];
+
+    for (NSUInteger i = 0; i < length; i++) {
+        unichar c = [line characterAtIndex:i];
+        if (c == '\\' && quote != '\'' && i + 1 < length) {
+            c = [line characterAtIndex:++i];
+        } else if (quote && c == quote) {
+            quote = 0;
+            continue;
+        } else if (!quote && (c == '\'' || c == '"')) {
+            quote = c;
+            word = word ?: [NSMutableString string];
+            continue;
+        } else if (!quote && (c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+            if (word) {
+                [words addObject:word];
+                word = nil;
+            }
+            continue;
+        }
+        word = word ?: [NSMutableString string];
+        [word appendString:[NSString stringWithCharacters:&c length:1]];
+    }
+
+    if (quote) {
+        return nil;
+    }
+    if (word) {
+        [words addObject:word];
+    }
+    return words;
+}
+
+/**
+ * Run one command with its stdout captured in capture (a scratch file)
+ * and write the framed result to the real stdout
+ */
+void runBatchCommand(NSArray *words, FILE *capture, int realStdout) {
+    const char **args = calloc([words count] + 1, sizeof(char *));
+    if (!args) {
+        printf("1 0\n\n");
+        fflush(stdout);
+        return;
+    }
+    args[0] = "clippy";
+    for (NSUInteger i = 0; i < [words count]; i++) {
+        args[i + 1] = [words[i] UTF8String];
+    }
+
+    int captureFd = fileno(capture);
+    ftruncate(captureFd, 0);
+    lseek(captureFd, 0, SEEK_SET);
+
+    fflush(stdout);
+    dup2(captureFd, STDOUT_FILENO);
+    int status = runCommand((int)[words count] + 1, args);
+    fflush(stdout);
+    dup2(realStdout, STDOUT_FILENO);
+    free(args);
+
+    off_t size = lseek(captureFd, 0, SEEK_END);
+    NSMutableData *output = [NSMutableData dataWithLength:(NSUInteger)MAX(size, 0)];
+    if (pread(captureFd, [output mutableBytes], [output length], 0) != (ssize_t)[output length]) {
+        fprintf(stderr, "Error: Could not read command output: %s\n", strerror(errno));
+        [output setLength:0];
+        status = 1;
+    }
+
+    printf("%d %lu\n", status, (unsigned long)[output length]);
+    fwrite([output bytes], 1, [output length], stdout);
+    printf("\n");
+    fflush(stdout);
+}
+
+int cmdBatch(void) {
+    FILE *capture = tmpfile();
+    int realStdout = dup(STDOUT_FILENO);
+    if (!capture || realStdout < 0) {
+        fprintf(stderr, "Error: Could not set up batch mode: %s\n", strerror(errno));
+        return 1;
+    }
+    batchMode = YES;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, stdin)) > 0) {
+        @autoreleasepool {
+            NSString *text = [[NSString alloc] initWithBytes:line length:(NSUInteger)length
+                                                    encoding:NSUTF8StringEncoding];
+            NSArray *words = text ? splitCommandLine(text) : nil;
+            if (!words) {
+                // Still answer, so the caller stays in step
+                fprintf(stderr, "Error: Could not parse batch command: %.*s", (int)length, line);
+                printf("1 0\n\n");
+                fflush(stdout);
+            } else if ([words count] > 0) {
+                runBatchCommand(words, capture, realStdout);
+            }
+        }
+    }
+
+    free(line);
+    fclose(capture);
+    close(realStdout);
+    return 0;
+}
+
 // ============================================================================
 // Main
 // ============================================================================
 
-int main(int argc, const char *argv[]) {
+/**
+ * Dispatch one command line (argv[0] is the program name)
+ */
+int runCommand(int argc, const char *argv[]) {
     @autoreleasepool {
-        // Load configuration
-        clippy_load_config();
-
         if (argc < 2) {
             printUsage();
             return 0;
@@ -474,12 +899,28 @@ int main(int argc, const char *argv[]) {
             return cmdClear();
         }
 
-        if ([command isEqualToString:@"search"]) {
+        if ([command isEqualToString:@"export"]) {
+            NSString *path = argc >= 3 ? [NSString stringWithUTF8String:argv[2]] : clippy_history_path();
+            return cmdExport([path stringByExpandingTildeInPath]);
+        }
+
+        if ([command isEqualToString:@"import"]) {
             if (argc < 3) {
+                fprintf(stderr, "Error: 'import' requires a file.\n");
+                return 1;
+            }
+            return cmdImport([[NSString stringWithUTF8String:argv[2]] stringByExpandingTildeInPath]);
+        }
+
+        if ([command isEqualToString:@"search"]) {
+            BOOL fuzzy = argc >= 3 && (strcmp(argv[2], "-f") == 0 || strcmp(argv[2], "--fuzzy") == 0);
+            int queryArg = fuzzy ? 3 : 2;
+            if (argc <= queryArg) {
                 fprintf(stderr, "Error: 'search' requires a query.\n");
+                fprintf(stderr, "Usage: clippy search [-f|--fuzzy] <Q>\n");
                 return 1;
             }
-            return cmdSearch([NSString stringWithUTF8String:argv[2]]);
+            return cmdSearch([NSString stringWithUTF8String:argv[queryArg]], fuzzy);
         }
 
         // ---- Pin Commands ----
@@ -540,9 +981,25 @@ int main(int argc, const char *argv[]) {
             return cmdConfig();
         }
 
+        if ([command isEqualToString:@"stats"]) {
+            return cmdStats(argc >= 3 && strcmp(argv[2], "--json") == 0);
+        }
+
         // Unknown command
         fprintf(stderr, "Unknown command: %s\n", [command UTF8String]);
         fprintf(stderr, "Run 'clippy --help' for usage.\n");
         return 1;
     }
 }
+
+int main(int argc, const char *argv[]) {
+    @autoreleasepool {
+        // Load configuration
+        clippy_load_config();
+
+        if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+            return cmdBatch();
+        }
+        return runCommand(argc, argv);
+    }
+}
@@ -4,12 +4,16 @@
  * A native macOS GUI app that provides a global hotkey (Cmd+Shift+V)
  * to display a fuzzy search popup for clipboard history selection.
  *
- * Build: clang -framework AppKit -framework Foundation -framework Carbon -Iinclude -o clippy-picker clippy_picker.m
+ * Build: clang -framework AppKit -framework Foundation -framework Carbon -lcompression -Iinclude -o clippy-picker clippy_picker.m
  */
 
 #import <AppKit/AppKit.h>
 #import <Carbon/Carbon.h>
 #include "clippy_common.h"
+#include "clippy_search.h"
+#include "clippy_ipc.h"
+#include "clippy_trace.h"
+#include <stdatomic.h>
 
 // ============================================================================
 // Constants
@@ -22,74 +26,14 @@
 #define PADDING 6
 #define BUTTON_HEIGHT 28
 #define BUTTON_BAR_HEIGHT 40
-
-// ============================================================================
-// Fuzzy Search
-// ============================================================================
-
-typedef struct {
-    BOOL matches;
-    NSInteger score;
-} FuzzyMatchResult;
-
-static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
-    FuzzyMatchResult result = {NO, 0};
-
-    if (!pattern || [pattern length] == 0) {
-        result.matches = YES;
-        result.score = 0;
-        return result;
-    }
-
-    if (!text || [text length] == 0) {
-        return result;
-    }
-
-    NSString *lowerPattern = [pattern lowercaseString];
-    NSString *lowerText = [text lowercaseString];
-
-    NSUInteger patternIdx = 0;
-    NSUInteger textIdx = 0;
-    NSInteger score = 0;
-    NSInteger consecutiveBonus = 0;
-    NSInteger lastMatchIdx = -2;
-
-    while (patternIdx < [lowerPattern length] && textIdx < [lowerText length]) {
-        unichar patternChar = [lowerPattern characterAtIndex:patternIdx];
-        unichar textChar = [lowerText characterAtIndex:textIdx];
-
-        if (patternChar == textChar) {
-            score += 1;
-
-            if ((NSInteger)textIdx == lastMatchIdx + 1) {
-                consecutiveBonus += 2;
-                score += consecutiveBonus;
-            } else {
-                consecutiveBonus = 0;
-            }
-
-            if (textIdx == 0) {
-                score += 10;
-            } else {
-                unichar prevChar = [lowerText characterAtIndex:textIdx - 1];
-                if ([[NSCharacterSet whitespaceAndNewlineCharacterSet] characterIsMember:prevChar] ||
-                    [[NSCharacterSet punctuationCharacterSet] characterIsMember:prevChar]) {
-                    score += 5;
-                }
-            }
-
-            score += MAX(0, (50 - (NSInteger)textIdx));
-
-            lastMatchIdx = textIdx;
-            patternIdx++;
-        }
-        textIdx++;
-    }
-
-    result.matches = (patternIdx == [lowerPattern length]);
-    result.score = result.matches ? score : 0;
-    return result;
-}
+#define THUMBNAIL_WIDTH 80
+#define THUMBNAIL_HEIGHT 40
+#define THUMBNAIL_CACHE_SIZE 64
+#define SEARCH_MAX_RESULTS 200     // Rows kept per search (top-K by score)
+#define SEARCH_CHUNK_SIZE 1024     // Entries per dispatch_apply iteration
+#define TABLE_DIFF_MAX_STEPS 256   // Row inserts + moves per update before reloadData is cheaper
+#define PICKER_OPEN_BUDGET_MS 100  // Hotkey to first frame; slower opens are logged
+#define HOTKEY_MAX_AGE_US 10000000 // Event timestamps older than this are treated as bogus
 
 // ============================================================================
 // Picker Delegate Protocol
@@ -138,7 +82,7 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
 - (BOOL)becomeFirstResponder {
     BOOL result = [super becomeFirstResponder];
     if (result) {
-        NSLog(@"clippy-picker: Search field became first responder");
+        os_log_debug(clippy_trace_log(), "Search field became first responder");
     }
     return result;
 }
@@ -163,7 +107,7 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
 - (void)keyDown:(NSEvent *)event {
     unsigned short keyCode = event.keyCode;
 
-    NSLog(@"clippy-picker: keyDown received, keyCode=%d", keyCode);
+    os_log_debug(clippy_trace_log(), "keyDown received, keyCode=%d", keyCode);
 
     // Arrow Up
     if (keyCode == 126) {
@@ -199,6 +143,8 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
 @property (strong) NSTextField *mainLabel;
 @property (strong) NSTextField *timeLabel;
 @property (strong) NSTextField *typeLabel;
+@property (strong) NSImageView *thumbnailView;
+@property (copy) NSString *thumbnailPath;  // Thumbnail this cell is waiting for
 @end
 
 @implementation ClippyTableCellView
@@ -234,7 +180,19 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
         _typeLabel.translatesAutoresizingMaskIntoConstraints = NO;
         [self addSubview:_typeLabel];
 
+        _thumbnailView = [[NSImageView alloc] initWithFrame:NSZeroRect];
+        _thumbnailView.imageScaling = NSImageScaleProportionallyDown;
+        _thumbnailView.imageAlignment = NSImageAlignRight;
+        _thumbnailView.translatesAutoresizingMaskIntoConstraints = NO;
+        _thumbnailView.hidden = YES;
+        [self addSubview:_thumbnailView];
+
         [NSLayoutConstraint activateConstraints:@[
+            [_thumbnailView.trailingAnchor constraintEqualToAnchor:self.trailingAnchor constant:-16],
+            [_thumbnailView.centerYAnchor constraintEqualToAnchor:self.centerYAnchor],
+            [_thumbnailView.widthAnchor constraintEqualToConstant:THUMBNAIL_WIDTH],
+            [_thumbnailView.heightAnchor constraintEqualToConstant:THUMBNAIL_HEIGHT],
+
             [_timeLabel.leadingAnchor constraintEqualToAnchor:self.leadingAnchor constant:16],
             [_timeLabel.topAnchor constraintEqualToAnchor:self.topAnchor constant:8],
 
@@ -242,7 +200,7 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
             [_typeLabel.centerYAnchor constraintEqualToAnchor:_timeLabel.centerYAnchor],
 
             [_mainLabel.leadingAnchor constraintEqualToAnchor:self.leadingAnchor constant:16],
-            [_mainLabel.trailingAnchor constraintEqualToAnchor:self.trailingAnchor constant:-16],
+            [_mainLabel.trailingAnchor constraintEqualToAnchor:_thumbnailView.leadingAnchor constant:-8],
             [_mainLabel.topAnchor constraintEqualToAnchor:_timeLabel.bottomAnchor constant:4],
         ]];
     }
@@ -251,10 +209,440 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
 
 @end
 
+// ============================================================================
+// Thumbnail Cache (LRU)
+// ============================================================================
+
+@interface ClippyThumbnailCache : NSObject
+- (instancetype)initWithCapacity:(NSUInteger)capacity;
+- (id)objectForKey:(NSString *)key;  // NSImage, NSNull for a known miss, or nil
+- (void)setObject:(id)object forKey:(NSString *)key;
+- (void)removeAllObjects;
+@end
+
+@implementation ClippyThumbnailCache {
+    NSMutableDictionary *_objects;
+    NSMutableOrderedSet *_order;  // Least recently used first
+    NSUInteger _capacity;
+}
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity {
+    self = [super init];
+    if (self) {
+        _objects = [NSMutableDictionary dictionaryWithCapacity:capacity];
+        _order = [NSMutableOrderedSet orderedSetWithCapacity:capacity];
+        _capacity = capacity;
+    }
+    return self;
+}
+
+- (id)objectForKey:(NSString *)key {
+    id object = _objects[key];
+    if (object) {
+        [_order removeObject:key];
+        [_order addObject:key];
+    }
+    return object;
+}
+
+- (void)setObject:(id)object forKey:(NSString *)key {
+    _objects[key] = object;
+    [_order removeObject:key];
+    [_order addObject:key];
+
+    while ([_order count] > _capacity) {
+        NSString *oldest = [_order firstObject];
+        [_order removeObjectAtIndex:0];
+        [_objects removeObjectForKey:oldest];
+    }
+}
+
+- (void)removeAllObjects {
+    [_objects removeAllObjects];
+    [_order removeAllObjects];
+}
+
+@end
+
+// ============================================================================
+// Pasteboard Promises
+// ============================================================================
+
+/**
+ * Supplies a restored entry's data only when an app pastes it
+ * Images hand over the stored PNG, mapped when the entry is picked and never
+ * decoded; TIFF is converted from it only for an app that asks for TIFF.
+ * Long text and the rich text/HTML kept with it are decompressed from their
+ * blobs on demand.
+ */
+@interface ClippyPasteboardProvider : NSObject <NSPasteboardItemDataProvider>
+@property (readonly) NSDictionary *entry;
+@property (readonly) NSArray<NSPasteboardType> *types;
+@property (assign) NSInteger changeCount;  // Pasteboard generation holding the promise
+- (instancetype)initWithEntry:(NSDictionary *)entry;  // nil if the image can't be read
+- (NSData *)dataForType:(NSPasteboardType)type;
+@end
+
+@implementation ClippyPasteboardProvider {
+    NSData *_png;  // Mapped image file
+}
+
+- (instancetype)initWithEntry:(NSDictionary *)entry {
+    self = [super init];
+    if (self) {
+        _entry = entry;
+        if ([entry[@"type"] isEqualToString:@"image"]) {
+            NSString *path = entry[@"path"];
+            _png = path ? [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:nil] : nil;
+            if (!_png) {
+                return nil;
+            }
+            _types = @[NSPasteboardTypePNG, NSPasteboardTypeTIFF];
+        } else {
+            NSMutableArray *types = [NSMutableArray array];
+            if ([entry[@"files"] isKindOfClass:[NSArray class]] && [entry[@"files"] count] > 0) {
+                [types addObject:NSPasteboardTypeFileURL];
+            }
+            NSDictionary *repTypes = clippy_rep_types();
+            for (NSString *rep in [entry[@"reps"] allKeys]) {
+                if (repTypes[rep]) {
+                    [types addObject:repTypes[rep]];
+                }
+            }
+            [types addObject:NSPasteboardTypeString];
+            _types = types;
+        }
+    }
+    return self;
+}
+
+- (NSData *)dataForType:(NSPasteboardType)type {
+    if ([type isEqualToString:NSPasteboardTypePNG]) {
+        return _png;
+    }
+    if ([type isEqualToString:NSPasteboardTypeTIFF]) {
+        return _png ? [[NSBitmapImageRep imageRepWithData:_png] TIFFRepresentation] : nil;
+    }
+    if ([type isEqualToString:NSPasteboardTypeString]) {
+        return _entry ? [clippy_entry_full_text(_entry) dataUsingEncoding:NSUTF8StringEncoding] : nil;
+    }
+    if ([type isEqualToString:NSPasteboardTypeFileURL]) {
+        NSString *file = [_entry[@"files"] firstObject];
+        return file ? [[[NSURL fileURLWithPath:file] absoluteString] dataUsingEncoding:NSUTF8StringEncoding] : nil;
+    }
+    NSString *rep = [[clippy_rep_types() allKeysForObject:type] firstObject];
+    return rep && _entry ? clippy_entry_rep_data(_entry, rep) : nil;
+}
+
+- (void)pasteboard:(NSPasteboard *)pasteboard item:(NSPasteboardItem *)item provideDataForType:(NSPasteboardType)type {
+    (void)pasteboard;
+    NSData *data = [self dataForType:type];
+    if (data) {
+        [item setData:data forType:type];
+    }
+}
+
+// Something else owns the pasteboard now; let go of the mapping
+- (void)pasteboardFinishedWithDataProvider:(NSPasteboard *)pasteboard {
+    (void)pasteboard;
+    _png = nil;
+    _entry = nil;
+}
+
+@end
+
+// ============================================================================
+// Search Model
+// ============================================================================
+
+/**
+ * Row strings for one entry, built the first time the row is shown
+ * The time label is kept for the day it was formatted in ("Today" becomes
+ * "Yesterday" at midnight)
+ */
+@interface ClippyDisplayRow : NSObject
+@property (copy) NSString *preview;
+@property (copy) NSString *timeLabel;
+@property (assign) NSTimeInterval timeLabelDay;  // clippy_day_buckets().today it was made for
+@end
+
+@implementation ClippyDisplayRow
+@end
+
+/**
+ * Immutable snapshot of the picker model and its search index
+ * Background searches hold a reference, so a reload can't free the index
+ * out from under them. Display rows are memoized per entry (main thread
+ * only) and go away with the snapshot.
+ */
+@interface ClippySearchModel : NSObject
+@property (readonly) NSArray *entries;
+@property (readonly) ClippySearchIndex *index;   // Parallel to entries, may be NULL
+@property (readonly) NSUInteger generation;
+- (instancetype)initWithEntries:(NSArray *)entries
+                          index:(ClippySearchIndex *)index
+                     generation:(NSUInteger)generation;
+- (ClippyDisplayRow *)displayRowForEntry:(NSDictionary *)entry;
+@end
+
+@implementation ClippySearchModel {
+    NSMapTable *_displayRows;  // Entry (by identity) -> ClippyDisplayRow
+}
+
+- (instancetype)initWithEntries:(NSArray *)entries
+                          index:(ClippySearchIndex *)index
+                     generation:(NSUInteger)generation {
+    self = [super init];
+    if (self) {
+        _entries = entries;
+        _index = index;
+        _generation = generation;
+        _displayRows = [[NSMapTable alloc]
+            initWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                  valueOptions:NSPointerFunctionsStrongMemory
+                      capacity:64];
+    }
+    return self;
+}
+
+- (ClippyDisplayRow *)displayRowForEntry:(NSDictionary *)entry {
+    ClippyDisplayRow *row = [_displayRows objectForKey:entry];
+    if (!row) {
+        row = [[ClippyDisplayRow alloc] init];
+        row.preview = clippy_preview_text(entry[@"text"]);
+        [_displayRows setObject:row forKey:entry];
+    }
+
+    NSTimeInterval today = clippy_day_buckets().today;
+    if (!row.timeLabel || row.timeLabelDay != today) {
+        NSNumber *timestamp = entry[@"timestamp"];
+        row.timeLabel = timestamp ? clippy_format_timestamp(timestamp) : @"";
+        row.timeLabelDay = today;
+    }
+    return row;
+}
+
+- (void)dealloc {
+    clippy_search_index_free(_index);
+}
+
+@end
+
+/**
+ * Score candidate slots across cores; with no candidates (a fresh query)
+ * only the posting list of the query's rarest character is visited
+ * Each chunk keeps its own top-K heap and survivor list; chunks bail out as
+ * soon as *current moves past generation. Returns NO if cancelled.
+ */
+static BOOL searchIndex(const ClippySearchIndex *index, NSString *query,
+                        const NSUInteger *candidates, NSUInteger candidateCount,
+                        atomic_uint_fast64_t *current, uint_fast64_t generation,
+                        NSData **outHits, NSData **outSurvivors) {
+    ClippySearchQuery searchQuery;
+    clippy_search_query_init(&searchQuery, query);
+    clippy_search_query_prepare(&searchQuery, index);
+
+    if (!candidates) {
+        candidates = index->postings[searchQuery.postingBit];
+        candidateCount = index->postingCounts[searchQuery.postingBit];
+    }
+
+    NSUInteger chunks = (candidateCount + SEARCH_CHUNK_SIZE - 1) / SEARCH_CHUNK_SIZE;
+    ClippySearchTopK *heaps = calloc(MAX(chunks, 1), sizeof(ClippySearchTopK));
+    NSUInteger **survivors = calloc(MAX(chunks, 1), sizeof(NSUInteger *));
+    NSUInteger *survivorCounts = calloc(MAX(chunks, 1), sizeof(NSUInteger));
+    if (!heaps || !survivors || !survivorCounts) {
+        free(heaps);
+        free(survivors);
+        free(survivorCounts);
+        clippy_search_query_free(&searchQuery);
+        return NO;
+    }
+
+    const ClippySearchQuery *q = &searchQuery;
+    dispatch_apply(chunks, DISPATCH_APPLY_AUTO, ^(size_t c) {
+        if (atomic_load(current) != generation) {
+            return;
+        }
+
+        NSUInteger start = c * SEARCH_CHUNK_SIZE;
+        NSUInteger end = MIN(start + SEARCH_CHUNK_SIZE, candidateCount);
+        NSUInteger *kept = malloc((end - start) * sizeof(NSUInteger));
+        if (!kept || !clippy_search_topk_init(&heaps[c], SEARCH_MAX_RESULTS)) {
+            free(kept);
+            return;
+        }
+
+        NSUInteger keptCount = 0;
+        for (NSUInteger n = start; n < end; n++) {
+            NSUInteger slot = candidates[n];
+            FuzzyMatchResult match = clippy_search_match_ranked(q, &index->entries[slot]);
+            if (match.matches) {
+                kept[keptCount++] = slot;
+                clippy_search_topk_push(&heaps[c], (ClippySearchHit){match.score, slot});
+            }
+        }
+        survivors[c] = kept;
+        survivorCounts[c] = keptCount;
+    });
+
+    BOOL completed = (atomic_load(current) == generation);
+    for (NSUInteger c = 0; c < chunks && completed; c++) {
+        completed = (survivors[c] != NULL);
+    }
+
+    if (completed) {
+        // Merge per-chunk winners; survivors stay in history order
+        ClippySearchTopK best;
+        NSMutableData *survivorData = [NSMutableData data];
+        completed = clippy_search_topk_init(&best, SEARCH_MAX_RESULTS);
+        for (NSUInteger c = 0; c < chunks && completed; c++) {
+            for (NSUInteger h = 0; h < heaps[c].count; h++) {
+                clippy_search_topk_push(&best, heaps[c].hits[h]);
+            }
+            [survivorData appendBytes:survivors[c] length:survivorCounts[c] * sizeof(NSUInteger)];
+        }
+        if (completed) {
+            clippy_search_topk_sort(&best);
+            *outHits = [NSData dataWithBytes:best.hits length:best.count * sizeof(ClippySearchHit)];
+            *outSurvivors = survivorData;
+            clippy_search_topk_free(&best);
+        }
+    }
+
+    for (NSUInteger c = 0; c < chunks; c++) {
+        clippy_search_topk_free(&heaps[c]);
+        free(survivors[c]);
+    }
+    free(heaps);
+    free(survivors);
+    free(survivorCounts);
+    clippy_search_query_free(&searchQuery);
+    return completed;
+}
+
 // ============================================================================
 // App Delegate
 // ============================================================================
 
+// ============================================================================
+// Table Row Diffing
+// ============================================================================
+
+/**
+ * Rows are matched across updates by identity, not by object: a reload
+ * brings new dictionaries for the same entries. History entries are
+ * identified by their id, pins by the negated id (ids derived from
+ * timestamps may repeat between a pin and an entry, never within either).
+ */
+static NSNumber *rowIdentity(NSDictionary *entry) {
+    long long entryId = (long long)clippy_entry_id(entry);
+    return @([entry[@"isPinned"] boolValue] ? -entryId : entryId);
+}
+
+typedef struct {
+    BOOL insert;          // Insert a row at `to`, else move `from` to `to`
+    NSUInteger from;
+    NSUInteger to;
+} ClippyRowStep;
+
+/**
+ * Turn the rows showing oldRows into rows showing newRows with batched removes,
+ * inserts and moves; rows whose entry is unchanged keep their views as-is,
+ * rows whose entry changed (an image finished processing) are redrawn.
+ * The steps are planned first: NO, with the table untouched, when the
+ * lists have duplicate identities or the change is large enough that
+ * reloadData is cheaper.
+ */
+static BOOL applyRowDiff(NSTableView *tableView, NSArray *oldRows, NSArray *newRows) {
+    NSUInteger oldCount = [oldRows count];
+    NSUInteger newCount = [newRows count];
+
+    NSMutableDictionary *oldByIdentity = [NSMutableDictionary dictionaryWithCapacity:oldCount];
+    for (NSDictionary *entry in oldRows) {
+        oldByIdentity[rowIdentity(entry)] = entry;
+    }
+    NSMutableArray *newIdentities = [NSMutableArray arrayWithCapacity:newCount];
+    for (NSDictionary *entry in newRows) {
+        [newIdentities addObject:rowIdentity(entry)];
+    }
+    NSSet *newSet = [NSSet setWithArray:newIdentities];
+    if ([oldByIdentity count] != oldCount || [newSet count] != newCount) {
+        return NO;
+    }
+
+    // Removals first, in old coordinates; the rest keep their order
+    NSMutableIndexSet *removed = [NSMutableIndexSet indexSet];
+    NSMutableArray *working = [NSMutableArray arrayWithCapacity:oldCount];
+    for (NSUInteger i = 0; i < oldCount; i++) {
+        NSNumber *identity = rowIdentity(oldRows[i]);
+        if ([newSet containsObject:identity]) {
+            [working addObject:identity];
+        } else {
+            [removed addIndex:i];
+        }
+    }
+
+    // Then build the new order top-down: position i is either already
+    // right, a new row, or a surviving row moved up from further down
+    ClippyRowStep steps[TABLE_DIFF_MAX_STEPS];
+    NSUInteger stepCount = 0;
+    NSUInteger scanBudget = 4 * (oldCount + newCount) + TABLE_DIFF_MAX_STEPS;
+    for (NSUInteger i = 0; i < newCount; i++) {
+        NSNumber *identity = newIdentities[i];
+        if (i < [working count] && [working[i] isEqual:identity]) {
+            continue;
+        }
+        if (stepCount == TABLE_DIFF_MAX_STEPS) {
+            return NO;
+        }
+
+        if (!oldByIdentity[identity]) {
+            steps[stepCount++] = (ClippyRowStep){YES, 0, i};
+            [working insertObject:identity atIndex:i];
+            continue;
+        }
+
+        NSUInteger j = i + 1;
+        while (![working[j] isEqual:identity]) {
+            if (--scanBudget == 0) {
+                return NO;
+            }
+            j++;
+        }
+        steps[stepCount++] = (ClippyRowStep){NO, j, i};
+        [working removeObjectAtIndex:j];
+        [working insertObject:identity atIndex:i];
+    }
+
+    NSMutableIndexSet *changed = [NSMutableIndexSet indexSet];
+    for (NSUInteger i = 0; i < newCount; i++) {
+        NSDictionary *before = oldByIdentity[newIdentities[i]];
+        if (before && before != newRows[i] && ![before isEqualToDictionary:newRows[i]]) {
+            [changed addIndex:i];
+        }
+    }
+
+    [tableView beginUpdates];
+    if ([removed count] > 0) {
+        [tableView removeRowsAtIndexes:removed withAnimation:NSTableViewAnimationEffectNone];
+    }
+    for (NSUInteger n = 0; n < stepCount; n++) {
+        if (steps[n].insert) {
+            [tableView insertRowsAtIndexes:[NSIndexSet indexSetWithIndex:steps[n].to]
+                             withAnimation:NSTableViewAnimationEffectNone];
+        } else {
+            [tableView moveRowAtIndex:(NSInteger)steps[n].from toIndex:(NSInteger)steps[n].to];
+        }
+    }
+    [tableView endUpdates];
+
+    if ([changed count] > 0) {
+        [tableView reloadDataForRowIndexes:changed columnIndexes:[NSIndexSet indexSetWithIndex:0]];
+    }
+    return YES;
+}
+
 @interface ClippyPickerAppDelegate : NSObject <NSApplicationDelegate, NSTableViewDataSource,
                                                 NSTableViewDelegate, NSTextFieldDelegate,
                                                 NSWindowDelegate, ClippyPickerDelegate>
@@ -270,6 +658,31 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
 
 @property (strong) NSMutableArray *allHistory;
 @property (strong) NSMutableArray *filteredHistory;
+@property (strong) ClippySearchModel *searchModel;  // allHistory + its index
+@property (strong) dispatch_queue_t searchQueue;
+
+// Previous search, reused when the next query only appends characters
+@property (copy) NSString *lastSearchQuery;         // Case-folded
+@property (assign) NSUInteger lastSearchGeneration; // Model generation it ran against
+@property (strong) NSData *lastSearchCandidates;    // NSUInteger slots that matched
+
+// Resident model: pins + history, refreshed only when the files change
+@property (assign) ClippyFileStamp historyStamp;
+@property (assign) ClippyFileStamp pinsStamp;
+@property (assign) BOOL modelLoaded;
+@property (assign) NSUInteger modelGeneration;
+@property (assign) BOOL modelRefreshQueued;
+@property (strong) dispatch_queue_t modelQueue;
+@property (strong) dispatch_source_t historyWatcher;
+@property (strong) dispatch_source_t pinsWatcher;
+@property (strong) dispatch_source_t daemonSource;  // clipd subscription
+
+@property (strong) ClippyThumbnailCache *thumbnailCache;
+@property (strong) dispatch_queue_t thumbnailQueue;
+@property (strong) NSMutableSet *thumbnailsLoading;
+
+@property (strong) ClippyPasteboardProvider *pasteboardProvider;  // Last entry restored
+@property (assign) BOOL prewarmPending;  // Warm the window once the model is rebuilt
 
 @property (assign) CFMachPortRef eventTap;
 @property (assign) CFRunLoopSourceRef runLoopSource;
@@ -278,7 +691,9 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
 
 @end
 
-@implementation ClippyPickerAppDelegate
+@implementation ClippyPickerAppDelegate {
+    atomic_uint_fast64_t _searchGeneration;  // Bumped per keystroke; stale searches stop
+}
 
 // ============================================================================
 // Application Lifecycle
@@ -287,6 +702,15 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
 - (void)applicationDidFinishLaunching:(NSNotification *)notification {
     clippy_load_config();
 
+    self.thumbnailCache = [[ClippyThumbnailCache alloc] initWithCapacity:THUMBNAIL_CACHE_SIZE];
+    self.thumbnailQueue = dispatch_queue_create("com.local.clippy-picker.thumbnails", DISPATCH_QUEUE_SERIAL);
+    self.thumbnailsLoading = [NSMutableSet set];
+
+    self.modelQueue = dispatch_queue_create("com.local.clippy-picker.model", DISPATCH_QUEUE_SERIAL);
+    self.searchQueue = dispatch_queue_create("com.local.clippy-picker.search",
+        dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_USER_INITIATED, 0));
+    [self prewarm];
+
     [NSApp setActivationPolicy:NSApplicationActivationPolicyAccessory];
 
     [self setupStatusItem];
@@ -309,10 +733,17 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
                                                  name:@"ShowPickerNotification"
                                                object:nil];
 
+    // Sleep pages much of this out again; rebuild before the next open
+    [[[NSWorkspace sharedWorkspace] notificationCenter] addObserver:self
+                                                           selector:@selector(systemDidWake:)
+                                                               name:NSWorkspaceDidWakeNotification
+                                                             object:nil];
+
     NSLog(@"clippy-picker: Started successfully");
 }
 
 - (void)applicationWillTerminate:(NSNotification *)notification {
+    [self fulfillPasteboardPromise];
     if (self.hotkeyRef) {
         UnregisterEventHotKey(self.hotkeyRef);
     }
@@ -327,6 +758,102 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
     }
 }
 
+// ============================================================================
+// Prewarm
+// ============================================================================
+
+/**
+ * Do the first open's one-time work before the hotkey is pressed. The model
+ * is rebuilt in the background; then, on the main thread, the table is
+ * filled and laid out (populating its cell reuse pool), the field editor is
+ * created and the window is drawn once, fully transparent, so its backing
+ * store and layers exist. Runs at launch and after wake from sleep.
+ */
+- (void)prewarm {
+    self.prewarmPending = YES;
+    [self refreshModelInBackground];
+}
+
+- (void)systemDidWake:(NSNotification *)notification {
+    (void)notification;
+    [self prewarm];
+}
+
+- (void)warmWindow {
+    self.prewarmPending = NO;
+    if (self.pickerWindow.visible) {
+        return;
+    }
+
+    CLIPPY_TRACE_BEGIN(Prewarm);
+    [self applyFilteredResults:[self.allHistory mutableCopy] keepSelection:NO];
+    [self.tableView layoutSubtreeIfNeeded];
+    [self.pickerWindow fieldEditor:YES forObject:self.searchField];
+
+    CGFloat alpha = self.pickerWindow.alphaValue;
+    self.pickerWindow.alphaValue = 0;
+    [self.pickerWindow orderFrontRegardless];
+    [self.pickerWindow displayIfNeeded];
+    [self.pickerWindow orderOut:nil];
+    self.pickerWindow.alphaValue = alpha;
+    CLIPPY_TRACE_END(Prewarm);
+}
+
+// ============================================================================
+// Open Latency
+// ============================================================================
+
+/**
+ * Hotkey-to-first-frame: from the hotkey event's own timestamp to the window
+ * server reporting the picker visible (windowDidChangeOcclusionState:). It
+ * is an os_signpost interval (HotkeyToFrame), and each sample goes to clipd,
+ * whose histogram `clippy stats` prints as "picker open". Opens slower than
+ * PICKER_OPEN_BUDGET_MS are logged. Both hotkey paths call in on the main
+ * run loop.
+ */
+
+static uint64_t hotkeyPressedUs = 0;  // clippy_trace_now_us() time; 0 when none pending
+static os_signpost_id_t hotkeySignpost = OS_SIGNPOST_ID_NULL;
+
+/**
+ * A hotkey press that happened ageUs ago
+ */
+static void noteHotkeyPressed(uint64_t ageUs) {
+    if (hotkeyPressedUs != 0) {
+        os_signpost_interval_end(clippy_trace_log(), hotkeySignpost, "HotkeyToFrame");
+    }
+    uint64_t now = clippy_trace_now_us();
+    hotkeyPressedUs = now - (ageUs < HOTKEY_MAX_AGE_US ? MIN(ageUs, now - 1) : 0);
+    hotkeySignpost = os_signpost_id_generate(clippy_trace_log());
+    os_signpost_interval_begin(clippy_trace_log(), hotkeySignpost, "HotkeyToFrame");
+}
+
+/**
+ * Microseconds since the pending press, which is then cleared; 0 if none
+ */
+static uint64_t takeHotkeyLatencyUs(void) {
+    if (hotkeyPressedUs == 0) {
+        return 0;
+    }
+    uint64_t us = clippy_trace_now_us() - hotkeyPressedUs;
+    hotkeyPressedUs = 0;
+    os_signpost_interval_end(clippy_trace_log(), hotkeySignpost, "HotkeyToFrame");
+    return MAX(us, 1ull);
+}
+
+- (void)recordOpenLatency {
+    uint64_t us = takeHotkeyLatencyUs();
+    if (us == 0) {
+        return;
+    }
+    if (us > PICKER_OPEN_BUDGET_MS * 1000ull) {
+        NSLog(@"clippy-picker: Open took %llu ms (budget %d ms)", us / 1000, PICKER_OPEN_BUDGET_MS);
+    }
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+        clippy_ipc_request(@{@"cmd": @"report", @"metric": @"picker_open", @"us": @(us)});
+    });
+}
+
 // ============================================================================
 // Status Bar
 // ============================================================================
@@ -370,9 +897,11 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
 
 static OSStatus hotkeyHandler(EventHandlerCallRef nextHandler, EventRef event, void *userData) {
     (void)nextHandler;
-    (void)event;
     (void)userData;
 
+    EventTime age = GetCurrentEventTime() - GetEventTime(event);
+    noteHotkeyPressed(age > 0 ? (uint64_t)(age * 1e6) : 0);
+
     dispatch_async(dispatch_get_main_queue(), ^{
         [[NSNotificationCenter defaultCenter]
          postNotificationName:@"ShowPickerNotification" object:nil];
@@ -466,6 +995,9 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
         // V key is keycode 9
         if (hasCmd && hasShift && noAlt && noCtrl && keycode == 9) {
             NSLog(@"clippy-picker: Hotkey detected!");
+            uint64_t now = mach_absolute_time();
+            CGEventTimestamp pressed = CGEventGetTimestamp(event);
+            noteHotkeyPressed(now > pressed ? clippy_trace_ticks_to_us(now - pressed) : 0);
             dispatch_async(dispatch_get_main_queue(), ^{
                 [[NSNotificationCenter defaultCenter]
                  postNotificationName:@"ShowPickerNotification" object:nil];
@@ -639,40 +1171,30 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
         return;
     }
 
-    // Read existing pins
-    NSMutableArray *pins = clippy_read_json_array(clippy_pins_path());
+    if ([entry[@"pending"] boolValue]) {
+        NSLog(@"clippy-picker: Image is still being processed");
+        return;
+    }
+
+    NSString *error = nil;
+    NSDictionary *response = clippy_ipc_request(@{@"cmd": @"pin", @"id": @(clippy_entry_id(entry))});
+    if (response) {
+        error = [response[@"ok"] boolValue] ? nil : response[@"error"];
+    } else if (clippy_pins_add(entry, nil, &error) >= 0) {
+        error = nil;
+    }
 
-    // Check pin limit
-    if ([pins count] >= (NSUInteger)clippy_config.maxPins) {
+    if (error) {
         NSAlert *alert = [[NSAlert alloc] init];
-        alert.messageText = @"Pin Limit Reached";
-        alert.informativeText = [NSString stringWithFormat:@"Maximum of %d pins allowed. Unpin some items first.", clippy_config.maxPins];
+        alert.messageText = @"Could Not Pin Item";
+        alert.informativeText = error;
         [alert addButtonWithTitle:@"OK"];
         [alert runModal];
         return;
     }
 
-    // Create pin entry
-    NSMutableDictionary *pin = [NSMutableDictionary dictionary];
-    pin[@"timestamp"] = @((NSUInteger)[[NSDate date] timeIntervalSince1970]);
-
-    NSString *type = entry[@"type"] ?: @"text";
-    pin[@"type"] = type;
-
-    if ([type isEqualToString:@"image"]) {
-        pin[@"path"] = entry[@"path"];
-        pin[@"text"] = entry[@"text"] ?: @"[Image]";
-    } else {
-        pin[@"text"] = entry[@"text"];
-    }
-
-    [pins addObject:pin];
-    clippy_write_json_array(pins, clippy_pins_path());
-
     NSLog(@"clippy-picker: Pinned item");
-
-    // Refresh the picker
-    [self showPicker:nil];
+    [self refreshAfterEdit];
 }
 
 - (void)deleteSelectedItem:(id)sender {
@@ -687,61 +1209,28 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
     NSDictionary *entry = self.filteredHistory[row];
     BOOL isPinned = [entry[@"isPinned"] boolValue];
 
-    if (isPinned) {
-        // Delete from pins
-        NSMutableArray *pins = clippy_read_json_array(clippy_pins_path());
-        NSString *targetText = entry[@"text"];
-        NSNumber *targetTimestamp = entry[@"timestamp"];
-
-        NSUInteger indexToRemove = NSNotFound;
-        for (NSUInteger i = 0; i < [pins count]; i++) {
-            NSDictionary *pin = pins[i];
-            if ([pin[@"text"] isEqualToString:targetText] &&
-                [pin[@"timestamp"] isEqualToNumber:targetTimestamp]) {
-                indexToRemove = i;
-                break;
-            }
-        }
-
-        if (indexToRemove != NSNotFound) {
-            [pins removeObjectAtIndex:indexToRemove];
-            clippy_write_json_array(pins, clippy_pins_path());
-            NSLog(@"clippy-picker: Deleted pinned item");
-        }
-    } else {
-        // Delete from history
-        NSMutableArray *history = clippy_read_json_array(clippy_history_path());
-        NSString *targetText = entry[@"text"];
-        NSNumber *targetTimestamp = entry[@"timestamp"];
-        NSString *type = entry[@"type"] ?: @"text";
-
-        NSUInteger indexToRemove = NSNotFound;
-        for (NSUInteger i = 0; i < [history count]; i++) {
-            NSDictionary *item = history[i];
-            if ([item[@"text"] isEqualToString:targetText] &&
-                [item[@"timestamp"] isEqualToNumber:targetTimestamp]) {
-                indexToRemove = i;
-                break;
-            }
-        }
+    uint64_t targetId = clippy_entry_id(entry);
 
-        if (indexToRemove != NSNotFound) {
-            // If it's an image, delete the file too
-            if ([type isEqualToString:@"image"]) {
-                NSString *imagePath = entry[@"path"];
-                if (imagePath) {
-                    [[NSFileManager defaultManager] removeItemAtPath:imagePath error:nil];
-                }
-            }
+    // clipd applies the change to its copy; without it, edit the files
+    NSDictionary *response = clippy_ipc_request(@{
+        @"cmd": isPinned ? @"unpin" : @"delete",
+        @"id": @(targetId)
+    });
 
-            [history removeObjectAtIndex:indexToRemove];
-            clippy_write_json_array(history, clippy_history_path());
-            NSLog(@"clippy-picker: Deleted history item");
-        }
+    BOOL deleted;
+    if (response) {
+        deleted = [response[@"ok"] boolValue];
+    } else if (isPinned) {
+        deleted = clippy_pins_remove(NSNotFound, targetId) != nil;
+    } else {
+        // Drops the image reference too (file goes with the last one)
+        deleted = clippy_history_remove_id(targetId) != nil;
     }
 
-    // Refresh the picker
-    [self showPicker:nil];
+    if (deleted) {
+        NSLog(@"clippy-picker: Deleted %@ item", isPinned ? @"pinned" : @"history");
+    }
+    [self refreshAfterEdit];
 }
 
 - (void)clearHistory:(id)sender {
@@ -759,31 +1248,300 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
         return;
     }
 
-    NSFileManager *fm = [NSFileManager defaultManager];
-    NSError *error = nil;
+    // Remove history log and legacy files; images go with their last reference
+    if (!clippy_ipc_request(@{@"cmd": @"clear"})) {
+        clippy_history_clear();
+    }
+
+    NSLog(@"clippy-picker: Cleared history and images");
+
+    // The confirmation alert took key status and hid the picker; bring it back
+    [self showPicker:nil];
+}
+
+// ============================================================================
+// History Model
+// ============================================================================
 
-    // Remove history file
-    NSString *historyPath = clippy_history_path();
-    if ([fm fileExistsAtPath:historyPath]) {
-        [fm removeItemAtPath:historyPath error:&error];
+/**
+ * Pins (marked isPinned) followed by history, newest first
+ * History is cut where the model would outgrow max_memory_mb (pins are
+ * always kept); *bytes is its clippy_entry_footprint
+ */
+static NSMutableArray *loadPickerModel(NSUInteger *bytes) {
+    // Straight from clipd's memory when it is running
+    NSDictionary *historyResponse = clippy_ipc_request(@{@"cmd": @"list"});
+    NSDictionary *pinsResponse = historyResponse ? clippy_ipc_request(@{@"cmd": @"pins"}) : nil;
+
+    NSArray *history = [historyResponse[@"ok"] boolValue] ? historyResponse[@"entries"]
+                                                          : clippy_history_load();
+    NSArray *pins = [pinsResponse[@"ok"] boolValue] ? pinsResponse[@"pins"]
+                                                    : clippy_pins_load();
+
+    NSMutableArray *model = [NSMutableArray arrayWithCapacity:[pins count] + [history count]];
+    *bytes = 0;
+    for (NSDictionary *pin in pins) {
+        NSMutableDictionary *marked = [pin mutableCopy];
+        marked[@"isPinned"] = @YES;
+        [model addObject:marked];
+        *bytes += clippy_entry_footprint(marked);
     }
 
-    // Remove backup file
-    NSString *backupPath = [historyPath stringByAppendingString:@".backup"];
-    if ([fm fileExistsAtPath:backupPath]) {
-        [fm removeItemAtPath:backupPath error:nil];
+    NSUInteger budget = clippy_memory_budget_bytes();
+    for (NSDictionary *entry in history) {
+        NSUInteger entryBytes = clippy_entry_footprint(entry);
+        if (*bytes + entryBytes > budget && [model count] > 0) {
+            NSLog(@"clippy-picker: Showing %lu of %lu history items (max_memory_mb = %d)",
+                  (unsigned long)([model count] - [pins count]), (unsigned long)[history count],
+                  clippy_config.maxMemoryMB);
+            break;
+        }
+        [model addObject:entry];
+        *bytes += entryBytes;
     }
+    return model;
+}
 
-    // Remove images directory
-    NSString *imagesPath = clippy_images_dir();
-    if ([fm fileExistsAtPath:imagesPath]) {
-        [fm removeItemAtPath:imagesPath error:nil];
+/**
+ * Search index over the model, with each entry's frecency boost computed
+ * here, once per model rather than per keystroke (pins have none)
+ */
+static ClippySearchIndex *createModelIndex(NSArray *model) {
+    ClippySearchIndex *index = clippy_search_index_create(model);
+    NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+    for (NSUInteger i = 0; index && i < index->count; i++) {
+        if (![model[i][@"isPinned"] boolValue]) {
+            index->entries[i].boost = clippy_frecency_boost(model[i], now);
+        }
     }
+    return index;
+}
 
-    NSLog(@"clippy-picker: Cleared history and images");
+/**
+ * Send clipd the model's size and the process footprint for `clippy stats`
+ */
+- (void)reportMemory:(NSUInteger)modelBytes {
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+        clippy_ipc_request(@{@"cmd": @"report", @"metric": @"picker_memory",
+                             @"bytes": @(modelBytes), @"footprint": @(clippy_trace_footprint_bytes())});
+    });
+}
 
-    // Refresh the picker
-    [self showPicker:nil];
+- (BOOL)modelIsCurrent {
+    return self.modelLoaded &&
+           clippy_file_stamp_equal(self.historyStamp, clippy_file_stamp(clippy_history_log_path())) &&
+           clippy_file_stamp_equal(self.pinsStamp, clippy_file_stamp(clippy_pins_journal_path()));
+}
+
+- (void)installModel:(NSMutableArray *)model
+               index:(ClippySearchIndex *)index
+               bytes:(NSUInteger)bytes
+        historyStamp:(ClippyFileStamp)historyStamp
+           pinsStamp:(ClippyFileStamp)pinsStamp {
+    [self reportMemory:bytes + clippy_search_index_bytes(index)];
+    self.modelGeneration++;
+    self.searchModel = [[ClippySearchModel alloc] initWithEntries:model
+                                                            index:index
+                                                       generation:self.modelGeneration];
+    self.allHistory = model;
+    self.historyStamp = historyStamp;
+    self.pinsStamp = pinsStamp;
+    self.modelLoaded = YES;
+}
+
+/**
+ * Synchronous reload, only when a file changed since the model was built
+ * Stamps are taken before reading so a write racing the read forces a reload
+ * next time rather than being missed
+ */
+- (void)refreshModelIfStale {
+    if ([self modelIsCurrent]) {
+        return;
+    }
+
+    ClippyFileStamp historyStamp = clippy_file_stamp(clippy_history_log_path());
+    ClippyFileStamp pinsStamp = clippy_file_stamp(clippy_pins_journal_path());
+    NSUInteger bytes = 0;
+    NSMutableArray *model = loadPickerModel(&bytes);
+    [self installModel:model
+                 index:createModelIndex(model)
+                 bytes:bytes
+          historyStamp:historyStamp
+             pinsStamp:pinsStamp];
+    [self watchForChanges];
+}
+
+/**
+ * Rebuild the model off the main thread (coalesced), so the window can be
+ * shown straight from memory after clipd appends
+ */
+- (void)refreshModelInBackground {
+    if (self.modelRefreshQueued) {
+        return;
+    }
+    self.modelRefreshQueued = YES;
+    NSUInteger generation = self.modelGeneration;
+
+    dispatch_async(self.modelQueue, ^{
+        ClippyFileStamp historyStamp = clippy_file_stamp(clippy_history_log_path());
+        ClippyFileStamp pinsStamp = clippy_file_stamp(clippy_pins_journal_path());
+        NSUInteger bytes = 0;
+        NSMutableArray *model = loadPickerModel(&bytes);
+        ClippySearchIndex *index = createModelIndex(model);
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            self.modelRefreshQueued = NO;
+            // A synchronous reload that landed meanwhile is at least as fresh
+            if (self.modelGeneration == generation) {
+                [self installModel:model
+                             index:index
+                             bytes:bytes
+                      historyStamp:historyStamp
+                         pinsStamp:pinsStamp];
+            } else {
+                clippy_search_index_free(index);
+            }
+            [self watchForChanges];
+            if (self.prewarmPending) {
+                [self warmWindow];
+            }
+        });
+    });
+}
+
+/**
+ * Watch a file for writes; a delete or rename (atomic rewrite, compaction)
+ * cancels the source so the next refresh re-arms it on the new file
+ */
+- (dispatch_source_t)watchFile:(NSString *)path {
+    int fd = open([path fileSystemRepresentation], O_EVTONLY);
+    if (fd < 0) {
+        return nil;
+    }
+
+    unsigned long mask = DISPATCH_VNODE_WRITE | DISPATCH_VNODE_EXTEND | DISPATCH_VNODE_ATTRIB |
+                         DISPATCH_VNODE_DELETE | DISPATCH_VNODE_RENAME;
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_VNODE, (uintptr_t)fd,
+                                                      mask, dispatch_get_main_queue());
+    if (!source) {
+        close(fd);
+        return nil;
+    }
+
+    __weak typeof(self) weakSelf = self;
+    __weak dispatch_source_t weakSource = source;
+    dispatch_source_set_event_handler(source, ^{
+        dispatch_source_t strongSource = weakSource;
+        if (!strongSource) {
+            return;
+        }
+        if (dispatch_source_get_data(strongSource) & (DISPATCH_VNODE_DELETE | DISPATCH_VNODE_RENAME)) {
+            dispatch_source_cancel(strongSource);
+        }
+        [weakSelf refreshModelInBackground];
+    });
+    dispatch_source_set_cancel_handler(source, ^{
+        close(fd);
+    });
+    dispatch_resume(source);
+    return source;
+}
+
+- (void)armWatchers {
+    if (self.daemonSource) {
+        return;  // clipd pushes changes; no need to watch its files as well
+    }
+    if (!self.historyWatcher || dispatch_source_testcancel(self.historyWatcher)) {
+        self.historyWatcher = [self watchFile:clippy_history_log_path()];
+    }
+    if (!self.pinsWatcher || dispatch_source_testcancel(self.pinsWatcher)) {
+        self.pinsWatcher = [self watchFile:clippy_pins_journal_path()];
+    }
+}
+
+/**
+ * Subscribe to clipd's change events; file watchers cover the gaps when it
+ * isn't running, and a later refresh retries the subscription
+ */
+- (void)subscribeToDaemon {
+    if (self.daemonSource) {
+        return;
+    }
+
+    int fd = clippy_ipc_connect();
+    if (fd < 0) {
+        return;
+    }
+
+    NSMutableData *buffer = [NSMutableData data];
+    NSDictionary *ack = clippy_ipc_send(fd, @{@"cmd": @"subscribe"}) ? clippy_ipc_read_message(fd, buffer) : nil;
+    if (![ack[@"ok"] boolValue]) {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t)fd, 0,
+                                                      dispatch_get_main_queue());
+    if (!source) {
+        close(fd);
+        return;
+    }
+
+    __weak typeof(self) weakSelf = self;
+    dispatch_source_set_event_handler(source, ^{
+        char chunk[4096];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            [weakSelf daemonDisconnected];
+            return;
+        }
+        [buffer appendBytes:chunk length:(NSUInteger)n];
+
+        BOOL changed = NO;
+        BOOL complete = YES;
+        while (complete) {
+            clippy_ipc_take_message(buffer, &complete);
+            changed = changed || complete;
+        }
+        if (changed) {
+            [weakSelf refreshModelInBackground];
+        }
+    });
+    dispatch_source_set_cancel_handler(source, ^{
+        close(fd);
+    });
+    dispatch_resume(source);
+    self.daemonSource = source;
+
+    if (self.historyWatcher) {
+        dispatch_source_cancel(self.historyWatcher);
+    }
+    if (self.pinsWatcher) {
+        dispatch_source_cancel(self.pinsWatcher);
+    }
+    self.historyWatcher = nil;
+    self.pinsWatcher = nil;
+
+    NSLog(@"clippy-picker: Subscribed to clipd updates");
+}
+
+- (void)daemonDisconnected {
+    if (self.daemonSource) {
+        dispatch_source_cancel(self.daemonSource);
+        self.daemonSource = nil;
+    }
+    NSLog(@"clippy-picker: Lost connection to clipd, watching files");
+    [self armWatchers];
+    [self refreshModelInBackground];
+}
+
+- (void)watchForChanges {
+    [self subscribeToDaemon];
+    [self armWatchers];
 }
 
 // ============================================================================
@@ -794,19 +1552,16 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
     (void)sender;
 
     NSLog(@"clippy-picker: Showing picker window");
+    CLIPPY_TRACE_BEGIN(ShowPicker);
 
-    self.allHistory = clippy_read_json_array(clippy_history_path());
-
-    NSArray *pins = clippy_read_json_array(clippy_pins_path());
-    for (NSDictionary *pin in [pins reverseObjectEnumerator]) {
-        NSMutableDictionary *marked = [pin mutableCopy];
-        marked[@"isPinned"] = @YES;
-        [self.allHistory insertObject:marked atIndex:0];
-    }
+    // Normally a no-op: the watchers have already refreshed the model
+    [self refreshModelIfStale];
 
     self.searchField.stringValue = @"";
-    self.filteredHistory = [self.allHistory mutableCopy];
-    [self.tableView reloadData];
+    atomic_fetch_add(&_searchGeneration, 1);
+    self.lastSearchQuery = nil;
+    self.lastSearchCandidates = nil;
+    [self applyFilteredResults:[self.allHistory mutableCopy] keepSelection:NO];
 
     // Center on screen with mouse cursor
     NSPoint mouseLoc = [NSEvent mouseLocation];
@@ -825,13 +1580,14 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
     [self.pickerWindow setFrameOrigin:NSMakePoint(x, y)];
 
     // Activate app and show window
+    BOOL wasVisible = self.pickerWindow.visible;
     [NSApp activateIgnoringOtherApps:YES];
     [self.pickerWindow makeKeyAndOrderFront:nil];
 
     // Ensure search field gets focus - use dispatch to ensure window is ready
     dispatch_async(dispatch_get_main_queue(), ^{
         [self.pickerWindow makeFirstResponder:self.searchField];
-        NSLog(@"clippy-picker: First responder set to search field");
+        os_log_debug(clippy_trace_log(), "First responder set to search field");
 
         // Also select the text field's editor for immediate typing
         NSText *fieldEditor = [self.pickerWindow fieldEditor:YES forObject:self.searchField];
@@ -841,8 +1597,6 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
     });
 
     if ([self.filteredHistory count] > 0) {
-        [self.tableView selectRowIndexes:[NSIndexSet indexSetWithIndex:0]
-                    byExtendingSelection:NO];
         [self.tableView scrollRowToVisible:0];
     }
 
@@ -863,6 +1617,12 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
             });
         }
     }];
+
+    // Already on screen: no occlusion change is coming
+    if (wasVisible) {
+        [self recordOpenLatency];
+    }
+    CLIPPY_TRACE_END(ShowPicker);
 }
 
 - (void)hidePickerWindow {
@@ -874,6 +1634,7 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
         self.clickMonitor = nil;
     }
 
+    takeHotkeyLatencyUs();  // Hidden before its first frame: no sample
     [self.pickerWindow orderOut:nil];
 }
 
@@ -886,48 +1647,131 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
     [self hidePickerWindow];
 }
 
+- (void)windowDidChangeOcclusionState:(NSNotification *)notification {
+    (void)notification;
+    if (self.pickerWindow.occlusionState & NSWindowOcclusionStateVisible) {
+        [self recordOpenLatency];
+    }
+}
+
 // ============================================================================
 // Filter Results
 // ============================================================================
 
 - (void)updateFilteredResults {
+    [self updateFilteredResultsKeepingSelection:NO];
+}
+
+/**
+ * Pin and delete refresh in place: same query, same selected entry (or the
+ * row that took its place)
+ */
+- (void)refreshAfterEdit {
+    [self refreshModelIfStale];
+    [self updateFilteredResultsKeepingSelection:YES];
+}
+
+- (void)updateFilteredResultsKeepingSelection:(BOOL)keepSelection {
     NSString *query = self.searchField.stringValue;
+    uint_fast64_t generation = atomic_fetch_add(&_searchGeneration, 1) + 1;
 
     if ([query length] == 0) {
-        self.filteredHistory = [self.allHistory mutableCopy];
-    } else {
-        NSMutableArray *scored = [NSMutableArray array];
-
-        for (NSDictionary *entry in self.allHistory) {
-            NSString *text = entry[@"text"] ?: @"";
-            NSString *label = entry[@"label"] ?: @"";
+        self.lastSearchQuery = nil;
+        self.lastSearchCandidates = nil;
+        [self applyFilteredResults:[self.allHistory mutableCopy] keepSelection:keepSelection];
+        return;
+    }
 
-            FuzzyMatchResult textMatch = fuzzyMatch(query, text);
-            FuzzyMatchResult labelMatch = fuzzyMatch(query, label);
+    ClippySearchModel *model = self.searchModel;
+    ClippySearchIndex *index = model.index;
+    if (!index) {
+        [self applyFilteredResults:[NSMutableArray array] keepSelection:keepSelection];
+        return;
+    }
 
-            NSInteger bestScore = MAX(textMatch.score, labelMatch.score);
-            BOOL matches = textMatch.matches || labelMatch.matches;
+    // Appending to the query can only shrink the match set, so rescore
+    // the previous survivors instead of the whole history
+    NSString *folded = [query lowercaseString];
+    BOOL narrowing = self.lastSearchQuery && self.lastSearchCandidates &&
+                     self.lastSearchGeneration == model.generation &&
+                     [folded hasPrefix:self.lastSearchQuery];
+    NSData *previous = narrowing ? self.lastSearchCandidates : nil;
+
+    dispatch_async(self.searchQueue, ^{
+        // A newer keystroke is already queued behind us
+        if (atomic_load(&self->_searchGeneration) != generation) {
+            return;
+        }
 
-            if (matches) {
-                [scored addObject:@{
-                    @"entry": entry,
-                    @"score": @(bestScore)
-                }];
-            }
+        NSData *hits = nil;
+        NSData *survivors = nil;
+        const NSUInteger *candidates = previous ? [previous bytes] : NULL;
+        NSUInteger candidateCount = previous ? [previous length] / sizeof(NSUInteger) : 0;
+
+        CLIPPY_TRACE_BEGIN(SearchPass);
+        BOOL finished = searchIndex(index, query, candidates, candidateCount,
+                                    &self->_searchGeneration, generation, &hits, &survivors);
+        CLIPPY_TRACE_END(SearchPass);
+        if (!finished) {
+            return;
+        }
+        uint64_t searchUs = CLIPPY_TRACE_ELAPSED_US(SearchPass);
+        dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+            clippy_ipc_request(@{@"cmd": @"report", @"metric": @"picker_search", @"us": @(searchUs)});
+        });
+
+        const ClippySearchHit *hit = [hits bytes];
+        NSUInteger hitCount = [hits length] / sizeof(ClippySearchHit);
+        NSMutableArray *results = [NSMutableArray arrayWithCapacity:hitCount];
+        for (NSUInteger i = 0; i < hitCount; i++) {
+            [results addObject:model.entries[hit[i].slot]];
         }
 
-        [scored sortUsingComparator:^NSComparisonResult(id a, id b) {
-            return [b[@"score"] compare:a[@"score"]];
-        }];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (atomic_load(&self->_searchGeneration) != generation) {
+                return;
+            }
+            self.lastSearchQuery = folded;
+            self.lastSearchGeneration = model.generation;
+            self.lastSearchCandidates = survivors;
+            [self applyFilteredResults:results keepSelection:keepSelection];
+        });
+    });
+}
 
-        self.filteredHistory = [[scored valueForKey:@"entry"] mutableCopy];
+/**
+ * Show new results, updating only the rows that changed
+ * Selects the top row, or with keepSelection the previously selected entry
+ */
+- (void)applyFilteredResults:(NSMutableArray *)results keepSelection:(BOOL)keepSelection {
+    NSArray *previous = self.filteredHistory ?: @[];
+    NSInteger selectedRow = self.tableView.selectedRow;
+    NSNumber *selectedIdentity = (selectedRow >= 0 && selectedRow < (NSInteger)[previous count])
+                                 ? rowIdentity(previous[selectedRow]) : nil;
+
+    self.filteredHistory = results;
+    if (!applyRowDiff(self.tableView, previous, results)) {
+        [self.tableView reloadData];
     }
 
-    [self.tableView reloadData];
+    if ([results count] == 0) {
+        return;
+    }
 
-    if ([self.filteredHistory count] > 0) {
-        [self.tableView selectRowIndexes:[NSIndexSet indexSetWithIndex:0]
-                    byExtendingSelection:NO];
+    NSUInteger row = 0;
+    if (keepSelection && selectedIdentity) {
+        row = [results indexOfObjectPassingTest:^BOOL(NSDictionary *entry, NSUInteger idx, BOOL *stop) {
+            (void)idx;
+            (void)stop;
+            return [rowIdentity(entry) isEqual:selectedIdentity];
+        }];
+        if (row == NSNotFound) {
+            row = MIN((NSUInteger)selectedRow, [results count] - 1);
+        }
+    }
+    [self.tableView selectRowIndexes:[NSIndexSet indexSetWithIndex:row] byExtendingSelection:NO];
+    if (keepSelection) {
+        [self.tableView scrollRowToVisible:(NSInteger)row];
     }
 }
 
@@ -950,13 +1794,12 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
     }
 
     NSDictionary *entry = self.filteredHistory[row];
-    NSString *text = entry[@"text"] ?: @"";
-    NSNumber *timestamp = entry[@"timestamp"];
+    ClippyDisplayRow *display = [self.searchModel displayRowForEntry:entry];
     NSString *type = entry[@"type"] ?: @"text";
     BOOL isPinned = [entry[@"isPinned"] boolValue];
     NSString *label = entry[@"label"];
 
-    cell.timeLabel.stringValue = timestamp ? clippy_format_timestamp(timestamp) : @"";
+    cell.timeLabel.stringValue = display.timeLabel;
 
     if (isPinned) {
         cell.typeLabel.stringValue = label ? [NSString stringWithFormat:@"📌 %@", label] : @"📌 PIN";
@@ -968,11 +1811,57 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
         cell.typeLabel.stringValue = @"";
     }
 
-    cell.mainLabel.stringValue = clippy_preview_text(text);
+    cell.mainLabel.stringValue = display.preview;
+
+    NSString *imagePath = [type isEqualToString:@"image"] ? entry[@"path"] : nil;
+    [self showThumbnailForImage:imagePath inCell:cell];
 
     return cell;
 }
 
+// ============================================================================
+// Thumbnails
+// ============================================================================
+
+- (void)showThumbnailForImage:(NSString *)imagePath inCell:(ClippyTableCellView *)cell {
+    NSString *thumbPath = imagePath ? clippy_thumbnail_path(imagePath) : nil;
+    cell.thumbnailPath = thumbPath;
+
+    id cached = thumbPath ? [self.thumbnailCache objectForKey:thumbPath] : nil;
+    cell.thumbnailView.image = [cached isKindOfClass:[NSImage class]] ? cached : nil;
+    cell.thumbnailView.hidden = (cell.thumbnailView.image == nil);
+
+    if (!thumbPath || cached || [self.thumbnailsLoading containsObject:thumbPath]) {
+        return;
+    }
+
+    // Decode off the main thread; only rows being displayed ever get here
+    [self.thumbnailsLoading addObject:thumbPath];
+    dispatch_async(self.thumbnailQueue, ^{
+        NSImage *image = [[NSImage alloc] initWithContentsOfFile:thumbPath];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self.thumbnailsLoading removeObject:thumbPath];
+            [self.thumbnailCache setObject:(image ?: [NSNull null]) forKey:thumbPath];
+            [self applyThumbnail:image forPath:thumbPath];
+        });
+    });
+}
+
+- (void)applyThumbnail:(NSImage *)image forPath:(NSString *)thumbPath {
+    if (!image) {
+        return;
+    }
+
+    NSRange visible = [self.tableView rowsInRect:self.tableView.visibleRect];
+    for (NSUInteger row = visible.location; row < NSMaxRange(visible); row++) {
+        ClippyTableCellView *cell = [self.tableView viewAtColumn:0 row:(NSInteger)row makeIfNecessary:NO];
+        if ([cell.thumbnailPath isEqualToString:thumbPath]) {
+            cell.thumbnailView.image = image;
+            cell.thumbnailView.hidden = NO;
+        }
+    }
+}
+
 // ============================================================================
 // Text Field Delegate
 // ============================================================================
@@ -987,7 +1876,7 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
     (void)control;
     (void)textView;
 
-    NSLog(@"clippy-picker: doCommandBySelector: %@", NSStringFromSelector(commandSelector));
+    os_log_debug(clippy_trace_log(), "doCommandBySelector: %{public}s", sel_getName(commandSelector));
 
     // Arrow Up
     if (commandSelector == @selector(moveUp:)) {
@@ -1058,23 +1947,30 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
 // ============================================================================
 
 - (void)copyEntryToClipboard:(NSDictionary *)entry {
+    if ([entry[@"pending"] boolValue]) {
+        NSLog(@"clippy-picker: Image is still being processed");
+        NSBeep();
+        return;
+    }
+    [self recordUse:entry];
+
     NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
     [pasteboard clearContents];
 
-    NSString *type = entry[@"type"] ?: @"text";
-
-    if ([type isEqualToString:@"image"]) {
-        NSString *path = entry[@"path"];
-        if (path && [[NSFileManager defaultManager] fileExistsAtPath:path]) {
-            NSData *imageData = [NSData dataWithContentsOfFile:path];
-            if (imageData) {
-                NSImage *image = [[NSImage alloc] initWithData:imageData];
-                if (image) {
-                    [pasteboard writeObjects:@[image]];
-                    NSLog(@"clippy-picker: Copied image to clipboard");
-                    return;
-                }
-            }
+    // Images, long text and extra representations are promised, so picking
+    // one reads nothing; the data is produced when an app pastes it
+    ClippyPasteboardProvider *provider = nil;
+    if ([clippy_entry_stored_paths(entry) count] > 0 || entry[@"files"]) {
+        provider = [[ClippyPasteboardProvider alloc] initWithEntry:entry];
+    }
+    if (provider) {
+        NSPasteboardItem *item = [[NSPasteboardItem alloc] init];
+        [item setDataProvider:provider forTypes:provider.types];
+        if ([pasteboard writeObjects:[@[item] arrayByAddingObjectsFromArray:[self extraFileItems:entry]]]) {
+            provider.changeCount = pasteboard.changeCount;
+            self.pasteboardProvider = provider;
+            NSLog(@"clippy-picker: Copied to clipboard: %@", clippy_preview_text(entry[@"text"]));
+            return;
         }
     }
 
@@ -1085,6 +1981,60 @@ static CGEventRef hotkeyCallback(CGEventTapProxy proxy, CGEventType type,
     }
 }
 
+/**
+ * Count a paste of a history entry toward its frecency, off the main thread
+ * The new score reaches the model with the history reload clipd triggers.
+ */
+- (void)recordUse:(NSDictionary *)entry {
+    if ([entry[@"isPinned"] boolValue]) {
+        return;
+    }
+    uint64_t entryId = clippy_entry_id(entry);
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+        if (!clippy_ipc_request(@{@"cmd": @"use", @"id": @(entryId)})) {
+            clippy_history_record_use(entryId);
+        }
+    });
+}
+
+/**
+ * Copied files beyond the first (which the promised item carries), one
+ * pasteboard item each
+ */
+- (NSArray *)extraFileItems:(NSDictionary *)entry {
+    NSArray *files = [entry[@"files"] isKindOfClass:[NSArray class]] ? entry[@"files"] : @[];
+    NSMutableArray *items = [NSMutableArray array];
+    for (NSUInteger i = 1; i < [files count]; i++) {
+        NSPasteboardItem *item = [[NSPasteboardItem alloc] init];
+        [item setString:[[NSURL fileURLWithPath:files[i]] absoluteString] forType:NSPasteboardTypeFileURL];
+        [items addObject:item];
+    }
+    return items;
+}
+
+/**
+ * Promises die with the process: if one is still on the pasteboard, write
+ * its data out before quitting
+ */
+- (void)fulfillPasteboardPromise {
+    ClippyPasteboardProvider *provider = self.pasteboardProvider;
+    NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
+    if (!provider || pasteboard.changeCount != provider.changeCount) {
+        return;
+    }
+
+    NSPasteboardItem *item = [[NSPasteboardItem alloc] init];
+    for (NSPasteboardType type in provider.types) {
+        NSData *data = [provider dataForType:type];
+        if (data) {
+            [item setData:data forType:type];
+        }
+    }
+    [pasteboard clearContents];
+    [pasteboard writeObjects:[@[item] arrayByAddingObjectsFromArray:[self extraFileItems:provider.entry]]];
+    self.pasteboardProvider = nil;
+}
+
 @end
 
 // ============================================================================
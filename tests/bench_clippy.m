@@ -0,0 +1,399 @@
+/**
+ * bench_clippy.m - Benchmarks for capture, storage, search and picker open
+ *
+ * Generates synthetic histories (50, 1k, 10k and 100k entries of mixed
+ * length, some Unicode, some images) and times the hot paths against files
+ * in a temporary directory; the real ~/.clippy_data is never touched.
+ *
+ * Each scenario prints one JSON object per line on stdout:
+ *   {"scenario":"...","entries":N,"iterations":N,"ns_per_op":N,
+ *    "p50_ns":N,"p99_ns":N,"allocs_per_op":N}
+ * Progress goes to stderr, so `make bench > before.ndjson` can be diffed
+ * against a later run.
+ *
+ * Build: make bench
+ * Usage: bench_clippy [scenario-substring ...]
+ */
+
+#import <Foundation/Foundation.h>
+#include <mach/mach_time.h>
+#include <stdatomic.h>
+#include "clippy_common.h"
+#include "clippy_ipc.h"
+#include "clippy_search.h"
+#include "clippy_trigram.h"
+
+#define BENCH_TARGET_NS     (300ull * 1000 * 1000)  // Time budget per scenario
+#define BENCH_MIN_ITERATIONS 5
+#define BENCH_MAX_ITERATIONS 2000
+
+// ============================================================================
+// Allocation Counting
+// ============================================================================
+
+/**
+ * libmalloc reports every allocation to malloc_logger when it is set (this
+ * is the hook malloc stack logging uses). Counting calls there covers C
+ * buffers and Objective-C objects alike.
+ */
+typedef void (malloc_logger_t)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3,
+                               uintptr_t result, uint32_t num_hot_frames_to_skip);
+extern malloc_logger_t *malloc_logger;
+
+#define BENCH_MALLOC_LOG_ALLOCATE 2
+
+static atomic_uint_fast64_t allocations = 0;
+
+static void countAllocation(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3,
+                            uintptr_t result, uint32_t skip) {
+    (void)arg1;
+    (void)arg2;
+    (void)arg3;
+    (void)result;
+    (void)skip;
+    if (type & BENCH_MALLOC_LOG_ALLOCATE) {
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    }
+}
+
+// ============================================================================
+// Timing
+// ============================================================================
+
+static uint64_t nowNs(void) {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+static int compareNs(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static NSArray<NSString *> *filters = nil;
+
+/**
+ * Run op until the time budget is spent (within the iteration bounds) and
+ * print its result line. setup, if given, runs untimed before every op.
+ */
+static void bench(NSString *scenario, NSUInteger entries, void (^setup)(void), void (^op)(void)) {
+    BOOL selected = ([filters count] == 0);
+    for (NSString *filter in filters) {
+        selected = selected || [scenario containsString:filter];
+    }
+    if (!selected) {
+        return;
+    }
+    fprintf(stderr, "  %-24s %7lu entries... ", [scenario UTF8String], (unsigned long)entries);
+
+    uint64_t *samples = malloc(BENCH_MAX_ITERATIONS * sizeof(uint64_t));
+    uint64_t total = 0;
+    uint64_t allocs = 0;
+    NSUInteger iterations = 0;
+
+    while (iterations < BENCH_MAX_ITERATIONS &&
+           (iterations < BENCH_MIN_ITERATIONS || total < BENCH_TARGET_NS)) {
+        @autoreleasepool {
+            if (setup) {
+                setup();
+            }
+            uint64_t allocsBefore = atomic_load(&allocations);
+            uint64_t start = nowNs();
+            op();
+            uint64_t elapsed = nowNs() - start;
+            allocs += atomic_load(&allocations) - allocsBefore;
+
+            samples[iterations++] = elapsed;
+            total += elapsed;
+        }
+    }
+
+    qsort(samples, iterations, sizeof(uint64_t), compareNs);
+    uint64_t p50 = samples[iterations / 2];
+    uint64_t p99 = samples[MIN(iterations - 1, iterations * 99 / 100)];
+    free(samples);
+
+    printf("{\"scenario\":\"%s\",\"entries\":%lu,\"iterations\":%lu,\"ns_per_op\":%llu,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"allocs_per_op\":%llu}\n",
+           [scenario UTF8String], (unsigned long)entries, (unsigned long)iterations,
+           (unsigned long long)(total / iterations), (unsigned long long)p50,
+           (unsigned long long)p99, (unsigned long long)(allocs / iterations));
+    fflush(stdout);
+    fprintf(stderr, "%llu ns/op\n", (unsigned long long)(total / iterations));
+}
+
+// ============================================================================
+// Synthetic History
+// ============================================================================
+
+static uint32_t seed = 42;
+
+static uint32_t nextRandom(void) {
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 8;
+}
+
+static NSString *syntheticText(void) {
+    static NSArray *words = nil;
+    if (!words) {
+        words = @[@"git", @"commit", @"https://github.com/", @"token", @"sk_live_", @"SELECT",
+                  @"FROM", @"users", @"WHERE", @"id", @"=", @"function", @"return", @"error:",
+                  @"stack", @"trace", @"at", @"main.m:42", @"ssh", @"deploy", @"email@example.com",
+                  @"café", @"naïve", @"日本語", @"テキスト", @"emoji 😀", @"Ünïcödé"];
+    }
+
+    // Mostly short snippets, some paragraphs, the occasional log dump
+    uint32_t roll = nextRandom() % 100;
+    NSUInteger wordCount = roll < 70 ? 1 + nextRandom() % 8
+                         : roll < 95 ? 20 + nextRandom() % 200
+                         : 1000 + nextRandom() % 2000;
+
+    NSMutableString *text = [NSMutableString string];
+    for (NSUInteger i = 0; i < wordCount; i++) {
+        if (i > 0) {
+            [text appendString:(nextRandom() % 12 == 0) ? @"\n" : @" "];
+        }
+        [text appendString:words[nextRandom() % [words count]]];
+    }
+    return text;
+}
+
+/**
+ * count entries, newest first, about one in twenty an image. Timestamps
+ * step back an hour per entry; expiredEvery > 0 also ages the oldest
+ * 1/expiredEvery of the text entries past max_age_days (order is kept, as
+ * expiry relies on it).
+ */
+static NSArray *syntheticHistory(NSUInteger count, NSUInteger expiredEvery) {
+    seed = 42;
+    NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+    NSTimeInterval expired = now - (clippy_config.maxAgeDays + 1) * 24 * 60 * 60;
+
+    NSMutableArray *entries = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        NSTimeInterval timestamp = now - (NSTimeInterval)i * 3600;
+        if (nextRandom() % 20 == 0) {
+            // No path: nothing here should reach the real image refcounts
+            [entries addObject:@{
+                @"type": @"image",
+                @"text": [NSString stringWithFormat:@"[Image: %u bytes]", 10000 + nextRandom() % 900000],
+                @"hash": clippy_sha256_hex([[NSString stringWithFormat:@"%lu", (unsigned long)i]
+                                            dataUsingEncoding:NSUTF8StringEncoding]),
+                @"timestamp": @(timestamp)
+            }];
+        } else {
+            BOOL old = expiredEvery > 0 && i >= count - count / expiredEvery;
+            [entries addObject:@{
+                @"type": @"text",
+                @"text": syntheticText(),
+                @"timestamp": @(old ? MIN(timestamp, expired - (NSTimeInterval)i) : timestamp)
+            }];
+        }
+    }
+    return entries;
+}
+
+// ============================================================================
+// Scenarios
+// ============================================================================
+
+static NSString *benchDir = nil;
+
+static NSString *benchPath(NSString *name) {
+    return [benchDir stringByAppendingPathComponent:name];
+}
+
+static void benchCapture(NSArray *history) {
+    NSUInteger count = [history count];
+    NSString *logPath = benchPath(@"capture.log");
+    clippy_log_write_entries(logPath, history);
+
+    __block NSUInteger n = 0;
+    bench(@"capture_append", count, nil, ^{
+        clippy_log_append(logPath, @{
+            @"type": @"text",
+            @"text": [NSString stringWithFormat:@"captured snippet %lu", (unsigned long)n++],
+            @"timestamp": @([[NSDate date] timeIntervalSince1970])
+        });
+    });
+
+    // What clipd does for a long copy: hash, compress and key the blob
+    NSString *longText = [@"" stringByPaddingToLength:200000 withString:@"stack frame 0x1f\n"
+                                      startingAtIndex:0];
+    bench(@"capture_compress_blob", count, nil, ^{
+        NSData *utf8 = nil;
+        clippy_text_blob_key(longText, &utf8);
+        clippy_blob_compress(utf8);
+    });
+}
+
+static void benchStorage(NSArray *history) {
+    NSUInteger count = [history count];
+
+    NSString *logPath = benchPath(@"history.log");
+    clippy_log_write_entries(logPath, history);
+    bench(@"history_load", count, nil, ^{
+        clippy_history_entries_from_records(clippy_log_read_records(logPath));
+    });
+    bench(@"history_compact", count, nil, ^{
+        clippy_log_write_entries(logPath, history);
+    });
+    bench(@"history_read_entry", count, nil, ^{
+        NSUInteger total = 0;
+        clippy_log_read_range(logPath, count / 2, 1, &total);
+    });
+
+    NSString *jsonPath = benchPath(@"history.json");
+    clippy_write_json_array(history, jsonPath);
+    bench(@"json_read", count, nil, ^{
+        clippy_read_json_array(jsonPath);
+    });
+    bench(@"json_write", count, nil, ^{
+        clippy_write_json_array(history, jsonPath);
+    });
+
+    // The oldest quarter has expired; the file is restored between runs
+    NSArray *aging = syntheticHistory(count, 4);
+    NSString *agingPath = benchPath(@"aging.json");
+    bench(@"cleanup_old_entries", count, ^{
+        clippy_write_json_array(aging, agingPath);
+    }, ^{
+        clippy_json_array_expire(agingPath, clippy_expiry_cutoff(), YES);
+    });
+    bench(@"expiry_boundary", count, nil, ^{
+        clippy_expiry_boundary(aging, clippy_expiry_cutoff(), YES);
+    });
+}
+
+static void benchSearch(NSArray *history) {
+    NSUInteger count = [history count];
+    NSArray *queries = @[@"g", @"git", @"sk_live", @"trace main", @"日本", @"zzqx"];
+
+    bench(@"fuzzy_match_strings", count, nil, ^{
+        for (NSString *query in queries) {
+            for (NSDictionary *entry in history) {
+                clippy_fuzzy_match(query, entry[@"text"]);
+            }
+        }
+    });
+
+    bench(@"search_index_build", count, nil, ^{
+        clippy_search_index_free(clippy_search_index_create(history));
+    });
+
+    ClippySearchIndex *index = clippy_search_index_create(history);
+    bench(@"search_index_query", count, nil, ^{
+        for (NSString *pattern in queries) {
+            ClippySearchQuery query;
+            ClippySearchTopK top;
+            clippy_search_query_init(&query, pattern);
+            clippy_search_query_prepare(&query, index);
+            clippy_search_topk_init(&top, 200);
+
+            const NSUInteger *slots = index->postings[query.postingBit];
+            NSUInteger slotCount = index->postingCounts[query.postingBit];
+            for (NSUInteger n = 0; n < slotCount; n++) {
+                FuzzyMatchResult match = clippy_search_match_entry(&query, &index->entries[slots[n]]);
+                if (match.matches) {
+                    clippy_search_topk_push(&top, (ClippySearchHit){match.score, slots[n]});
+                }
+            }
+            clippy_search_topk_sort(&top);
+            clippy_search_topk_free(&top);
+            clippy_search_query_free(&query);
+        }
+    });
+    clippy_search_index_free(index);
+
+    __block ClippyTrigramIndex trigrams;
+    clippy_trigram_index_init(&trigrams);
+    bench(@"trigram_index_build", count, nil, ^{
+        clippy_trigram_index_load(&trigrams, history);
+    });
+    bench(@"trigram_search", count, nil, ^{
+        NSMutableData *candidates = [NSMutableData data];
+        for (NSString *query in queries) {
+            if (!clippy_trigram_index_candidates(&trigrams, query, candidates)) {
+                continue;
+            }
+            const NSUInteger *positions = [candidates bytes];
+            NSString *folded = [query lowercaseString];
+            for (NSUInteger n = 0; n < [candidates length] / sizeof(NSUInteger); n++) {
+                [[history[positions[n]][@"text"] lowercaseString] containsString:folded];
+            }
+        }
+    });
+    clippy_trigram_index_free(&trigrams);
+}
+
+/**
+ * Opening the picker after history changed: fetch the list as clipd sends
+ * it, decode it and index it for search (the window itself isn't timed)
+ */
+static void benchPickerOpen(NSArray *history) {
+    NSUInteger count = [history count];
+    NSDictionary *response = @{@"ok": @YES, @"entries": history, @"total": @(count)};
+
+    bench(@"picker_open", count, nil, ^{
+        NSData *line = clippy_log_encode_record(response);
+        NSMutableData *buffer = [line mutableCopy];
+        BOOL complete = NO;
+        NSDictionary *decoded = clippy_ipc_take_message(buffer, &complete);
+        clippy_search_index_free(clippy_search_index_create(decoded[@"entries"]));
+    });
+
+    // One screenful of rows as the picker and `clippy list` format them
+    NSArray *visible = [history subarrayWithRange:NSMakeRange(0, MIN(count, (NSUInteger)20))];
+    bench(@"picker_rows", count, nil, ^{
+        for (NSDictionary *entry in visible) {
+            clippy_preview_text(entry[@"text"]);
+            clippy_format_timestamp(entry[@"timestamp"]);
+        }
+    });
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+int main(int argc, const char *argv[]) {
+    @autoreleasepool {
+        NSMutableArray *selected = [NSMutableArray array];
+        for (int i = 1; i < argc; i++) {
+            [selected addObject:@(argv[i])];
+        }
+        filters = selected;
+
+        benchDir = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                    [NSString stringWithFormat:@"clippy_bench_%d", getpid()]];
+        [[NSFileManager defaultManager] createDirectoryAtPath:benchDir
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:nil];
+
+        // No trimming: every scenario sees its full history
+        clippy_config.maxHistoryItems = INT_MAX;
+        malloc_logger = countAllocation;
+
+        fprintf(stderr, "\n=== Clippy Benchmarks ===\n\n");
+        NSUInteger sizes[] = {50, 1000, 10000, 100000};
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            @autoreleasepool {
+                NSArray *history = syntheticHistory(sizes[s], 0);
+                benchCapture(history);
+                benchStorage(history);
+                benchSearch(history);
+                benchPickerOpen(history);
+            }
+        }
+        fprintf(stderr, "\n");
+
+        malloc_logger = NULL;
+        [[NSFileManager defaultManager] removeItemAtPath:benchDir error:nil];
+    }
+    return 0;
+}
@@ -7,6 +7,8 @@
 
 #import <Foundation/Foundation.h>
 #include "clippy_common.h"
+#include "clippy_ipc.h"
+#include "clippy_trace.h"
 
 // ============================================================================
 // Test Framework
@@ -61,6 +63,7 @@ static int tests_failed = 0;
 static NSString *testHistoryPath = nil;
 static NSString *testPinsPath = nil;
 static NSString *testConfigPath = nil;
+static NSString *testLogPath = nil;
 
 void setup(void) {
     // Use temp directory for test files
@@ -68,9 +71,13 @@ void setup(void) {
     testHistoryPath = [tempDir stringByAppendingPathComponent:@"test_clipboard_history"];
     testPinsPath = [tempDir stringByAppendingPathComponent:@"test_clipboard_pins"];
     testConfigPath = [tempDir stringByAppendingPathComponent:@"test_clippy.conf"];
+    testLogPath = [tempDir stringByAppendingPathComponent:@"test_history.log"];
 
     // Clean up any existing test files
     NSFileManager *fm = [NSFileManager defaultManager];
+    [fm removeItemAtPath:testLogPath error:nil];
+    [fm removeItemAtPath:[testLogPath stringByAppendingString:@".lock"] error:nil];
+    [fm removeItemAtPath:clippy_log_index_path(testLogPath) error:nil];
     [fm removeItemAtPath:testHistoryPath error:nil];
     [fm removeItemAtPath:testPinsPath error:nil];
     [fm removeItemAtPath:testConfigPath error:nil];
@@ -80,6 +87,9 @@ void setup(void) {
 
 void teardown(void) {
     NSFileManager *fm = [NSFileManager defaultManager];
+    [fm removeItemAtPath:testLogPath error:nil];
+    [fm removeItemAtPath:[testLogPath stringByAppendingString:@".lock"] error:nil];
+    [fm removeItemAtPath:clippy_log_index_path(testLogPath) error:nil];
     [fm removeItemAtPath:testHistoryPath error:nil];
     [fm removeItemAtPath:testPinsPath error:nil];
     [fm removeItemAtPath:testConfigPath error:nil];
@@ -87,6 +97,19 @@ void teardown(void) {
     [fm removeItemAtPath:[testPinsPath stringByAppendingString:@".backup"] error:nil];
 }
 
+// Tests that store files run against a scratch data directory
+void setup_data_dir(void) {
+    setup();
+    clippy_data_dir_override = [NSTemporaryDirectory() stringByAppendingPathComponent:@"test_clippy_data"];
+    [[NSFileManager defaultManager] removeItemAtPath:clippy_data_dir_override error:nil];
+}
+
+void teardown_data_dir(void) {
+    [[NSFileManager defaultManager] removeItemAtPath:clippy_data_dir_override error:nil];
+    clippy_data_dir_override = nil;
+    teardown();
+}
+
 // ============================================================================
 // Tests: File Path Helpers
 // ============================================================================
@@ -131,23 +154,30 @@ TEST(json_read_nonexistent) {
     ASSERT_EQ([read count], 0);
 }
 
-TEST(json_backup_created) {
-    // Write initial data
+TEST(json_write_compact) {
     NSMutableArray *data1 = [NSMutableArray arrayWithObject:@{@"text": @"first"}];
     clippy_write_json_array(data1, testHistoryPath);
-
-    // Write new data (should create backup)
     NSMutableArray *data2 = [NSMutableArray arrayWithObject:@{@"text": @"second"}];
     clippy_write_json_array(data2, testHistoryPath);
 
-    // Check backup exists
+    // One atomic write per save: no backup copy, no pretty-printing
     NSString *backupPath = [testHistoryPath stringByAppendingString:@".backup"];
-    ASSERT([[NSFileManager defaultManager] fileExistsAtPath:backupPath]);
+    ASSERT(![[NSFileManager defaultManager] fileExistsAtPath:backupPath]);
+    NSString *content = [NSString stringWithContentsOfFile:testHistoryPath
+                                                  encoding:NSUTF8StringEncoding
+                                                     error:nil];
+    ASSERT_STR_EQ(content, @"[{\"text\":\"second\"}]");
+}
 
-    // Check backup contains old data
-    NSMutableArray *backup = clippy_read_json_array(backupPath);
-    ASSERT_EQ([backup count], 1);
-    ASSERT_STR_EQ(backup[0][@"text"], @"first");
+TEST(json_backup_recovery) {
+    // Backups left by earlier versions still rescue a corrupted file
+    NSString *backupPath = [testHistoryPath stringByAppendingString:@".backup"];
+    [@"[{\"text\":\"saved\"}]" writeToFile:backupPath atomically:YES encoding:NSUTF8StringEncoding error:nil];
+    [@"[{\"text\":" writeToFile:testHistoryPath atomically:YES encoding:NSUTF8StringEncoding error:nil];
+
+    NSMutableArray *read = clippy_read_json_array(testHistoryPath);
+    ASSERT_EQ([read count], 1);
+    ASSERT_STR_EQ(read[0][@"text"], @"saved");
 }
 
 TEST(json_corrupted_returns_empty) {
@@ -162,6 +192,564 @@ TEST(json_corrupted_returns_empty) {
     ASSERT_EQ([read count], 0);
 }
 
+// ============================================================================
+// Tests: Journal
+// ============================================================================
+
+TEST(journal_checksums_and_torn_tail) {
+    ASSERT(clippy_crc32("123456789", 9) == 0xCBF43926u);
+
+    ASSERT(clippy_journal_append_locked(testLogPath, @{@"op": @"add", @"pin": @{@"id": @1}}));
+    ASSERT(clippy_journal_append_locked(testLogPath, @{@"op": @"remove", @"id": @1}));
+    ASSERT_EQ([clippy_journal_read(testLogPath) count], 2);
+
+    // A flipped byte ends the replay there; a torn append is ignored
+    NSMutableData *data = [NSMutableData dataWithContentsOfFile:testLogPath];
+    NSData *third = clippy_journal_encode_record(@{@"op": @"expire", @"before": @5});
+    [data appendData:third];
+    [data appendData:[third subdataWithRange:NSMakeRange(0, [third length] / 2)]];
+    [data writeToFile:testLogPath atomically:YES];
+    ASSERT_EQ([clippy_journal_read(testLogPath) count], 3);
+
+    ((char *)[data mutableBytes])[12] ^= 0x01;  // Inside the first record's JSON
+    [data writeToFile:testLogPath atomically:YES];
+    ASSERT_EQ([clippy_journal_read(testLogPath) count], 0);
+}
+
+TEST(journal_append_after_torn_tail) {
+    ASSERT(clippy_journal_append_locked(testLogPath, @{@"op": @"add", @"pin": @{@"id": @1}}));
+    NSData *torn = clippy_journal_encode_record(@{@"op": @"remove", @"id": @1});
+    NSFileHandle *handle = [NSFileHandle fileHandleForWritingAtPath:testLogPath];
+    [handle seekToEndOfFile];
+    [handle writeData:[torn subdataWithRange:NSMakeRange(0, [torn length] / 2)]];
+    [handle closeFile];
+
+    // The writer cuts the fragment off, so its record is the next one read
+    NSUInteger validLength = 0;
+    ASSERT_EQ([clippy_journal_read_valid(testLogPath, &validLength) count], 1);
+    ASSERT(clippy_journal_truncate_locked(testLogPath, validLength));
+    ASSERT(clippy_journal_append_locked(testLogPath, @{@"op": @"add", @"pin": @{@"id": @2}}));
+    ASSERT(clippy_journal_append_locked(testLogPath, @{@"op": @"remove", @"id": @1}));
+
+    NSMutableArray *records = clippy_journal_read(testLogPath);
+    ASSERT_EQ([records count], 3);
+    ASSERT([records[1][@"pin"][@"id"] isEqual:@2]);
+    ASSERT_STR_EQ(records[2][@"op"], @"remove");
+
+    // An intact journal is left alone
+    NSUInteger intactLength = 0;
+    clippy_journal_read_valid(testLogPath, &intactLength);
+    ASSERT(clippy_journal_truncate_locked(testLogPath, intactLength));
+    ASSERT_EQ([clippy_journal_read(testLogPath) count], 3);
+}
+
+TEST(pins_journal_replay) {
+    NSMutableArray *pins = [NSMutableArray arrayWithObject:@{@"text": @"legacy", @"timestamp": @(10)}];
+    NSArray *records = @[
+        @{@"op": @"add", @"pin": @{@"id": @(7000), @"text": @"a", @"timestamp": @(20)}},
+        @{@"op": @"add", @"pin": @{@"id": @(8000), @"text": @"b", @"timestamp": @(30)}},
+        @{@"op": @"remove", @"id": @(7000)},
+        @{@"op": @"expire", @"before": @(15)}
+    ];
+
+    // Replaying twice (crash between checkpoint and journal reset) is harmless
+    for (int pass = 0; pass < 2; pass++) {
+        for (NSDictionary *record in records) {
+            clippy_pins_apply(pins, record);
+        }
+    }
+    ASSERT_EQ([pins count], 1);
+    ASSERT_STR_EQ(pins[0][@"text"], @"b");
+}
+
+// ============================================================================
+// Tests: Record Log
+// ============================================================================
+
+TEST(log_append_read) {
+    ASSERT(clippy_log_append(testLogPath, @{@"text": @"first", @"timestamp": @(1)}));
+    ASSERT(clippy_log_append(testLogPath, @{@"text": @"second", @"timestamp": @(2)}));
+
+    NSMutableArray *records = clippy_log_read_records(testLogPath);
+    ASSERT_EQ([records count], 2);
+    ASSERT_STR_EQ(records[0][@"text"], @"first");
+    ASSERT_STR_EQ(records[1][@"text"], @"second");
+}
+
+TEST(log_append_batch) {
+    ASSERT(clippy_log_append_batch(testLogPath, @[]));
+    ASSERT(clippy_log_append(testLogPath, @{@"text": @"before"}));
+    ASSERT(clippy_log_append_batch(testLogPath, @[@{@"text": @"one"}, @{@"text": @"two\nlines"}, @{@"text": @"three"}]));
+
+    NSMutableArray *records = clippy_log_read_records(testLogPath);
+    ASSERT_EQ([records count], 4);
+    ASSERT_STR_EQ(records[0][@"text"], @"before");
+    ASSERT_STR_EQ(records[2][@"text"], @"two\nlines");
+    ASSERT_STR_EQ(records[3][@"text"], @"three");
+}
+
+TEST(log_read_last) {
+    ASSERT(clippy_log_read_last(testLogPath) == nil);
+
+    clippy_log_append(testLogPath, @{@"text": @"one"});
+    clippy_log_append(testLogPath, @{@"text": @"two\nlines"});
+    ASSERT_STR_EQ(clippy_log_read_last(testLogPath)[@"text"], @"two\nlines");
+
+    // Entries larger than one tail chunk
+    NSString *big = [@"" stringByPaddingToLength:CLIPPY_LOG_TAIL_CHUNK * 3 withString:@"x" startingAtIndex:0];
+    clippy_log_append(testLogPath, @{@"text": big});
+    ASSERT_STR_EQ(clippy_log_read_last(testLogPath)[@"text"], big);
+}
+
+TEST(log_torn_tail_ignored) {
+    clippy_log_append(testLogPath, @{@"text": @"intact"});
+
+    // Simulate a crash mid-append
+    NSFileHandle *handle = [NSFileHandle fileHandleForWritingAtPath:testLogPath];
+    [handle seekToEndOfFile];
+    [handle writeData:[@"{\"text\":\"tor" dataUsingEncoding:NSUTF8StringEncoding]];
+    [handle closeFile];
+
+    NSMutableArray *records = clippy_log_read_records(testLogPath);
+    ASSERT_EQ([records count], 1);
+    ASSERT_STR_EQ(clippy_log_read_last(testLogPath)[@"text"], @"intact");
+
+    // Later appends, single and batched, land after the cut-off fragment
+    ASSERT(clippy_log_append(testLogPath, @{@"text": @"after"}));
+    handle = [NSFileHandle fileHandleForWritingAtPath:testLogPath];
+    [handle seekToEndOfFile];
+    [handle writeData:[@"{\"te" dataUsingEncoding:NSUTF8StringEncoding]];
+    [handle closeFile];
+    ASSERT(clippy_log_append_batch(testLogPath, @[@{@"text": @"one"}, @{@"text": @"two"}]));
+
+    records = clippy_log_read_records(testLogPath);
+    ASSERT_EQ([records count], 4);
+    ASSERT_STR_EQ(records[1][@"text"], @"after");
+    ASSERT_STR_EQ(records[3][@"text"], @"two");
+    ASSERT_STR_EQ(clippy_log_read_last(testLogPath)[@"text"], @"two");
+}
+
+TEST(log_write_entries_compacts) {
+    clippy_log_append(testLogPath, @{@"text": @"stale"});
+
+    // In-memory order is newest first, on-disk order is oldest first
+    NSArray *entries = @[@{@"text": @"newer"}, @{@"text": @"older"}];
+    ASSERT(clippy_log_write_entries(testLogPath, entries));
+
+    NSMutableArray *records = clippy_log_read_records(testLogPath);
+    ASSERT_EQ([records count], 2);
+    ASSERT_STR_EQ(records[0][@"text"], @"older");
+    ASSERT_STR_EQ(clippy_log_read_last(testLogPath)[@"text"], @"newer");
+
+    NSDictionary *attrs = [[NSFileManager defaultManager] attributesOfItemAtPath:testLogPath error:nil];
+    ASSERT_EQ([attrs[NSFilePosixPermissions] intValue] & 0777, 0600);
+}
+
+TEST(log_replay_ops) {
+    NSArray *records = @[
+        @{@"text": @"a", @"timestamp": @(1)},
+        @{@"type": @"image", @"text": @"[Image: processing]", @"pending": @YES, @"timestamp": @(2)},
+        @{@"op": @"update", @"ts": @(2), @"set": @{@"path": @"/tmp/x.png"}, @"unset": @[@"pending"]},
+        @{@"text": @"c", @"timestamp": @(3)},
+        @{@"op": @"remove", @"ts": @(1)},
+        @{@"op": @"update", @"ts": @(99), @"set": @{@"text": @"orphan"}}
+    ];
+
+    NSMutableArray *history = clippy_history_entries_from_records(records);
+    ASSERT_EQ([history count], 2);
+    ASSERT_STR_EQ(history[0][@"text"], @"c");
+    ASSERT_STR_EQ(history[1][@"path"], @"/tmp/x.png");
+    ASSERT(history[1][@"pending"] == nil);
+}
+
+TEST(log_replay_move) {
+    NSArray *records = @[
+        @{@"text": @"a", @"timestamp": @(1)},
+        @{@"text": @"b", @"timestamp": @(2)},
+        @{@"op": @"move", @"ts": @(1), @"to": @(3)},
+        @{@"op": @"update", @"ts": @(3), @"set": @{@"label": @"moved"}},
+        @{@"op": @"move", @"ts": @(1), @"to": @(4)}
+    ];
+
+    // The old timestamp no longer names anything once moved
+    NSMutableArray *history = clippy_history_entries_from_records(records);
+    ASSERT_EQ([history count], 2);
+    ASSERT_STR_EQ(history[0][@"text"], @"a");
+    ASSERT_EQ([history[0][@"timestamp"] intValue], 3);
+    ASSERT_STR_EQ(history[0][@"label"], @"moved");
+    ASSERT_STR_EQ(history[1][@"text"], @"b");
+}
+
+TEST(entry_ids) {
+    NSNumber *first = clippy_new_entry_id();
+    NSNumber *second = clippy_new_entry_id();
+    ASSERT([second unsignedLongLongValue] > [first unsignedLongLongValue]);
+    ASSERT([first unsignedLongLongValue] < (1ull << 53));
+    ASSERT(([first unsignedLongLongValue] & ((1u << CLIPPY_ID_SEQUENCE_BITS) - 1)) != 0);
+
+    // Records without an id get the same one from every reader
+    NSDictionary *legacy = @{@"text": @"a", @"timestamp": @(1700000000.25)};
+    ASSERT(clippy_entry_id(legacy) == clippy_id_for_timestamp(1700000000.25));
+    ASSERT(clippy_entry_id(@{@"id": first, @"timestamp": @(1)}) == [first unsignedLongLongValue]);
+    ASSERT(clippy_entry_id(@{@"text": @"no timestamp"}) == 0);
+
+    NSArray *pins = @[legacy, @{@"id": second, @"text": @"b"}];
+    ASSERT_EQ(clippy_index_of_entry_id(pins, [second unsignedLongLongValue]), 1);
+    ASSERT(clippy_index_of_entry_id(pins, 42) == NSNotFound);
+}
+
+TEST(log_replay_by_id) {
+    NSArray *records = @[
+        @{@"text": @"legacy", @"timestamp": @(1)},
+        @{@"id": @(5000), @"text": @"b", @"timestamp": @(1)},
+        @{@"id": @(6000), @"text": @"c", @"timestamp": @(2)},
+        @{@"op": @"move", @"id": @(clippy_id_for_timestamp(1)), @"to": @(3)},
+        @{@"op": @"update", @"id": @(clippy_id_for_timestamp(1)), @"set": @{@"label": @"moved"}},
+        @{@"op": @"remove", @"id": @(6000)},
+        @{@"op": @"update", @"id": @(6000), @"set": @{@"text": @"orphan"}}
+    ];
+
+    // Entries sharing a timestamp stay apart, and a moved legacy entry keeps
+    // the id it was derived with
+    NSMutableArray *history = clippy_history_entries_from_records(records);
+    ASSERT_EQ([history count], 2);
+    ASSERT_STR_EQ(history[0][@"text"], @"legacy");
+    ASSERT_STR_EQ(history[0][@"label"], @"moved");
+    ASSERT(clippy_entry_id(history[0]) == clippy_id_for_timestamp(1));
+    ASSERT_STR_EQ(history[1][@"text"], @"b");
+    ASSERT(clippy_entry_id(history[1]) == 5000);
+}
+
+TEST(frecency_decays_and_replays) {
+    NSTimeInterval now = 1700000000;
+    NSTimeInterval halfLife = CLIPPY_FRECENCY_HALF_LIFE_SEC;
+    NSDictionary *unused = @{@"id": @(7000), @"text": @"a"};
+    ASSERT(clippy_frecency_uses(unused, now) == 0);
+    ASSERT_EQ(clippy_frecency_boost(unused, now), 0);
+
+    // Two uses now count twice one, and halve after a half-life
+    NSDictionary *once = @{@"id": @(7000), @"frecency": @(clippy_frecency_after_use(unused, now))};
+    NSDictionary *twice = @{@"id": @(7000), @"frecency": @(clippy_frecency_after_use(once, now))};
+    ASSERT(fabs(clippy_frecency_uses(once, now) - 1.0) < 1e-6);
+    ASSERT(fabs(clippy_frecency_uses(twice, now) - 2.0) < 1e-6);
+    ASSERT(fabs(clippy_frecency_uses(twice, now + halfLife) - 1.0) < 1e-6);
+    ASSERT(clippy_frecency_boost(twice, now) > clippy_frecency_boost(once, now));
+    ASSERT(clippy_frecency_boost(once, now + 10 * halfLife) < clippy_frecency_boost(once, now));
+
+    // Many uses are capped
+    NSDictionary *busy = once;
+    for (int i = 0; i < 1000; i++) {
+        busy = @{@"id": @(7000), @"frecency": @(clippy_frecency_after_use(busy, now))};
+    }
+    ASSERT_EQ(clippy_frecency_boost(busy, now), CLIPPY_FRECENCY_MAX_BOOST);
+
+    // Uses are folded in at replay, so two writers' uses both count and
+    // survive later moves
+    NSArray *records = @[
+        @{@"id": @(7000), @"text": @"a", @"timestamp": @(1)},
+        clippy_history_use_record(7000, now),
+        @{@"op": @"move", @"id": @(7000), @"to": @(2)},
+        clippy_history_use_record(7000, now)
+    ];
+    NSMutableArray *history = clippy_history_entries_from_records(records);
+    ASSERT_EQ([history count], 1);
+    ASSERT(fabs(clippy_frecency_uses(history[0], now) - 2.0) < 1e-6);
+}
+
+TEST(log_index_partial_reads) {
+    NSMutableArray *entries = [NSMutableArray array];
+    for (int i = 5; i >= 1; i--) {
+        [entries addObject:@{@"id": @(i * 1000), @"text": [NSString stringWithFormat:@"e%d", i], @"timestamp": @(i)}];
+    }
+    ASSERT(clippy_log_write_entries(testLogPath, entries));
+    ASSERT(clippy_log_index_current(testLogPath));
+
+    NSUInteger total = 0;
+    NSArray *range = clippy_log_read_range(testLogPath, 1, 2, &total);
+    ASSERT_EQ(total, 5);
+    ASSERT_EQ([range count], 2);
+    ASSERT_STR_EQ(range[0][@"text"], @"e4");
+    ASSERT_STR_EQ(range[1][@"text"], @"e3");
+
+    // Records appended since the index are overlaid as a full replay would
+    clippy_log_append_batch(testLogPath, @[
+        @{@"id": @(6000), @"text": @"e6", @"timestamp": @(6)},
+        clippy_history_update_record(4000, @{@"label": @"kept"}, nil),
+        clippy_history_remove_record(3000),
+        clippy_history_move_record(2000, @(7)),
+        clippy_history_update_record(2000, @{@"label": @"moved"}, nil),
+        @{@"op": @"expire", @"before": @(1.5)}
+    ]);
+    ASSERT(!clippy_log_index_current(testLogPath));
+
+    NSArray *replayed = clippy_history_entries_from_records(clippy_log_read_records(testLogPath));
+    ASSERT_EQ([replayed count], 4);
+    ASSERT([clippy_log_read_range(testLogPath, 0, 0, &total) isEqualToArray:replayed]);
+    ASSERT_EQ(total, 4);
+    for (NSUInteger start = 0; start <= 4; start++) {
+        NSArray *one = clippy_log_read_range(testLogPath, start, 1, &total);
+        ASSERT([one isEqualToArray:[replayed subarrayWithRange:NSMakeRange(start, MIN(1, 4 - start))]]);
+    }
+
+    // Many ops on indexed entries, and one naming its entry by timestamp
+    NSMutableArray *ops = [NSMutableArray array];
+    for (int i = 0; i < 50; i++) {
+        [ops addObject:clippy_history_use_record(i % 2 ? 4000 : 5000, 100 + i)];
+    }
+    [ops addObject:@{@"op": @"update", @"ts": @(5), @"set": @{@"label": @"by time"}}];
+    clippy_log_append_batch(testLogPath, ops);
+    replayed = clippy_history_entries_from_records(clippy_log_read_records(testLogPath));
+    ASSERT([clippy_log_read_range(testLogPath, 0, 0, &total) isEqualToArray:replayed]);
+    ASSERT_STR_EQ(clippy_log_read_range(testLogPath, 2, 1, &total)[0][@"label"], @"by time");
+
+    // A log replaced behind the index's back is read in full
+    [[NSFileManager defaultManager] removeItemAtPath:testLogPath error:nil];
+    clippy_log_append(testLogPath, @{@"text": @"fresh", @"timestamp": @(8)});
+    range = clippy_log_read_range(testLogPath, 0, 0, &total);
+    ASSERT_EQ(total, 1);
+    ASSERT_STR_EQ(range[0][@"text"], @"fresh");
+}
+
+TEST(sha256_hex) {
+    NSData *data = [@"abc" dataUsingEncoding:NSUTF8StringEncoding];
+    ASSERT_STR_EQ(clippy_sha256_hex(data),
+                  @"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+}
+
+TEST(text_blob_round_trip) {
+    NSMutableString *text = [NSMutableString string];
+    for (int i = 0; i < 5000; i++) {
+        [text appendFormat:@"line %d: stack frame \u00e9\n", i];
+    }
+    NSData *utf8 = [text dataUsingEncoding:NSUTF8StringEncoding];
+
+    NSData *blob = clippy_blob_compress(utf8);
+    ASSERT(blob != nil);
+    ASSERT([blob length] < [utf8 length]);
+    ASSERT([clippy_blob_decompress(blob) isEqualToData:utf8]);
+    ASSERT(clippy_blob_decompress([@"junk" dataUsingEncoding:NSUTF8StringEncoding]) == nil);
+
+    // Only entries with a readable blob resolve to more than their preview
+    NSString *blobPath = [testLogPath stringByAppendingPathExtension:@CLIPPY_BLOB_EXTENSION];
+    ASSERT([blob writeToFile:blobPath atomically:YES]);
+    NSDictionary *entry = @{@"type": @"text", @"text": @"line 0", @"blob": blobPath};
+    ASSERT_STR_EQ(clippy_entry_full_text(entry), text);
+    ASSERT_STR_EQ(clippy_entry_stored_path(entry), blobPath);
+    ASSERT_STR_EQ(clippy_entry_full_text(@{@"text": @"plain"}), @"plain");
+    [[NSFileManager defaultManager] removeItemAtPath:blobPath error:nil];
+    ASSERT_STR_EQ(clippy_entry_full_text(entry), @"line 0");
+}
+
+TEST(text_blob_preview_keeps_characters_whole) {
+    int saved = clippy_config.maxEntryLength;
+    clippy_config.maxEntryLength = 3;
+
+    ASSERT(!clippy_text_needs_blob(@"abc"));
+    ASSERT(clippy_text_needs_blob(@"abcd"));
+    ASSERT_STR_EQ(clippy_text_blob_preview(@"abcdef"), @"abc");
+    // An emoji is two UTF-16 units and must not be cut in half
+    ASSERT_STR_EQ(clippy_text_blob_preview(@"ab\U0001F600cd"), @"ab\U0001F600");
+
+    clippy_config.maxEntryLength = saved;
+}
+
+TEST(entry_stored_paths_include_reps) {
+    NSDictionary *entry = @{
+        @"type": @"text", @"text": @"preview", @"blob": @"/tmp/a.lzfse",
+        @"reps": @{@"rtf": @"/tmp/b.lzfse"}, @"files": @[@"/tmp/file.txt"]
+    };
+    NSArray *paths = clippy_entry_stored_paths(entry);
+    ASSERT_EQ([paths count], 2);
+    ASSERT_STR_EQ(paths[0], @"/tmp/a.lzfse");
+    ASSERT_STR_EQ(paths[1], @"/tmp/b.lzfse");
+
+    ASSERT_EQ([clippy_entry_stored_paths(@{@"type": @"image", @"path": @"/tmp/c.png"}) count], 1);
+    ASSERT_EQ([clippy_entry_stored_paths(@{@"text": @"plain", @"reps": @"junk"}) count], 0);
+    ASSERT(clippy_entry_rep_data(entry, @"html") == nil);
+    ASSERT(clippy_store_rep([@"big" dataUsingEncoding:NSUTF8StringEncoding], 0) == nil);
+}
+
+TEST(capture_after_placeholder_deleted) {
+    ASSERT(clippy_ensure_data_dir());
+    NSString *logPath = clippy_history_log_path();
+    NSDictionary *placeholder = @{@"id": @(7000), @"type": @"image", @"text": @"[Image: processing]",
+                                  @"pending": @YES, @"timestamp": @(1)};
+    ASSERT(clippy_log_append(logPath, placeholder));
+
+    // The capture job stores its file, and the entry is deleted meanwhile
+    NSData *png = [@"not really a png" dataUsingEncoding:NSUTF8StringEncoding];
+    NSString *path = clippy_store_image(png, nil);
+    ASSERT(path != nil);
+    ASSERT_EQ([clippy_image_refs_read()[[path lastPathComponent]] intValue], 1);
+    ASSERT(clippy_log_append(logPath, clippy_history_remove_record(7000)));
+
+    NSArray *history = clippy_history_entries_from_records(clippy_log_read_records(logPath));
+    ASSERT_EQ(clippy_index_of_entry_id(history, 7000), NSNotFound);
+    NSDictionary *set = @{@"path": path, @"text": @"[Image: 16 bytes]"};
+    ASSERT(clippy_image_capture_record(nil, set) == nil);
+
+    // Nothing owns the stored file, so its reference goes and the file with it
+    clippy_image_release(path);
+    ASSERT(![[NSFileManager defaultManager] fileExistsAtPath:path]);
+    ASSERT(clippy_image_refs_read()[[path lastPathComponent]] == nil);
+
+    // A live placeholder is settled in place
+    NSDictionary *record = clippy_image_capture_record(placeholder, set);
+    ASSERT(clippy_log_append(logPath, placeholder));
+    ASSERT(clippy_log_append(logPath, record));
+    history = clippy_history_entries_from_records(clippy_log_read_records(logPath));
+    ASSERT_EQ([history count], 1);
+    ASSERT_STR_EQ(history[0][@"path"], path);
+    ASSERT(history[0][@"pending"] == nil);
+}
+
+TEST(capture_types_and_text_budget) {
+    ASSERT_EQ(clippy_parse_capture_types(@"text, RTF,bogus"), CLIPPY_CAPTURE_TEXT | CLIPPY_CAPTURE_RTF);
+    ASSERT_EQ(clippy_parse_capture_types(@"files,html,image"),
+              CLIPPY_CAPTURE_FILES | CLIPPY_CAPTURE_HTML | CLIPPY_CAPTURE_IMAGE);
+    ASSERT_EQ(clippy_parse_capture_types(@"nothing"), 0);
+
+    int saved = clippy_config.maxTextKB;
+    clippy_config.maxTextKB = 1;
+
+    NSString *fits = [@"" stringByPaddingToLength:1024 withString:@"x" startingAtIndex:0];
+    ASSERT(clippy_text_fit_budget(fits) == fits);
+
+    // Two UTF-8 bytes per character: 512 of them fill the budget
+    NSString *wide = [@"" stringByPaddingToLength:1000 withString:@"\u00e9" startingAtIndex:0];
+    NSString *cut = clippy_text_fit_budget(wide);
+    ASSERT_EQ([cut length], 512);
+    ASSERT([cut lengthOfBytesUsingEncoding:NSUTF8StringEncoding] <= 1024);
+
+    // An emoji straddling the limit is dropped whole
+    NSString *emoji = [[@"" stringByPaddingToLength:1022 withString:@"x" startingAtIndex:0]
+                       stringByAppendingString:@"\U0001F600"];
+    ASSERT_STR_EQ(clippy_text_fit_budget(emoji), [emoji substringToIndex:1022]);
+
+    clippy_config.maxTextKB = saved;
+}
+
+TEST(history_memory_budget) {
+    int savedItems = clippy_config.maxHistoryItems;
+    int savedMemory = clippy_config.maxMemoryMB;
+    clippy_config.maxHistoryItems = 10;
+    clippy_config.maxMemoryMB = 1;
+
+    // About 400 KB each as UTF-16: two fit in a megabyte, three don't
+    NSString *big = [@"" stringByPaddingToLength:200000 withString:@"x" startingAtIndex:0];
+    NSMutableArray *history = [NSMutableArray array];
+    for (int i = 0; i < 4; i++) {
+        [history addObject:@{@"text": big, @"timestamp": @(4 - i)}];
+    }
+    ASSERT(clippy_entry_footprint(history[0]) > 400000);
+    ASSERT_EQ(clippy_history_keep_count(history), 2);
+
+    // The newest entry stays however large it is, and the item cap still applies
+    clippy_config.maxMemoryMB = 0;
+    ASSERT_EQ(clippy_history_keep_count(history), 1);
+    clippy_config.maxMemoryMB = 64;
+    clippy_config.maxHistoryItems = 3;
+    ASSERT_EQ(clippy_history_keep_count(history), 3);
+    ASSERT_EQ(clippy_history_keep_count(@[]), 0);
+
+    clippy_config.maxHistoryItems = savedItems;
+    clippy_config.maxMemoryMB = savedMemory;
+}
+
+TEST(file_stamp_tracks_changes) {
+    ClippyFileStamp missing = clippy_file_stamp(testLogPath);
+    ASSERT(!missing.exists);
+    ASSERT(clippy_file_stamp_equal(missing, clippy_file_stamp(testLogPath)));
+
+    clippy_log_append(testLogPath, @{@"text": @"one"});
+    ClippyFileStamp first = clippy_file_stamp(testLogPath);
+    ASSERT(first.exists);
+    ASSERT(!clippy_file_stamp_equal(missing, first));
+    ASSERT(clippy_file_stamp_equal(first, clippy_file_stamp(testLogPath)));
+
+    // Append grows the file; an atomic rewrite replaces the inode
+    clippy_log_append(testLogPath, @{@"text": @"two"});
+    ClippyFileStamp appended = clippy_file_stamp(testLogPath);
+    ASSERT(!clippy_file_stamp_equal(first, appended));
+
+    clippy_log_write_entries(testLogPath, @[@{@"text": @"two"}, @{@"text": @"one"}]);
+    ASSERT(!clippy_file_stamp_equal(appended, clippy_file_stamp(testLogPath)));
+}
+
+// ============================================================================
+// Tests: IPC Framing
+// ============================================================================
+
+TEST(ipc_take_message_framing) {
+    NSMutableData *buffer = [[@"{\"cmd\":\"list\"}\n{\"cmd\"" dataUsingEncoding:NSUTF8StringEncoding] mutableCopy];
+    BOOL complete = NO;
+
+    NSDictionary *first = clippy_ipc_take_message(buffer, &complete);
+    ASSERT(complete);
+    ASSERT_STR_EQ(first[@"cmd"], @"list");
+
+    // Partial line stays buffered until its newline arrives
+    ASSERT(clippy_ipc_take_message(buffer, &complete) == nil);
+    ASSERT(!complete);
+    [buffer appendData:[@":\"pins\"}\nnot json\n" dataUsingEncoding:NSUTF8StringEncoding]];
+    ASSERT_STR_EQ(clippy_ipc_take_message(buffer, &complete)[@"cmd"], @"pins");
+
+    ASSERT(clippy_ipc_take_message(buffer, &complete) == nil);
+    ASSERT(complete);
+    ASSERT_EQ([buffer length], 0);
+}
+
+TEST(ipc_round_trip) {
+    int fds[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    ASSERT(clippy_ipc_send(fds[0], @{@"cmd": @"get", @"index": @2}));
+    ASSERT(clippy_ipc_send(fds[0], @{@"cmd": @"pins"}));
+
+    NSMutableData *buffer = [NSMutableData data];
+    NSDictionary *first = clippy_ipc_read_message(fds[1], buffer);
+    ASSERT_STR_EQ(first[@"cmd"], @"get");
+    ASSERT_EQ([first[@"index"] intValue], 2);
+    ASSERT_STR_EQ(clippy_ipc_read_message(fds[1], buffer)[@"cmd"], @"pins");
+
+    // EOF with nothing buffered
+    close(fds[0]);
+    ASSERT(clippy_ipc_read_message(fds[1], buffer) == nil);
+    close(fds[1]);
+}
+
+// ============================================================================
+// Tests: Stats
+// ============================================================================
+
+TEST(histogram_percentiles) {
+    ClippyHistogram histogram = {0};
+    ASSERT_EQ(clippy_histogram_percentile(&histogram, 0.5), 0);
+
+    for (int i = 0; i < 98; i++) {
+        clippy_histogram_record(&histogram, 10);    // Bucket [8, 16)
+    }
+    clippy_histogram_record(&histogram, 5000);      // Bucket [4096, 8192)
+    clippy_histogram_record(&histogram, 5000);
+
+    ASSERT_EQ(histogram.count, 100);
+    ASSERT_EQ(histogram.totalUs, 10980);
+    ASSERT_EQ(histogram.maxUs, 5000);
+    ASSERT_EQ(clippy_histogram_percentile(&histogram, 0.50), 15);
+    ASSERT_EQ(clippy_histogram_percentile(&histogram, 0.99), 5000);  // Capped at the max
+
+    NSDictionary *summary = clippy_histogram_dictionary(&histogram);
+    ASSERT_EQ([summary[@"buckets"] count], 13);  // Trailing empty buckets dropped
+    ASSERT_EQ([summary[@"buckets"][3] intValue], 98);
+    ASSERT_EQ([summary[@"p99_us"] intValue], 5000);
+}
+
+TEST(io_counters_track_writes) {
+    uint64_t before = atomic_load(&clippy_stat_bytes_written);
+    ASSERT(clippy_log_append(testLogPath, @{@"text": @"counted", @"timestamp": @1}));
+    ASSERT(atomic_load(&clippy_stat_bytes_written) > before);
+}
+
 // ============================================================================
 // Tests: Display Helpers
 // ============================================================================
@@ -187,6 +775,22 @@ TEST(preview_text_newlines) {
     ASSERT(![preview containsString:@"\r"]);
 }
 
+TEST(preview_text_matches_full_rewrite) {
+    // Carriage returns dropped before the cut, long tails never affect it
+    NSMutableString *text = [NSMutableString string];
+    for (int i = 0; i < 500; i++) {
+        [text appendString:@"ab\r\n"];
+    }
+    NSString *expected = [[text stringByReplacingOccurrencesOfString:@"\n" withString:@"↵"]
+                          stringByReplacingOccurrencesOfString:@"\r" withString:@""];
+    expected = [[expected substringToIndex:CLIPPY_PREVIEW_LENGTH] stringByAppendingString:@"..."];
+    ASSERT_STR_EQ(clippy_preview_text(text), expected);
+
+    NSString *exact = [@"" stringByPaddingToLength:CLIPPY_PREVIEW_LENGTH withString:@"y" startingAtIndex:0];
+    ASSERT_STR_EQ(clippy_preview_text([exact stringByAppendingString:@"\r"]), exact);
+    ASSERT_STR_EQ(clippy_preview_text(nil), @"");
+}
+
 TEST(format_timestamp_today) {
     NSNumber *now = @([[NSDate date] timeIntervalSince1970]);
     NSString *formatted = clippy_format_timestamp(now);
@@ -200,6 +804,16 @@ TEST(format_timestamp_yesterday) {
     ASSERT([formatted hasPrefix:@"Yesterday"]);
 }
 
+TEST(format_timestamp_older) {
+    NSTimeInterval lastWeek = [[NSDate date] timeIntervalSince1970] - (7 * 24 * 60 * 60);
+    NSString *formatted = clippy_format_timestamp(@(lastWeek));
+    ASSERT(![formatted hasPrefix:@"Today"]);
+    ASSERT(![formatted hasPrefix:@"Yesterday"]);
+
+    // Shared formatters: same input, same label
+    ASSERT_STR_EQ(clippy_format_timestamp(@(lastWeek)), formatted);
+}
+
 // ============================================================================
 // Tests: Configuration
 // ============================================================================
@@ -234,7 +848,7 @@ TEST(cleanup_old_entries) {
     clippy_write_json_array(data, testHistoryPath);
 
     // Run cleanup
-    NSUInteger removed = clippy_cleanup_old_entries(testHistoryPath);
+    NSUInteger removed = clippy_json_array_expire(testHistoryPath, clippy_expiry_cutoff(), YES);
     ASSERT_EQ(removed, 1);
 
     // Verify only recent entry remains
@@ -243,6 +857,67 @@ TEST(cleanup_old_entries) {
     ASSERT_STR_EQ(read[0][@"text"], @"recent");
 }
 
+TEST(expiry_boundary_binary_search) {
+    NSMutableArray *newestFirst = [NSMutableArray array];
+    for (int i = 0; i < 9; i++) {
+        [newestFirst addObject:@{@"text": @"x", @"timestamp": @(100 - i * 10)}];  // 100 ... 20
+    }
+    ASSERT_EQ(clippy_expiry_boundary(newestFirst, 45, YES), 6);  // 40, 30, 20 expired
+    ASSERT_EQ(clippy_expiry_boundary(newestFirst, 0, YES), 9);
+    ASSERT_EQ(clippy_expiry_boundary(newestFirst, 1000, YES), 0);
+    ASSERT_EQ(clippy_expiry_boundary(@[], 45, YES), 0);
+
+    NSArray *oldestFirst = [[newestFirst reverseObjectEnumerator] allObjects];
+    ASSERT_EQ(clippy_expiry_boundary(oldestFirst, 45, NO), 3);
+    ASSERT_EQ(clippy_expiry_boundary(oldestFirst, 0, NO), 0);
+}
+
+TEST(expiry_keeps_time_order) {
+    // An imported entry without a timestamp never expires
+    NSMutableArray *history = [@[@{@"text": @"b", @"timestamp": @(100)},
+                                 @{@"text": @"d", @"timestamp": @(10)}] mutableCopy];
+    ASSERT_EQ(clippy_history_merge(history, @[@{@"text": @"forever"}, @{@"text": @"c", @"timestamp": @(50)}]), 2);
+    ASSERT_STR_EQ(history[0][@"text"], @"forever");
+    ASSERT_EQ(clippy_expiry_boundary(history, 60, YES), 2);
+
+    // Compaction writes oldest first; replaying an expire keeps it too
+    NSMutableArray *records = [[[history reverseObjectEnumerator] allObjects] mutableCopy];
+    [records addObject:@{@"op": @"expire", @"before": @(60)}];
+    NSMutableArray *replayed = clippy_history_entries_from_records(records);
+    ASSERT_EQ([replayed count], 2);
+    ASSERT_STR_EQ(replayed[0][@"text"], @"forever");
+    ASSERT_STR_EQ(replayed[1][@"text"], @"b");
+
+    // Out of order anyway: only the expired run at the old end goes
+    NSArray *stepped = @[@{@"timestamp": @(100)}, @{@"timestamp": @(10)},
+                         @{@"timestamp": @(90)}, @{@"timestamp": @(5)}];
+    ASSERT_EQ(clippy_expiry_boundary(stepped, 50, YES), 3);
+    ASSERT_EQ(clippy_expiry_boundary([[stepped reverseObjectEnumerator] allObjects], 50, NO), 1);
+
+    // New entries never sort behind one stamped before the clock stepped back
+    NSNumber *ahead = @([[NSDate date] timeIntervalSince1970] + 3600);
+    ASSERT([clippy_next_timestamp(@[@{@"timestamp": ahead}], YES) isEqual:ahead]);
+    ASSERT([clippy_next_timestamp(@[@{@"timestamp": @(5)}, @{@"timestamp": ahead}], NO) isEqual:ahead]);
+    ASSERT([clippy_next_timestamp(@[], YES) doubleValue] < [ahead doubleValue]);
+}
+
+TEST(log_replay_expire) {
+    NSArray *records = @[
+        @{@"text": @"old", @"timestamp": @(10)},
+        @{@"text": @"kept", @"timestamp": @(20)},
+        @{@"text": @"moved", @"timestamp": @(5)},
+        @{@"op": @"move", @"ts": @(5), @"to": @(30)},
+        @{@"op": @"expire", @"before": @(15)},
+        @{@"text": @"new", @"timestamp": @(40)}
+    ];
+
+    NSMutableArray *history = clippy_history_entries_from_records(records);
+    ASSERT_EQ([history count], 3);
+    ASSERT_STR_EQ(history[0][@"text"], @"new");
+    ASSERT_STR_EQ(history[1][@"text"], @"moved");
+    ASSERT_STR_EQ(history[2][@"text"], @"kept");
+}
+
 // ============================================================================
 // Tests: File Permissions
 // ============================================================================
@@ -288,20 +963,90 @@ int main(int argc, const char *argv[]) {
         teardown();
 
         setup();
-        RUN_TEST(json_backup_created);
+        RUN_TEST(json_write_compact);
+        teardown();
+
+        setup();
+        RUN_TEST(json_backup_recovery);
         teardown();
 
         setup();
         RUN_TEST(json_corrupted_returns_empty);
         teardown();
 
+        printf("\nJournal Tests:\n");
+        setup();
+        RUN_TEST(journal_checksums_and_torn_tail);
+        teardown();
+
+        setup();
+        RUN_TEST(journal_append_after_torn_tail);
+        RUN_TEST(pins_journal_replay);
+        teardown();
+
+        printf("\nRecord Log Tests:\n");
+        setup();
+        RUN_TEST(log_append_read);
+        teardown();
+
+        setup();
+        RUN_TEST(log_append_batch);
+        teardown();
+
+        setup();
+        RUN_TEST(log_read_last);
+        teardown();
+
+        setup();
+        RUN_TEST(log_torn_tail_ignored);
+        teardown();
+
+        setup();
+        RUN_TEST(log_write_entries_compacts);
+        teardown();
+
+        setup();
+        RUN_TEST(log_replay_ops);
+        RUN_TEST(log_replay_move);
+        RUN_TEST(entry_ids);
+        RUN_TEST(log_replay_by_id);
+        RUN_TEST(frecency_decays_and_replays);
+        RUN_TEST(log_index_partial_reads);
+        RUN_TEST(sha256_hex);
+        teardown();
+
+        setup();
+        RUN_TEST(file_stamp_tracks_changes);
+        RUN_TEST(text_blob_round_trip);
+        RUN_TEST(text_blob_preview_keeps_characters_whole);
+        RUN_TEST(entry_stored_paths_include_reps);
+        RUN_TEST(capture_types_and_text_budget);
+        RUN_TEST(history_memory_budget);
+        teardown();
+
+        setup_data_dir();
+        RUN_TEST(capture_after_placeholder_deleted);
+        teardown_data_dir();
+
+        printf("\nIPC Tests:\n");
+        RUN_TEST(ipc_take_message_framing);
+        RUN_TEST(ipc_round_trip);
+
+        printf("\nStats Tests:\n");
+        setup();
+        RUN_TEST(histogram_percentiles);
+        RUN_TEST(io_counters_track_writes);
+        teardown();
+
         printf("\nDisplay Helper Tests:\n");
         setup();
         RUN_TEST(preview_text_short);
         RUN_TEST(preview_text_long);
         RUN_TEST(preview_text_newlines);
+        RUN_TEST(preview_text_matches_full_rewrite);
         RUN_TEST(format_timestamp_today);
         RUN_TEST(format_timestamp_yesterday);
+        RUN_TEST(format_timestamp_older);
         teardown();
 
         printf("\nConfiguration Tests:\n");
@@ -312,6 +1057,9 @@ int main(int argc, const char *argv[]) {
         printf("\nCleanup Tests:\n");
         setup();
         RUN_TEST(cleanup_old_entries);
+        RUN_TEST(expiry_boundary_binary_search);
+        RUN_TEST(expiry_keeps_time_order);
+        RUN_TEST(log_replay_expire);
         teardown();
 
         printf("\nPermissions Tests:\n");
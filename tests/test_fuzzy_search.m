@@ -5,6 +5,8 @@
  */
 
 #import <Foundation/Foundation.h>
+#include "clippy_search.h"
+#include "clippy_trigram.h"
 
 // ============================================================================
 // Test Framework
@@ -53,15 +55,11 @@ static int tests_failed = 0;
 } while(0)
 
 // ============================================================================
-// Fuzzy Search Implementation (copied from clippy_picker.m for testing)
+// Reference Implementation (original NSString-based matcher)
 // ============================================================================
 
-typedef struct {
-    BOOL matches;
-    NSInteger score;
-} FuzzyMatchResult;
-
-static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
+// The indexed matcher in clippy_search.h must score exactly like this
+static FuzzyMatchResult referenceFuzzyMatch(NSString *pattern, NSString *text) {
     FuzzyMatchResult result = {NO, 0};
 
     if (!pattern || [pattern length] == 0) {
@@ -125,23 +123,23 @@ static FuzzyMatchResult fuzzyMatch(NSString *pattern, NSString *text) {
 // ============================================================================
 
 TEST(empty_pattern_matches_all) {
-    FuzzyMatchResult result = fuzzyMatch(@"", @"hello world");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"", @"hello world");
     ASSERT(result.matches);
     ASSERT_EQ(result.score, 0);
 }
 
 TEST(empty_text_no_match) {
-    FuzzyMatchResult result = fuzzyMatch(@"hello", @"");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"hello", @"");
     ASSERT(!result.matches);
 }
 
 TEST(nil_pattern_matches_all) {
-    FuzzyMatchResult result = fuzzyMatch(nil, @"hello");
+    FuzzyMatchResult result = clippy_fuzzy_match(nil, @"hello");
     ASSERT(result.matches);
 }
 
 TEST(nil_text_no_match) {
-    FuzzyMatchResult result = fuzzyMatch(@"hello", nil);
+    FuzzyMatchResult result = clippy_fuzzy_match(@"hello", nil);
     ASSERT(!result.matches);
 }
 
@@ -150,31 +148,31 @@ TEST(nil_text_no_match) {
 // ============================================================================
 
 TEST(exact_match) {
-    FuzzyMatchResult result = fuzzyMatch(@"hello", @"hello");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"hello", @"hello");
     ASSERT(result.matches);
     ASSERT_GT(result.score, 0);
 }
 
 TEST(substring_match) {
-    FuzzyMatchResult result = fuzzyMatch(@"ell", @"hello");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"ell", @"hello");
     ASSERT(result.matches);
     ASSERT_GT(result.score, 0);
 }
 
 TEST(scattered_match) {
-    FuzzyMatchResult result = fuzzyMatch(@"hlo", @"hello");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"hlo", @"hello");
     ASSERT(result.matches);
 }
 
 TEST(no_match) {
-    FuzzyMatchResult result = fuzzyMatch(@"xyz", @"hello");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"xyz", @"hello");
     ASSERT(!result.matches);
     ASSERT_EQ(result.score, 0);
 }
 
 TEST(case_insensitive) {
-    FuzzyMatchResult result1 = fuzzyMatch(@"HELLO", @"hello");
-    FuzzyMatchResult result2 = fuzzyMatch(@"hello", @"HELLO");
+    FuzzyMatchResult result1 = clippy_fuzzy_match(@"HELLO", @"hello");
+    FuzzyMatchResult result2 = clippy_fuzzy_match(@"hello", @"HELLO");
     ASSERT(result1.matches);
     ASSERT(result2.matches);
 }
@@ -185,8 +183,8 @@ TEST(case_insensitive) {
 
 TEST(consecutive_scores_higher) {
     // "hel" in "hello" (consecutive) should score higher than "hlo" (scattered)
-    FuzzyMatchResult consecutive = fuzzyMatch(@"hel", @"hello");
-    FuzzyMatchResult scattered = fuzzyMatch(@"hlo", @"hello");
+    FuzzyMatchResult consecutive = clippy_fuzzy_match(@"hel", @"hello");
+    FuzzyMatchResult scattered = clippy_fuzzy_match(@"hlo", @"hello");
 
     ASSERT(consecutive.matches);
     ASSERT(scattered.matches);
@@ -195,8 +193,8 @@ TEST(consecutive_scores_higher) {
 
 TEST(start_match_scores_higher) {
     // Matching at start should score higher
-    FuzzyMatchResult startMatch = fuzzyMatch(@"hel", @"hello world");
-    FuzzyMatchResult midMatch = fuzzyMatch(@"wor", @"hello world");
+    FuzzyMatchResult startMatch = clippy_fuzzy_match(@"hel", @"hello world");
+    FuzzyMatchResult midMatch = clippy_fuzzy_match(@"wor", @"hello world");
 
     ASSERT(startMatch.matches);
     ASSERT(midMatch.matches);
@@ -205,14 +203,14 @@ TEST(start_match_scores_higher) {
 
 TEST(word_boundary_bonus) {
     // "wo" at word start in "hello world" should get bonus
-    FuzzyMatchResult result = fuzzyMatch(@"w", @"hello world");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"w", @"hello world");
     ASSERT(result.matches);
     ASSERT_GT(result.score, 0);
 }
 
 TEST(earlier_position_scores_higher) {
-    FuzzyMatchResult early = fuzzyMatch(@"a", @"abc");
-    FuzzyMatchResult late = fuzzyMatch(@"c", @"abc");
+    FuzzyMatchResult early = clippy_fuzzy_match(@"a", @"abc");
+    FuzzyMatchResult late = clippy_fuzzy_match(@"c", @"abc");
 
     ASSERT(early.matches);
     ASSERT(late.matches);
@@ -224,23 +222,23 @@ TEST(earlier_position_scores_higher) {
 // ============================================================================
 
 TEST(api_key_search) {
-    FuzzyMatchResult result = fuzzyMatch(@"sk-", @"sk-proj-abc123xyz");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"sk-", @"sk-proj-abc123xyz");
     ASSERT(result.matches);
 }
 
 TEST(email_search) {
-    FuzzyMatchResult result = fuzzyMatch(@"email", @"my-email@example.com");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"email", @"my-email@example.com");
     ASSERT(result.matches);
 }
 
 TEST(url_search) {
-    FuzzyMatchResult result = fuzzyMatch(@"github", @"https://github.com/user/repo");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"github", @"https://github.com/user/repo");
     ASSERT(result.matches);
 }
 
 TEST(partial_command) {
     // Common use case: searching for commands
-    FuzzyMatchResult result = fuzzyMatch(@"gits", @"git status");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"gits", @"git status");
     ASSERT(result.matches);
 }
 
@@ -249,25 +247,429 @@ TEST(partial_command) {
 // ============================================================================
 
 TEST(single_char_match) {
-    FuzzyMatchResult result = fuzzyMatch(@"h", @"hello");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"h", @"hello");
     ASSERT(result.matches);
 }
 
 TEST(pattern_longer_than_text) {
-    FuzzyMatchResult result = fuzzyMatch(@"hello world", @"hi");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"hello world", @"hi");
     ASSERT(!result.matches);
 }
 
 TEST(special_characters) {
-    FuzzyMatchResult result = fuzzyMatch(@"@", @"email@test.com");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"@", @"email@test.com");
     ASSERT(result.matches);
 }
 
 TEST(unicode_characters) {
-    FuzzyMatchResult result = fuzzyMatch(@"caf", @"cafe");
+    FuzzyMatchResult result = clippy_fuzzy_match(@"caf", @"cafe");
     ASSERT(result.matches);
 }
 
+// ============================================================================
+// Tests: Search Index
+// ============================================================================
+
+static NSArray *equivalenceTexts(void) {
+    return @[
+        @"", @"hello", @"HELLO", @"hello world", @"abc", @"git status",
+        @"sk-proj-abc123xyz", @"my-email@example.com", @"https://github.com/user/repo",
+        @"email@test.com", @"café au lait", @"Straße", @"İstanbul", @"tab\tseparated\nlines",
+        @"The quick brown fox jumps over the lazy dog, then naps; the end.",
+        @"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+    ];
+}
+
+static NSArray *equivalencePatterns(void) {
+    return @[
+        @"", @"h", @"hel", @"hlo", @"HELLO", @"wor", @"w", @"a", @"c", @"xyz",
+        @"sk-", @"email", @"github", @"gits", @"@", @"caf", @"café", @"ss",
+        @"istanbul", @"the", @"tfjold", @"aaaa", @"hello world", @"t s",
+    ];
+}
+
+TEST(indexed_scores_identical) {
+    for (NSString *text in equivalenceTexts()) {
+        for (NSString *pattern in equivalencePatterns()) {
+            FuzzyMatchResult expected = referenceFuzzyMatch(pattern, text);
+            FuzzyMatchResult actual = clippy_fuzzy_match(pattern, text);
+            ASSERT_EQ(actual.matches, expected.matches);
+            ASSERT_EQ(actual.score, expected.score);
+        }
+    }
+}
+
+TEST(indexed_nil_inputs) {
+    FuzzyMatchResult nilPattern = clippy_fuzzy_match(nil, @"hello");
+    ASSERT(nilPattern.matches);
+    ASSERT_EQ(nilPattern.score, 0);
+
+    FuzzyMatchResult nilText = clippy_fuzzy_match(@"hello", nil);
+    ASSERT(!nilText.matches);
+}
+
+TEST(index_entry_best_of_text_and_label) {
+    NSArray *entries = @[
+        @{@"text": @"unrelated", @"label": @"github token"},
+        @{@"text": @"https://github.com"},
+        @{@"label": @"nothing"},
+    ];
+    ClippySearchIndex *index = clippy_search_index_create(entries);
+    ASSERT(index != NULL);
+    ASSERT_EQ(index->count, 3);
+
+    ClippySearchQuery query;
+    clippy_search_query_init(&query, @"git");
+
+    for (NSUInteger i = 0; i < index->count; i++) {
+        NSString *text = entries[i][@"text"] ?: @"";
+        NSString *label = entries[i][@"label"] ?: @"";
+        FuzzyMatchResult textMatch = referenceFuzzyMatch(@"git", text);
+        FuzzyMatchResult labelMatch = referenceFuzzyMatch(@"git", label);
+
+        FuzzyMatchResult match = clippy_search_match_entry(&query, &index->entries[i]);
+        ASSERT_EQ(match.matches, textMatch.matches || labelMatch.matches);
+        ASSERT_EQ(match.score, MAX(textMatch.score, labelMatch.score));
+    }
+    ASSERT(!clippy_search_match_entry(&query, &index->entries[2]).matches);
+
+    clippy_search_query_free(&query);
+    clippy_search_index_free(index);
+}
+
+TEST(prefiltered_index_scores_identical) {
+    NSMutableArray *entries = [NSMutableArray array];
+    for (NSString *text in equivalenceTexts()) {
+        [entries addObject:@{@"text": text}];
+    }
+    ClippySearchIndex *index = clippy_search_index_create(entries);
+    ASSERT(index != NULL);
+
+    for (NSString *pattern in equivalencePatterns()) {
+        ClippySearchQuery query;
+        clippy_search_query_init(&query, pattern);
+        clippy_search_query_prepare(&query, index);
+
+        for (NSUInteger i = 0; i < index->count; i++) {
+            FuzzyMatchResult expected = referenceFuzzyMatch(pattern, entries[i][@"text"]);
+            FuzzyMatchResult actual = clippy_search_match_text(&query, &index->entries[i].text);
+            ASSERT_EQ(actual.matches, expected.matches);
+            ASSERT_EQ(actual.score, expected.score);
+        }
+        clippy_search_query_free(&query);
+    }
+    clippy_search_index_free(index);
+}
+
+TEST(prefilter_rejects_missing_chars) {
+    ClippySearchIndex *index = clippy_search_index_create(@[@{@"text": @"hello, world"}]);
+    const ClippySearchText *text = &index->entries[0].text;
+
+    ClippySearchQuery query;
+    clippy_search_query_init(&query, @"hz");
+    ASSERT(!clippy_search_may_match(&query, text));
+    clippy_search_query_free(&query);
+
+    // ';' shares a mask bucket with ' '; only the scan can rule it out
+    ClippySearchQuery bucketed;
+    clippy_search_query_init(&bucketed, @";h");
+    clippy_search_query_prepare(&bucketed, index);
+    ASSERT(bucketed.hasScanChar);
+    ASSERT(!clippy_search_may_match(&bucketed, text));
+    clippy_search_query_free(&bucketed);
+
+    clippy_search_index_free(index);
+}
+
+// The picker rescans only previous survivors when the query grows
+TEST(extended_query_matches_subset) {
+    for (NSString *text in equivalenceTexts()) {
+        for (NSString *pattern in equivalencePatterns()) {
+            for (NSUInteger len = 1; len < [pattern length]; len++) {
+                NSString *prefix = [pattern substringToIndex:len];
+                if (clippy_fuzzy_match(pattern, text).matches) {
+                    ASSERT(clippy_fuzzy_match(prefix, text).matches);
+                }
+            }
+        }
+    }
+}
+
+TEST(find_char_across_vector_widths) {
+    unichar chars[40];
+    for (NSUInteger i = 0; i < 40; i++) {
+        chars[i] = 'a';
+    }
+    for (NSUInteger pos = 0; pos < 40; pos++) {
+        chars[pos] = 'x';
+        ASSERT_EQ(clippy_search_find(chars, 40, 0, 'x'), pos);
+        ASSERT_EQ(clippy_search_find(chars, 40, pos + 1, 'x'), NSNotFound);
+        ASSERT_EQ(clippy_search_find(chars, pos, 0, 'x'), NSNotFound);
+        chars[pos] = 'a';
+    }
+}
+
+TEST(ascii_text_takes_byte_path) {
+    ClippySearchText ascii, wide;
+    clippy_search_text_init(&ascii, @"Hello, World");
+    clippy_search_text_init(&wide, @"Héllo, World");
+    ASSERT(ascii.ascii != NULL && ascii.chars == NULL);
+    ASSERT(wide.chars != NULL && wide.ascii == NULL);
+    ASSERT_EQ(ascii.length, 12);
+    ASSERT_EQ(ascii.ascii[0], 'h');  // Folded in place
+    ASSERT(clippy_search_is_boundary(&ascii, 7));  // After ' '
+    ASSERT(!clippy_search_is_boundary(&ascii, 8));
+
+    // Both paths score the shared ASCII suffix the same way
+    ClippySearchQuery query;
+    clippy_search_query_init(&query, @"wrld");
+    ASSERT_EQ(clippy_search_match_text(&query, &ascii).score,
+              clippy_search_match_text(&query, &wide).score);
+    clippy_search_query_free(&query);
+
+    clippy_search_text_free(&ascii);
+    clippy_search_text_free(&wide);
+}
+
+TEST(index_texts_share_arena) {
+    NSMutableArray *entries = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 2000; i++) {
+        // Non-ASCII entries take back their discarded ASCII attempt
+        NSString *text = i % 3 ? [NSString stringWithFormat:@"entry %lu, git status", (unsigned long)i]
+                               : [NSString stringWithFormat:@"entrée %lu, git status", (unsigned long)i];
+        [entries addObject:@{@"text": text, @"label": @"Label"}];
+    }
+    ClippySearchIndex *index = clippy_search_index_create(entries);
+    ASSERT(index != NULL);
+    ASSERT(index->arena.reserved <= 2 * CLIPPY_SEARCH_ARENA_BLOCK);
+    ASSERT(clippy_search_index_bytes(index) > index->arena.reserved);
+
+    ClippySearchQuery query;
+    clippy_search_query_init(&query, @"gst");
+    for (NSUInteger i = 0; i < index->count; i++) {
+        ClippySearchText standalone;
+        clippy_search_text_init(&standalone, entries[i][@"text"]);
+        ASSERT_EQ(clippy_search_match_text(&query, &index->entries[i].text).score,
+                  clippy_search_match_text(&query, &standalone).score);
+        ASSERT_EQ(index->entries[i].text.length, standalone.length);
+        clippy_search_text_free(&standalone);
+    }
+    clippy_search_query_free(&query);
+    clippy_search_index_free(index);
+}
+
+TEST(ranked_match_adds_boost) {
+    NSArray *entries = @[@{@"text": @"git status"}, @{@"text": @"a gist about stash"}, @{@"text": @"npm test"}];
+    ClippySearchIndex *index = clippy_search_index_create(entries);
+    ASSERT(index != NULL);
+    ASSERT_EQ(index->entries[1].boost, 0);
+
+    ClippySearchQuery query;
+    clippy_search_query_init(&query, @"gst");
+    FuzzyMatchResult best = clippy_search_match_ranked(&query, &index->entries[0]);
+    FuzzyMatchResult used = clippy_search_match_ranked(&query, &index->entries[1]);
+    ASSERT(best.score > used.score);
+
+    // A boost reorders matches without changing what matches
+    for (NSUInteger i = 0; i < index->count; i++) {
+        index->entries[i].boost = best.score - used.score + 1;
+    }
+    index->entries[0].boost = 0;
+    ASSERT_EQ(clippy_search_match_ranked(&query, &index->entries[1]).score,
+              clippy_search_match_entry(&query, &index->entries[1]).score + best.score - used.score + 1);
+    ASSERT(clippy_search_match_ranked(&query, &index->entries[1]).score > best.score);
+    ASSERT(!clippy_search_match_ranked(&query, &index->entries[2]).matches);
+    ASSERT_EQ(clippy_search_match_ranked(&query, &index->entries[2]).score, 0);
+
+    clippy_search_query_free(&query);
+    clippy_search_index_free(index);
+}
+
+TEST(match_positions_for_highlighting) {
+    NSMutableIndexSet *positions = [NSMutableIndexSet indexSet];
+    ASSERT(clippy_fuzzy_match_positions(@"gst", @"git status", positions).matches);
+    ASSERT_EQ([positions count], 3);
+    ASSERT([positions containsIndex:0] && [positions containsIndex:4] && [positions containsIndex:5]);
+
+    [positions removeAllIndexes];
+    ASSERT(clippy_fuzzy_match_positions(@"CAF", @"café au lait", positions).matches);
+    ASSERT([positions isEqualToIndexSet:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, 3)]]);
+
+    [positions removeAllIndexes];
+    ASSERT(!clippy_fuzzy_match_positions(@"xyz", @"git status", positions).matches);
+    ASSERT_EQ([positions count], 0);
+
+    // Scores are the same with or without positions
+    ASSERT_EQ(clippy_fuzzy_match_positions(@"hlo", @"hello", nil).score,
+              clippy_fuzzy_match(@"hlo", @"hello").score);
+}
+
+TEST(postings_hold_every_possible_match) {
+    NSArray *texts = equivalenceTexts();
+    NSMutableArray *entries = [NSMutableArray array];
+    for (NSString *text in texts) {
+        [entries addObject:@{@"text": text}];
+    }
+    ClippySearchIndex *index = clippy_search_index_create(entries);
+    ASSERT(index != NULL);
+
+    for (NSString *pattern in equivalencePatterns()) {
+        ClippySearchQuery query;
+        clippy_search_query_init(&query, pattern);
+        clippy_search_query_prepare(&query, index);
+
+        // The list is ascending, and no entry outside it can match
+        const NSUInteger *posting = index->postings[query.postingBit];
+        NSUInteger count = index->postingCounts[query.postingBit];
+        NSUInteger next = 0;
+        for (NSUInteger slot = 0; slot < index->count; slot++) {
+            BOOL listed = (next < count && posting[next] == slot);
+            next += listed;
+            if (!listed) {
+                ASSERT(!clippy_search_match_entry(&query, &index->entries[slot]).matches);
+            }
+        }
+        ASSERT_EQ(next, count);
+        clippy_search_query_free(&query);
+    }
+    clippy_search_index_free(index);
+}
+
+// ============================================================================
+// Tests: Trigram Index
+// ============================================================================
+
+static BOOL candidatesCover(const ClippyTrigramIndex *index, NSArray *texts, NSString *query) {
+    NSMutableData *candidates = [NSMutableData data];
+    if (!clippy_trigram_index_candidates(index, query, candidates)) {
+        return NO;
+    }
+    const NSUInteger *positions = [candidates bytes];
+    NSUInteger count = [candidates length] / sizeof(NSUInteger);
+    for (NSUInteger n = 1; n < count; n++) {
+        if (positions[n] <= positions[n - 1]) {
+            return NO;
+        }
+    }
+
+    NSString *folded = [query lowercaseString];
+    NSUInteger next = 0;
+    for (NSUInteger i = 0; i < [texts count]; i++) {
+        while (next < count && positions[next] < i) {
+            next++;
+        }
+        BOOL listed = (next < count && positions[next] == i);
+        if ([[texts[i] lowercaseString] containsString:folded] && !listed) {
+            return NO;
+        }
+    }
+    return count == 0 || positions[count - 1] < [texts count];
+}
+
+TEST(trigram_candidates_match_substrings) {
+    NSArray *texts = @[@"Hello World", @"say hello", @"HELP wanted", @"", @"he", @"othello"];
+    ClippyTrigramIndex index;
+    clippy_trigram_index_init(&index);
+    NSMutableArray *entries = [NSMutableArray array];
+    for (NSString *text in texts) {
+        [entries addObject:@{@"text": text}];
+    }
+    ASSERT(clippy_trigram_index_load(&index, entries));
+    ASSERT_EQ(index.liveCount, [texts count]);
+
+    ASSERT(candidatesCover(&index, texts, @"hello"));
+    ASSERT(candidatesCover(&index, texts, @"HEL"));
+    ASSERT(candidatesCover(&index, texts, @"xyz"));
+
+    NSMutableData *candidates = [NSMutableData data];
+    ASSERT(clippy_trigram_index_candidates(&index, @"ello", candidates));
+    ASSERT_EQ([candidates length] / sizeof(NSUInteger), 3);
+    ASSERT_EQ(((const NSUInteger *)[candidates bytes])[0], 0);
+
+    // Too short to narrow: the caller scans
+    ASSERT(!clippy_trigram_index_candidates(&index, @"he", candidates));
+    clippy_trigram_index_free(&index);
+}
+
+TEST(trigram_index_tracks_list_edits) {
+    ClippyTrigramIndex index;
+    clippy_trigram_index_init(&index);
+    NSMutableArray *texts = [NSMutableArray array];
+    NSArray *words = @[@"alpha", @"beta", @"gamma", @"Alphabet", @"pha", @"bet"];
+    NSArray *queries = @[@"alp", @"pha", @"BET", @"amma", @"hab", @"zzz"];
+
+    // Enough churn to cross the compaction threshold several times
+    uint32_t seed = 12345;
+    for (NSUInteger step = 0; step < 12000; step++) {
+        seed = seed * 1103515245u + 12345u;
+        uint32_t roll = (seed >> 16) % 10;
+        NSString *text = [NSString stringWithFormat:@"%@ %@", words[(seed >> 8) % [words count]],
+                          words[(seed >> 20) % [words count]]];
+
+        if (roll < 4 || [texts count] < 2) {
+            [texts insertObject:text atIndex:0];
+            ASSERT(clippy_trigram_index_prepend(&index, text));
+        } else if (roll < 8) {
+            NSUInteger position = seed % [texts count];
+            [texts removeObjectAtIndex:position];
+            clippy_trigram_index_remove_at(&index, position);
+        } else {
+            NSUInteger position = seed % [texts count];
+            texts[position] = text;
+            ASSERT(clippy_trigram_index_update_at(&index, position, text));
+        }
+
+        ASSERT_EQ(index.liveCount, [texts count]);
+        if (step % 500 == 0) {
+            for (NSString *query in queries) {
+                ASSERT(candidatesCover(&index, texts, query));
+            }
+        }
+    }
+    // Dead ids never pile up past the compaction threshold
+    uint32_t dead = index.docCount - index.liveCount;
+    ASSERT(dead < CLIPPY_TRIGRAM_COMPACT_MIN || dead <= index.liveCount);
+    clippy_trigram_index_free(&index);
+}
+
+// ============================================================================
+// Tests: Top-K Selection
+// ============================================================================
+
+TEST(topk_keeps_best_in_order) {
+    ClippySearchTopK heap;
+    ASSERT(clippy_search_topk_init(&heap, 5));
+
+    // Scores 0..99 pushed in a scrambled order
+    for (NSUInteger i = 0; i < 100; i++) {
+        NSUInteger slot = (i * 37) % 100;
+        clippy_search_topk_push(&heap, (ClippySearchHit){(NSInteger)slot, slot});
+    }
+    ASSERT_EQ(heap.count, 5);
+
+    clippy_search_topk_sort(&heap);
+    for (NSUInteger i = 0; i < 5; i++) {
+        ASSERT_EQ(heap.hits[i].score, 99 - (NSInteger)i);
+    }
+    clippy_search_topk_free(&heap);
+}
+
+TEST(topk_ties_keep_history_order) {
+    ClippySearchTopK heap;
+    ASSERT(clippy_search_topk_init(&heap, 3));
+
+    for (NSUInteger slot = 10; slot > 0; slot--) {
+        clippy_search_topk_push(&heap, (ClippySearchHit){7, slot});
+    }
+    clippy_search_topk_sort(&heap);
+
+    ASSERT_EQ(heap.count, 3);
+    ASSERT_EQ(heap.hits[0].slot, 1);
+    ASSERT_EQ(heap.hits[1].slot, 2);
+    ASSERT_EQ(heap.hits[2].slot, 3);
+    clippy_search_topk_free(&heap);
+}
+
 // ============================================================================
 // Main
 // ============================================================================
@@ -310,6 +712,28 @@ int main(int argc, const char *argv[]) {
         RUN_TEST(special_characters);
         RUN_TEST(unicode_characters);
 
+        printf("\nSearch Index Tests:\n");
+        RUN_TEST(indexed_scores_identical);
+        RUN_TEST(indexed_nil_inputs);
+        RUN_TEST(index_entry_best_of_text_and_label);
+        RUN_TEST(prefiltered_index_scores_identical);
+        RUN_TEST(prefilter_rejects_missing_chars);
+        RUN_TEST(extended_query_matches_subset);
+        RUN_TEST(find_char_across_vector_widths);
+        RUN_TEST(ascii_text_takes_byte_path);
+        RUN_TEST(index_texts_share_arena);
+        RUN_TEST(ranked_match_adds_boost);
+        RUN_TEST(match_positions_for_highlighting);
+        RUN_TEST(postings_hold_every_possible_match);
+
+        printf("\nTrigram Index Tests:\n");
+        RUN_TEST(trigram_candidates_match_substrings);
+        RUN_TEST(trigram_index_tracks_list_edits);
+
+        printf("\nTop-K Selection Tests:\n");
+        RUN_TEST(topk_keeps_best_in_order);
+        RUN_TEST(topk_ties_keep_history_order);
+
         printf("\n=== Results ===\n");
         printf("Tests run: %d\n", tests_run);
         printf("Passed:    %d\n", tests_passed);